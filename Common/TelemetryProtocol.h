@@ -0,0 +1,715 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "Crc16.h"
+
+
+// Binary frames from the STM32 to the ESP32, shared by both sides.
+//
+// A frame is [header | payload | crc16], COBS encoded and terminated by a 0x00 byte, so the
+// receiver can always resynchronise at the next zero after a corrupted byte.
+//   header:  version u8, type u8, seq u16, tick u32
+//   crc16:   CRC-16/CCITT-FALSE over header and payload
+// All fields are little endian. Measurements are fixed point, see the scales below.
+// seq counts every frame the STM32 sends, so a gap is a lost frame; tick is the scheduler
+// tick the frame was sent on. Both start again from 0 when the STM32 resets.
+// TELEMETRY frames go out for every filter window, or only by exception: when a value leaves
+// its deadband around the last frame sent, a status changes or a heartbeat is due. held counts
+// the windows left out since the previous frame, which the receiver fills forward.
+// Measurements are per channel, in the order of the STM32's channel list: a count of
+// thermistors and of loads, then a value for each. A load's relay status is a bit in a byte.
+// RECORD frames carry the minute records of the STM32's flash log, live or replayed after an
+// outage. Each is acked back with the line L,<record seq>\n and resent until it is, so the
+// receiving end must ignore records it already has.
+// CAPTURE frames carry the raw current waveforms of every load around a trigger, split into
+// chunks that go out when the link is otherwise idle. They are not acked; a lost chunk leaves a
+// gap.
+// SPECTRUM frames carry the features of one windowed FFT of the raw fan current, about once
+// a minute while the fan runs, in place of the waveform itself.
+namespace Protocol {
+
+const uint8_t VERSION = 11;
+
+enum FrameType : uint8_t {
+    TELEMETRY = 1,
+    DIAGNOSTICS = 2,
+    ACK = 3,
+    RECORD = 4,
+    CAPTURE = 5,
+    SPECTRUM = 6,
+};
+
+// What froze a waveform capture, in the low nibble of its cause byte, with the load it
+// happened on in the high nibble
+enum CaptureCause : uint8_t {
+    CAPTURE_RELAY = 1,
+    CAPTURE_STEP = 2,           // dI/dt between two 1ms means
+    CAPTURE_LIMIT = 3,          // one sample past the current limit
+};
+
+inline uint8_t captureCause(CaptureCause cause, size_t load) { return cause | load << 4; }
+inline CaptureCause captureKind(uint8_t cause) { return (CaptureCause) (cause & 0x0F); }
+inline size_t captureLoad(uint8_t cause) { return cause >> 4; }
+
+const size_t HEADER_SIZE = 8;
+const size_t CRC_SIZE = 2;
+const size_t MAX_TASKS = 10;
+const size_t TASK_NAME_SIZE = 8;
+const size_t MAX_THERMISTORS = 4;
+const size_t MAX_LOADS = 8;             // One status bit each
+const size_t CAPTURE_CHUNK_SAMPLES = 96;    // Frames of every load's counts, 48 frames of 2 loads
+const size_t SPECTRUM_BANDS = 4;
+const uint16_t SPECTRUM_BAND_HZ[SPECTRUM_BANDS + 1] = {10, 100, 300, 1000, 5000};   // band edges
+const size_t MAX_PAYLOAD = 59 + MAX_TASKS * 24;    // Largest frame is a full diagnostics frame
+static_assert(16 + 2 * MAX_THERMISTORS + 12 * MAX_LOADS <= MAX_PAYLOAD, "telemetry fits a frame");
+static_assert(17 + MAX_LOADS * 4 + CAPTURE_CHUNK_SAMPLES * 2 <= MAX_PAYLOAD, "capture chunk fits a frame");
+const size_t MAX_RAW_FRAME = HEADER_SIZE + MAX_PAYLOAD + CRC_SIZE;
+const size_t MAX_ENCODED_FRAME = MAX_RAW_FRAME + MAX_RAW_FRAME / 254 + 2;  // COBS overhead and delimiter
+
+// Fixed point scales
+const float VOLTAGE_SCALE = 1000;       // mV, u16
+const float CURRENT_SCALE = 1000;       // mA, i16
+const float TEMPERATURE_SCALE = 100;    // 0.01 F, i16
+const float POWER_SCALE = 100;          // 0.01 W, u16
+const float LOAD_SCALE = 100;           // 0.01 %, u16
+const float MCU_CURRENT_SCALE = 100;    // 0.01 mA, u16
+const float WAKEUP_SCALE = 1;           // per second, u16
+const float ZERO_SCALE = 10;            // 0.1 ADC counts, u16
+const float AMPS_PER_COUNT_SCALE = 1e5; // 0.01 mA per ADC count, u16
+const float TRIP_LATENCY_SCALE = 100;   // 0.01 us, u16
+const float FREQUENCY_SCALE = 10;       // 0.1 Hz, u16
+const float RIPPLE_SCALE = 1e5;         // 0.01 mA rms, u16
+
+const uint32_t UNKNOWN_AGE = 0xFFFFFFFF;    // Record from an earlier boot
+
+
+struct Header {
+    uint8_t version;
+    uint8_t type;
+    uint16_t seq;
+    uint32_t tick;
+};
+
+// 16 + 2 * thermistors + 12 * loads byte payload: 42 bytes, 54 on the wire, for 1 and 2
+struct Telemetry {
+    uint8_t thermistorCount;
+    uint8_t loadCount;
+    float temperature[MAX_THERMISTORS];
+    float voltage[MAX_LOADS];
+    float current[MAX_LOADS];
+    bool status[MAX_LOADS];
+    bool logData;
+    uint8_t textStatus;     // 0-15: 1 power limit, 2 temperature, 3 + load an overcurrent trip on that load
+    float powerAvg;
+    float powerMin;
+    float powerMax;
+    float powerStd;
+    uint16_t held;          // windows not sent since the previous frame, within its deadbands, saturates
+    uint16_t scanRate;      // hz, the ADC scan rate as the window closed
+    // Totals since the STM32's energy counters started, whole units. They only go up, unless
+    // the STM32 lost its backup domain supply, which starts them again from 0.
+    uint32_t coulombs[MAX_LOADS];
+    uint32_t joules[MAX_LOADS];
+};
+
+struct TaskDiagnostics {
+    char name[TASK_NAME_SIZE + 1];
+    uint32_t minCycles;
+    uint32_t avgCycles;
+    uint32_t maxCycles;
+    uint16_t deadlineMisses;
+    uint16_t overruns;
+};
+
+struct Diagnostics {
+    uint16_t cpuMHz;
+    float cpuLoad;          // time awake
+    float isrLoad;          // part of cpuLoad in the tick interrupt, ISR tasks included
+    uint32_t skippedTicks;
+    uint32_t maxLatencyCycles;
+    uint32_t droppedWindows;
+    uint32_t scanOverruns;
+    uint32_t uartTxDropped;
+    uint32_t uartRxDropped;
+    float idlePercent;      // time asleep in WFI
+    float mcuCurrent;       // mA, estimated from idlePercent
+    float wakeupRate;       // sleeps ended per second
+    uint16_t logBacklog;    // flash log records not yet acked
+    uint32_t logOverwritten;    // records erased before they were acked
+    uint16_t captures;      // waveform captures since boot
+    uint16_t capturesMissed;    // triggers dropped while a capture was held or in holdoff
+    uint16_t trips;         // overcurrent trips since boot
+    float tripLatency;      // us, last trip, from the sample to the relay pins going low
+    uint32_t telemetryWindows;  // filter windows since boot
+    uint32_t telemetryFrames;   // telemetry frames sent for them
+    uint8_t taskCount;
+    TaskDiagnostics tasks[MAX_TASKS];
+};
+
+// Command ack, seq and result as in the command channel
+struct Ack {
+    uint8_t seq;
+    uint8_t result;
+    uint32_t tick;          // Tick the relay switched on
+    uint8_t loadCount;
+    bool status[MAX_LOADS];
+};
+
+// One minute record of the flash log, recordSize() bytes packed. seq counts records over the
+// life of the log and boot counts STM32 resets, so (boot, seq) names a record and millis
+// places it within its boot.
+struct Record {
+    uint32_t seq;
+    uint16_t boot;
+    uint32_t millis;        // Uptime when logged
+    uint32_t ageMillis;     // Uptime since, or UNKNOWN_AGE. Filled in when sent, not stored.
+    uint8_t thermistorCount;
+    uint8_t loadCount;
+    float temperature[MAX_THERMISTORS];
+    float voltage[MAX_LOADS];
+    float current[MAX_LOADS];
+    bool status[MAX_LOADS];
+    float powerAvg;
+};
+
+constexpr size_t recordSize(size_t thermistors, size_t loads) {
+    return 19 + 2 * thermistors + 4 * loads;
+}
+
+// One chunk of a waveform capture: frames [index * framesPerChunk, + frameCount) of the
+// capture, framesPerChunk being CAPTURE_CHUNK_SAMPLES / loadCount. A frame holds the raw count
+// of every load, in load order. Every chunk repeats the capture's description, so any one of
+// them places its samples. Amps are (counts - zero) * ampsPerCount, signed.
+struct CaptureChunk {
+    uint16_t id;            // Counts captures since boot
+    uint8_t cause;          // CaptureCause and load, see captureCause()
+    uint8_t index;
+    uint8_t chunks;
+    uint16_t sampleRate;    // Hz
+    uint16_t preFrames;     // Frames before the trigger
+    uint16_t frames;        // Frames in the whole capture
+    uint32_t ageMillis;     // Since the trigger, when this chunk was sent
+    uint8_t loadCount;
+    float zero[MAX_LOADS];
+    float ampsPerCount[MAX_LOADS];
+    uint8_t frameCount;
+    uint16_t counts[CAPTURE_CHUNK_SAMPLES];
+};
+
+// Fan current spectrum features from one block of raw samples, see FanSpectrum.h.
+// 28 byte payload, 40 bytes on the wire
+struct Spectrum {
+    uint16_t blockSize;     // Samples in the FFT
+    uint16_t sampleRate;    // Hz
+    float dominantHz;       // Strongest ripple line above the first band edge, 0 without a clear one
+    uint16_t rpm;           // From dominantHz and the ripple periods per turn
+    float current;          // A, mean over the block
+    float rippleRms;        // A rms about the mean
+    float bands[SPECTRUM_BANDS];    // A rms between SPECTRUM_BAND_HZ edges
+    uint32_t cycles;        // DWT cycles the window, FFT and features took
+    uint32_t blocks;        // Analysed since boot
+};
+
+
+// Little endian field access with bounds checking. A writer or reader that ran out of room
+// stays failed, so a whole payload can be packed and checked once at the end.
+class Writer {
+public:
+    Writer(uint8_t* buffer, size_t capacity) : _buffer(buffer), _capacity(capacity) {}
+
+    void put8(uint8_t value) {
+        if (_length + 1 > _capacity) { _failed = true; return; }
+        _buffer[_length++] = value;
+    }
+    void put16(uint16_t value) { put8(value); put8(value >> 8); }
+    void put32(uint32_t value) { put16(value); put16(value >> 16); }
+    void putBytes(const void* data, size_t length) {
+        if (_length + length > _capacity) { _failed = true; return; }
+        memcpy(&_buffer[_length], data, length);
+        _length += length;
+    }
+
+    // Rounded and saturated to the field range
+    void putFixedU16(float value, float scale) { put16(_fixed(value * scale, 0, 65535)); }
+    void putFixedI16(float value, float scale) { put16((uint16_t) _fixed(value * scale, -32768, 32767)); }
+
+    size_t length() const { return _failed ? 0 : _length; }
+
+private:
+    static int32_t _fixed(float value, int32_t low, int32_t high) {
+        if (!(value > low)) return low;     // Also catches NaN
+        if (value > high) return high;
+        return (int32_t) (value < 0 ? value - 0.5f : value + 0.5f);
+    }
+
+    uint8_t* _buffer;
+    size_t _capacity;
+    size_t _length = 0;
+    bool _failed = false;
+};
+
+class Reader {
+public:
+    Reader(const uint8_t* buffer, size_t length) : _buffer(buffer), _length(length) {}
+
+    uint8_t get8() {
+        if (_position + 1 > _length) { _failed = true; return 0; }
+        return _buffer[_position++];
+    }
+    uint16_t get16() { uint16_t low = get8(); return low | (uint16_t) get8() << 8; }
+    uint32_t get32() { uint32_t low = get16(); return low | (uint32_t) get16() << 16; }
+    void getBytes(void* data, size_t length) {
+        if (_position + length > _length) { _failed = true; memset(data, 0, length); return; }
+        memcpy(data, &_buffer[_position], length);
+        _position += length;
+    }
+
+    float getFixedU16(float scale) { return get16() / scale; }
+    float getFixedI16(float scale) { return (int16_t) get16() / scale; }
+
+    // Everything read and nothing missing
+    bool complete() const { return !_failed && _position == _length; }
+
+private:
+    const uint8_t* _buffer;
+    size_t _length;
+    size_t _position = 0;
+    bool _failed = false;
+};
+
+
+// COBS: replaces every zero so the only zero on the wire is the frame delimiter.
+// Both return 0 when the output does not fit or the input is not valid COBS.
+inline size_t cobsEncode(const uint8_t* in, size_t length, uint8_t* out, size_t capacity) {
+    if (capacity == 0) return 0;
+    size_t codeIndex = 0;
+    size_t write = 1;
+    uint8_t code = 1;
+    for (size_t read = 0; read < length; read++) {
+        if (in[read] != 0) {
+            if (write >= capacity) return 0;
+            out[write++] = in[read];
+            code++;
+        }
+        if (in[read] == 0 || code == 0xFF) {
+            if (write >= capacity) return 0;
+            out[codeIndex] = code;
+            code = 1;
+            codeIndex = write++;
+        }
+    }
+    out[codeIndex] = code;
+    return write;
+}
+
+inline size_t cobsDecode(const uint8_t* in, size_t length, uint8_t* out, size_t capacity) {
+    size_t read = 0;
+    size_t write = 0;
+    while (read < length) {
+        uint8_t code = in[read++];
+        if (code == 0) return 0;
+        for (uint8_t i = 1; i < code; i++) {
+            if (read >= length || in[read] == 0 || write >= capacity) return 0;
+            out[write++] = in[read++];
+        }
+        if (code != 0xFF && read < length) {
+            if (write >= capacity) return 0;
+            out[write++] = 0;
+        }
+    }
+    return write;
+}
+
+
+// Payloads. pack returns the payload length, 0 if it did not fit; unpack checks the length.
+// Statuses go as one bit per load, the first load in bit 0.
+inline uint8_t statusBits(const bool* status, size_t count) {
+    uint8_t bits = 0;
+    for (size_t i = 0; i < count && i < MAX_LOADS; i++) bits |= status[i] ? 1 << i : 0;
+    return bits;
+}
+
+inline void fromStatusBits(uint8_t bits, bool* status, size_t count) {
+    for (size_t i = 0; i < count && i < MAX_LOADS; i++) status[i] = bits & 1 << i;
+}
+
+inline size_t packTelemetry(const Telemetry& telemetry, uint8_t* payload, size_t capacity) {
+    Writer writer(payload, capacity);
+    if (telemetry.thermistorCount > MAX_THERMISTORS || telemetry.loadCount > MAX_LOADS) return 0;
+    writer.put8(telemetry.thermistorCount);
+    writer.put8(telemetry.loadCount);
+    for (uint8_t i = 0; i < telemetry.thermistorCount; i++) writer.putFixedI16(telemetry.temperature[i], TEMPERATURE_SCALE);
+    for (uint8_t i = 0; i < telemetry.loadCount; i++) {
+        writer.putFixedU16(telemetry.voltage[i], VOLTAGE_SCALE);
+        writer.putFixedI16(telemetry.current[i], CURRENT_SCALE);
+    }
+    writer.put8(statusBits(telemetry.status, telemetry.loadCount));
+    writer.put8((telemetry.logData ? 0x01 : 0) | (telemetry.textStatus & 0x0F) << 4);
+    writer.putFixedU16(telemetry.powerAvg, POWER_SCALE);
+    writer.putFixedU16(telemetry.powerMin, POWER_SCALE);
+    writer.putFixedU16(telemetry.powerMax, POWER_SCALE);
+    writer.putFixedU16(telemetry.powerStd, POWER_SCALE);
+    writer.put16(telemetry.held);
+    writer.put16(telemetry.scanRate);
+    for (uint8_t i = 0; i < telemetry.loadCount; i++) {
+        writer.put32(telemetry.coulombs[i]);
+        writer.put32(telemetry.joules[i]);
+    }
+    return writer.length();
+}
+
+inline bool unpackTelemetry(const uint8_t* payload, size_t length, Telemetry& telemetry) {
+    Reader reader(payload, length);
+    telemetry.thermistorCount = reader.get8();
+    telemetry.loadCount = reader.get8();
+    if (telemetry.thermistorCount > MAX_THERMISTORS || telemetry.loadCount > MAX_LOADS) return false;
+    for (uint8_t i = 0; i < telemetry.thermistorCount; i++) telemetry.temperature[i] = reader.getFixedI16(TEMPERATURE_SCALE);
+    for (uint8_t i = 0; i < telemetry.loadCount; i++) {
+        telemetry.voltage[i] = reader.getFixedU16(VOLTAGE_SCALE);
+        telemetry.current[i] = reader.getFixedI16(CURRENT_SCALE);
+    }
+    fromStatusBits(reader.get8(), telemetry.status, telemetry.loadCount);
+    uint8_t flags = reader.get8();
+    telemetry.logData = flags & 0x01;
+    telemetry.textStatus = flags >> 4;
+    telemetry.powerAvg = reader.getFixedU16(POWER_SCALE);
+    telemetry.powerMin = reader.getFixedU16(POWER_SCALE);
+    telemetry.powerMax = reader.getFixedU16(POWER_SCALE);
+    telemetry.powerStd = reader.getFixedU16(POWER_SCALE);
+    telemetry.held = reader.get16();
+    telemetry.scanRate = reader.get16();
+    for (uint8_t i = 0; i < telemetry.loadCount; i++) {
+        telemetry.coulombs[i] = reader.get32();
+        telemetry.joules[i] = reader.get32();
+    }
+    return reader.complete();
+}
+
+inline size_t packDiagnostics(const Diagnostics& diagnostics, uint8_t* payload, size_t capacity) {
+    Writer writer(payload, capacity);
+    uint8_t taskCount = diagnostics.taskCount < MAX_TASKS ? diagnostics.taskCount : MAX_TASKS;
+    writer.put16(diagnostics.cpuMHz);
+    writer.putFixedU16(diagnostics.cpuLoad, LOAD_SCALE);
+    writer.putFixedU16(diagnostics.isrLoad, LOAD_SCALE);
+    writer.put32(diagnostics.skippedTicks);
+    writer.put32(diagnostics.maxLatencyCycles);
+    writer.put32(diagnostics.droppedWindows);
+    writer.put32(diagnostics.scanOverruns);
+    writer.put32(diagnostics.uartTxDropped);
+    writer.put32(diagnostics.uartRxDropped);
+    writer.putFixedU16(diagnostics.idlePercent, LOAD_SCALE);
+    writer.putFixedU16(diagnostics.mcuCurrent, MCU_CURRENT_SCALE);
+    writer.putFixedU16(diagnostics.wakeupRate, WAKEUP_SCALE);
+    writer.put16(diagnostics.logBacklog);
+    writer.put32(diagnostics.logOverwritten);
+    writer.put16(diagnostics.captures);
+    writer.put16(diagnostics.capturesMissed);
+    writer.put16(diagnostics.trips);
+    writer.putFixedU16(diagnostics.tripLatency, TRIP_LATENCY_SCALE);
+    writer.put32(diagnostics.telemetryWindows);
+    writer.put32(diagnostics.telemetryFrames);
+    writer.put8(taskCount);
+    for (uint8_t i = 0; i < taskCount; i++) {
+        const TaskDiagnostics& task = diagnostics.tasks[i];
+        char name[TASK_NAME_SIZE] = {0};    // Null padded, not terminated when the name fills it
+        for (size_t c = 0; c < TASK_NAME_SIZE && task.name[c] != '\0'; c++) name[c] = task.name[c];
+        writer.putBytes(name, TASK_NAME_SIZE);
+        writer.put32(task.minCycles);
+        writer.put32(task.avgCycles);
+        writer.put32(task.maxCycles);
+        writer.put16(task.deadlineMisses);
+        writer.put16(task.overruns);
+    }
+    return writer.length();
+}
+
+inline bool unpackDiagnostics(const uint8_t* payload, size_t length, Diagnostics& diagnostics) {
+    Reader reader(payload, length);
+    diagnostics.cpuMHz = reader.get16();
+    diagnostics.cpuLoad = reader.getFixedU16(LOAD_SCALE);
+    diagnostics.isrLoad = reader.getFixedU16(LOAD_SCALE);
+    diagnostics.skippedTicks = reader.get32();
+    diagnostics.maxLatencyCycles = reader.get32();
+    diagnostics.droppedWindows = reader.get32();
+    diagnostics.scanOverruns = reader.get32();
+    diagnostics.uartTxDropped = reader.get32();
+    diagnostics.uartRxDropped = reader.get32();
+    diagnostics.idlePercent = reader.getFixedU16(LOAD_SCALE);
+    diagnostics.mcuCurrent = reader.getFixedU16(MCU_CURRENT_SCALE);
+    diagnostics.wakeupRate = reader.getFixedU16(WAKEUP_SCALE);
+    diagnostics.logBacklog = reader.get16();
+    diagnostics.logOverwritten = reader.get32();
+    diagnostics.captures = reader.get16();
+    diagnostics.capturesMissed = reader.get16();
+    diagnostics.trips = reader.get16();
+    diagnostics.tripLatency = reader.getFixedU16(TRIP_LATENCY_SCALE);
+    diagnostics.telemetryWindows = reader.get32();
+    diagnostics.telemetryFrames = reader.get32();
+    diagnostics.taskCount = reader.get8();
+    if (diagnostics.taskCount > MAX_TASKS) return false;
+    for (uint8_t i = 0; i < diagnostics.taskCount; i++) {
+        TaskDiagnostics& task = diagnostics.tasks[i];
+        reader.getBytes(task.name, TASK_NAME_SIZE);
+        task.name[TASK_NAME_SIZE] = '\0';
+        task.minCycles = reader.get32();
+        task.avgCycles = reader.get32();
+        task.maxCycles = reader.get32();
+        task.deadlineMisses = reader.get16();
+        task.overruns = reader.get16();
+    }
+    return reader.complete();
+}
+
+inline size_t packAck(const Ack& ack, uint8_t* payload, size_t capacity) {
+    Writer writer(payload, capacity);
+    if (ack.loadCount > MAX_LOADS) return 0;
+    writer.put8(ack.seq);
+    writer.put8(ack.result);
+    writer.put32(ack.tick);
+    writer.put8(ack.loadCount);
+    writer.put8(statusBits(ack.status, ack.loadCount));
+    return writer.length();
+}
+
+inline bool unpackAck(const uint8_t* payload, size_t length, Ack& ack) {
+    Reader reader(payload, length);
+    ack.seq = reader.get8();
+    ack.result = reader.get8();
+    ack.tick = reader.get32();
+    ack.loadCount = reader.get8();
+    if (ack.loadCount > MAX_LOADS) return false;
+    fromStatusBits(reader.get8(), ack.status, ack.loadCount);
+    return reader.complete();
+}
+
+inline size_t packRecord(const Record& record, uint8_t* payload, size_t capacity) {
+    Writer writer(payload, capacity);
+    if (record.thermistorCount > MAX_THERMISTORS || record.loadCount > MAX_LOADS) return 0;
+    writer.put32(record.seq);
+    writer.put16(record.boot);
+    writer.put32(record.millis);
+    writer.put32(record.ageMillis);
+    writer.put8(record.thermistorCount);
+    writer.put8(record.loadCount);
+    for (uint8_t i = 0; i < record.thermistorCount; i++) writer.putFixedI16(record.temperature[i], TEMPERATURE_SCALE);
+    for (uint8_t i = 0; i < record.loadCount; i++) {
+        writer.putFixedU16(record.voltage[i], VOLTAGE_SCALE);
+        writer.putFixedI16(record.current[i], CURRENT_SCALE);
+    }
+    writer.put8(statusBits(record.status, record.loadCount));
+    writer.putFixedU16(record.powerAvg, POWER_SCALE);
+    return writer.length();
+}
+
+inline bool unpackRecord(const uint8_t* payload, size_t length, Record& record) {
+    Reader reader(payload, length);
+    record.seq = reader.get32();
+    record.boot = reader.get16();
+    record.millis = reader.get32();
+    record.ageMillis = reader.get32();
+    record.thermistorCount = reader.get8();
+    record.loadCount = reader.get8();
+    if (record.thermistorCount > MAX_THERMISTORS || record.loadCount > MAX_LOADS) return false;
+    for (uint8_t i = 0; i < record.thermistorCount; i++) record.temperature[i] = reader.getFixedI16(TEMPERATURE_SCALE);
+    for (uint8_t i = 0; i < record.loadCount; i++) {
+        record.voltage[i] = reader.getFixedU16(VOLTAGE_SCALE);
+        record.current[i] = reader.getFixedI16(CURRENT_SCALE);
+    }
+    fromStatusBits(reader.get8(), record.status, record.loadCount);
+    record.powerAvg = reader.getFixedU16(POWER_SCALE);
+    return reader.complete();
+}
+
+inline size_t packCaptureChunk(const CaptureChunk& chunk, uint8_t* payload, size_t capacity) {
+    Writer writer(payload, capacity);
+    if (chunk.loadCount == 0 || chunk.loadCount > MAX_LOADS) return 0;
+    size_t maxFrames = CAPTURE_CHUNK_SAMPLES / chunk.loadCount;
+    uint8_t frameCount = chunk.frameCount < maxFrames ? chunk.frameCount : maxFrames;
+    writer.put16(chunk.id);
+    writer.put8(chunk.cause);
+    writer.put8(chunk.index);
+    writer.put8(chunk.chunks);
+    writer.put16(chunk.sampleRate);
+    writer.put16(chunk.preFrames);
+    writer.put16(chunk.frames);
+    writer.put32(chunk.ageMillis);
+    writer.put8(chunk.loadCount);
+    for (uint8_t i = 0; i < chunk.loadCount; i++) {
+        writer.putFixedU16(chunk.zero[i], ZERO_SCALE);
+        writer.putFixedU16(chunk.ampsPerCount[i], AMPS_PER_COUNT_SCALE);
+    }
+    writer.put8(frameCount);
+    for (size_t i = 0; i < (size_t) frameCount * chunk.loadCount; i++) writer.put16(chunk.counts[i]);
+    return writer.length();
+}
+
+inline bool unpackCaptureChunk(const uint8_t* payload, size_t length, CaptureChunk& chunk) {
+    Reader reader(payload, length);
+    chunk.id = reader.get16();
+    chunk.cause = reader.get8();
+    chunk.index = reader.get8();
+    chunk.chunks = reader.get8();
+    chunk.sampleRate = reader.get16();
+    chunk.preFrames = reader.get16();
+    chunk.frames = reader.get16();
+    chunk.ageMillis = reader.get32();
+    chunk.loadCount = reader.get8();
+    if (chunk.loadCount == 0 || chunk.loadCount > MAX_LOADS) return false;
+    for (uint8_t i = 0; i < chunk.loadCount; i++) {
+        chunk.zero[i] = reader.getFixedU16(ZERO_SCALE);
+        chunk.ampsPerCount[i] = reader.getFixedU16(AMPS_PER_COUNT_SCALE);
+    }
+    chunk.frameCount = reader.get8();
+    if (chunk.frameCount > CAPTURE_CHUNK_SAMPLES / chunk.loadCount) return false;
+    for (size_t i = 0; i < (size_t) chunk.frameCount * chunk.loadCount; i++) chunk.counts[i] = reader.get16();
+    return reader.complete();
+}
+
+inline size_t packSpectrum(const Spectrum& spectrum, uint8_t* payload, size_t capacity) {
+    Writer writer(payload, capacity);
+    writer.put16(spectrum.blockSize);
+    writer.put16(spectrum.sampleRate);
+    writer.putFixedU16(spectrum.dominantHz, FREQUENCY_SCALE);
+    writer.put16(spectrum.rpm);
+    writer.putFixedI16(spectrum.current, CURRENT_SCALE);
+    writer.putFixedU16(spectrum.rippleRms, RIPPLE_SCALE);
+    for (size_t i = 0; i < SPECTRUM_BANDS; i++) writer.putFixedU16(spectrum.bands[i], RIPPLE_SCALE);
+    writer.put32(spectrum.cycles);
+    writer.put32(spectrum.blocks);
+    return writer.length();
+}
+
+inline bool unpackSpectrum(const uint8_t* payload, size_t length, Spectrum& spectrum) {
+    Reader reader(payload, length);
+    spectrum.blockSize = reader.get16();
+    spectrum.sampleRate = reader.get16();
+    spectrum.dominantHz = reader.getFixedU16(FREQUENCY_SCALE);
+    spectrum.rpm = reader.get16();
+    spectrum.current = reader.getFixedI16(CURRENT_SCALE);
+    spectrum.rippleRms = reader.getFixedU16(RIPPLE_SCALE);
+    for (size_t i = 0; i < SPECTRUM_BANDS; i++) spectrum.bands[i] = reader.getFixedU16(RIPPLE_SCALE);
+    spectrum.cycles = reader.get32();
+    spectrum.blocks = reader.get32();
+    return reader.complete();
+}
+
+
+// Wraps a payload into a complete frame on the wire, delimiter included. Returns its length,
+// 0 if it did not fit.
+inline size_t encodeFrame(uint8_t type, uint16_t seq, uint32_t tick, const uint8_t* payload,
+                          size_t payloadLength, uint8_t* out, size_t capacity) {
+    uint8_t raw[MAX_RAW_FRAME];
+    Writer writer(raw, sizeof(raw));
+    writer.put8(VERSION);
+    writer.put8(type);
+    writer.put16(seq);
+    writer.put32(tick);
+    writer.putBytes(payload, payloadLength);
+    size_t length = writer.length();
+    if (length == 0 || length + CRC_SIZE > sizeof(raw)) return 0;
+    uint16_t crc = crc16(raw, length);
+    raw[length++] = crc;
+    raw[length++] = crc >> 8;
+
+    size_t encoded = cobsEncode(raw, length, out, capacity);
+    if (encoded == 0 || encoded >= capacity) return 0;
+    out[encoded++] = 0;
+    return encoded;
+}
+
+
+// Byte by byte receiver for the ESP32. push() returns true when a valid frame is complete;
+// its header and payload stay available until the next push(). Frames that fail COBS, CRC or
+// version checks are dropped and counted, and a gap in seq counts the frames lost in between.
+// A seq back at 0 other than by wrapping, or a tick that went backwards, is the STM32 starting
+// again after a reset: a new session, counted as a restart and not as lost frames.
+class FrameReceiver {
+public:
+    bool push(uint8_t byte) {
+        if (byte != 0) {
+            if (_encodedLength < sizeof(_encoded)) {
+                _encoded[_encodedLength++] = byte;
+            } else {
+                _overflow = true;
+            }
+            return false;
+        }
+
+        // Delimiter
+        size_t encodedLength = _encodedLength;
+        bool overflow = _overflow;
+        _encodedLength = 0;
+        _overflow = false;
+        if (encodedLength == 0) return false;   // Back to back delimiters
+        if (overflow) {
+            _framingErrors++;
+            return false;
+        }
+
+        size_t length = cobsDecode(_encoded, encodedLength, _raw, sizeof(_raw));
+        if (length < HEADER_SIZE + CRC_SIZE) {
+            _framingErrors++;
+            return false;
+        }
+        uint16_t crc = _raw[length - 2] | (uint16_t) _raw[length - 1] << 8;
+        if (crc16(_raw, length - CRC_SIZE) != crc) {
+            _crcErrors++;
+            return false;
+        }
+
+        Reader reader(_raw, HEADER_SIZE);
+        _header.version = reader.get8();
+        _header.type = reader.get8();
+        _header.seq = reader.get16();
+        _header.tick = reader.get32();
+        if (_header.version != VERSION) {
+            _versionErrors++;
+            return false;
+        }
+
+        if (_frames > 0) {
+            bool restarted = (_header.seq == 0 && _lastSeq != 0xFFFF) || (int32_t) (_header.tick - _lastTick) < 0;
+            if (restarted) {
+                _restarts++;
+            } else {
+                _lostFrames += (uint16_t) (_header.seq - _lastSeq - 1);
+            }
+        }
+        _lastSeq = _header.seq;
+        _lastTick = _header.tick;
+        _frames++;
+        _payloadLength = length - HEADER_SIZE - CRC_SIZE;
+        return true;
+    }
+
+    const Header& header() const { return _header; }
+    const uint8_t* payload() const { return &_raw[HEADER_SIZE]; }
+    size_t payloadLength() const { return _payloadLength; }
+
+    uint32_t frames() const { return _frames; }
+    uint32_t lostFrames() const { return _lostFrames; }
+    uint32_t restarts() const { return _restarts; }
+    uint32_t crcErrors() const { return _crcErrors; }
+    uint32_t framingErrors() const { return _framingErrors; }
+    uint32_t versionErrors() const { return _versionErrors; }
+
+private:
+    uint8_t _encoded[MAX_ENCODED_FRAME];
+    size_t _encodedLength = 0;
+    bool _overflow = false;
+    uint8_t _raw[MAX_RAW_FRAME];
+    Header _header = {};
+    size_t _payloadLength = 0;
+    uint16_t _lastSeq = 0;
+    uint32_t _lastTick = 0;
+    uint32_t _frames = 0;
+    uint32_t _lostFrames = 0;
+    uint32_t _restarts = 0;
+    uint32_t _crcErrors = 0;
+    uint32_t _framingErrors = 0;
+    uint32_t _versionErrors = 0;
+};
+
+}
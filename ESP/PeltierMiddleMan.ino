@@ -2,6 +2,7 @@
 #include <ArduinoJson.h>
 #include <WebSocketsClient.h>
 #include <HardwareSerial.h>
+#include "TelemetryProtocol.h"
 
 #define RX_PIN 21
 #define TX_PIN 19
@@ -16,11 +17,153 @@ const char* serverHost = "INSERT HOST";
 const int serverPort = 3000;
 const char* websocketPath = "/?id=esp";
 
-String incoming = "";
+Protocol::FrameReceiver receiver;  // Binary frames from the STM32
 
 WebSocketsClient webSocket;
 
 
+// Outgoing messages
+// Every message is serialized into this one buffer and sent from it, so publishing never touches
+// the heap; the documents are static where they are too big for the loop task's stack. A message
+// that would not fit is dropped and counted rather than sent cut short.
+char txBuffer[2048];  // the diagnostics, the largest message, take up to about 1.8KB with MAX_TASKS tasks
+unsigned long txOverflows = 0;
+
+// Heap, sampled at every diagnostics frame and sent with it. The low water mark is the least free
+// heap since boot, and the largest block shows fragmentation long before an allocation fails.
+unsigned long heapSamples = 0;
+
+void sendJson(const JsonDocument& doc) {
+  size_t length = measureJson(doc);
+  if (length >= sizeof(txBuffer)) {
+    txOverflows++;
+    Serial.printf("Message of %u bytes dropped, buffer is %u\n", (unsigned) length, (unsigned) sizeof(txBuffer));
+    return;
+  }
+  serializeJson(doc, txBuffer, sizeof(txBuffer));
+  webSocket.sendTXT(txBuffer, length);
+}
+
+
+// Command channel to the STM32
+// ESP -> STM32: C,<seq>,<opcode>,<arg>\n
+// STM32 -> ESP: ACK frame with seq, result, tick and both relay states
+// ESP -> STM32: L,<record seq>\n once the server has stored a flash log record, no reply
+// Server commands queue up here and go out one at a time, so a resend can never overtake a
+// newer command. The head is resent until the STM32 acks it, and the result goes back to the
+// server as a commandAck with the STM32 tick and the UART round trip.
+// The server names the device and gives the argument, signed and already in the STM32's units.
+#define CMD_FAN 1
+#define CMD_PELTIER 2
+#define CMD_CONTROL 3  // control strategy, an index into the STM32's controlStrategies
+#define CMD_THERMISTOR_OFFSET 4  // hundredths of a F
+#define CMD_CLEAR_FAULT 5  // releases a latched overcurrent trip
+#define CMD_TELEMETRY 6  // telemetry heartbeat in s, 0 sends every window
+#define CMD_SPECTRUM 8  // fan spectrum block in samples, 0 is off
+#define CMD_DEADBAND_VOLTAGE 9  // telemetry deadbands, in thousandths of a V, A, F and W
+#define CMD_DEADBAND_CURRENT 10
+#define CMD_DEADBAND_TEMPERATURE 11
+#define CMD_DEADBAND_POWER 12
+
+// Results 0-4 come from the STM32, the rest are decided here
+#define RESULT_TIMEOUT 5
+#define RESULT_BUSY 6
+
+const unsigned long COMMAND_RETRY_MILLIS = 200;
+const int COMMAND_MAX_ATTEMPTS = 3;
+const int MAX_PENDING_COMMANDS = 4;
+
+struct PendingCommand {
+  uint8_t seq;
+  unsigned long id;  // server command id
+  uint8_t opcode;
+  long arg;
+  int attempts;
+  unsigned long queuedMillis;
+  unsigned long lastSentMillis;
+};
+
+PendingCommand pendingCommands[MAX_PENDING_COMMANDS];  // [0] is in flight
+int pendingCount = 0;
+uint8_t nextSeq = 1;
+
+// ack is the STM32's, with every relay state in load order, or NULL when the command never got one
+void sendCommandAck(unsigned long id, int result, const Protocol::Ack* ack, unsigned long uartMillis, int attempts) {
+  StaticJsonDocument<JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(6) + JSON_ARRAY_SIZE(Protocol::MAX_LOADS)> wrapperObj;
+  wrapperObj["type"] = "commandAck";
+  JsonObject data = wrapperObj.createNestedObject("data");
+  data["id"] = id;
+  data["result"] = result;
+  if (ack == NULL) {
+    data["tick"] = 0;
+    data["status"] = nullptr;
+  } else {
+    data["tick"] = ack->tick;
+    JsonArray status = data.createNestedArray("status");
+    for (int i = 0; i < ack->loadCount; i++) status.add(ack->status[i]);
+  }
+  data["uartMillis"] = uartMillis;
+  data["attempts"] = attempts;
+
+  sendJson(wrapperObj);
+}
+
+void transmitCommand(PendingCommand& command) {
+  command.attempts++;
+  command.lastSentMillis = millis();
+  mySerial.printf("C,%u,%u,%ld\n", command.seq, command.opcode, command.arg);
+}
+
+// Drops the head and starts the next queued command
+void completeCommand() {
+  for (int i = 1; i < pendingCount; i++) pendingCommands[i - 1] = pendingCommands[i];
+  pendingCount--;
+  if (pendingCount > 0) transmitCommand(pendingCommands[0]);
+}
+
+void queueCommand(unsigned long id, uint8_t opcode, long arg) {
+  for (int i = 0; i < pendingCount; i++) {
+    if (pendingCommands[i].id == id) return;  // server resend, already queued
+  }
+  if (pendingCount == MAX_PENDING_COMMANDS) {
+    sendCommandAck(id, RESULT_BUSY, NULL, 0, 0);
+    return;
+  }
+
+  PendingCommand& command = pendingCommands[pendingCount++];
+  command.seq = nextSeq;
+  nextSeq = nextSeq == 255 ? 1 : nextSeq + 1;  // 0 is reserved for unparseable commands
+  command.id = id;
+  command.opcode = opcode;
+  command.arg = arg;
+  command.attempts = 0;
+  command.queuedMillis = millis();
+  if (pendingCount == 1) transmitCommand(command);
+}
+
+void handleAck(const Protocol::Ack& ack) {
+  // Late acks for a command that already completed or timed out are ignored
+  if (pendingCount == 0 || pendingCommands[0].seq != ack.seq) return;
+  PendingCommand& command = pendingCommands[0];
+  sendCommandAck(command.id, ack.result, &ack, millis() - command.queuedMillis, command.attempts);
+  completeCommand();
+}
+
+void checkPendingCommands() {
+  if (pendingCount == 0) return;
+  PendingCommand& command = pendingCommands[0];
+  unsigned long now = millis();
+  if (now - command.lastSentMillis < COMMAND_RETRY_MILLIS) return;
+
+  if (command.attempts >= COMMAND_MAX_ATTEMPTS) {
+    sendCommandAck(command.id, RESULT_TIMEOUT, NULL, now - command.queuedMillis, command.attempts);
+    completeCommand();
+  } else {
+    transmitCommand(command);
+  }
+}
+
+
 void webSocketEvent(WStype_t type, uint8_t * payload, size_t length) {
   switch (type) {
     case WStype_DISCONNECTED:
@@ -33,9 +176,9 @@ void webSocketEvent(WStype_t type, uint8_t * payload, size_t length) {
     case WStype_TEXT: { // This is a message from the server
         Serial.printf("[WS] Got payload: %s\n", payload);
 
-        // Parse the incoming JSON command
+        // Parse the incoming JSON command in place: strings stay in payload rather than being copied
         StaticJsonDocument<256> doc;
-        DeserializationError error = deserializeJson(doc, payload);
+        DeserializationError error = deserializeJson(doc, (char*) payload, length);
 
         if (error) {
             Serial.print("deserializeJson() failed: ");
@@ -43,24 +186,31 @@ void webSocketEvent(WStype_t type, uint8_t * payload, size_t length) {
             return;
         }
 
-        if (doc["type"] == "controlData") {
+        if (doc["type"] == "recordAck") {
+            // The server has the record, so the STM32 can stop resending it
+            unsigned long seq = doc["data"]["seq"];
+            mySerial.printf("L,%lu\n", seq);
+        } else if (doc["type"] == "controlData") {
             JsonObject data = doc["data"];
-            
-            if (data.containsKey("fanStatus")) {
-                bool fanOn = data["fanStatus"];
-                Serial.printf("Setting Fan Status to: %s\n", fanOn ? "ON" : "OFF");
-
-                // Communicate to STM32
-                mySerial.printf(fanOn ? "FAN_ON" : "FAN_OFF");
-            }
-
-            if (data.containsKey("pelStatus")) {
-                bool pelOn = data["pelStatus"];
-                Serial.printf("Setting Peltier Status to: %s\n", pelOn ? "ON" : "OFF");
-
-                // Communicate to STM32
-                mySerial.printf(pelOn ? "PELTIER_ON" : "PELTIER_OFF");
-            }
+            unsigned long id = data["id"];
+            const char* device = data["device"] | "";
+            bool status = data["status"];
+            long arg = data["arg"] | (status ? 1L : 0L);
+            Serial.printf("Command %lu: %s %ld\n", id, device, arg);
+
+            uint8_t opcode = 0;
+            if (strcmp(device, "fan") == 0) opcode = CMD_FAN;
+            else if (strcmp(device, "peltier") == 0) opcode = CMD_PELTIER;
+            else if (strcmp(device, "control") == 0) opcode = CMD_CONTROL;
+            else if (strcmp(device, "thermistorOffset") == 0) opcode = CMD_THERMISTOR_OFFSET;
+            else if (strcmp(device, "fault") == 0) opcode = CMD_CLEAR_FAULT;
+            else if (strcmp(device, "spectrum") == 0) opcode = CMD_SPECTRUM;
+            else if (strcmp(device, "heartbeat") == 0) opcode = CMD_TELEMETRY;
+            else if (strcmp(device, "voltageDeadband") == 0) opcode = CMD_DEADBAND_VOLTAGE;
+            else if (strcmp(device, "currentDeadband") == 0) opcode = CMD_DEADBAND_CURRENT;
+            else if (strcmp(device, "temperatureDeadband") == 0) opcode = CMD_DEADBAND_TEMPERATURE;
+            else if (strcmp(device, "powerDeadband") == 0) opcode = CMD_DEADBAND_POWER;
+            queueCommand(id, opcode, arg);
         }
         break;
     }
@@ -72,67 +222,236 @@ void webSocketEvent(WStype_t type, uint8_t * payload, size_t length) {
   }
 }
 
-void parseUART(String msg) {
-  // Serial.print("Received from STM32: ");
-  // Serial.println(msg);
-
-  float fanVoltage, fanCurrent, fanPower, pelVoltage, pelCurrent, pelPower, temperature;
+// Every channel in the STM32's list order: temperatures in F, and per load its voltage, current,
+// power, relay status and, from the energy counters, its whole C and J. The server names them.
+const size_t LOAD_JSON_SIZE = JSON_OBJECT_SIZE(6);
+const size_t CHANNELS_JSON_SIZE = JSON_ARRAY_SIZE(Protocol::MAX_THERMISTORS) + JSON_ARRAY_SIZE(Protocol::MAX_LOADS) +
+                                  Protocol::MAX_LOADS * LOAD_JSON_SIZE;
 
-  int fanStatus, pelStatus, logData;
+void publishTelemetry(const Protocol::Header& header, const Protocol::Telemetry& telemetry) {
+  static StaticJsonDocument<JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(14) + CHANNELS_JSON_SIZE> wrapperObj;
+  wrapperObj.clear();
+  wrapperObj["type"] = "sensorData";
+  JsonObject doc = wrapperObj.createNestedObject("data");
+  JsonArray temperatures = doc.createNestedArray("temperatures");
+  for (int i = 0; i < telemetry.thermistorCount; i++) temperatures.add(telemetry.temperature[i]);
+  JsonArray loads = doc.createNestedArray("loads");
+  for (int i = 0; i < telemetry.loadCount; i++) {
+    JsonObject load = loads.createNestedObject();
+    load["voltage"] = telemetry.voltage[i];
+    load["current"] = telemetry.current[i];
+    load["power"] = telemetry.voltage[i] * telemetry.current[i];
+    load["status"] = telemetry.status[i];
+    // Totals from the STM32's energy counters, so nothing depends on which frames get through
+    load["coulombs"] = telemetry.coulombs[i];
+    load["joules"] = telemetry.joules[i];
+  }
+  doc["logData"] = telemetry.logData;
+  doc["textStatus"] = telemetry.textStatus;
+  doc["powerAvg"] = telemetry.powerAvg;  // running window of total power kept by the STM32
+  doc["powerMin"] = telemetry.powerMin;
+  doc["powerMax"] = telemetry.powerMax;
+  doc["powerStd"] = telemetry.powerStd;
+  doc["held"] = telemetry.held;  // windows left out before this one, the server fills them forward
+  doc["scanRate"] = telemetry.scanRate;
+  doc["seq"] = header.seq;
+  doc["tick"] = header.tick;
 
-  int textStatus;
+  // Serial.print("Sending: ");
+  // Serial.println(txBuffer);
+  sendJson(wrapperObj);
 
-  int items = sscanf(msg.c_str(), "%f,%f,%f,%f,%f,%f,%f,%d,%d,%d,%d", &fanVoltage, &fanCurrent, &fanPower, &pelVoltage, &pelCurrent, &pelPower, &temperature, &fanStatus, &pelStatus, &logData, &textStatus);
+}
 
-  if (items != 11) {
-    Serial.printf("Wrong amt of data entered from STM32");
-    return;
+// A minute record from the STM32's flash log, live or replayed after an outage. The server acks
+// it once stored; while it is unreachable nothing is acked and the STM32 keeps the record.
+void publishRecord(const Protocol::Record& record) {
+  static StaticJsonDocument<JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(7) + CHANNELS_JSON_SIZE> wrapperObj;
+  wrapperObj.clear();
+  wrapperObj["type"] = "logRecord";
+  JsonObject data = wrapperObj.createNestedObject("data");
+  data["seq"] = record.seq;
+  data["boot"] = record.boot;
+  data["millis"] = record.millis;
+  if (record.ageMillis == Protocol::UNKNOWN_AGE) data["ageMillis"] = nullptr;
+  else data["ageMillis"] = record.ageMillis;
+  JsonArray temperatures = data.createNestedArray("temperatures");
+  for (int i = 0; i < record.thermistorCount; i++) temperatures.add(record.temperature[i]);
+  JsonArray loads = data.createNestedArray("loads");
+  for (int i = 0; i < record.loadCount; i++) {
+    JsonObject load = loads.createNestedObject();
+    load["voltage"] = record.voltage[i];
+    load["current"] = record.current[i];
+    load["power"] = record.voltage[i] * record.current[i];
+    load["status"] = record.status[i];
   }
+  data["powerAvg"] = record.powerAvg;
 
-  StaticJsonDocument<512> doc;
-  doc["fanVoltage"] = fanVoltage;  // 5.0,0.1,0.5,5.0,0.1,0.5,76.3,1,1,0
-  doc["fanCurrent"] = fanCurrent;
-  doc["fanPower"] = fanPower;
-  doc["pelVoltage"] = pelVoltage;
-  doc["pelCurrent"] = pelCurrent;
-  doc["pelPower"] = pelPower;
-  doc["temperature"] = temperature;
-  doc["fanStatus"] = (fanStatus == 1);
-  doc["pelStatus"] = (pelStatus == 1);
-  doc["logData"] = (logData == 1);
-  doc["textStatus"] = textStatus;
-
-
-  StaticJsonDocument<768> wrapperObj;
-  wrapperObj["type"] = "sensorData";
-  wrapperObj["data"] = doc;
+  sendJson(wrapperObj);
+}
 
-  String requestBody;
-  serializeJson(wrapperObj, requestBody);
+// One chunk of a waveform capture, raw counts with what the server needs to turn them into
+// amps, per load in list order. cause is the trigger's kind, load the one that triggered it.
+// The server puts the capture back together; chunks are not acked.
+void publishCaptureChunk(const Protocol::CaptureChunk& chunk) {
+  static StaticJsonDocument<JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(11) + JSON_ARRAY_SIZE(Protocol::MAX_LOADS) +
+                            Protocol::MAX_LOADS * JSON_OBJECT_SIZE(3) +
+                            JSON_ARRAY_SIZE(Protocol::CAPTURE_CHUNK_SAMPLES)> wrapperObj;  // kept off the stack
+  static const char* const causes[] = {"unknown", "relay", "step", "limit"};
+  wrapperObj.clear();
+  wrapperObj["type"] = "captureChunk";
+  JsonObject data = wrapperObj.createNestedObject("data");
+  data["id"] = chunk.id;
+  uint8_t kind = Protocol::captureKind(chunk.cause);
+  data["cause"] = causes[kind <= Protocol::CAPTURE_LIMIT ? kind : 0];
+  data["load"] = Protocol::captureLoad(chunk.cause);
+  data["index"] = chunk.index;
+  data["chunks"] = chunk.chunks;
+  // frame of the capture the arrays start at
+  data["first"] = chunk.index * (Protocol::CAPTURE_CHUNK_SAMPLES / chunk.loadCount);
+  data["sampleRate"] = chunk.sampleRate;
+  data["preFrames"] = chunk.preFrames;
+  data["frames"] = chunk.frames;
+  data["ageMillis"] = chunk.ageMillis;
+  JsonArray loads = data.createNestedArray("loads");
+  for (int c = 0; c < chunk.loadCount; c++) {
+    JsonObject load = loads.createNestedObject();
+    load["zero"] = chunk.zero[c];
+    load["ampsPerCount"] = chunk.ampsPerCount[c];
+    JsonArray counts = load.createNestedArray("counts");
+    for (int i = 0; i < chunk.frameCount; i++) counts.add(chunk.counts[i * chunk.loadCount + c]);
+  }
 
-  // Serial.print("Sending: ");
-  // Serial.println(requestBody);
-  webSocket.sendTXT(requestBody);
+  sendJson(wrapperObj);
+}
 
+// Fan current spectrum features from the STM32, one block every minute or so while the fan runs
+void publishSpectrum(const Protocol::Header& header, const Protocol::Spectrum& spectrum) {
+  StaticJsonDocument<512> wrapperObj;
+  wrapperObj["type"] = "spectrum";
+  JsonObject data = wrapperObj.createNestedObject("data");
+  data["blockSize"] = spectrum.blockSize;
+  data["sampleRate"] = spectrum.sampleRate;
+  data["dominantHz"] = spectrum.dominantHz;
+  data["rpm"] = spectrum.rpm;
+  data["current"] = spectrum.current;
+  data["rippleRms"] = spectrum.rippleRms;
+  JsonArray bands = data.createNestedArray("bands");  // A rms, edges in bandHz
+  JsonArray bandHz = data.createNestedArray("bandHz");
+  for (size_t i = 0; i < Protocol::SPECTRUM_BANDS; i++) bands.add(spectrum.bands[i]);
+  for (size_t i = 0; i <= Protocol::SPECTRUM_BANDS; i++) bandHz.add(Protocol::SPECTRUM_BAND_HZ[i]);
+  data["cycles"] = spectrum.cycles;
+  data["blocks"] = spectrum.blocks;
+  data["tick"] = header.tick;
+
+  sendJson(wrapperObj);
 }
 
-void checkStm32Data() {
-  // if (mySerial.available()) {
-  //   String msg = mySerial.readStringUntil('\n');
-  //   msg.trim();
-  //   if (msg.length() > 0) {
-  //     parseUART(msg);
-  //   }
-  // }
+// Scheduler diagnostics from the STM32, plus this side's counters for the link
+void publishDiagnostics(const Protocol::Header& header, const Protocol::Diagnostics& diagnostics) {
+  static StaticJsonDocument<2048> wrapperObj;  // MAX_TASKS objects of 6 members, kept off the stack
+  wrapperObj.clear();
+  wrapperObj["type"] = "diagnostics";
+  JsonObject data = wrapperObj.createNestedObject("data");
+  data["cpuMHz"] = diagnostics.cpuMHz;
+  data["cpuLoad"] = diagnostics.cpuLoad;
+  data["isrLoad"] = diagnostics.isrLoad;
+  data["skippedTicks"] = diagnostics.skippedTicks;
+  data["maxLatencyCycles"] = diagnostics.maxLatencyCycles;
+  data["droppedWindows"] = diagnostics.droppedWindows;
+  data["scanOverruns"] = diagnostics.scanOverruns;
+  data["uartTxDropped"] = diagnostics.uartTxDropped;
+  data["uartRxDropped"] = diagnostics.uartRxDropped;
+  data["idlePercent"] = diagnostics.idlePercent;
+  data["mcuCurrent"] = diagnostics.mcuCurrent;
+  data["wakeupRate"] = diagnostics.wakeupRate;
+  data["logBacklog"] = diagnostics.logBacklog;
+  data["logOverwritten"] = diagnostics.logOverwritten;
+  data["captures"] = diagnostics.captures;
+  data["capturesMissed"] = diagnostics.capturesMissed;
+  data["trips"] = diagnostics.trips;
+  data["tripLatency"] = diagnostics.tripLatency;  // us, last overcurrent trip
+  data["telemetryWindows"] = diagnostics.telemetryWindows;
+  data["telemetryFrames"] = diagnostics.telemetryFrames;
+  data["tick"] = header.tick;
+
+  JsonObject link = data.createNestedObject("link");
+  link["frames"] = receiver.frames();
+  link["lostFrames"] = receiver.lostFrames();
+  link["restarts"] = receiver.restarts();         // STM32 resets seen, not counted as lost
+  link["crcErrors"] = receiver.crcErrors();
+  link["framingErrors"] = receiver.framingErrors();
+  link["versionErrors"] = receiver.versionErrors();
+
+  JsonObject esp = data.createNestedObject("esp");
+  esp["heapSize"] = ESP.getHeapSize();
+  esp["freeHeap"] = ESP.getFreeHeap();
+  esp["minFreeHeap"] = ESP.getMinFreeHeap();     // low water mark since boot
+  esp["maxAllocHeap"] = ESP.getMaxAllocHeap();   // largest free block
+  esp["txOverflows"] = txOverflows;
+  esp["heapSamples"] = ++heapSamples;
+
+  JsonArray tasks = data.createNestedArray("tasks");
+  for (int i = 0; i < diagnostics.taskCount; i++) {
+    const Protocol::TaskDiagnostics& profile = diagnostics.tasks[i];
+    JsonObject task = tasks.createNestedObject();
+    task["name"] = (const char*) profile.name;  // not copied, diagnostics outlives the document
+    task["minCycles"] = profile.minCycles;
+    task["avgCycles"] = profile.avgCycles;
+    task["maxCycles"] = profile.maxCycles;
+    task["deadlineMisses"] = profile.deadlineMisses;
+    task["overruns"] = profile.overruns;
+  }
+
+  sendJson(wrapperObj);
 }
 
-void checkKeyboardInput() {
-  if (Serial.available()) { // Check the Serial Monitor
-    String msg = Serial.readStringUntil('\n'); // Read from the Serial Monitor
-    msg.trim();
-    if (msg.length() > 0) {
-      parseUART(msg); // Send the keyboard data to your existing parser
+// A complete frame that passed the CRC, dispatched on its type
+void handleFrame() {
+  const Protocol::Header& header = receiver.header();
+  const uint8_t* payload = receiver.payload();
+  size_t length = receiver.payloadLength();
+
+  switch (header.type) {
+    case Protocol::TELEMETRY: {
+      Protocol::Telemetry telemetry;
+      if (Protocol::unpackTelemetry(payload, length, telemetry)) publishTelemetry(header, telemetry);
+      else Serial.println("Bad telemetry frame from STM32");
+      break;
     }
+    case Protocol::DIAGNOSTICS: {
+      static Protocol::Diagnostics diagnostics;  // ~220 bytes, kept off the stack
+      if (Protocol::unpackDiagnostics(payload, length, diagnostics)) publishDiagnostics(header, diagnostics);
+      else Serial.println("Bad diagnostics frame from STM32");
+      break;
+    }
+    case Protocol::ACK: {
+      Protocol::Ack ack;
+      if (Protocol::unpackAck(payload, length, ack)) handleAck(ack);
+      else Serial.println("Bad ack frame from STM32");
+      break;
+    }
+    case Protocol::RECORD: {
+      Protocol::Record record;
+      if (Protocol::unpackRecord(payload, length, record)) publishRecord(record);
+      else Serial.println("Bad record frame from STM32");
+      break;
+    }
+    case Protocol::CAPTURE: {
+      static Protocol::CaptureChunk chunk;  // ~220 bytes, kept off the stack
+      if (Protocol::unpackCaptureChunk(payload, length, chunk)) publishCaptureChunk(chunk);
+      else Serial.println("Bad capture frame from STM32");
+      break;
+    }
+    case Protocol::SPECTRUM: {
+      Protocol::Spectrum spectrum;
+      if (Protocol::unpackSpectrum(payload, length, spectrum)) publishSpectrum(header, spectrum);
+      else Serial.println("Bad spectrum frame from STM32");
+      break;
+    }
+    default:
+      Serial.println("Unknown frame type from STM32");
+      break;
   }
 }
 
@@ -140,6 +459,8 @@ void setup() {
   // put your setup code here, to run once:
   Serial.begin(115200);
   mySerial.begin(115200, SERIAL_8N1, RX_PIN, TX_PIN);
+  // Commands count seq from 1 again, so the STM32 forgets the last seq it ran before this boot
+  mySerial.print("S\n");
 
   // Connect to wifi
   Serial.print("Connecting to ");
@@ -162,23 +483,11 @@ void setup() {
 void loop() {
 
   webSocket.loop();
-  // checkStm32Data(); // Checks for STM32 data
-
 
   while (mySerial.available()) {
-    char c = mySerial.read();
-    // Serial.print(c);
-    if (c == '|') {
-      // Serial.print("Received from STM32: ");
-      // Serial.println(incoming);
-      parseUART(incoming);
-      incoming = "";
-    } else {
-      incoming += c;
-    }
+    if (receiver.push(mySerial.read())) handleFrame();
   }
 
-
-  // checkKeyboardInput();
+  checkPendingCommands();
 
 }
@@ -0,0 +1,55 @@
+#include "AdaptiveScan.h"
+#include <math.h>
+
+
+void AdaptiveScan::begin(int lowDivider, const float* jumpCounts, const float* quietCounts, unsigned long quietMillis) {
+    _lowDivider = lowDivider;
+    _quietMillis = quietMillis;
+    for (int i = 0; i < CHANNELS; i++) {
+        _jump[i] = jumpCounts[i];
+        _quietVariance[i] = quietCounts[i] * quietCounts[i];
+    }
+    _primed = false;
+    _activeMillis = millis();
+    _divider = 1;
+}
+
+int AdaptiveScan::update(const float* counts, unsigned long nowMillis) {
+    bool active = false;
+    for (int i = 0; i < CHANNELS; i++) {
+        if (!_primed) {
+            _mean[i] = counts[i];
+            _variance[i] = 0;
+            continue;
+        }
+        float deviation = counts[i] - _mean[i];
+        if (fabsf(deviation) > _jump[i]) active = true;
+        _mean[i] += GAIN * deviation;
+        _variance[i] = (1 - GAIN) * (_variance[i] + GAIN * deviation * deviation);
+        if (_variance[i] > _quietVariance[i]) active = true;
+    }
+    _primed = true;
+    if (active) _activeMillis = nowMillis;
+    return _pick(nowMillis);
+}
+
+int AdaptiveScan::wake(unsigned long nowMillis) {
+    _activeMillis = nowMillis;
+    return _pick(nowMillis);
+}
+
+int AdaptiveScan::hold(unsigned long nowMillis, unsigned long forMillis) {
+    _holdUntil = nowMillis + forMillis;
+    return _pick(nowMillis);
+}
+
+void AdaptiveScan::setFixedDivider(int divider) {
+    _fixedDivider = divider;
+}
+
+int AdaptiveScan::_pick(unsigned long nowMillis) {
+    if (_fixedDivider > 0) _divider = _fixedDivider;
+    else if ((long) (nowMillis - _holdUntil) < 0) _divider = 1;
+    else _divider = nowMillis - _activeMillis >= _quietMillis ? _lowDivider : 1;
+    return _divider;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "Arduino.h"
+#include "Channels.h"
+
+
+// Picks the scan divider from how much the inputs move. SampleData feeds it every filter input,
+// the 1ms mean of each channel in raw counts, and it keeps an exponential mean and variance of
+// each. One input further than its jump from the mean, or wake() for a relay change, asks for
+// the full rate at once; the low rate only comes back once every channel's deviation has stayed
+// under its quiet level for quietMillis. At the low rate an input is a single sample rather than
+// a mean of several, so the quiet levels have to sit above the raw sample noise. hold() keeps
+// the full rate until a time without counting as activity, for a measurement that needs it.
+class AdaptiveScan {
+
+public:
+    static const int CHANNELS = Channels::SCAN_CHANNELS;   // ScanFrame order
+
+    void begin(int lowDivider, const float* jumpCounts, const float* quietCounts, unsigned long quietMillis);
+    int update(const float* counts, unsigned long nowMillis);  // Divider to scan at
+    int wake(unsigned long nowMillis);                          // Same, now at the full rate
+    int hold(unsigned long nowMillis, unsigned long forMillis); // Same, full rate until then
+    void setFixedDivider(int divider);                          // 0 adapts
+    int getDivider() { return _divider; }
+
+private:
+    static constexpr float GAIN = 1.0f / 256;      // per input, about a quarter second at 1khz
+
+    float _jump[CHANNELS] = {};
+    float _quietVariance[CHANNELS] = {};
+    float _mean[CHANNELS] = {};
+    float _variance[CHANNELS] = {};
+    bool _primed = false;
+    int _lowDivider = 1;
+    int _fixedDivider = 0;
+    volatile int _divider = 1;
+    unsigned long _quietMillis = 0;
+    volatile unsigned long _activeMillis = 0;  // Last input or wake that needed the full rate
+    volatile unsigned long _holdUntil = 0;
+
+    int _pick(unsigned long nowMillis);
+
+};
@@ -0,0 +1,60 @@
+#include "CalibrationStore.h"
+#include "Crc16.h"
+#include "stm32_eeprom.h"
+#include <stddef.h>
+
+
+bool CalibrationStore::load(SensorCalibration& calibration) {
+    Record record;
+    uint8_t* bytes = (uint8_t*) &record;
+
+    // Copies the page into RAM once, then reads from the copy
+    eeprom_buffer_fill();
+    for (size_t i = 0; i < sizeof(record); i++) {
+        bytes[i] = eeprom_buffered_read_byte(i);
+    }
+
+    if (record.magic != MAGIC || record.version != VERSION || record.length != sizeof(record)) return false;
+    if (record.crc != _crc(record)) return false;
+    if (!_plausible(record.calibration)) return false;
+
+    _writes = record.writes;
+    calibration = record.calibration;
+    return true;
+}
+
+bool CalibrationStore::save(const SensorCalibration& calibration) {
+    if (!_plausible(calibration)) return false;
+
+    Record record;
+    memset(&record, 0, sizeof(record));
+    record.magic = MAGIC;
+    record.version = VERSION;
+    record.length = sizeof(record);
+    record.writes = _writes + 1;
+    record.calibration = calibration;
+    record.crc = _crc(record);
+
+    // Whole record into the RAM copy, then a single erase and program of the page
+    const uint8_t* bytes = (const uint8_t*) &record;
+    for (size_t i = 0; i < sizeof(record); i++) {
+        eeprom_buffered_write_byte(i, bytes[i]);
+    }
+    eeprom_buffer_flush();
+
+    _writes = record.writes;
+    return true;
+}
+
+uint16_t CalibrationStore::_crc(const Record& record) {
+    return crc16((const uint8_t*) &record, offsetof(Record, crc));
+}
+
+bool CalibrationStore::_plausible(const SensorCalibration& calibration) {
+    // Baselines sit near mid scale on an ACS712, anything far off is a bad calibration
+    for (size_t load = 0; load < Channels::LOAD_COUNT; load++) {
+        float baseline = calibration.currentBaseline[load];
+        if (!(baseline > 1000 && baseline < 3000)) return false;
+    }
+    return calibration.thermistorOffset > -20 && calibration.thermistorOffset < 20;
+}
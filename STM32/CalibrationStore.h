@@ -0,0 +1,38 @@
+#pragma once
+
+#include "Arduino.h"
+#include "HardwareAPI.h"
+
+
+// SensorCalibration in the core's emulated EEPROM, which is one flash page on the STM32L4.
+// The record carries a magic, a layout version and a CRC-16, so a blank page, an older layout
+// or a write cut short by a reset all read back as no calibration.
+// save() erases and programs the whole page, which stalls the CPU for tens of ms and wears the
+// flash, so callers keep writes rare and off the interrupt path.
+class CalibrationStore {
+
+public:
+    static const uint32_t MAGIC = 0x4C414350;  // "PCAL"
+    static const uint16_t VERSION = 1;
+
+    bool load(SensorCalibration& calibration);
+    bool save(const SensorCalibration& calibration);
+
+    unsigned long getWrites() { return _writes; }  // Page writes over the life of the record
+
+private:
+    struct Record {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t length;
+        uint32_t writes;
+        SensorCalibration calibration;
+        uint16_t crc;
+    };
+
+    unsigned long _writes = 0;
+
+    static uint16_t _crc(const Record& record);
+    static bool _plausible(const SensorCalibration& calibration);
+
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "Arduino.h"
+#include <stddef.h>
+#include <utility>
+
+
+// The board's analog channels, described at compile time. A thermistor is a 10k NTC under a
+// 10k pull-up. A load is a relay and the ACS712 current sensor in its supply, read through a
+// divider. The ADC scans the thermistors first and then the loads' sensors, each in list order,
+// so a ScanFrame and a RawCounts hold them in the same order. HardwareAPI, the scan and RTOS.c
+// iterate over these lists, and so do the wire protocol, the flash records, the energy counters
+// and the waveform capture; adding a channel is a line here and a name in its enum. The
+// relay control drives each load by its role.
+namespace Channels {
+
+// What RelayControl does with a load
+enum LoadRole : uint8_t {
+    COOLER,                 // Switched by the control strategy's decision
+    HEAT_SINK_FAN,          // On with the coolers, off a run-on time after they last were
+};
+
+struct Thermistor {
+    const char* name;
+    int pin;
+};
+
+struct Load {
+    const char* name;
+    LoadRole role;
+    int currentPin;
+    int relayPin;
+    float voltsPerAmp;      // Sensor sensitivity, 0.185 for the 5A ACS712
+    float divider;          // Sensor output to ADC input
+    float multiplier;       // Measured correction of the sensitivity on this board
+    float supplyVolts;      // Across the load while on, there is no voltage sense
+    float tripAmps;         // Overcurrent trip limit, 0 for none, see HardwareAPI::armOvercurrentTrip
+    float testAmps;         // Drawn while on in the testing constructor's synthetic data
+    float captureAmps;      // One sample past it freezes a waveform capture, 0 for none
+};
+
+enum ThermistorChannel : uint8_t {BOX = 0};
+enum LoadChannel : uint8_t {FAN = 0, PELTIER = 1};
+
+constexpr Thermistor THERMISTORS[] = {
+    {"box", PA0},
+};
+
+constexpr Load LOADS[] = {
+    // name       role           current  relay  V/A     divider  multiplier  supply  trip   test   capture
+    {"fan",       HEAT_SINK_FAN, PA1,     PB10,  0.185f, 0.5f,    0.51f,      5.0f,   5.0f,  0.77f, 1.5f},
+    {"peltier",   COOLER,        PA4,     PB4,   0.185f, 0.5f,    0.92f,      5.0f,   8.0f,  1.2f,  2.5f},
+};
+
+constexpr size_t THERMISTOR_COUNT = sizeof(THERMISTORS) / sizeof(THERMISTORS[0]);
+constexpr size_t LOAD_COUNT = sizeof(LOADS) / sizeof(LOADS[0]);
+constexpr size_t SCAN_CHANNELS = THERMISTOR_COUNT + LOAD_COUNT;
+static_assert(SCAN_CHANNELS <= 8, "the scan sequence has at most 8 ranks");
+
+constexpr float ADC_VOLTS = 3.3f;
+constexpr float ADC_RANGE = 4095;
+
+// Slope of a load's current conversion, amps per ADC count
+constexpr float ampsPerCount(size_t load) {
+    return (ADC_VOLTS / ADC_RANGE) / (LOADS[load].voltsPerAmp * LOADS[load].divider * LOADS[load].multiplier);
+}
+
+// Calls f(std::integral_constant<size_t, I>()) for every I below N, unrolled at compile time,
+// so each call sees its channel's descriptor as constants
+template <typename F, size_t... I>
+inline void forEachIndex(F& f, std::index_sequence<I...>) {
+    (f(std::integral_constant<size_t, I>()), ...);
+}
+
+template <size_t N, typename F>
+inline void forEach(F f) {
+    forEachIndex(f, std::make_index_sequence<N>());
+}
+
+}
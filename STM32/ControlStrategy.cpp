@@ -0,0 +1,122 @@
+#include "ControlStrategy.h"
+
+
+// Threshold
+
+ThresholdControl::ThresholdControl(float onAbove) {
+    _onAbove = onAbove;
+}
+
+int ThresholdControl::update(const ControlInput& input) {
+    return input.temperature > _onAbove ? CONTROL_ON : CONTROL_HOLD;
+}
+
+
+
+// Hysteresis
+
+HysteresisControl::HysteresisControl(float setpoint, float band) {
+    _setpoint = setpoint;
+    _band = band;
+}
+
+void HysteresisControl::reset() {
+    _on = false;
+}
+
+int HysteresisControl::update(const ControlInput& input) {
+    if (input.temperature > _setpoint + _band / 2) _on = true;
+    else if (input.temperature < _setpoint - _band / 2) _on = false;
+    return _on ? CONTROL_ON : CONTROL_OFF;
+}
+
+
+
+// Time proportional
+
+TimeProportionalControl::TimeProportionalControl(float setpoint, float band, unsigned long windowMillis,
+                                                 unsigned long minSwitchMillis) {
+    _setpoint = setpoint;
+    _band = band;
+    _windowMillis = windowMillis;
+    _minSwitchMillis = minSwitchMillis;
+}
+
+void TimeProportionalControl::reset() {
+    _started = false;
+    _duty = 0;
+    _onMillis = 0;
+}
+
+int TimeProportionalControl::update(const ControlInput& input) {
+    unsigned long elapsed = input.nowMillis - _windowStart;
+
+    // Outside the band the current phase can only make things worse, so don't wait it out
+    bool on = elapsed < _onMillis;
+    bool restart = elapsed >= _minSwitchMillis &&
+                   ((!on && input.temperature > _setpoint + _band / 2) ||
+                    (on && input.temperature < _setpoint - _band / 2));
+
+    if (!_started || elapsed >= _windowMillis || restart) {
+        _duty = _computeDuty(input, _started ? elapsed / 1000.0f : 0);
+        if (_duty < 0) _duty = 0;
+        if (_duty > 1) _duty = 1;
+        _onMillis = _duty * _windowMillis;
+        if (_onMillis < _minSwitchMillis) _onMillis = 0;
+        if (_windowMillis - _onMillis < _minSwitchMillis) _onMillis = _windowMillis;
+        _windowStart = input.nowMillis;
+        _started = true;
+        elapsed = 0;
+    }
+    return elapsed < _onMillis ? CONTROL_ON : CONTROL_OFF;
+}
+
+float TimeProportionalControl::_computeDuty(const ControlInput& input, float seconds) {
+    return (input.temperature - (_setpoint - _band / 2)) / _band;
+}
+
+
+
+// PID
+
+PidControl::PidControl(float setpoint, float band, float kp, float ki, float kd, float powerBudget,
+                       unsigned long windowMillis, unsigned long minSwitchMillis)
+    : TimeProportionalControl(setpoint, band, windowMillis, minSwitchMillis) {
+    _kp = kp;
+    _ki = ki;
+    _kd = kd;
+    _powerBudget = powerBudget;
+}
+
+void PidControl::reset() {
+    TimeProportionalControl::reset();
+    _integral = 0;
+    _hasLast = false;
+}
+
+float PidControl::_computeDuty(const ControlInput& input, float seconds) {
+    // Positive error means too warm, so more cooling
+    float error = input.temperature - _setpoint;
+    float derivative = _hasLast && seconds > 0 ? (input.temperature - _lastTemperature) / seconds : 0;
+    _lastTemperature = input.temperature;
+    _hasLast = true;
+
+    // Running flat out for the whole window would average every load's watts
+    float maxDuty = 1;
+    float fullPower = input.loadPower;
+    if (fullPower > 0 && _powerBudget < fullPower) maxDuty = _powerBudget / fullPower;
+
+    float proportional = _kp * error + _kd * derivative;
+    float integral = _integral + _ki * error * seconds;
+    float output = proportional + integral;
+
+    // Conditional integration: only wind further while the output is inside its limits
+    if ((output < maxDuty || error < 0) && (output > 0 || error > 0)) _integral = integral;
+    if (_integral < 0) _integral = 0;
+    if (_integral > maxDuty) _integral = maxDuty;
+
+    output = proportional + _integral;
+    if (output < 0) return 0;
+    if (output > maxDuty) return maxDuty;
+    return output;
+}
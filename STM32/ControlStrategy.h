@@ -0,0 +1,122 @@
+#pragma once
+
+#include "Arduino.h"
+
+
+// What a strategy sees every relay period
+struct ControlInput {
+    unsigned long nowMillis;
+    float temperature;      // F, decimation filter output
+    float loadPower;        // W, every load's last filtered reading while it was on, summed
+    float powerAvg;         // W, power management window mean
+};
+
+// Decisions for the cooler relays
+enum ControlDecision {CONTROL_HOLD = -1, CONTROL_OFF = 0, CONTROL_ON = 1};
+
+
+// A thermostat policy for the peltier. RelayControl() asks for a decision every relay period,
+// switches the coolers and their heat sink fans together and keeps power management as the
+// last word.
+class ControlStrategy {
+
+public:
+    virtual ~ControlStrategy() {}
+    virtual const char* name() = 0;
+    virtual void reset() {}
+    virtual int update(const ControlInput& input) = 0;  // ControlDecision
+
+    // Automatic strategies own both relays. The others only act at their thresholds and
+    // leave the relays to manual commands in between.
+    virtual bool isAutomatic() { return true; }
+
+};
+
+
+// The original behavior: both relays on above a threshold, never off except by power management
+class ThresholdControl : public ControlStrategy {
+
+public:
+    ThresholdControl(float onAbove);
+    const char* name() { return "threshold"; }
+    int update(const ControlInput& input);
+    bool isAutomatic() { return false; }
+
+private:
+    float _onAbove;
+
+};
+
+
+// On above setpoint + band / 2, off below setpoint - band / 2
+class HysteresisControl : public ControlStrategy {
+
+public:
+    HysteresisControl(float setpoint, float band);
+    const char* name() { return "hysteresis"; }
+    void reset();
+    int update(const ControlInput& input);
+
+private:
+    float _setpoint;
+    float _band;
+    bool _on = false;
+
+};
+
+
+// Slow PWM: a duty cycle is picked at the start of every window and the peltier runs for that
+// share of the window. On or off times shorter than minSwitchMillis are rounded away, which
+// bounds relay wear at two switches per window. A window is cut short when the temperature
+// leaves setpoint +- band / 2 on the side the current phase can't correct.
+// The base duty is proportional, 0 at setpoint - band / 2 and 1 at setpoint + band / 2.
+class TimeProportionalControl : public ControlStrategy {
+
+public:
+    TimeProportionalControl(float setpoint, float band, unsigned long windowMillis, unsigned long minSwitchMillis);
+    const char* name() { return "time-proportional"; }
+    void reset();
+    int update(const ControlInput& input);
+    float getDuty() { return _duty; }
+
+protected:
+    float _setpoint;
+    virtual float _computeDuty(const ControlInput& input, float seconds);
+
+private:
+    float _band;
+    unsigned long _windowMillis;
+    unsigned long _minSwitchMillis;
+    unsigned long _windowStart = 0;
+    unsigned long _onMillis = 0;
+    bool _started = false;
+    float _duty = 0;
+
+};
+
+
+// PID on the filtered temperature, driving the time proportioned duty cycle. Gains are in duty
+// per F, per F second and per F/s. The duty is capped so the loads together average at most
+// powerBudget watts, from their measured power while on, and the integral stops
+// winding while the output sits at a limit. band only sets when a window is cut short.
+class PidControl : public TimeProportionalControl {
+
+public:
+    PidControl(float setpoint, float band, float kp, float ki, float kd, float powerBudget,
+               unsigned long windowMillis, unsigned long minSwitchMillis);
+    const char* name() { return "pid"; }
+    void reset();
+
+protected:
+    float _computeDuty(const ControlInput& input, float seconds);
+
+private:
+    float _kp;
+    float _ki;
+    float _kd;
+    float _powerBudget;
+    float _integral = 0;
+    float _lastTemperature = 0;
+    bool _hasLast = false;
+
+};
@@ -0,0 +1,165 @@
+#include "DecimationFilter.h"
+
+#if defined(ARDUINO_ARCH_STM32)
+#include <CMSIS_DSP.h>
+#define DECIMATION_USE_CMSIS 1
+#endif
+
+
+// Stage layouts for a 1khz input. Taps set the Hamming transition width (about 3.3 * fs / taps),
+// sized so aliases only fold into the band between 0.4 and 0.5 of each output rate.
+struct StageLayout {
+    int factor;
+    int taps;
+};
+
+static const StageLayout STAGES_50HZ[] = {{5, 23}, {4, 67}};
+static const StageLayout STAGES_10HZ[] = {{5, 23}, {4, 67}, {5, 83}};
+static const StageLayout STAGES_1HZ[] = {{5, 23}, {4, 67}, {5, 83}, {10, 165}};
+
+static const int MAX_TAPS_TOTAL = 23 + 67 + 83 + 165;
+
+// Static storage, sized for the longest cascade
+static float _coefficients[MAX_TAPS_TOTAL];
+static float _history[DecimationFilter::CHANNELS][2 * MAX_TAPS_TOTAL];
+
+
+static void _designLowPass(float* coefficients, int taps, float cutoff) {
+    // cutoff is normalized to the stage input rate
+    float sum = 0;
+    int middle = (taps - 1) / 2;
+    for (int i = 0; i < taps; i++) {
+        int n = i - middle;
+        float sinc = n == 0 ? 2 * cutoff : sin(2 * PI * cutoff * n) / (PI * n);
+        float window = 0.54 - 0.46 * cos(2 * PI * i / (taps - 1));
+        coefficients[i] = sinc * window;
+        sum += coefficients[i];
+    }
+    // Unity gain at DC
+    for (int i = 0; i < taps; i++) {
+        coefficients[i] /= sum;
+    }
+}
+
+static float _dot(const float* a, const float* b, int length) {
+#ifdef DECIMATION_USE_CMSIS
+    float result;
+    arm_dot_prod_f32(a, b, length, &result);
+    return result;
+#else
+    float result = 0;
+    for (int i = 0; i < length; i++) {
+        result += a[i] * b[i];
+    }
+    return result;
+#endif
+}
+
+
+bool DecimationFilter::begin(unsigned long inputRateHz, unsigned long outputRateHz) {
+    const StageLayout* layout;
+    int count;
+    if (inputRateHz != 1000) return false;
+    switch (outputRateHz) {
+        case 50: layout = STAGES_50HZ; count = 2; break;
+        case 10: layout = STAGES_10HZ; count = 3; break;
+        case 1: layout = STAGES_1HZ; count = 4; break;
+        default: return false;
+    }
+
+    _inputRateHz = inputRateHz;
+    _outputRateHz = outputRateHz;
+    _stageCount = count;
+
+    int offset = 0;
+    unsigned long stageRate = inputRateHz;
+    for (int s = 0; s < count; s++) {
+        Stage& stage = _stages[s];
+        stage.factor = layout[s].factor;
+        stage.taps = layout[s].taps;
+        _designLowPass(&_coefficients[offset], stage.taps, 0.5f / stage.factor);
+        stage.coefficients = &_coefficients[offset];
+        for (int c = 0; c < CHANNELS; c++) {
+            stage.history[c] = &_history[c][2 * offset];
+        }
+        offset += stage.taps;
+        stageRate /= stage.factor;
+    }
+
+    reset();
+    return stageRate == outputRateHz;
+}
+
+void DecimationFilter::reset() {
+    for (int s = 0; s < _stageCount; s++) {
+        _stages[s].position = 0;
+        _stages[s].phase = 0;
+        for (int c = 0; c < CHANNELS; c++) {
+            memset(_stages[s].history[c], 0, 2 * _stages[s].taps * sizeof(float));
+        }
+    }
+    _primed = false;
+}
+
+bool DecimationFilter::push(const float* input, float* output) {
+    // Start every stage as if the first input had always been there, so the first outputs
+    // are not a ramp up from zero counts (-130F and 30A, enough to trip power management).
+    // A primed cascade outputs its input at unity DC gain, so that first output is published
+    // at once instead of a whole output period after boot.
+    if (!_primed) {
+        for (int s = 0; s < _stageCount; s++) {
+            for (int c = 0; c < CHANNELS; c++) {
+                for (int i = 0; i < 2 * _stages[s].taps; i++) _stages[s].history[c][i] = input[c];
+            }
+        }
+        _primed = true;
+        memcpy(output, input, CHANNELS * sizeof(float));
+        return true;
+    }
+    return _pushStage(0, input, output);
+}
+
+bool DecimationFilter::_pushStage(int index, const float* input, float* output) {
+    Stage& stage = _stages[index];
+
+    // Newest sample sits at the end of the window starting at position
+    for (int c = 0; c < CHANNELS; c++) {
+        stage.history[c][stage.position] = input[c];
+        stage.history[c][stage.position + stage.taps] = input[c];
+    }
+    stage.position++;
+    if (stage.position >= stage.taps) stage.position = 0;
+
+    stage.phase++;
+    if (stage.phase < stage.factor) return false;
+    stage.phase = 0;
+
+    // Only the kept phase is computed. Coefficients are symmetric, so no reversal is needed.
+    float stageOutput[CHANNELS];
+    for (int c = 0; c < CHANNELS; c++) {
+        stageOutput[c] = _dot(&stage.history[c][stage.position], stage.coefficients, stage.taps);
+    }
+
+    if (index + 1 < _stageCount) return _pushStage(index + 1, stageOutput, output);
+    memcpy(output, stageOutput, sizeof(stageOutput));
+    return true;
+}
+
+unsigned long DecimationFilter::getOutputRate() {
+    return _outputRateHz;
+}
+
+int DecimationFilter::getStageCount() {
+    return _stageCount;
+}
+
+unsigned long DecimationFilter::getDelayMillis() {
+    // Linear phase: (taps - 1) / 2 samples per stage at that stage's input rate
+    unsigned long delayMicros = 0;
+    unsigned long stageRate = _inputRateHz;
+    for (int s = 0; s < _stageCount; s++) {
+        delayMicros += 1000000UL * (_stages[s].taps - 1) / 2 / stageRate;
+        stageRate /= _stages[s].factor;
+    }
+    return delayMicros / 1000;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "Arduino.h"
+#include "Channels.h"
+
+
+// Multi-channel, multi-stage FIR decimator between the 1khz block stream and SendData.
+// Each stage is a Hamming windowed-sinc low pass cut at the stage's output Nyquist,
+// evaluated polyphase style: one dot product per output, none for the dropped inputs.
+// The cascade is picked from the output rate, so slower rates only add stages.
+class DecimationFilter {
+
+public:
+    static const int CHANNELS = Channels::SCAN_CHANNELS;   // ScanFrame order
+    static const int MAX_STAGES = 4;
+
+    bool begin(unsigned long inputRateHz, unsigned long outputRateHz);  // 1000 -> 50, 10 or 1
+    bool push(const float* input, float* output);  // CHANNELS values in, true when output holds a new sample
+    void reset();
+
+    unsigned long getOutputRate();
+    int getStageCount();
+    unsigned long getDelayMillis();  // Group delay of the whole cascade
+
+private:
+
+    struct Stage {
+        int factor;
+        int taps;
+        const float* coefficients;
+        int position;
+        int phase;
+        float* history[CHANNELS];  // 2 * taps, every sample stored twice so the window is contiguous
+    };
+
+    Stage _stages[MAX_STAGES];
+    int _stageCount = 0;
+    unsigned long _inputRateHz = 0;
+    unsigned long _outputRateHz = 0;
+    bool _primed = false;
+
+    bool _pushStage(int stage, const float* input, float* output);
+
+};
@@ -0,0 +1,97 @@
+#include "EnergyMeter.h"
+#include "Crc16.h"
+#include "stm32yyxx_ll_bus.h"
+#include "stm32yyxx_ll_pwr.h"
+#include "stm32yyxx_ll_rtc.h"
+#include <math.h>
+
+
+bool EnergyMeter::begin(unsigned long sampleRateHz) {
+    _sampleRateHz = sampleRateHz;
+
+    // The backup domain is write protected out of reset
+    LL_APB1_GRP1_EnableClock(LL_APB1_GRP1_PERIPH_PWR);
+    LL_PWR_EnableBkUpAccess();
+
+    uint32_t seqs[2];
+    Totals copies[2];
+    bool good[2];
+    for (uint32_t copy = 0; copy < 2; copy++) good[copy] = _readCopy(copy, seqs[copy], copies[copy]);
+    int newest = -1;
+    if (good[0] && good[1]) newest = (int32_t) (seqs[1] - seqs[0]) > 0 ? 1 : 0;
+    else if (good[0]) newest = 0;
+    else if (good[1]) newest = 1;
+    if (newest < 0) return false;
+
+    _totals = copies[newest];
+    _seq = seqs[newest];
+    return true;
+}
+
+void EnergyMeter::setChannel(Channels::LoadChannel load, float zero, float ampsPerCount, float volts) {
+    ChannelScale& scale = _scales[load];
+    scale.zero16 = lroundf(zero * 16);
+    scale.nanoCoulombsQ16 = lround(ampsPerCount / 16 / _sampleRateHz * 1e9 * 65536);
+    scale.millivolts = lroundf(volts * 1000);
+}
+
+void EnergyMeter::add(const RawCounts& counts, const bool* on) {
+    for (size_t i = 0; i < CHANNELS; i++) {
+        if (on[i]) _add(i, counts.current[i], counts.samples);
+    }
+}
+
+void EnergyMeter::_add(size_t load, uint32_t sum, uint32_t samples) {
+    const ChannelScale& scale = _scales[load];
+    int64_t deviation = (int64_t) sum * 16 - (int64_t) samples * scale.zero16;
+    if (deviation < 0) deviation = -deviation;   // the sensors read either way round
+    uint64_t nanoCoulombs = ((uint64_t) deviation * scale.nanoCoulombsQ16) >> 16;
+    _totals.nanoCoulombs[load] += nanoCoulombs;
+    _totals.nanoJoules[load] += nanoCoulombs * scale.millivolts / 1000;
+}
+
+void EnergyMeter::save() {
+    uint32_t words[COPY_WORDS];
+    words[0] = MAGIC;
+    words[1] = ++_seq;
+    // Every load's charge, then every load's energy
+    for (size_t i = 0; i < CHANNELS; i++) {
+        words[2 + i * 2] = (uint32_t) _totals.nanoCoulombs[i];
+        words[3 + i * 2] = (uint32_t) (_totals.nanoCoulombs[i] >> 32);
+        words[2 + (CHANNELS + i) * 2] = (uint32_t) _totals.nanoJoules[i];
+        words[3 + (CHANNELS + i) * 2] = (uint32_t) (_totals.nanoJoules[i] >> 32);
+    }
+    words[COPY_WORDS - 1] = _crc(words);
+
+    // Odd saves into copy 1, even into copy 0, so the other copy is always a whole one
+    uint32_t copy = _seq & 1;
+    for (uint32_t word = 0; word < COPY_WORDS; word++) LL_RTC_BAK_SetRegister(RTC, _register(copy, word), words[word]);
+}
+
+EnergyMeter::Totals EnergyMeter::read() {
+    noInterrupts();
+    Totals totals = _totals;
+    interrupts();
+    return totals;
+}
+
+bool EnergyMeter::_readCopy(uint32_t copy, uint32_t& seq, Totals& totals) {
+    uint32_t words[COPY_WORDS];
+    for (uint32_t word = 0; word < COPY_WORDS; word++) words[word] = LL_RTC_BAK_GetRegister(RTC, _register(copy, word));
+    if (words[0] != MAGIC || words[COPY_WORDS - 1] != _crc(words)) return false;
+
+    seq = words[1];
+    for (size_t i = 0; i < CHANNELS; i++) {
+        totals.nanoCoulombs[i] = (uint64_t) words[3 + i * 2] << 32 | words[2 + i * 2];
+        totals.nanoJoules[i] = (uint64_t) words[3 + (CHANNELS + i) * 2] << 32 | words[2 + (CHANNELS + i) * 2];
+    }
+    return true;
+}
+
+uint32_t EnergyMeter::_register(uint32_t copy, uint32_t word) {
+    return LL_RTC_BKP_DR0 + FIRST_REGISTER + copy * COPY_WORDS + word;
+}
+
+uint16_t EnergyMeter::_crc(const uint32_t* words) {
+    return crc16((const uint8_t*) words, (COPY_WORDS - 1) * sizeof(uint32_t));
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "Arduino.h"
+#include "HardwareAPI.h"
+
+
+// Charge and energy through every load in Channels.h, integrated from every 1ms block of the
+// scan in fixed point and kept in the RTC backup registers, so a reset, a watchdog or a
+// firmware update carries on from the last save. Only losing the backup domain supply, VDD
+// and VBAT both, starts them again from 0.
+// Each block adds |sum - samples * zero| of the raw counts, in 1/16 counts, scaled to nC by a
+// Q16 factor and to nJ by the supply in mV. The current cannot change sign within a block, so
+// this is the same as adding every sample. A load only counts while its relay is on, the
+// sensor noise around the zero would otherwise add up. The supply is a fixed voltage, there
+// is no voltage sense, so energy is that voltage times the charge.
+// The registers hold two copies, written in turn with a sequence number and a CRC-16, so a
+// reset in the middle of a save still leaves the one before it. A copy takes four words a load,
+// so the registers above FIRST_REGISTER hold two loads.
+class EnergyMeter {
+
+public:
+    static const size_t CHANNELS = Channels::LOAD_COUNT;
+
+    struct Totals {
+        uint64_t nanoCoulombs[CHANNELS];
+        uint64_t nanoJoules[CHANNELS];
+    };
+
+    // Restores the newest good copy from the backup registers, true if there was one
+    bool begin(unsigned long sampleRateHz);
+
+    // Zero in ADC counts, the slope of the current conversion and the supply across the load
+    void setChannel(Channels::LoadChannel load, float zero, float ampsPerCount, float volts);
+
+    // From the tick interrupt: one block of summed raw counts, samples at the full rate, and
+    // each load's relay status
+    void add(const RawCounts& counts, const bool* on);
+    void save();
+
+    Totals read();      // From loop(), whole
+
+private:
+    static const uint32_t MAGIC = 0x4E455045;  // "PENE"
+    static const uint32_t FIRST_REGISTER = 8;  // Below are left to the core and the RTC library
+    static const uint32_t BACKUP_REGISTERS = 32;
+    static const uint32_t COPY_WORDS = 3 + 4 * CHANNELS;   // magic, seq, 64 bit totals, crc
+    static_assert(FIRST_REGISTER + 2 * COPY_WORDS <= BACKUP_REGISTERS, "both copies fit the backup registers");
+
+    struct ChannelScale {
+        int32_t zero16 = 0;             // 1/16 counts
+        uint32_t nanoCoulombsQ16 = 0;   // Per 1/16 count sample, Q16
+        uint32_t millivolts = 0;
+    };
+
+    unsigned long _sampleRateHz = 0;
+    ChannelScale _scales[CHANNELS];
+    Totals _totals = {};
+    uint32_t _seq = 0;
+
+    void _add(size_t load, uint32_t sum, uint32_t samples);
+    static uint32_t _register(uint32_t copy, uint32_t word);
+    static bool _readCopy(uint32_t copy, uint32_t& seq, Totals& totals);
+    static uint16_t _crc(const uint32_t* words);
+
+};
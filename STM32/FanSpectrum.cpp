@@ -0,0 +1,203 @@
+#include "FanSpectrum.h"
+#include <math.h>
+
+
+static const float TWO_PI_F = 6.28318531f;
+static const float LINE_RATIO = 16;     // Peak over the mean bin power, 12dB, clear of the largest noise bin
+
+
+bool FanSpectrum::supportedBlock(int blockSize) {
+    return blockSize == 256 || blockSize == 512 || blockSize == 1024;
+}
+
+void FanSpectrum::begin(unsigned long sampleRateHz, int blockSize, int ripplesPerTurn) {
+    _sampleRateHz = sampleRateHz;
+    _ripplesPerTurn = ripplesPerTurn;
+    setBlockSize(blockSize);
+}
+
+bool FanSpectrum::setBlockSize(int blockSize) {
+    if (!supportedBlock(blockSize)) return false;
+    _state = IDLE;
+    _blockSize = blockSize;
+#ifdef FAN_SPECTRUM_CMSIS_DSP
+    arm_rfft_fast_init_f32(&_rfft, blockSize);
+#endif
+    return true;
+}
+
+void FanSpectrum::setChannel(float zero, float ampsPerCount) {
+    _zero = zero;
+    _ampsPerCount = ampsPerCount;
+}
+
+void FanSpectrum::start() {
+    _filled = 0;
+    _state = COLLECTING;
+}
+
+void FanSpectrum::cancel() {
+    _state = IDLE;
+}
+
+void FanSpectrum::push(const ScanFrame* frames, int count) {
+    if (_state != COLLECTING) return;
+    int filled = _filled;
+    for (int i = 0; i < count && filled < _blockSize; i++) _samples[filled++] = frames[i].current[Channels::FAN];
+    _filled = filled;
+    if (filled >= _blockSize) _state = FULL;
+}
+
+void FanSpectrum::restart() {
+    if (_state == COLLECTING) _filled = 0;
+}
+
+bool FanSpectrum::analyse(Protocol::Spectrum& spectrum) {
+    if (_state != FULL) return false;
+    const int n = _blockSize;
+
+    // Mean and ripple in the time domain, then a periodic Hann window over the ripple alone so
+    // the DC does not leak into the low bins. The window's cosine turns by rotation.
+    float sum = 0;
+    for (int i = 0; i < n; i++) sum += _samples[i];
+    float mean = sum / n;
+    float squares = 0;
+    float stepCos = cosf(TWO_PI_F / n);
+    float stepSin = sinf(TWO_PI_F / n);
+    float c = 1;
+    float s = 0;
+    for (int i = 0; i < n; i++) {
+        float ripple = _samples[i] - mean;
+        squares += ripple * ripple;
+        _samples[i] = ripple * (0.5f - 0.5f * c);
+        float next = c * stepCos - s * stepSin;
+        s = s * stepCos + c * stepSin;
+        c = next;
+    }
+
+    _transform();
+
+    // One sided power per bin, scaled so a band's sum is its mean square; a Hann window's
+    // squares add up to 3n/8
+    float scale = 2.0f / ((float) n * (3.0f * n / 8));
+    float binHz = (float) _sampleRateHz / n;
+    float bandPower[Protocol::SPECTRUM_BANDS] = {};
+    size_t band = 0;
+    int peak = 0;
+    float peakPower = 0;
+    float totalPower = 0;
+    int bins = 0;
+    for (int k = 1; k < n / 2; k++) {
+        float hz = k * binHz;
+        if (hz < Protocol::SPECTRUM_BAND_HZ[0]) continue;
+        while (band < Protocol::SPECTRUM_BANDS && hz >= Protocol::SPECTRUM_BAND_HZ[band + 1]) band++;
+        if (band == Protocol::SPECTRUM_BANDS) break;
+        float power = _spectrum[2 * k] * _spectrum[2 * k] + _spectrum[2 * k + 1] * _spectrum[2 * k + 1];
+        bandPower[band] += power;
+        totalPower += power;
+        bins++;
+        if (power > peakPower) {
+            peak = k;
+            peakPower = power;
+        }
+    }
+
+    // No line at all unless the peak stands well clear of the noise floor
+    if (bins == 0 || peakPower < LINE_RATIO * totalPower / bins) peak = 0;
+
+    // The peak between bins, from a parabola through the log power of it and its neighbours
+    float offset = 0;
+    if (peak > 1 && peak < n / 2 - 1) {
+        float left = logf(_spectrum[2 * peak - 2] * _spectrum[2 * peak - 2] +
+                          _spectrum[2 * peak - 1] * _spectrum[2 * peak - 1] + 1e-12f);
+        float middle = logf(peakPower + 1e-12f);
+        float right = logf(_spectrum[2 * peak + 2] * _spectrum[2 * peak + 2] +
+                           _spectrum[2 * peak + 3] * _spectrum[2 * peak + 3] + 1e-12f);
+        float curve = left - 2 * middle + right;
+        if (curve < 0) offset = 0.5f * (left - right) / curve;
+    }
+
+    spectrum.blockSize = n;
+    spectrum.sampleRate = _sampleRateHz;
+    spectrum.dominantHz = peak > 0 ? (peak + offset) * binHz : 0;
+    spectrum.rpm = lroundf(spectrum.dominantHz * 60 / _ripplesPerTurn);
+    spectrum.current = fabsf(mean - _zero) * _ampsPerCount;
+    spectrum.rippleRms = sqrtf(squares / n) * _ampsPerCount;
+    for (size_t i = 0; i < Protocol::SPECTRUM_BANDS; i++) spectrum.bands[i] = sqrtf(bandPower[i] * scale) * _ampsPerCount;
+    spectrum.cycles = 0;
+    spectrum.blocks = ++_blocks;
+
+    _state = IDLE;
+    return true;
+}
+
+// Real FFT of _samples into _spectrum: the DC and Nyquist terms first, then the real and
+// imaginary part of every bin in between
+void FanSpectrum::_transform() {
+#ifdef FAN_SPECTRUM_CMSIS_DSP
+    arm_rfft_fast_f32(&_rfft, _samples, _spectrum, 0);
+#else
+    // The even and odd samples as one complex sequence of half the length, then split
+    const int points = _blockSize / 2;
+    _complexFft(_samples, points);
+    _spectrum[0] = _samples[0] + _samples[1];
+    _spectrum[1] = _samples[0] - _samples[1];
+    float stepCos = cosf(TWO_PI_F / _blockSize);
+    float stepSin = sinf(TWO_PI_F / _blockSize);
+    float c = stepCos;
+    float s = stepSin;
+    for (int k = 1; k < points; k++) {
+        float re = _samples[2 * k];
+        float im = _samples[2 * k + 1];
+        float mirrorRe = _samples[2 * (points - k)];
+        float mirrorIm = -_samples[2 * (points - k) + 1];
+        float evenRe = 0.5f * (re + mirrorRe);
+        float evenIm = 0.5f * (im + mirrorIm);
+        float oddRe = 0.5f * (im - mirrorIm);
+        float oddIm = -0.5f * (re - mirrorRe);
+        _spectrum[2 * k] = evenRe + c * oddRe + s * oddIm;
+        _spectrum[2 * k + 1] = evenIm + c * oddIm - s * oddRe;
+        float next = c * stepCos - s * stepSin;
+        s = s * stepCos + c * stepSin;
+        c = next;
+    }
+#endif
+}
+
+// In place radix-2 forward FFT of interleaved complex data
+void FanSpectrum::_complexFft(float* data, int points) {
+    for (int i = 1, j = 0; i < points; i++) {
+        int bit = points >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) {
+            float re = data[2 * i];
+            float im = data[2 * i + 1];
+            data[2 * i] = data[2 * j];
+            data[2 * i + 1] = data[2 * j + 1];
+            data[2 * j] = re;
+            data[2 * j + 1] = im;
+        }
+    }
+    for (int length = 2; length <= points; length <<= 1) {
+        float stepCos = cosf(TWO_PI_F / length);
+        float stepSin = -sinf(TWO_PI_F / length);
+        for (int i = 0; i < points; i += length) {
+            float c = 1;
+            float s = 0;
+            for (int k = 0; k < length / 2; k++) {
+                float* a = &data[2 * (i + k)];
+                float* b = &data[2 * (i + k + length / 2)];
+                float re = b[0] * c - b[1] * s;
+                float im = b[0] * s + b[1] * c;
+                b[0] = a[0] - re;
+                b[1] = a[1] - im;
+                a[0] += re;
+                a[1] += im;
+                float next = c * stepCos - s * stepSin;
+                s = s * stepCos + c * stepSin;
+                c = next;
+            }
+        }
+    }
+}
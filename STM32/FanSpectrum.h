@@ -0,0 +1,75 @@
+#pragma once
+
+#include "Arduino.h"
+#include "HardwareAPI.h"
+#include "TelemetryProtocol.h"
+
+#if __has_include(<arm_math.h>)
+#include <arm_math.h>
+#define FAN_SPECTRUM_CMSIS_DSP 1
+#endif
+
+
+// Spectral health features of the fan current. The fan's commutation ripple rides on its DC
+// current at a fixed number of periods per turn, so the strongest line gives the speed, and
+// how the ripple spreads over the bands shows bearing wear before the mean current moves.
+// start() asks for the next block of raw fan samples, push() takes them from the scan tap in
+// the tick interrupt, and analyse() runs a Hann window, a real FFT and the features from
+// loop(). Only the features go upstream, never the block. Without a line well above the noise,
+// a stopped or very smooth fan, the dominant frequency and speed are 0.
+// The FFT is CMSIS-DSP's arm_rfft_fast_f32 when arm_math.h is on the include path, with the
+// CMSIS_DSP library linked. Otherwise a radix-2 FFT here gives the same packed output, which
+// is what the simulator runs. The CMSIS path has only been compiled against a stub header and
+// never run: that its output packs DC and Nyquist into the first pair like _transform()'s, as
+// the features assume, is from its documentation and still to be checked on the board. The
+// radix-2 path and that packing are checked against a direct DFT in sim/test.cpp.
+// A block is one unbroken run of full rate samples. restart() starts it again when the scan
+// slows, so the caller holds the full rate while a block fills.
+class FanSpectrum {
+
+public:
+    static const int MAX_BLOCK = 1024;          // 8KB of float samples and spectrum
+    static bool supportedBlock(int blockSize);  // 256, 512 or 1024
+
+    void begin(unsigned long sampleRateHz, int blockSize, int ripplesPerTurn);
+    bool setBlockSize(int blockSize);           // Drops a block under way
+    int getBlockSize() { return _blockSize; }
+
+    // Zero in ADC counts and the slope of the current conversion, for the amps features
+    void setChannel(float zero, float ampsPerCount);
+
+    // From loop()
+    void start();
+    void cancel();
+    bool isIdle() { return _state == IDLE; }
+
+    // From the tick interrupt
+    void push(const ScanFrame* frames, int count);
+    void restart();
+
+    // From loop(). The features of a full block, false while there is none. The caller times it.
+    bool analyse(Protocol::Spectrum& spectrum);
+
+    unsigned long getBlocks() { return _blocks; }
+
+private:
+    enum State : uint8_t {IDLE, COLLECTING, FULL};
+
+    volatile State _state = IDLE;
+    volatile int _filled = 0;
+    int _blockSize = MAX_BLOCK;
+    unsigned long _sampleRateHz = 0;
+    int _ripplesPerTurn = 1;
+    float _zero = 0;
+    float _ampsPerCount = 0;
+    unsigned long _blocks = 0;
+    float _samples[MAX_BLOCK];      // Raw counts, then windowed in place
+    float _spectrum[MAX_BLOCK];     // Packed as arm_rfft_fast_f32 leaves it
+#ifdef FAN_SPECTRUM_CMSIS_DSP
+    arm_rfft_fast_instance_f32 _rfft;
+#endif
+
+    void _transform();
+    static void _complexFft(float* data, int points);
+
+};
@@ -0,0 +1,236 @@
+#include "FlashLog.h"
+#include "Crc16.h"
+#include <string.h>
+
+
+// The log ends where the emulated EEPROM page starts, the last page of flash
+static const uint32_t LOG_BASE = FLASH_END + 1 - (FlashLog::PAGES + 1) * FLASH_PAGE_SIZE;
+static const uint32_t RECORD_CRC_OFFSET = FlashLog::RECORD_SIZE;
+static_assert(FlashLog::RECORD_SIZE + 2 <= FlashLog::SLOT_SIZE - 8, "record and CRC fit in four double words");
+
+static FlashLog* _eraseInstance = NULL;
+
+
+void FlashLog::begin() {
+    _eraseInstance = this;
+    NVIC_SetPriority(FLASH_IRQn, 3);
+    NVIC_EnableIRQ(FLASH_IRQn);
+
+    // The newest record gives the write position, seq and boot
+    Protocol::Record record;
+    bool found = false;
+    uint32_t newestSlot = 0;
+    uint32_t newestSeq = 0;
+    uint16_t newestBoot = 0;
+    for (uint32_t slot = 0; slot < SLOTS; slot++) {
+        if (!_read(slot, record)) continue;
+        if (!found || (int32_t) (record.seq - newestSeq) > 0) {
+            found = true;
+            newestSlot = slot;
+            newestSeq = record.seq;
+            newestBoot = record.boot;
+        }
+    }
+    _head = found ? (newestSlot + 1) % SLOTS : 0;
+    _nextSeq = found ? newestSeq + 1 : 1;
+    _boot = found ? newestBoot + 1 : 1;
+
+    // A write cut short by a reset leaves the rest of its page unusable
+    if (!_blank(_address(_head), SLOT_SIZE)) {
+        uint32_t skip = SLOTS_PER_PAGE - _head % SLOTS_PER_PAGE;
+        _head = (_head + skip) % SLOTS;
+        _nextSeq += skip;
+    }
+    uint32_t page = _head / SLOTS_PER_PAGE;
+    if (_head % SLOTS_PER_PAGE == 0 && !_blank(_pageAddress(page), FLASH_PAGE_SIZE)) _erase(page, true);
+    uint32_t ahead = (page + 1) % PAGES;
+    if (!_blank(_pageAddress(ahead), FLASH_PAGE_SIZE)) _erase(ahead, true);
+
+    // Oldest first from the page after the one ahead, the first record still unacked
+    _tail = _head;
+    for (uint32_t i = 1; i < SLOTS; i++) {
+        uint32_t slot = (_head + i) % SLOTS;
+        if (_read(slot, record) && record.seq == _seqAt(slot) && !_delivered(slot)) {
+            _tail = slot;
+            break;
+        }
+    }
+    _cursor = _tail;
+    _probing = false;
+}
+
+bool FlashLog::append(Protocol::Record& record) {
+    if (_erasing != NO_ERASE) return false;
+    if (!_blank(_address(_head), SLOT_SIZE)) {
+        // The erase ahead of this page failed, so try it again and lose this record
+        if (_head % SLOTS_PER_PAGE == 0) {
+            _giveUpPage(_head / SLOTS_PER_PAGE);
+            _erase(_head / SLOTS_PER_PAGE, false);
+        }
+        return false;
+    }
+
+    record.seq = _nextSeq;
+    record.boot = _boot;
+    record.ageMillis = 0;
+    uint8_t slot[MARK_OFFSET];
+    memset(slot, 0, sizeof(slot));
+    size_t length = Protocol::packRecord(record, slot, RECORD_SIZE);
+    uint16_t crc = crc16(slot, RECORD_SIZE);
+    slot[RECORD_CRC_OFFSET] = crc;
+    slot[RECORD_CRC_OFFSET + 1] = crc >> 8;
+    bool ok = length == RECORD_SIZE && _program(_address(_head), slot, sizeof(slot));
+
+    // The slot and seq are used up either way, a failed slot reads back invalid and is skipped
+    _head = (_head + 1) % SLOTS;
+    _nextSeq++;
+    if (_head % SLOTS_PER_PAGE == 0) {
+        uint32_t ahead = (_head / SLOTS_PER_PAGE + 1) % PAGES;
+        _giveUpPage(ahead);
+        _erase(ahead, false);
+    }
+    return ok;
+}
+
+bool FlashLog::next(Protocol::Record& record, unsigned long now) {
+    if (_distance(_tail, _cursor) > 0 && now - _lastProgress >= RETRY_MILLIS) {
+        _cursor = _tail;
+        _probing = true;
+    }
+    _advanceTail();
+    while (_cursor != _head && (_delivered(_cursor) || !_read(_cursor, record))) _cursor = (_cursor + 1) % SLOTS;
+    if (_cursor == _head) return false;
+
+    uint32_t inFlight = _distance(_tail, _cursor);
+    if (inFlight >= (_probing ? 1 : WINDOW)) return false;
+    if (inFlight == 0) _lastProgress = now;
+
+    record.ageMillis = record.boot == _boot ? now - record.millis : Protocol::UNKNOWN_AGE;
+    _cursor = (_cursor + 1) % SLOTS;
+    return true;
+}
+
+void FlashLog::acknowledge(uint32_t seq, unsigned long now) {
+    // Only records still held; a lost ack is repaired by the resend
+    uint32_t fromHead = _nextSeq - seq;
+    if (fromHead == 0 || fromHead > _distance(_tail, _head) || _erasing != NO_ERASE) return;
+    uint32_t slot = (_head + SLOTS - fromHead) % SLOTS;
+
+    if (!_delivered(slot)) {
+        uint8_t mark[8];
+        memset(mark, 0, sizeof(mark));
+        if (!_program(_address(slot) + MARK_OFFSET, mark, sizeof(mark))) return;
+    }
+    _probing = false;
+    _lastProgress = now;
+    _advanceTail();
+}
+
+void FlashLog::onEraseDone(bool ok) {
+    HAL_FLASH_Lock();
+    _erasing = NO_ERASE;
+    if (!ok) Serial.println("Flash log erase failed");
+}
+
+void FlashLog::_advanceTail() {
+    Protocol::Record record;
+    while (_tail != _head && (_delivered(_tail) || !_read(_tail, record))) {
+        if (_tail == _cursor) _cursor = (_cursor + 1) % SLOTS;
+        _tail = (_tail + 1) % SLOTS;
+    }
+}
+
+// The page ahead is about to be erased: unacked records on it are lost
+void FlashLog::_giveUpPage(uint32_t page) {
+    Protocol::Record record;
+    while (_tail != _head && _tail / SLOTS_PER_PAGE == page) {
+        if (_read(_tail, record) && !_delivered(_tail)) _overwritten++;
+        if (_tail == _cursor) _cursor = (_cursor + 1) % SLOTS;
+        _tail = (_tail + 1) % SLOTS;
+    }
+}
+
+
+
+// Flash access
+
+uint32_t FlashLog::_pageAddress(uint32_t page) {
+    return LOG_BASE + page * FLASH_PAGE_SIZE;
+}
+
+uint32_t FlashLog::_address(uint32_t slot) {
+    return _pageAddress(slot / SLOTS_PER_PAGE) + slot % SLOTS_PER_PAGE * SLOT_SIZE;
+}
+
+bool FlashLog::_blank(uint32_t address, uint32_t length) {
+    const uint32_t* words = (const uint32_t*) (uintptr_t) address;
+    for (uint32_t i = 0; i < length / 4; i++) {
+        if (words[i] != 0xFFFFFFFF) return false;
+    }
+    return true;
+}
+
+bool FlashLog::_read(uint32_t slot, Protocol::Record& record) {
+    const uint8_t* bytes = (const uint8_t*) (uintptr_t) _address(slot);
+    uint16_t crc = bytes[RECORD_CRC_OFFSET] | (uint16_t) bytes[RECORD_CRC_OFFSET + 1] << 8;
+    if (_blank(_address(slot), MARK_OFFSET) || crc16(bytes, RECORD_SIZE) != crc) return false;
+    return Protocol::unpackRecord(bytes, RECORD_SIZE, record);
+}
+
+bool FlashLog::_delivered(uint32_t slot) {
+    return !_blank(_address(slot) + MARK_OFFSET, 8);
+}
+
+bool FlashLog::_program(uint32_t address, const uint8_t* data, uint32_t length) {
+    bool ok = true;
+    HAL_FLASH_Unlock();
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ALL_ERRORS);
+    for (uint32_t i = 0; i < length && ok; i += 8) {
+        uint64_t doubleWord;
+        memcpy(&doubleWord, &data[i], 8);
+        ok = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, address + i, doubleWord) == HAL_OK;
+    }
+    HAL_FLASH_Lock();
+    return ok;
+}
+
+// Page numbers in the erase request count from the start of their bank
+bool FlashLog::_erase(uint32_t page, bool wait) {
+    uint32_t address = _pageAddress(page);
+    FLASH_EraseInitTypeDef erase = {};
+    erase.TypeErase = FLASH_TYPEERASE_PAGES;
+    erase.Banks = address >= FLASH_BASE + FLASH_BANK_SIZE ? FLASH_BANK_2 : FLASH_BANK_1;
+    erase.Page = (address - FLASH_BASE) % FLASH_BANK_SIZE / FLASH_PAGE_SIZE;
+    erase.NbPages = 1;
+
+    HAL_FLASH_Unlock();
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ALL_ERRORS);
+    if (wait) {
+        uint32_t badPage;
+        bool ok = HAL_FLASHEx_Erase(&erase, &badPage) == HAL_OK;
+        HAL_FLASH_Lock();
+        return ok;
+    }
+
+    // Runs on while the caller carries on, onEraseDone() locks the flash again
+    _erasing = page;
+    if (HAL_FLASHEx_Erase_IT(&erase) == HAL_OK) return true;
+    _erasing = NO_ERASE;
+    HAL_FLASH_Lock();
+    return false;
+}
+
+
+
+// HAL flash callbacks, after the last page of an interrupt driven erase or on an error
+extern "C" void HAL_FLASH_EndOfOperationCallback(uint32_t page) {
+    if (page == 0xFFFFFFFF && _eraseInstance != NULL) _eraseInstance->onEraseDone(true);
+}
+
+extern "C" void HAL_FLASH_OperationErrorCallback(uint32_t page) {
+    if (_eraseInstance != NULL) _eraseInstance->onEraseDone(false);
+}
+
+extern "C" void FLASH_IRQHandler(void) {
+    HAL_FLASH_IRQHandler();
+}
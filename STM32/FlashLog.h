@@ -0,0 +1,76 @@
+#pragma once
+
+#include "Arduino.h"
+#include "Channels.h"
+#include "TelemetryProtocol.h"
+
+
+// Store and forward log of minute records in a ring of flash pages, so records made while the
+// ESP32 or its WiFi is down are kept, through resets too, until the receiving end acks them.
+// The pages sit in flash bank 2 just below the core's emulated EEPROM page, so code keeps
+// running from bank 1 while a page is erased or programmed. Each record takes a 40 byte slot:
+// four double words of packed record and CRC-16, then one double word left erased until the
+// record is acked. Writing goes round the ring, and the page ahead of the one being written is
+// erased in the background as the writing enters a page, so every page is erased once a lap
+// and only records older than a lap are given up.
+// Records go out oldest first, at most WINDOW unacked at a time. When no ack comes back for
+// RETRY_MILLIS, sending goes back to the oldest unacked record and probes one record at a time
+// until acks return, so an outage costs a probe every few seconds and the backlog then drains
+// at the rate next() is called.
+class FlashLog {
+
+public:
+    static const uint32_t PAGES = 16;
+    static const uint32_t SLOT_SIZE = 40;
+    static const size_t RECORD_SIZE = Protocol::recordSize(Channels::THERMISTOR_COUNT, Channels::LOAD_COUNT);
+    static const uint32_t SLOTS_PER_PAGE = FLASH_PAGE_SIZE / SLOT_SIZE;
+    static const uint32_t SLOTS = PAGES * SLOTS_PER_PAGE;
+    static const uint32_t WINDOW = 8;
+    static const unsigned long RETRY_MILLIS = 5000;
+
+    // Finds the newest record and the oldest unacked one. Blocks for any erase a reset cut short.
+    void begin();
+
+    // Stamps the record with the next seq and this boot and programs it, which takes a few
+    // hundred us. False if it could not be written, while a page erase runs or on a flash error.
+    bool append(Protocol::Record& record);
+
+    // The next record to send, its age filled in. False when nothing is waiting or the window
+    // is full.
+    bool next(Protocol::Record& record, unsigned long now);
+    void acknowledge(uint32_t seq, unsigned long now);
+
+    uint16_t getBoot() { return _boot; }
+    uint32_t getBacklog() { return _distance(_tail, _head); }
+    unsigned long getOverwritten() { return _overwritten; }
+
+    void onEraseDone(bool ok);  // From the flash interrupt
+
+private:
+    static const uint32_t MARK_OFFSET = SLOT_SIZE - 8;
+    static const int NO_ERASE = -1;
+
+    uint32_t _head = 0;         // Next slot to write
+    uint32_t _tail = 0;         // Oldest unacked slot
+    uint32_t _cursor = 0;       // Next slot to send
+    uint32_t _nextSeq = 1;      // seq of the record written at _head
+    uint16_t _boot = 1;
+    bool _probing = false;
+    unsigned long _lastProgress = 0;
+    unsigned long _overwritten = 0;
+    volatile int _erasing = NO_ERASE;
+
+    static uint32_t _distance(uint32_t from, uint32_t to) { return (to + SLOTS - from) % SLOTS; }
+    static uint32_t _address(uint32_t slot);
+    static uint32_t _pageAddress(uint32_t page);
+    static bool _blank(uint32_t address, uint32_t length);
+    static bool _read(uint32_t slot, Protocol::Record& record);
+    static bool _delivered(uint32_t slot);
+
+    uint32_t _seqAt(uint32_t slot) { return _nextSeq - _distance(slot, _head); }
+    void _advanceTail();
+    void _giveUpPage(uint32_t page);
+    bool _erase(uint32_t page, bool wait);
+    bool _program(uint32_t address, const uint8_t* data, uint32_t length);
+
+};
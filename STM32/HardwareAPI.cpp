@@ -1,51 +1,89 @@
 
 #include "HardwareAPI.h"
+#include "ThermistorTable.h"
+#include "stm32yyxx_ll_adc.h"
+#include "stm32yyxx_ll_bus.h"
+#include "stm32yyxx_ll_dma.h"
+#include "stm32yyxx_ll_gpio.h"
+#include "stm32yyxx_ll_tim.h"
+
+
+// Scan buffer, shared with the DMA interrupt
+static const int SCAN_BUFFER_BLOCKS = 2 * HardwareAPI::SCAN_HALF_BLOCKS;
+static const int SCAN_BUFFER_FRAMES = SCAN_BUFFER_BLOCKS * HardwareAPI::SCAN_BLOCK_FRAMES;
+static const int SCAN_CHANNELS = Channels::SCAN_CHANNELS;
+static_assert(sizeof(ScanFrame) == SCAN_CHANNELS * sizeof(uint16_t), "a ScanFrame is one sequence");
+static volatile ScanFrame _scanBuffer[SCAN_BUFFER_FRAMES];
+static volatile unsigned long _scanHalvesWritten = 0;
+
+// Overcurrent trip, shared with the ADC interrupt
+static GPIO_TypeDef* _tripPorts[Channels::LOAD_COUNT];     // Every relay pin
+static uint32_t _tripMasks[Channels::LOAD_COUNT];
+static uint8_t _tripWatchdogLoads[HardwareAPI::TRIP_WATCHDOGS];  // Load under AWD2 and AWD3
+static uint32_t _tripCyclesPerTick = 1; // TIM6 prescaler + 1
+static volatile uint8_t _tripChannel = TRIP_NONE;
+static volatile uint32_t _tripLatencyCycles = 0;
+static volatile unsigned long _trips = 0;
 
 
 // Constructor
-HardwareAPI::HardwareAPI(int thermistorPin, int fanRelayPin, int fanCurrentPin, int peltierRelayPin, int peltierCurrentPin) {
-    _thermistorPin = thermistorPin;
-    _fanRelayPin = fanRelayPin;
-    _fanCurrentPin = fanCurrentPin;
-    _peltierRelayPin = peltierRelayPin;
-    _peltierCurrentPin = peltierCurrentPin;
-
-    _fanRelayStatus = 0;
-    _peltierRelayStatus = 0;
-    pinMode(fanRelayPin, OUTPUT);
-    pinMode(peltierRelayPin, OUTPUT);
+HardwareAPI::HardwareAPI() {
+    for (size_t load = 0; load < Channels::LOAD_COUNT; load++) {
+        pinMode(Channels::LOADS[load].relayPin, OUTPUT);
+        _currentBaseline[load] = 1798;
+    }
 
     analogReadResolution(12);
 
-    // turnFanOff();
-    // turnPeltierOff();
-    // _baseFanADCValue = _getCurrentADC(1000, _fanCurrentPin);
-    // _basePeltierADCValue = _getCurrentADC(1000, _peltierCurrentPin);
-
     _testing = 0;
 
 }
 
 // Constructor for Testing
 HardwareAPI::HardwareAPI(bool testing) {
+    for (size_t load = 0; load < Channels::LOAD_COUNT; load++) _currentBaseline[load] = 1798;
     _testing = 1;
 }
 
 
 void HardwareAPI::setBaseADC() {
-    turnFanOff();
-    turnPeltierOff();
+    turnAllOff();
     delay(10000);
-    _baseFanADCValue = _getCurrentADC(5000, _fanCurrentPin);
-    _basePeltierADCValue = _getCurrentADC(5000, _peltierCurrentPin);
+    for (size_t load = 0; load < Channels::LOAD_COUNT; load++) {
+        _currentBaseline[load] = _getCurrentADC(5000, Channels::LOADS[load].currentPin);
+    }
+}
+
+SensorCalibration HardwareAPI::getCalibration() {
+    SensorCalibration calibration;
+    for (size_t load = 0; load < Channels::LOAD_COUNT; load++) calibration.currentBaseline[load] = _currentBaseline[load];
+    calibration.thermistorOffset = _thermistorOffset;
+    return calibration;
+}
+
+void HardwareAPI::setCalibration(const SensorCalibration& calibration) {
+    for (size_t load = 0; load < Channels::LOAD_COUNT; load++) _currentBaseline[load] = calibration.currentBaseline[load];
+    _thermistorOffset = calibration.thermistorOffset;
 }
 
 
 // Thermistor
 
-float HardwareAPI::getTemperature() {
-    if (_testing) return random(73, 75);
-    int adcValue = analogRead(_thermistorPin);
+float HardwareAPI::getTemperature(Channels::ThermistorChannel thermistor) {
+    if (_testing && !_scanning) return random(73, 75);
+    return temperatureFromCounts(_readThermistor(thermistor));
+}
+
+float HardwareAPI::temperatureFromCounts(float adcValue) {
+    if (!_exactTemperature) return ThermistorTable::lookup(adcValue) + _thermistorOffset;
+    return _exactTemperatureFromCounts(adcValue) + _thermistorOffset;
+}
+
+void HardwareAPI::useExactTemperature(bool exact) {
+    _exactTemperature = exact;
+}
+
+float HardwareAPI::_exactTemperatureFromCounts(float adcValue) {
     float voltage = adcValue * (_thermistorVCC / _adcRange);
     float thermistorResistance = _thermistorResistorValue * (_thermistorVCC / voltage - 1);
 
@@ -58,167 +96,475 @@ float HardwareAPI::getTemperature() {
 
 
 
-// Fan
-void HardwareAPI::turnFanOn() {
-    _fanRelayStatus = 1;
-    if (_testing) return;
-    digitalWrite(_fanRelayPin, HIGH);
+// Load relays
+void HardwareAPI::turnOn(Channels::LoadChannel load) {
+    noInterrupts();  // So a trip can't land between the check and the pin
+    if (_tripChannel == TRIP_NONE) {
+        _relayStatus[load] = 1;
+        if (!_testing) digitalWrite(Channels::LOADS[load].relayPin, HIGH);
+    }
+    interrupts();
 }
 
 
-void HardwareAPI::turnFanOff() {
-    _fanRelayStatus = 0;
+void HardwareAPI::turnOff(Channels::LoadChannel load) {
+    _relayStatus[load] = 0;
     if (_testing) return;
-    digitalWrite(_fanRelayPin, LOW);
+    digitalWrite(Channels::LOADS[load].relayPin, LOW);
+}
+
+void HardwareAPI::turnAllOff() {
+    for (size_t load = 0; load < Channels::LOAD_COUNT; load++) turnOff((Channels::LoadChannel) load);
 }
 
 
-bool HardwareAPI::toggleFan() {
-    _fanRelayStatus = !_fanRelayStatus;
-    if (_testing) return _fanRelayStatus;
-    digitalWrite(_fanRelayPin, _fanRelayStatus ? HIGH : LOW);
-    return _fanRelayStatus;
+bool HardwareAPI::toggle(Channels::LoadChannel load) {
+    if (getStatus(load)) turnOff(load);
+    else turnOn(load);
+    return getStatus(load);
 }
 
-bool HardwareAPI::getFanStatus() {
-    return _fanRelayStatus;
+bool HardwareAPI::getStatus(Channels::LoadChannel load) {
+    return _relayStatus[load] && _tripChannel == TRIP_NONE;
 }
 
 
 
 
+// Load sensors
 
-// Peltier
-void HardwareAPI::turnPeltierOn() {
-    _peltierRelayStatus = 1;
-    if (_testing) return;
-    digitalWrite(_peltierRelayPin, HIGH);
+float HardwareAPI::getCurrent(Channels::LoadChannel load, int samples) {
+    float adcValue = 0;
+    for (int i = 0; i < samples; i++) {
+        adcValue += _readCurrent(load);
+    }
+
+    adcValue /= samples;
+
+    return currentFromCounts(load, adcValue);
 }
 
+float HardwareAPI::getVoltage(Channels::LoadChannel load) {
+    return Channels::LOADS[load].supplyVolts;
+}
 
-void HardwareAPI::turnPeltierOff() {
-    _peltierRelayStatus = 0;
-    if (_testing) return;
-    digitalWrite(_peltierRelayPin, LOW);
+float HardwareAPI::getPower(Channels::LoadChannel load, int samples) {
+    return getCurrent(load, samples) * getVoltage(load);
 }
 
+int HardwareAPI::_testRead(Channels::LoadChannel load) {
+    int base = _currentBaseline[load];
+    if (!getStatus(load)) return random(base - 10, base + 10);
+    int counts = Channels::LOADS[load].testAmps / Channels::ampsPerCount(load);
+    return random(base + counts - counts / 10, base + counts + counts / 10);
+}
+
+int HardwareAPI::_readThermistor(Channels::ThermistorChannel thermistor) {
+    if (_scanning) return _latestScanFrame()->thermistor[thermistor];
+    if (_testing) return random(2110, 2140);
+    return analogRead(Channels::THERMISTORS[thermistor].pin);
+}
 
-bool HardwareAPI::togglePeltier() {
-    _peltierRelayStatus = !_peltierRelayStatus;
-    if (_testing) return _peltierRelayStatus;
-    digitalWrite(_peltierRelayPin, _peltierRelayStatus ? HIGH : LOW);
-    return _peltierRelayStatus;
+int HardwareAPI::_readCurrent(Channels::LoadChannel load) {
+    if (_scanning) return _latestScanFrame()->current[load];
+    if (_testing) return _testRead(load);
+    return analogRead(Channels::LOADS[load].currentPin);
 }
 
-bool HardwareAPI::getPeltierStatus() {
-    return _peltierRelayStatus;
+float HardwareAPI::_getCurrentADC(int samples, int sensorPin) {
+    float adcValue = 0;
+    for (int i = 0; i < samples; i++) {
+        adcValue += analogRead(sensorPin);
+    }
+    return (adcValue / samples);
 }
 
 
 
 
-// Fan get methods
+// Continuous acquisition
 
-float HardwareAPI::getFanCurrent() {
-    return _getCurrent(_fanCurrentPin);
+static uint32_t _adcChannel(int pin) {
+    PinName pinName = analogInputToPinName(pin);
+    pinmap_pinout(pinName, PinMap_ADC);
+    return __LL_ADC_DECIMAL_NB_TO_CHANNEL(STM_PIN_CHANNEL(pinmap_function(pinName, PinMap_ADC)));
 }
 
-float HardwareAPI::getFanCurrent(int samples) {
-    return _getCurrent(samples, _fanCurrentPin);
+bool HardwareAPI::beginScan(unsigned long sampleRateHz) {
+    if (sampleRateHz == 0) return false;
+    if (_scanning) endScan();
+
+    _scanRateHz = sampleRateHz;
+    _scanBlocksRead = _scanHalvesWritten * SCAN_HALF_BLOCKS;
+    _scanOverruns = 0;
+    _scanDivider = 1;
+    _readDivider = 1;
+    _readBlock = NULL;
+    _readWeight = 0;
+    _dividerChangesRead = _dividerChangesWritten;
+    _lastTestBlockTime = millis();
+
+    if (_testing) {
+        _fillTestBlock((ScanFrame*) &_scanBuffer[(SCAN_BUFFER_BLOCKS - 1) * SCAN_BLOCK_FRAMES]);
+        _scanning = 1;
+        return true;
+    }
+
+    // Trigger timer: TIM6 update event drives the ADC external trigger. The prescaler leaves
+    // room for the slowest divider, so a divider change only has to write a preloaded ARR.
+    LL_APB1_GRP1_EnableClock(LL_APB1_GRP1_PERIPH_TIM6);
+    uint32_t ticksPerSample = SystemCoreClock / sampleRateHz;
+    uint32_t prescaler = ticksPerSample * SCAN_MAX_DIVIDER / 65536;
+    LL_TIM_DisableCounter(TIM6);
+    LL_TIM_SetPrescaler(TIM6, prescaler);
+    LL_TIM_SetAutoReload(TIM6, ticksPerSample / (prescaler + 1) - 1);
+    LL_TIM_EnableARRPreload(TIM6);
+    LL_TIM_SetTriggerOutput(TIM6, LL_TIM_TRGO_UPDATE);
+    LL_TIM_GenerateEvent_UPDATE(TIM6);
+
+    // DMA: circular, half-word, half and full transfer interrupts
+    LL_AHB1_GRP1_EnableClock(LL_AHB1_GRP1_PERIPH_DMA1);
+    LL_DMA_DisableChannel(DMA1, LL_DMA_CHANNEL_1);
+    LL_DMA_SetPeriphRequest(DMA1, LL_DMA_CHANNEL_1, LL_DMA_REQUEST_0);
+    LL_DMA_ConfigTransfer(DMA1, LL_DMA_CHANNEL_1,
+                          LL_DMA_DIRECTION_PERIPH_TO_MEMORY | LL_DMA_MODE_CIRCULAR |
+                          LL_DMA_PERIPH_NOINCREMENT | LL_DMA_MEMORY_INCREMENT |
+                          LL_DMA_PDATAALIGN_HALFWORD | LL_DMA_MDATAALIGN_HALFWORD |
+                          LL_DMA_PRIORITY_HIGH);
+    LL_DMA_ConfigAddresses(DMA1, LL_DMA_CHANNEL_1,
+                           LL_ADC_DMA_GetRegAddr(ADC1, LL_ADC_DMA_REG_REGULAR_DATA),
+                           (uint32_t) (uintptr_t) _scanBuffer, LL_DMA_DIRECTION_PERIPH_TO_MEMORY);
+    LL_DMA_SetDataLength(DMA1, LL_DMA_CHANNEL_1, SCAN_BUFFER_FRAMES * SCAN_CHANNELS);
+    LL_DMA_EnableIT_HT(DMA1, LL_DMA_CHANNEL_1);
+    LL_DMA_EnableIT_TC(DMA1, LL_DMA_CHANNEL_1);
+    NVIC_SetPriority(DMA1_Channel1_IRQn, 1);
+    NVIC_EnableIRQ(DMA1_Channel1_IRQn);
+    LL_DMA_EnableChannel(DMA1, LL_DMA_CHANNEL_1);
+
+    // ADC: one rank per channel in ScanFrame order, one sequence per trigger
+    LL_AHB2_GRP1_EnableClock(LL_AHB2_GRP1_PERIPH_ADC);
+    if (LL_ADC_IsEnabled(ADC1)) {
+        LL_ADC_Disable(ADC1);
+        while (LL_ADC_IsEnabled(ADC1));
+    }
+    LL_ADC_SetCommonClock(__LL_ADC_COMMON_INSTANCE(ADC1), LL_ADC_CLOCK_SYNC_PCLK_DIV4);
+    LL_ADC_DisableDeepPowerDown(ADC1);
+    LL_ADC_EnableInternalRegulator(ADC1);
+    delayMicroseconds(LL_ADC_DELAY_INTERNAL_REGUL_STAB_US);
+
+    LL_ADC_SetResolution(ADC1, LL_ADC_RESOLUTION_12B);
+    LL_ADC_SetDataAlignment(ADC1, LL_ADC_DATA_ALIGN_RIGHT);
+    LL_ADC_REG_SetTriggerSource(ADC1, LL_ADC_REG_TRIG_EXT_TIM6_TRGO);
+    LL_ADC_REG_SetTriggerEdge(ADC1, LL_ADC_REG_TRIG_EXT_RISING);
+    LL_ADC_REG_SetContinuousMode(ADC1, LL_ADC_REG_CONV_SINGLE);
+    LL_ADC_REG_SetDMATransfer(ADC1, LL_ADC_REG_DMA_TRANSFER_UNLIMITED);
+    LL_ADC_REG_SetOverrun(ADC1, LL_ADC_REG_OVR_DATA_OVERWRITTEN);
+    static const uint32_t lengths[8] = {
+        LL_ADC_REG_SEQ_SCAN_DISABLE, LL_ADC_REG_SEQ_SCAN_ENABLE_2RANKS, LL_ADC_REG_SEQ_SCAN_ENABLE_3RANKS,
+        LL_ADC_REG_SEQ_SCAN_ENABLE_4RANKS, LL_ADC_REG_SEQ_SCAN_ENABLE_5RANKS, LL_ADC_REG_SEQ_SCAN_ENABLE_6RANKS,
+        LL_ADC_REG_SEQ_SCAN_ENABLE_7RANKS, LL_ADC_REG_SEQ_SCAN_ENABLE_8RANKS
+    };
+    static const uint32_t ranks[8] = {
+        LL_ADC_REG_RANK_1, LL_ADC_REG_RANK_2, LL_ADC_REG_RANK_3, LL_ADC_REG_RANK_4,
+        LL_ADC_REG_RANK_5, LL_ADC_REG_RANK_6, LL_ADC_REG_RANK_7, LL_ADC_REG_RANK_8
+    };
+    LL_ADC_REG_SetSequencerLength(ADC1, lengths[SCAN_CHANNELS - 1]);
+
+    uint32_t channels[SCAN_CHANNELS];
+    for (size_t i = 0; i < Channels::THERMISTOR_COUNT; i++) channels[i] = _adcChannel(Channels::THERMISTORS[i].pin);
+    for (size_t load = 0; load < Channels::LOAD_COUNT; load++) {
+        channels[Channels::THERMISTOR_COUNT + load] = _adcChannel(Channels::LOADS[load].currentPin);
+    }
+    for (int i = 0; i < SCAN_CHANNELS; i++) {
+        LL_ADC_REG_SetSequencerRanks(ADC1, ranks[i], channels[i]);
+        LL_ADC_SetChannelSamplingTime(ADC1, channels[i], LL_ADC_SAMPLINGTIME_47CYCLES_5);
+        LL_ADC_SetChannelSingleDiff(ADC1, channels[i], LL_ADC_SINGLE_ENDED);
+    }
+
+    _configureTrip(&channels[Channels::THERMISTOR_COUNT]);
+
+    LL_ADC_StartCalibration(ADC1, LL_ADC_SINGLE_ENDED);
+    while (LL_ADC_IsCalibrationOnGoing(ADC1));
+    delayMicroseconds(1);
+    LL_ADC_Enable(ADC1);
+    while (!LL_ADC_IsActiveFlag_ADRDY(ADC1));
+
+    _scanning = 1;
+    LL_ADC_REG_StartConversion(ADC1);  // Arms the ADC, conversions start on TIM6 TRGO
+    LL_TIM_EnableCounter(TIM6);
+    return true;
 }
 
-float HardwareAPI::getFanVoltage() {
-    return _getVoltage(_fanCurrentPin);
+void HardwareAPI::endScan() {
+    if (!_scanning) return;
+    _scanning = 0;
+    if (_testing) return;
+
+    LL_TIM_DisableCounter(TIM6);
+    LL_ADC_REG_StopConversion(ADC1);
+    while (LL_ADC_REG_IsStopConversionOngoing(ADC1));
+    LL_ADC_Disable(ADC1);
+    LL_DMA_DisableChannel(DMA1, LL_DMA_CHANNEL_1);
+    NVIC_DisableIRQ(DMA1_Channel1_IRQn);
+    NVIC_DisableIRQ(ADC1_2_IRQn);
 }
 
-float HardwareAPI::getFanPower() {
-    return _getPower(_fanCurrentPin);
+bool HardwareAPI::isScanning() {
+    return _scanning;
 }
 
-float HardwareAPI::getFanPower(int samples) {
-    return _getPower(samples, _fanCurrentPin);
+unsigned long HardwareAPI::getScanRate() {
+    return _scanning ? _scanRateHz / _scanDivider : 0;
 }
 
+void HardwareAPI::setScanDivider(int divider) {
+    if (divider < 1) divider = 1;
+    if (divider > SCAN_MAX_DIVIDER) divider = SCAN_MAX_DIVIDER;
+
+    // From the tick interrupt or loop(), and the frame and ARR have to agree
+    noInterrupts();
+    if (_scanning && divider != _scanDivider) {
+        DividerChange& change = _dividerChanges[_dividerChangesWritten % DIVIDER_CHANGES];
+        change.frame = _nextScanFrame();
+        change.divider = divider;
+        _dividerChangesWritten++;
+        _scanDivider = divider;
+        if (!_testing) {
+            uint32_t ticksPerSample = SystemCoreClock / _scanRateHz;
+            LL_TIM_SetAutoReload(TIM6, ticksPerSample * divider / (LL_TIM_GetPrescaler(TIM6) + 1) - 1);
+        }
+    }
+    interrupts();
+}
 
+int HardwareAPI::getScanDivider() {
+    return _scanDivider;
+}
 
-// Peltier get methods
+// The frame the next TIM6 trigger starts, which is the first one the preloaded ARR times. A
+// sequence under way already had its trigger, and a half the DMA completed before its interrupt
+// ran shows up as a position past the current half. A trigger that slips in between reading
+// the DMA count and writing ARR puts the change one frame late.
+uint32_t HardwareAPI::_nextScanFrame() {
+    const uint32_t halfFrames = SCAN_HALF_BLOCKS * SCAN_BLOCK_FRAMES;
+    if (_testing) return _scanBlocksRead * SCAN_BLOCK_FRAMES;
+    uint32_t transfers = SCAN_BUFFER_FRAMES * SCAN_CHANNELS - LL_DMA_GetDataLength(DMA1, LL_DMA_CHANNEL_1);
+    uint32_t position = (transfers + SCAN_CHANNELS - 1) / SCAN_CHANNELS;
+    uint32_t halves = _scanHalvesWritten;
+    uint32_t intoHalf = (position + SCAN_BUFFER_FRAMES - (halves % 2) * halfFrames) % SCAN_BUFFER_FRAMES;
+    return halves * halfFrames + intoHalf;
+}
 
-float HardwareAPI::getPeltierCurrent() {
-    return _getCurrent(_peltierCurrentPin);
+// Divider of a frame, read in order. Frame counts wrap after about 5 days at 10khz.
+int HardwareAPI::_frameDivider(uint32_t frame) {
+    while (_dividerChangesRead != _dividerChangesWritten) {
+        const DividerChange& change = _dividerChanges[_dividerChangesRead % DIVIDER_CHANGES];
+        if ((int32_t) (frame - change.frame) < 0) break;
+        _readDivider = change.divider;
+        _dividerChangesRead++;
+    }
+    return _readDivider;
 }
 
-float HardwareAPI::getPeltierCurrent(int samples) {
-    return _getCurrent(samples, _peltierCurrentPin);
+int HardwareAPI::_blockDivider(uint32_t firstFrame) {
+    int divider = _frameDivider(firstFrame);
+    for (uint32_t i = _dividerChangesRead; i != _dividerChangesWritten; i++) {
+        const DividerChange& change = _dividerChanges[i % DIVIDER_CHANGES];
+        if ((int32_t) (change.frame - (firstFrame + SCAN_BLOCK_FRAMES)) >= 0) break;
+        if (change.divider > divider) divider = change.divider;
+    }
+    return divider;
 }
 
-float HardwareAPI::getPeltierVoltage() {
-    return _getVoltage(_peltierCurrentPin);
+const ScanFrame* HardwareAPI::takeScanBlock() {
+    if (!_scanning) return NULL;
+
+    if (_testing) {
+        // One synthetic block per block period
+        unsigned long blockMillis = (1000UL * SCAN_BLOCK_FRAMES * _scanDivider) / _scanRateHz;
+        if (blockMillis == 0) blockMillis = 1;
+        if (millis() - _lastTestBlockTime < blockMillis) return NULL;
+        _lastTestBlockTime += blockMillis;
+        ScanFrame* block = (ScanFrame*) &_scanBuffer[(_scanBlocksRead % SCAN_BUFFER_BLOCKS) * SCAN_BLOCK_FRAMES];
+        _fillTestBlock(block);
+        _scanBlocksRead++;
+        return block;
+    }
+
+    // Blocks are only known complete a half at a time
+    unsigned long written = _scanHalvesWritten * SCAN_HALF_BLOCKS;
+    if (written == _scanBlocksRead) return NULL;
+
+    // The DMA is refilling everything older than the newest completed half, skip to it
+    if (written - _scanBlocksRead > (unsigned long) SCAN_HALF_BLOCKS) {
+        _scanOverruns += written - _scanBlocksRead - SCAN_HALF_BLOCKS;
+        _scanBlocksRead = written - SCAN_HALF_BLOCKS;
+    }
+
+    const ScanFrame* block = (const ScanFrame*) &_scanBuffer[(_scanBlocksRead % SCAN_BUFFER_BLOCKS) * SCAN_BLOCK_FRAMES];
+    _scanBlocksRead++;
+    return block;
 }
 
-float HardwareAPI::getPeltierPower() {
-    return _getPower(_peltierCurrentPin);
+unsigned long HardwareAPI::getScanOverruns() {
+    return _scanOverruns;
 }
 
-float HardwareAPI::getPeltierPower(int samples) {
-    return _getPower(samples, _peltierCurrentPin);
+void HardwareAPI::setScanTap(ScanTap tap) {
+    _scanTap = tap;
 }
 
+int HardwareAPI::readRawCounts(RawCounts& counts, uint32_t maxSamples) {
+    int added = 0;
 
+    if (!_scanning) {
+        if (counts.samples >= maxSamples) return 0;
+        for (size_t i = 0; i < Channels::THERMISTOR_COUNT; i++) {
+            counts.thermistor[i] += _readThermistor((Channels::ThermistorChannel) i);
+        }
+        for (size_t load = 0; load < Channels::LOAD_COUNT; load++) {
+            counts.current[load] += _readCurrent((Channels::LoadChannel) load);
+        }
+        counts.samples++;
+        return 1;
+    }
 
+    while (counts.samples < maxSamples) {
+        if (_readBlock == NULL) {
+            _readBlock = takeScanBlock();
+            if (_readBlock == NULL) break;
+            _readFrame = (_scanBlocksRead - 1) * SCAN_BLOCK_FRAMES;
+            _readBlockFrame = 0;
+            if (_scanTap != NULL) _scanTap(_readBlock, SCAN_BLOCK_FRAMES, _blockDivider(_readFrame));
+        }
+        if (_readWeight == 0) _readWeight = _frameDivider(_readFrame + _readBlockFrame);
+
+        uint32_t weight = maxSamples - counts.samples < _readWeight ? maxSamples - counts.samples : _readWeight;
+        // Unrolled over the channel lists, so the frame adds as straight line code
+        const ScanFrame& frame = _readBlock[_readBlockFrame];
+        Channels::forEach<Channels::THERMISTOR_COUNT>([&](auto i) { counts.thermistor[i] += weight * frame.thermistor[i]; });
+        Channels::forEach<Channels::LOAD_COUNT>([&](auto load) { counts.current[load] += weight * frame.current[load]; });
+        counts.samples += weight;
+        added += weight;
+        _readWeight -= weight;
+        if (_readWeight == 0 && ++_readBlockFrame == SCAN_BLOCK_FRAMES) _readBlock = NULL;
+    }
+    return added;
+}
 
+// Overcurrent trip
 
+bool HardwareAPI::armOvercurrentTrip(Channels::LoadChannel load, float limitCounts) {
+    int watched = 0;
+    for (size_t other = 0; other < Channels::LOAD_COUNT; other++) {
+        if (other != load && _tripCounts[other] > 0) watched++;
+    }
+    if (limitCounts > 0 && watched >= TRIP_WATCHDOGS) return false;
+    _tripCounts[load] = limitCounts;
+    return true;
+}
 
-// Current Sensor
-float HardwareAPI::_getCurrent(int sensorPin) {
-    return _getCurrent(1, sensorPin);
+OvercurrentTrip HardwareAPI::getOvercurrentTrip() {
+    OvercurrentTrip trip;
+    trip.channel = _tripChannel;
+    trip.latencyCycles = _tripLatencyCycles;
+    trip.trips = _trips;
+    return trip;
 }
 
-int HardwareAPI::_testRead(int sensorPin) {
-    if (sensorPin == _fanCurrentPin) {
-        return getFanStatus() ? random(_baseFanADCValue + 40, _baseFanADCValue + 50) : random(_baseFanADCValue -10, _baseFanADCValue + 10);
-    } else {
-        return getFanStatus() ? random(_basePeltierADCValue + 115, _basePeltierADCValue + 140) : random(_basePeltierADCValue -10, _basePeltierADCValue + 10);
+void HardwareAPI::clearOvercurrentTrip() {
+    if (_tripChannel == TRIP_NONE) return;
+    for (size_t load = 0; load < Channels::LOAD_COUNT; load++) {
+        _relayStatus[load] = 0;     // The handler left every pin low
     }
+    _tripChannel = TRIP_NONE;   // Before the interrupts, so a trip at once latches again
+    if (_testing || !_scanning) return;
+    LL_ADC_ClearFlag_AWD2(ADC1);
+    LL_ADC_ClearFlag_AWD3(ADC1);
+    _enableWatchdogs();
 }
 
-float HardwareAPI::_getCurrent(int samples, int sensorPin) {
-    float adcValue = 0;
-    for (int i = 0; i < samples; i++) {
-        if (_testing) {
-            adcValue += _testRead(sensorPin);
-        } else {
-            adcValue += analogRead(sensorPin);
-        }
+// Watchdog window around a zero, in the top 8 bits of the counts, never narrower than the limit
+static void _configureWatchdog(uint32_t watchdog, uint32_t channel, float zero, float limit) {
+    long high = (long) (zero + limit) / 16;
+    long low = (long) (zero - limit) / 16;
+    LL_ADC_SetAnalogWDMonitChannels(ADC1, watchdog, __LL_ADC_ANALOGWD_CHANNEL_GROUP(channel, LL_ADC_GROUP_REGULAR));
+    LL_ADC_ConfigAnalogWDThresholds(ADC1, watchdog, high > 255 ? 255 : high, low < 0 ? 0 : low);
+}
+
+// Before the ADC starts converting, the only time the thresholds can be written. The loads with
+// a limit take AWD2 and AWD3 in list order.
+void HardwareAPI::_configureTrip(const uint32_t* currentChannels) {
+    static const uint32_t watchdogs[TRIP_WATCHDOGS] = {LL_ADC_AWD2, LL_ADC_AWD3};
+    LL_ADC_DisableIT_AWD2(ADC1);
+    LL_ADC_DisableIT_AWD3(ADC1);
+    _tripWatchdogsUsed = 0;
+    for (size_t load = 0; load < Channels::LOAD_COUNT && _tripWatchdogsUsed < TRIP_WATCHDOGS; load++) {
+        if (_tripCounts[load] <= 0) continue;
+        _configureWatchdog(watchdogs[_tripWatchdogsUsed], currentChannels[load], _currentBaseline[load], _tripCounts[load]);
+        _tripWatchdogLoads[_tripWatchdogsUsed++] = load;
     }
-    
-    adcValue /= samples;
+    if (_tripWatchdogsUsed == 0) return;
 
-    float voltage = adcValue * (3.3 / 4095.0);
-    float difference = abs(voltage - (sensorPin == _fanCurrentPin ? (_baseFanADCValue / 4095.0 * 3.3) : (_basePeltierADCValue / 4095.0 * 3.3)));
-    float current = difference / ((.185 * (sensorPin == _fanCurrentPin ? _fanMultiplier : _peltierMultiplier))/2);
-    // current = 0;
+    for (size_t load = 0; load < Channels::LOAD_COUNT; load++) {
+        _tripPorts[load] = digitalPinToPort(Channels::LOADS[load].relayPin);
+        _tripMasks[load] = digitalPinToBitMask(Channels::LOADS[load].relayPin);
+    }
+    _tripCyclesPerTick = LL_TIM_GetPrescaler(TIM6) + 1;
 
-    if (current <= .15) current = 0;
+    LL_ADC_ClearFlag_AWD2(ADC1);
+    LL_ADC_ClearFlag_AWD3(ADC1);
+    if (_tripChannel == TRIP_NONE) _enableWatchdogs();
+    NVIC_SetPriority(ADC1_2_IRQn, 0);   // Above the scan DMA and the scheduler tick
+    NVIC_EnableIRQ(ADC1_2_IRQn);
+}
 
-    return current;
+void HardwareAPI::_enableWatchdogs() {
+    if (_tripWatchdogsUsed > 0) LL_ADC_EnableIT_AWD2(ADC1);
+    if (_tripWatchdogsUsed > 1) LL_ADC_EnableIT_AWD3(ADC1);
 }
 
-float HardwareAPI::_getCurrentADC(int samples, int sensorPin) {
-    float adcValue = 0;
-    for (int i = 0; i < samples; i++) {
-        adcValue += analogRead(sensorPin);
-    }
-    return (adcValue / samples);
+const ScanFrame* HardwareAPI::_latestScanFrame() {
+    // Last frame of the most recently completed block
+    unsigned long written = _testing ? _scanBlocksRead : _scanHalvesWritten * SCAN_HALF_BLOCKS;
+    int block = (written + SCAN_BUFFER_BLOCKS - 1) % SCAN_BUFFER_BLOCKS;
+    return (const ScanFrame*) &_scanBuffer[block * SCAN_BLOCK_FRAMES + SCAN_BLOCK_FRAMES - 1];
 }
 
-float HardwareAPI::_getVoltage(int sensorPin) {
-    return _powerCalculationVoltage;
+void HardwareAPI::_fillTestBlock(ScanFrame* block) {
+    for (int i = 0; i < SCAN_BLOCK_FRAMES; i++) {
+        for (size_t t = 0; t < Channels::THERMISTOR_COUNT; t++) block[i].thermistor[t] = random(2110, 2140);  // About 74F
+        for (size_t load = 0; load < Channels::LOAD_COUNT; load++) block[i].current[load] = _testRead((Channels::LoadChannel) load);
+    }
 }
 
-float HardwareAPI::_getPower(int sensorPin) {
-    return _getCurrent(1) * _getVoltage(sensorPin);
+// DMA half and full transfer: one half of the buffer, SCAN_HALF_BLOCKS blocks, is complete
+extern "C" void DMA1_Channel1_IRQHandler(void) {
+    if (LL_DMA_IsActiveFlag_HT1(DMA1)) {
+        LL_DMA_ClearFlag_HT1(DMA1);
+        _scanHalvesWritten++;
+    }
+    if (LL_DMA_IsActiveFlag_TC1(DMA1)) {
+        LL_DMA_ClearFlag_TC1(DMA1);
+        _scanHalvesWritten++;
+    }
 }
 
-float HardwareAPI::_getPower(int samples, int sensorPin) {
-    return _getCurrent(sensorPin) * _getVoltage(sensorPin);
+// Analog watchdog: a current outside its window. The relays go off first, the rest can wait.
+// TIM6 counts from the update that triggered the tripping sequence, so its counter is the time
+// since the sample was taken, conversion included. A handler held off past the next trigger
+// would read short, which at priority 0 only a masked section as long as a sample period can do.
+extern "C" void ADC1_2_IRQHandler(void) {
+    Channels::forEach<Channels::LOAD_COUNT>([](auto load) { LL_GPIO_ResetOutputPin(_tripPorts[load], _tripMasks[load]); });
+    uint32_t ticks = LL_TIM_GetCounter(TIM6);
+
+    uint8_t channel = _tripWatchdogLoads[LL_ADC_IsActiveFlag_AWD2(ADC1) ? 0 : 1] + 1;
+    LL_ADC_DisableIT_AWD2(ADC1);    // Latched, so no more interrupts until it is cleared
+    LL_ADC_DisableIT_AWD3(ADC1);
+    LL_ADC_ClearFlag_AWD2(ADC1);
+    LL_ADC_ClearFlag_AWD3(ADC1);
+    if (_tripChannel != TRIP_NONE) return;
+    _tripLatencyCycles = ticks * _tripCyclesPerTick;
+    _tripChannel = channel;
+    _trips++;
 }
@@ -1,93 +1,146 @@
+#pragma once
+
 #include "Arduino.h"
+#include "Channels.h"
+
+
+// One conversion of every scanned channel, in ADC sequencer order, see Channels.h
+struct ScanFrame {
+    uint16_t thermistor[Channels::THERMISTOR_COUNT];
+    uint16_t current[Channels::LOAD_COUNT];
+};
+
+// Running sums of raw ADC counts, converted once per averaging window
+struct RawCounts {
+    uint32_t thermistor[Channels::THERMISTOR_COUNT];
+    uint32_t current[Channels::LOAD_COUNT];
+    uint32_t samples;
+};
+
+// Sees every scan block readRawCounts() takes, in the same context. divider is the largest
+// scan divider among its frames, 1 for a block taken wholly at the full rate.
+typedef void (*ScanTap)(const ScanFrame* block, int frames, int divider);
+
+// A latched overcurrent trip, see armOvercurrentTrip()
+const uint8_t TRIP_NONE = 0;
+struct OvercurrentTrip {
+    uint8_t channel;            // Load that tripped plus 1, TRIP_NONE while not latched
+    uint32_t latencyCycles;     // From the TIM6 trigger of the tripping sample to the relay pins going low
+    unsigned long trips;        // Since boot
+};
+
+// Per board sensor calibration, kept in flash by CalibrationStore
+struct SensorCalibration {
+    float currentBaseline[Channels::LOAD_COUNT];    // ADC counts at zero current
+    float thermistorOffset;                         // F added to every temperature
+};
 
 
 class HardwareAPI {
 
 public:
-    // Constructor
-    HardwareAPI(int thermistorPin, int fanRelayPin, int fanCurrentPin, int peltierRelayPin, int peltierCurrentPin);
+    // Constructor, pins and sensors come from Channels.h
+    HardwareAPI();
     // Constructor for testing
     HardwareAPI(bool testing);
 
     // Temperature
-    float getTemperature();  // Returns Fahrenheit value
-
-    // Fan
-    void turnFanOn();
-    void turnFanOff();
-    bool toggleFan();
-    bool getFanStatus();
-
-    // Fan Sensor
-    float getFanCurrent();
-    float getFanCurrent(int samples);
-    float getFanVoltage();
-    float getFanPower();
-    float getFanPower(int samples);
-
-    
-    // Peltier
-    void turnPeltierOn();
-    void turnPeltierOff();
-    bool togglePeltier();
-    bool getPeltierStatus();
-    
-    // Peltier Sensor
-    float getPeltierCurrent();
-    float getPeltierCurrent(int samples);
-    float getPeltierVoltage();
-    float getPeltierPower();
-    float getPeltierPower(int samples);
-
+    float getTemperature(Channels::ThermistorChannel thermistor = Channels::BOX);  // Returns Fahrenheit value
+    void useExactTemperature(bool exact);  // Bypass the lookup table with the log() formula, for validation
+
+    // Load relays
+    void turnOn(Channels::LoadChannel load);
+    void turnOff(Channels::LoadChannel load);
+    void turnAllOff();
+    bool toggle(Channels::LoadChannel load);
+    bool getStatus(Channels::LoadChannel load);
+
+    // Load sensors
+    float getCurrent(Channels::LoadChannel load, int samples = 1);
+    float getVoltage(Channels::LoadChannel load);
+    float getPower(Channels::LoadChannel load, int samples = 1);
+
+    // Zero current baselines from 5000 samples each, after 10s with every relay off
     void setBaseADC();
+    SensorCalibration getCalibration();
+    void setCalibration(const SensorCalibration& calibration);
+
+    // Continuous acquisition
+    // The ADC scans every channel in Channels.h on every trigger of
+    // TIM6 and DMA writes the frames into a circular buffer split in two halves.
+    // Each half holds SCAN_HALF_BLOCKS blocks, so the DMA interrupt and the reader
+    // only have to come round once per half, and a completed half stays readable
+    // until the other one completes.
+    // While scanning, the single-read getters above return the newest frame.
+    static const int SCAN_BLOCK_FRAMES = 10;
+    static const int SCAN_HALF_BLOCKS = 8;
+    bool beginScan(unsigned long sampleRateHz);
+    void endScan();
+    bool isScanning();
+    unsigned long getScanRate();        // Active rate, the full rate over the divider
+
+    // Scan rate divider
+    // The scan can slow to the full rate over a divider of up to SCAN_MAX_DIVIDER. The new TIM6
+    // period is preloaded, so it starts at the next trigger, within one old sample period, and
+    // the frame that trigger starts is noted for the reader. readRawCounts() then weights every
+    // frame by the divider it was taken at, so counts.samples stays in full rate samples and a
+    // sum of SCAN_BLOCK_FRAMES samples always spans the same time, whatever the rate was.
+    static const int SCAN_MAX_DIVIDER = 10;
+    void setScanDivider(int divider);
+    int getScanDivider();
+    const ScanFrame* takeScanBlock();  // Next completed block, NULL if none
+    unsigned long getScanOverruns();   // Blocks the DMA overwrote before they were read
+    void setScanTap(ScanTap tap);
+
+    // Overcurrent trip
+    // While scanning, analog watchdogs 2 and 3 window a load's current channel around its zero.
+    // The first conversion outside a window interrupts, and the handler drives every relay pin
+    // low before anything else and latches the trip; the relays stay off and turn on calls are
+    // ignored until clearOvercurrentTrip(). The watchdogs only compare the top 8 bits, so a
+    // limit trips up to 16 counts late, and their thresholds can only change while the ADC is
+    // stopped, so limits and zeros are taken when beginScan() starts it. A limit of 0 turns that
+    // load's trip off. There are only the two watchdogs, so false once two loads have limits.
+    static const int TRIP_WATCHDOGS = 2;
+    bool armOvercurrentTrip(Channels::LoadChannel load, float limitCounts);
+    OvercurrentTrip getOvercurrentTrip();
+    void clearOvercurrentTrip();
+
+    // Adds completed frames to counts until it holds maxSamples, returns samples added.
+    // Drains scan blocks while scanning, a frame taken at divider d counting as d samples and
+    // split between calls where maxSamples falls inside it. Otherwise reads each pin once.
+    int readRawCounts(RawCounts& counts, uint32_t maxSamples);
+
+    // Conversions from raw ADC counts
+    // Inline, so a call with a constant load folds its slope and keeps only the baseline load
+    float currentFromCounts(Channels::LoadChannel load, float adcValue) {
+        float current = fabsf(adcValue - _currentBaseline[load]) * Channels::ampsPerCount(load);
+        return current <= .15f ? 0 : current;
+    }
+    float temperatureFromCounts(float adcValue);
+    static constexpr float ampsPerCount(Channels::LoadChannel load) {   // Before the deadband
+        return Channels::ampsPerCount(load);
+    }
 
 private:
 
     int _adcRange = 4095;
 
     // Thermistor
-    // Pins
-    int _thermistorPin;
-
     // Values
     float _thermistorResistorValue = 10000;
     float _thermistorVCC = 3.3;
+    bool _exactTemperature = 0;
 
-    // Fan Relay
-    int _fanRelayPin;
-    bool _fanRelayStatus;
-    
-    // Fan Current Sensor
-    int _fanCurrentPin;
-    
-    // Peltier Relay
-    int _peltierRelayPin;
-    bool _peltierRelayStatus;
-    
-    // Peltier Current Sensor
-    int _peltierCurrentPin;
-
-
-    // Power calculation variables
-    float _powerCalculationVoltage = 5;
-    float _max_voltage = .5921 * 5;
-    // float _zero_voltage = 1.47;
+    float _exactTemperatureFromCounts(float adcValue);
 
+    // Loads
+    bool _relayStatus[Channels::LOAD_COUNT] = {};
+    float _currentBaseline[Channels::LOAD_COUNT];
+    float _thermistorOffset = 0;
 
     float _getCurrentADC(int samples, int sensorPin);
-
-    // Power Helpers
-    float _getCurrent(int sensorPin);
-    float _getCurrent(int samples, int sensorPin);
-    float _getVoltage(int sensorPin);
-    float _getPower(int sensorPin);
-    float _getPower(int samples, int sensorPin);
-
-    int _baseFanADCValue = 1798;
-    int _basePeltierADCValue = 1798;
-
-    float _peltierMultiplier = .92;
-    float _fanMultiplier = .51;
+    int _readThermistor(Channels::ThermistorChannel thermistor);
+    int _readCurrent(Channels::LoadChannel load);
 
 
 
@@ -96,7 +149,42 @@ private:
     */
     bool _testing = 0;
 
-    int _testRead(int sensorPin);
+    int _testRead(Channels::LoadChannel load);
+
+
+    /*
+        Scan state
+    */
+    bool _scanning = 0;
+    unsigned long _scanRateHz = 0;
+    unsigned long _scanBlocksRead = 0;
+    unsigned long _scanOverruns = 0;
+    unsigned long _lastTestBlockTime = 0;
+    ScanTap _scanTap = NULL;
+    int _scanDivider = 1;                   // Set for the frames from the next trigger
+    struct DividerChange {
+        uint32_t frame;                     // First frame at the new divider, numbered with the blocks
+        uint8_t divider;
+    };
+    static const int DIVIDER_CHANGES = 8;   // Far more than can happen between two reads
+    DividerChange _dividerChanges[DIVIDER_CHANGES];
+    volatile uint32_t _dividerChangesWritten = 0;
+    uint32_t _dividerChangesRead = 0;
+    int _readDivider = 1;                   // Divider of the frame being read
+    const ScanFrame* _readBlock = NULL;     // Taken and partly read
+    uint32_t _readFrame = 0;                // Of _readBlock, counted like DividerChange::frame
+    int _readBlockFrame = 0;
+    uint32_t _readWeight = 0;               // Samples of the current frame still to add
+    float _tripCounts[Channels::LOAD_COUNT] = {};
+    int _tripWatchdogsUsed = 0;
+
+    const ScanFrame* _latestScanFrame();
+    uint32_t _nextScanFrame();
+    int _frameDivider(uint32_t frame);
+    int _blockDivider(uint32_t firstFrame);
+    void _configureTrip(const uint32_t* currentChannels);
+    void _enableWatchdogs();
+    void _fillTestBlock(ScanFrame* block);
 
 
 };
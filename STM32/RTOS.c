@@ -1,114 +1,393 @@
 #include "HardwareAPI.h"
+#include "DecimationFilter.h"
+#include "StreamingStats.h"
+#include "Scheduler.h"
+#include "UartDriver.h"
+#include "ControlStrategy.h"
+#include "CalibrationStore.h"
+#include "FlashLog.h"
+#include "WaveformCapture.h"
+#include "ReportByException.h"
+#include "AdaptiveScan.h"
+#include "EnergyMeter.h"
+#include "FanSpectrum.h"
+#include "TelemetryProtocol.h"
 #include <Arduino.h>
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 
-#define THERMISTOR_PIN PA0
-#define FAN_RELAY_PIN PB10
-#define FAN_CURRENT_PIN PA1
-#define PELTIER_RELAY_PIN PB4
-#define PELTIER_CURRENT_PIN PA4
 #define THREE_VOLT PB5
 
-HardwareAPI hardwareAPI(THERMISTOR_PIN, FAN_RELAY_PIN, FAN_CURRENT_PIN,
-                        PELTIER_RELAY_PIN, PELTIER_CURRENT_PIN);
-HardwareSerial Serial1(USART1);
+using Channels::FAN;
+using Channels::PELTIER;
+using Channels::LOAD_COUNT;
+using Channels::THERMISTOR_COUNT;
+static_assert(THERMISTOR_COUNT <= Protocol::MAX_THERMISTORS && LOAD_COUNT <= Protocol::MAX_LOADS,
+              "telemetry and records carry every channel");
+
+HardwareAPI hardwareAPI;   // pins and sensors in Channels.h
+UartDriver espSerial(PA10, PA9);   // rx, tx
 HardwareTimer Timer2(TIM2);
 
 // global variables
-int sampleCount = 0;
-const int num_samples = 1000;
-int fanStatus = 0;
-int pelStatus = 0;
+RawCounts blockCounts = {0};
+const unsigned long scan_rate = 10000;   // 10khz ADC scan into DMA
+const unsigned long block_rate = scan_rate / HardwareAPI::SCAN_BLOCK_FRAMES;   // 1khz, one filter input per DMA block at the full rate
+const unsigned long telemetry_rate = 1;   // windows per second out of the decimation filter: 1, 10 or 50
+DecimationFilter decimator;
 String send_data;
 
 
-// task struct
-typedef struct {
-    int state;
-    unsigned long period;
-    unsigned long elapsedTime;
-    int (*Function)(int);
-} task;
-
 // periods
-const unsigned long TICK = 1;           // 1 ms
-const unsigned long samp_period = 1;    // 1khz
-const unsigned long send_period = num_samples * samp_period;
+const unsigned long samp_period = 4;    // drain completed DMA blocks every 4ms, half a DMA half
+const unsigned long send_period = 10;   // poll for a published window
+const unsigned long uart_period = 4;    // move UART RX DMA bytes into the receive ring, the DMA buffer fills in 11ms
 const unsigned long relay_period = 50;
 const unsigned long log_period = 60000; // log data every min
-// tasks
-const int numTasks = 4;
-task tasks[numTasks];
+const unsigned long diag_period = 5000; // scheduler diagnostics every 5s
+const unsigned long calib_period = 1000; // baseline drift tracking every 1s
+const unsigned long replay_period = 50; // at most one flash log record out every 50ms
+const unsigned long capture_period = 50; // at most one waveform chunk out every 50ms
+const unsigned long spectrum_period = 100; // fan spectrum block started, checked or analysed every 100ms
+const bool send_diagnostics = true;     // optional diagnostics frame
 
 // data
-volatile float avgFanCurrent = 0;
-volatile float avgPeltierCurrent = 0;
-volatile float avgFanVoltage = 0;
-volatile float avgPeltierVoltage = 0;
-volatile float avgFanPower = 0;
-volatile float avgPeltierPower = 0;
-volatile float avgTempF = 0;
+// one averaged window, handed from SampleData to SendData, per channel in Channels.h order
+typedef struct {
+    float voltage[LOAD_COUNT];
+    float current[LOAD_COUNT];
+    float power[LOAD_COUNT];
+    int status[LOAD_COUNT];
+    float tempF[THERMISTOR_COUNT];
+    unsigned long scanRate;
+} sample_window;
+
+// ping-pong buffers: SampleData only writes windows[fillWindow], SendData only
+// reads the window it took from readyWindow. Ownership changes hands through an
+// atomic exchange on readyWindow, -1 means nothing is waiting to be sent.
+sample_window windows[2];
+int fillWindow = 0;
+volatile int readyWindow = -1;
+volatile unsigned long droppedWindows = 0;
 
 // Power management config
-const int powerManagementMemory = 30;
-volatile float powerManagementFanPowers[powerManagementMemory] = {0};
-volatile float powerManagementPeltierPowers[powerManagementMemory] = {0};
+const int powerManagementMemory = 60;   // 1 minute of total power at 1 entry per second
+StreamingStats<float, powerManagementMemory> powerManagementStats;
+const float power_limit = 10.0f;        // W, both relays off once the 1 minute average is above
+const float power_release = 9.0f;       // W, and kept off until it is back under this, so they do not chatter
+bool powerLimited = false;
+
+// Power management takes the mean power of each second straight from the 1ms blocks, ahead of the
+// decimation filter, whose 1hz cascade would hold a step back by about 9s. SampleData sums in
+// the tick interrupt and hands over each finished second; RelayControl pushes it.
+float powerBlockSum = 0;                    // W, summed over blocks and loads, SampleData only
+unsigned long powerBlocks = 0;
+volatile float powerSecondMean = 0;         // W, the last finished second
+volatile unsigned long powerSeconds = 0;    // seconds finished, released after powerSecondMean
+unsigned long powerSecondsPushed = 0;       // RelayControl only
+
+// Telemetry by exception, see ReportByException.h
+// A window only goes out when it has moved past a deadband from the last frame sent, a relay
+// switched, it has a text alert, or the heartbeat is due; the server fills the rest forward.
+// Deadbands sit a few steps of the wire resolution above the filtered noise. The heartbeat is
+// set in seconds with the telemetry command, 0 sends every window as before, and each deadband
+// with its own deadband command in thousandths of its unit. Both start from these at reset.
+ReportByException telemetryReport;
+const TelemetryDeadbands telemetry_deadbands = {
+    0.05f,      // V
+    0.02f,      // A
+    0.2f,       // F
+    0.05f,      // W
+};
+const unsigned long telemetry_heartbeat = 30;       // s
+const unsigned long telemetry_max_heartbeat = 3600; // s
+const unsigned long telemetry_max_deadband = 10000; // thousandths of a V, A, F or W
+
+// Adaptive scan rate, see AdaptiveScan.h and HardwareAPI::setScanDivider
+// After a quiet minute the scan drops to a tenth of the full rate, which cuts the DMA interrupts,
+// block sums and capture work tenfold; the filter still gets one input per ms, so its windows
+// and the telemetry rate do not change. A jump on any channel or a relay change brings the full
+// rate back from the next trigger. A jump is only seen once its DMA half completes, which takes
+// 80ms at the low rate. The overcurrent trip still sees every conversion, 1ms apart at the low rate.
+AdaptiveScan adaptiveScan;
+const int scan_low_divider = 10;                // 1khz
+const unsigned long scan_quiet_millis = 60000;
+const float scan_jump_current = 0.5f;           // A in one input, clear of single sample noise
+const float scan_quiet_current = 0.1f;          // A deviation
+const float scan_jump_thermistor = 25.0f;       // counts, about 1F around 75F
+const float scan_quiet_thermistor = 10.0f;
+
+// Overcurrent trip, see HardwareAPI.h
+// The power average above is slow, a hard short would run for seconds before it moved. The ADC
+// watchdogs cut every relay from their interrupt within microseconds of the sample instead, and
+// latch. RelayControl only reports a latch, with text alert 3 for the first load, the fan, 4 for
+// the second, the peltier, and so on, and the relays stay off until a clear fault command. The
+// limits are the loads' trip currents in Channels.h, above any relay inrush.
+unsigned long reportedTrips = 0;
+
+// Power
+// loop() sleeps with WFI whenever nothing is pending, and the timer only interrupts on ticks
+// a task is released on. Sleep rather than STOP: the 10khz scan needs TIM6, the ADC and the
+// DMA running, and STOP halts their clocks. The current estimate weights roughly the L4
+// datasheet typicals at 80MHz, run from flash and sleep, by the measured time asleep.
+const float mcu_run_milliamps = 10.2f;
+const float mcu_sleep_milliamps = 2.7f;
+
+// Thermal control, see ControlStrategy.h
+// Strategies are picked with the control command, by index into controlStrategies
+const float control_setpoint = 76.0f;       // F
+const float alert_temperature = 80.0f;      // F, text alert above
+const unsigned long fan_run_on = 30000;     // ms the heat sink fans keep running after the coolers stop
+ThresholdControl thresholdControl(alert_temperature);
+HysteresisControl hysteresisControl(control_setpoint, 2.0f);
+TimeProportionalControl timeProportionalControl(control_setpoint, 4.0f, 300000, 30000);
+PidControl pidControl(control_setpoint, 4.0f, 0.3f, 0.0005f, 30.0f, 0.9f * power_limit, 300000, 30000);
+
+enum CONTROL_STRATEGY {CONTROL_THRESHOLD = 0, CONTROL_HYSTERESIS = 1, CONTROL_TIME_PROPORTIONAL = 2, CONTROL_PID = 3};
+ControlStrategy* const controlStrategies[] = {&thresholdControl, &hysteresisControl, &timeProportionalControl, &pidControl};
+const unsigned long numControlStrategies = sizeof(controlStrategies) / sizeof(controlStrategies[0]);
+ControlStrategy* controller = &hysteresisControl;
+
+// control inputs from the newest filter window, written by PublishWindow in the tick interrupt
+volatile bool controlReady = false;
+volatile float controlTemperature = 0;
+volatile float onPower[LOAD_COUNT] = {};    // last reading while the relay was on
+unsigned long lastCoolerOnMillis = 0;
+
+// Sensor calibration, see CalibrationStore.h
+// Boot takes the baselines from flash. While a relay has been off for longer than the filter
+// remembers, its filtered counts are the sensor's zero, so TrackCalibration follows them with a
+// slow average and only rewrites flash once they drift, at most once an hour for page wear.
+CalibrationStore calibrationStore;
+const float calibration_gain = 1.0f / 64;              // per calib period, about a minute time constant
+const float calibration_drift = 2.0f;                  // counts, about 35mA on the fan sensor
+const float calibration_reject = 40.0f;                // counts, more than this is current, not drift
+const unsigned long calibration_write_interval = 3600000;
+SensorCalibration storedCalibration;
+unsigned long lastCalibrationWrite = 0;
+
+// Store and forward log, see FlashLog.h
+// Every minute record goes into flash and out through ReplayLog, live or after an outage, and
+// stays in flash until the ESP acks it with L,<record seq>. Replaying 20 records a second
+// takes about 800 bytes/s of the link, and a full log drains in under a minute.
+FlashLog flashLog;
+
+// Waveform capture, see WaveformCapture.h
+// Every scan block goes through CaptureBlock, which also triggers on relay changes. A chunk only
+// goes out while the UART TX ring is close to empty, so the 1 Hz telemetry, acks and records
+// never queue behind a capture; a whole capture takes about 2s of otherwise idle link.
+WaveformCapture capture;
+const float capture_step = 0.3f;            // A between two 1ms means, about 300 A/s
+const size_t capture_tx_backlog = 64;       // bytes queued on the UART at most before a chunk
+bool captureStatus[LOAD_COUNT] = {};         // relay states as CaptureBlock last saw them
+
+// Energy counters, see EnergyMeter.h
+// SampleData adds every 1ms block and saves the totals to the backup registers each pass, so a
+// reset loses at most 4ms of them. Telemetry carries them in whole C and J.
+EnergyMeter energyMeter;
+
+// Fan spectrum, see FanSpectrum.h
+// Once a minute while the fan runs, AnalyseSpectrum takes one block of raw fan samples and
+// sends its features as a SPECTRUM frame, 40 bytes on the link instead of 2KB of samples. The
+// scan is held at the full rate until the block is in, about 100ms for 1024 samples, plus up to
+// one 80ms DMA half for the low rate to end. It is off until the spectrum command sets a block
+// size, and 0 stops it again. The frame carries the analysis time in DWT cycles, interrupts
+// included.
+FanSpectrum fanSpectrum;
+int spectrumBlock = 0;                              // samples, 0 is off
+const unsigned long spectrum_interval = 60000;      // ms from one block to the next
+const unsigned long spectrum_timeout = 1000;        // ms a block may take to fill
+const int fan_ripples_per_turn = 4;                 // commutations per turn of a 4 pole fan
+unsigned long lastSpectrumMillis = 0;
+unsigned long spectrumStartMillis = 0;
+
+// filtered current sensor counts and relay history, written by PublishWindow
+volatile float calibrationCounts[LOAD_COUNT] = {};
+volatile unsigned long lastOnMillis[LOAD_COUNT] = {};
 
 // states
-enum SAMP_DATA_ST {SAMPLE_INIT, SAMP_READ, SAMP_AVG, AWAIT_SEND};
+enum SAMP_DATA_ST {SAMPLE_INIT, SAMP_READ};
 enum SEND_DATA_ST {SEND};
 enum RELAY_CTRL_ST {RELAY};
 enum LOG_DATA_ST {LOG_DATA};
+enum DIAG_ST {DIAG};
+enum CALIB_ST {CALIB};
+enum REPLAY_ST {REPLAY};
+enum CAPTURE_ST {CAPTURE};
+enum SPECTRUM_ST {SPECTRUM_WAIT, SPECTRUM_COLLECT};
 
 int SampleData(int state);
 int SendData(int state);
 int RelayControl(int state);
 int LogData(int state);
-volatile bool SendFlag = false;
+int SendDiagnostics(int state);
+int ServiceUart(int state);
+int TrackCalibration(int state);
+int ReplayLog(int state);
+int SendCapture(int state);
+int AnalyseSpectrum(int state);
+
+// tasks
+// SampleData only drains DMA blocks and ServiceUart only moves received bytes out of the
+// DMA buffer, so both run inside the timer interrupt and can never be held up. Everything
+// else is deferred to loop() and picked by priority.
+constexpr TaskDescriptor taskTable[] = {
+    // name        function          initial state  period         deadline       priority  from ISR
+    {"sample",      &SampleData,      SAMPLE_INIT,   samp_period,   samp_period,   0,        true},
+    {"uart",        &ServiceUart,     0,             uart_period,   uart_period,   0,        true},
+    {"relay",       &RelayControl,    RELAY,         relay_period,  relay_period,  1,        false},
+    {"send",        &SendData,        SEND,          send_period,   20,            2,        false},
+    {"log",         &LogData,         LOG_DATA,      log_period,    1000,          3,        false},
+    {"diag",        &SendDiagnostics, DIAG,          diag_period,   1000,          4,        false},
+    {"calib",       &TrackCalibration, CALIB,        calib_period,  1000,          5,        false},
+    {"replay",      &ReplayLog,       REPLAY,        replay_period, 1000,          6,        false},
+    {"capture",     &SendCapture,     CAPTURE,       capture_period, 1000,         7,        false},
+    {"spectrum",    &AnalyseSpectrum, SPECTRUM_WAIT, spectrum_period, 1000,        8,        false},
+};
+constexpr int numTasks = sizeof(taskTable) / sizeof(taskTable[0]);
+constexpr unsigned long TICK = schedulerTick(taskTable);               // gcd of the periods
+constexpr unsigned long HYPERPERIOD = schedulerHyperperiod(taskTable); // lcm of the periods
+static_assert(TICK > 0, "task periods must be whole ms");
+Scheduler<numTasks> scheduler(taskTable, TICK);
+
 volatile bool logData = false;
 
 volatile int textStatus = 0;
 volatile int lastTextStatus = 0;
 
+// uplink frames to the ESP, see TelemetryProtocol.h. Only sent from loop() context.
+uint16_t frameSeq = 0;
+uint8_t framePayload[Protocol::MAX_PAYLOAD];
+uint8_t frameBuffer[Protocol::MAX_ENCODED_FRAME];
+
+void SendFrame(uint8_t type, size_t payloadLength)
+{
+    size_t length = Protocol::encodeFrame(type, frameSeq++, scheduler.getTicks(), framePayload, payloadLength,
+                                          frameBuffer, sizeof(frameBuffer));
+    if (length > 0) espSerial.write(frameBuffer, length);
+}
+
 // task functions
+// calibration, deadband and conversions run once per filter output, on filtered counts
+// counts are in ScanFrame order: the thermistors, then the loads' current sensors
+void PublishWindow(const float* counts)
+{
+    sample_window* window = &windows[fillWindow];
+    unsigned long now = millis();
+    for (size_t i = 0; i < THERMISTOR_COUNT; i++) window->tempF[i] = hardwareAPI.temperatureFromCounts(counts[i]);
+    for (size_t i = 0; i < LOAD_COUNT; i++) {
+        Channels::LoadChannel load = (Channels::LoadChannel) i;
+        float loadCounts = counts[THERMISTOR_COUNT + i];
+        window->current[i] = hardwareAPI.currentFromCounts(load, loadCounts);
+        window->voltage[i] = hardwareAPI.getVoltage(load);
+        window->power[i] = window->voltage[i] * window->current[i];
+        window->status[i] = hardwareAPI.getStatus(load);
+        if (window->status[i] && window->power[i] > 0) onPower[i] = window->power[i];
+        calibrationCounts[i] = loadCounts;
+        if (window->status[i]) lastOnMillis[i] = now;
+    }
+    window->scanRate = hardwareAPI.getScanRate();
+
+    controlTemperature = window->tempF[Channels::BOX];
+    controlReady = true;
+
+    // publish and keep sampling into the other buffer
+    if (__atomic_exchange_n(&readyWindow, fillWindow, __ATOMIC_ACQ_REL) != -1) droppedWindows++;
+    fillWindow ^= 1;
+}
+
+void RelayStates(bool* on)
+{
+    for (size_t i = 0; i < LOAD_COUNT; i++) on[i] = hardwareAPI.getStatus((Channels::LoadChannel) i);
+}
+
+// scan tap, in SampleData's context. The capture ring and the fan spectrum only take full rate
+// blocks. The first load whose relay changed names the capture.
+void CaptureBlock(const ScanFrame* block, int frames, int divider)
+{
+    bool triggered = false;
+    for (size_t i = 0; i < LOAD_COUNT; i++) {
+        bool on = hardwareAPI.getStatus((Channels::LoadChannel) i);
+        if (on != captureStatus[i] && !triggered) {
+            capture.trigger(Protocol::captureCause(Protocol::CAPTURE_RELAY, i));
+            triggered = true;
+        }
+        captureStatus[i] = on;
+    }
+    if (divider == 1) {
+        capture.push(block, frames);
+        fanSpectrum.push(block, frames);
+    } else {
+        capture.restart();
+        fanSpectrum.restart();
+    }
+}
+
+// the energy counters follow the current sensor zeros too
+void ConfigureEnergy()
+{
+    SensorCalibration calibration = hardwareAPI.getCalibration();
+    for (size_t i = 0; i < LOAD_COUNT; i++) {
+        Channels::LoadChannel load = (Channels::LoadChannel) i;
+        energyMeter.setChannel(load, calibration.currentBaseline[i], HardwareAPI::ampsPerCount(load),
+                               hardwareAPI.getVoltage(load));
+    }
+}
+
+// capture triggers and the fan spectrum follow the current sensor zeros as calibration tracks them
+void ConfigureCapture()
+{
+    SensorCalibration calibration = hardwareAPI.getCalibration();
+    for (size_t i = 0; i < LOAD_COUNT; i++) {
+        Channels::LoadChannel load = (Channels::LoadChannel) i;
+        float scale = HardwareAPI::ampsPerCount(load);
+        capture.setChannel(load, calibration.currentBaseline[i], scale,
+                           Channels::LOADS[i].captureAmps / scale, capture_step / scale);
+    }
+    fanSpectrum.setChannel(calibration.currentBaseline[FAN], HardwareAPI::ampsPerCount(FAN));
+}
+
 int SampleData(int state)
 {
     switch (state){
         case SAMPLE_INIT:
-            sampleCount = 0;
+            blockCounts = RawCounts();
+            decimator.begin(block_rate, telemetry_rate);
             state = SAMP_READ;
             break;
-        case SAMP_READ:
-            avgFanCurrent += hardwareAPI.getFanCurrent();
-            avgPeltierCurrent += hardwareAPI.getPeltierCurrent();
-            avgFanVoltage += hardwareAPI.getFanVoltage();
-            avgPeltierVoltage += hardwareAPI.getPeltierVoltage();
-            // powerManagementFanPowerSum += hardwareAPI.getFanPower();
-            // powerManagementPeltierPowerSum += hardwareAPI.getPeltierPower();
-            // powerManagementSumSamples++;
-            avgTempF += hardwareAPI.getTemperature();
-            sampleCount++;
-            if (sampleCount >= num_samples) state = SAMP_AVG;
-            break;
-        case SAMP_AVG:
-            avgFanCurrent /= num_samples;
-            avgPeltierCurrent /= num_samples;
-            avgFanVoltage /= num_samples;
-            avgPeltierVoltage /= num_samples;
-            avgFanPower = avgFanVoltage * avgFanCurrent;
-            avgPeltierPower = avgPeltierVoltage * avgPeltierCurrent;
-            avgTempF /= num_samples;
-            fanStatus = hardwareAPI.getFanStatus();
-            pelStatus = hardwareAPI.getPeltierStatus();
-            SendFlag = true;
-            sampleCount = 0;
-            state = AWAIT_SEND;
-            break;
-        case AWAIT_SEND:
-            if (SendFlag) break;
-            state = SAMP_READ;
+        case SAMP_READ: {
+            // every 1ms of samples becomes one filter input, built from integer sums only. At the low
+            // scan rate readRawCounts weights each frame as the full rate samples it stands for.
+            float filtered[DecimationFilter::CHANNELS];
+            unsigned long now = millis();
+            int divider = hardwareAPI.getScanDivider();
+            bool on[LOAD_COUNT];
+            RelayStates(on);
+            while (hardwareAPI.readRawCounts(blockCounts, HardwareAPI::SCAN_BLOCK_FRAMES) > 0 &&
+                   blockCounts.samples >= HardwareAPI::SCAN_BLOCK_FRAMES) {
+                float block[DecimationFilter::CHANNELS];
+                for (size_t i = 0; i < THERMISTOR_COUNT; i++) block[i] = (float) blockCounts.thermistor[i] / blockCounts.samples;
+                for (size_t i = 0; i < LOAD_COUNT; i++) {
+                    Channels::LoadChannel load = (Channels::LoadChannel) i;
+                    block[THERMISTOR_COUNT + i] = (float) blockCounts.current[i] / blockCounts.samples;
+                    powerBlockSum += hardwareAPI.getVoltage(load) * hardwareAPI.currentFromCounts(load, block[THERMISTOR_COUNT + i]);
+                }
+                if (++powerBlocks >= block_rate) {
+                    powerSecondMean = powerBlockSum / powerBlocks;
+                    __atomic_add_fetch(&powerSeconds, 1, __ATOMIC_RELEASE);
+                    powerBlockSum = 0;
+                    powerBlocks = 0;
+                }
+                energyMeter.add(blockCounts, on);
+                blockCounts = RawCounts();
+                if (decimator.push(block, filtered)) PublishWindow(filtered);
+                divider = adaptiveScan.update(block, now);
+            }
+            if (divider != hardwareAPI.getScanDivider()) hardwareAPI.setScanDivider(divider);
+            energyMeter.save();
             break;
+        }
     }
 
     return state;
@@ -116,74 +395,132 @@ int SampleData(int state)
   
 int SendData(int state)
 {   
-    if (!SendFlag) return state;
-    Serial1.print(avgFanVoltage); Serial1.print(",");
-    Serial1.print(avgFanCurrent); Serial1.print(",");
-    Serial1.print(avgFanPower); Serial1.print(",");
-    Serial1.print(avgPeltierVoltage); Serial1.print(",");
-    Serial1.print(avgPeltierCurrent); Serial1.print(",");
-    Serial1.print(avgPeltierPower); Serial1.print(",");
-    Serial1.print(avgTempF); Serial1.print(",");
-    Serial1.print(fanStatus); Serial1.print(",");
-    Serial1.print(pelStatus); Serial1.print(",");
-    Serial1.print(logData); Serial1.print(",");
-    if (textStatus > 0 && textStatus != lastTextStatus) {
-        Serial1.print(textStatus);
-    } else {
-        Serial1.print("0");
+    int ready = __atomic_exchange_n(&readyWindow, -1, __ATOMIC_ACQ_REL);
+    if (ready < 0) return state;
+    const sample_window* window = &windows[ready];
+
+    // every channel in list order, Channels.h names them
+    EnergyMeter::Totals energy = energyMeter.read();
+    Protocol::Telemetry telemetry;
+    telemetry.thermistorCount = THERMISTOR_COUNT;
+    telemetry.loadCount = LOAD_COUNT;
+    for (size_t i = 0; i < THERMISTOR_COUNT; i++) telemetry.temperature[i] = window->tempF[i];
+    for (size_t i = 0; i < LOAD_COUNT; i++) {
+        telemetry.voltage[i] = window->voltage[i];
+        telemetry.current[i] = window->current[i];
+        telemetry.status[i] = window->status[i];
+        telemetry.coulombs[i] = energy.nanoCoulombs[i] / 1000000000ULL;
+        telemetry.joules[i] = energy.nanoJoules[i] / 1000000000ULL;
     }
-    Serial1.print("|");
-
-    for (int i = powerManagementMemory-1; i > 0; i--) {
-        powerManagementFanPowers[i] = powerManagementFanPowers[i-1];
-        powerManagementPeltierPowers[i] = powerManagementPeltierPowers[i-1];
+    telemetry.logData = logData;
+    telemetry.textStatus = textStatus > 0 && textStatus != lastTextStatus ? textStatus : 0;
+    telemetry.powerAvg = powerManagementStats.windowMean();
+    telemetry.powerMin = powerManagementStats.min();
+    telemetry.powerMax = powerManagementStats.max();
+    telemetry.powerStd = powerManagementStats.stddev();
+    telemetry.scanRate = window->scanRate;
+    if (telemetryReport.offer(telemetry)) {
+        SendFrame(Protocol::TELEMETRY, Protocol::packTelemetry(telemetry, framePayload, sizeof(framePayload)));
     }
-    powerManagementFanPowers[0] = avgFanPower;
-    powerManagementPeltierPowers[0] = avgPeltierPower;
 
-    
-    avgFanCurrent = 0;
-    avgPeltierCurrent = 0;
-    avgFanVoltage = 0;
-    avgPeltierVoltage = 0;
-    avgFanPower = 0;
-    avgPeltierPower = 0;
-    avgTempF = 0;
+    // the minute record goes to flash, ReplayLog sends it
+    if (logData) {
+        Protocol::Record record;
+        record.millis = millis();
+        record.thermistorCount = THERMISTOR_COUNT;
+        record.loadCount = LOAD_COUNT;
+        for (size_t i = 0; i < THERMISTOR_COUNT; i++) record.temperature[i] = window->tempF[i];
+        for (size_t i = 0; i < LOAD_COUNT; i++) {
+            record.voltage[i] = window->voltage[i];
+            record.current[i] = window->current[i];
+            record.status[i] = window->status[i];
+        }
+        record.powerAvg = telemetry.powerAvg;
+        if (!flashLog.append(record)) Serial.println("Flash log record lost");
+    }
 
-    SendFlag = false;
     logData = false;
     lastTextStatus = textStatus;
 
     return state;
 }
 
-int RelayControl(int state)
+void SelectControl(unsigned long strategy)
+{
+    controller = controlStrategies[strategy];
+    controller->reset();
+    Serial.print("Control: "); Serial.println(controller->name());
+}
+
+// full scan rate for a relay change, so its transient and any capture see every sample
+void WakeScan()
+{
+    hardwareAPI.setScanDivider(adaptiveScan.wake(millis()));
+}
+
+void WakeScanOnChange(const bool* wasOn)
 {
+    bool on[LOAD_COUNT];
+    RelayStates(on);
+    if (memcmp(on, wasOn, sizeof(on)) != 0) WakeScan();
+}
 
-    float fanPowerAvg = 0;
-    float peltierPowerAvg = 0;
+int RelayControl(int state)
+{
+    // one power management entry per second, from SampleData
+    unsigned long seconds = __atomic_load_n(&powerSeconds, __ATOMIC_ACQUIRE);
+    if (seconds != powerSecondsPushed) {
+        powerSecondsPushed = seconds;
+        powerManagementStats.push(powerSecondMean);
+    }
 
-    for (int i = 0; i < powerManagementMemory; i++) {
-        fanPowerAvg += powerManagementFanPowers[i];
-        peltierPowerAvg += powerManagementPeltierPowers[i];
+    if (!controlReady) return state;   // no filtered temperature yet
+    bool wasOn[LOAD_COUNT];
+    RelayStates(wasOn);
+
+    ControlInput input;
+    input.nowMillis = millis();
+    input.temperature = controlTemperature;
+    input.loadPower = 0;
+    for (size_t i = 0; i < LOAD_COUNT; i++) input.loadPower += onPower[i];
+    input.powerAvg = powerManagementStats.windowMean();   // entries not yet filled count as 0W
+    int decision = controller->update(input);
+
+    // a latched overcurrent trip overrides everything until it is cleared
+    OvercurrentTrip trip = hardwareAPI.getOvercurrentTrip();
+    if (trip.channel != TRIP_NONE) {
+        if (trip.trips != reportedTrips) {
+            reportedTrips = trip.trips;
+            Serial.print(Channels::LOADS[trip.channel - 1].name);
+            Serial.print(" overcurrent trip, relays off in ");
+            Serial.print((float) trip.latencyCycles / (SystemCoreClock / 1000000));
+            Serial.println("us");
+        }
+        textStatus = 2 + trip.channel;
+        return state;
     }
-    fanPowerAvg /= powerManagementMemory;
-    peltierPowerAvg /= powerManagementMemory;
 
-    if ((fanPowerAvg + peltierPowerAvg) > 10) {
-        hardwareAPI.turnFanOff();
-        hardwareAPI.turnPeltierOff();
+    // power management has the last word, whatever the strategy
+    if (input.powerAvg > power_limit) powerLimited = true;
+    else if (input.powerAvg < power_release) powerLimited = false;
+    if (powerLimited) {
+        hardwareAPI.turnAllOff();
+        WakeScanOnChange(wasOn);
         textStatus = 1;
-    } else {
-        float temp = hardwareAPI.getTemperature();
-        if (temp > 80.0f) {
-            hardwareAPI.turnFanOn();
-            hardwareAPI.turnPeltierOn();
-            textStatus = 2;
-        } else {
-            textStatus = 0;
-        }
+        return state;
     }
+    textStatus = input.temperature > alert_temperature ? 2 : 0;
+
+    // heat sink fans run with the coolers and a while after, to clear the hot side
+    if (decision == CONTROL_ON) lastCoolerOnMillis = input.nowMillis;
+    bool fanRunOn = input.nowMillis - lastCoolerOnMillis < fan_run_on;
+    for (size_t i = 0; i < LOAD_COUNT; i++) {
+        Channels::LoadChannel load = (Channels::LoadChannel) i;
+        bool fan = Channels::LOADS[i].role == Channels::HEAT_SINK_FAN;
+        if (decision == CONTROL_ON) hardwareAPI.turnOn(load);
+        else if (decision == CONTROL_OFF && !(fan && fanRunOn)) hardwareAPI.turnOff(load);
+    }
+    WakeScanOnChange(wasOn);
 
     return state;
 }
@@ -192,101 +529,428 @@ int LogData(int state){
     logData = true;
     return state;
 }
-// front end button interrupt handler
-void Handle_My_ESP(String message) 
+
+int ReplayLog(int state)
 {
-    message.trim();
+    Protocol::Record record;
+    if (flashLog.next(record, millis())) {
+        SendFrame(Protocol::RECORD, Protocol::packRecord(record, framePayload, sizeof(framePayload)));
+    }
+    return state;
+}
 
-    if (message == "FAN_ON") {
-        hardwareAPI.turnFanOn();
-        Serial.println("Fan turned on");
+int SendCapture(int state)
+{
+    if (espSerial.getTxSpace() < UartDriver::TX_RING_SIZE - capture_tx_backlog) return state;
+    static Protocol::CaptureChunk chunk;    // ~220 bytes, kept off the stack
+    if (!capture.takeChunk(chunk, millis())) return state;
+    if (chunk.index == 0) {
+        Serial.print("Capture "); Serial.print(chunk.id);
+        Serial.print(", cause "); Serial.println(chunk.cause);
     }
-    else if (message == "FAN_OFF") {
-        hardwareAPI.turnFanOff();
-        Serial.println("Fan turned off");
+    SendFrame(Protocol::CAPTURE, Protocol::packCaptureChunk(chunk, framePayload, sizeof(framePayload)));
+    return state;
+}
+
+// the scan goes back to adapting once a block is analysed or dropped
+void EndSpectrum(unsigned long now)
+{
+    lastSpectrumMillis = now;
+    hardwareAPI.setScanDivider(adaptiveScan.hold(now, 0));
+}
+
+int AnalyseSpectrum(int state)
+{
+    unsigned long now = millis();
+    switch (state) {
+        case SPECTRUM_WAIT:
+            if (spectrumBlock == 0 || !hardwareAPI.getStatus(FAN)) return state;
+            if (now - lastSpectrumMillis < spectrum_interval) return state;
+            spectrumStartMillis = now;
+            fanSpectrum.start();
+            hardwareAPI.setScanDivider(adaptiveScan.hold(now, spectrum_timeout));
+            return SPECTRUM_COLLECT;
+
+        case SPECTRUM_COLLECT: {
+            // the spectrum command dropped the block
+            if (fanSpectrum.isIdle()) {
+                hardwareAPI.setScanDivider(adaptiveScan.hold(now, 0));
+                return SPECTRUM_WAIT;
+            }
+            // a block with the fan off or one that never fills, a pinned low scan rate, is dropped
+            if (!hardwareAPI.getStatus(FAN) || now - spectrumStartMillis >= spectrum_timeout) {
+                fanSpectrum.cancel();
+                EndSpectrum(now);
+                return SPECTRUM_WAIT;
+            }
+            static Protocol::Spectrum spectrum;
+            uint32_t begin = cycleCount();
+            if (!fanSpectrum.analyse(spectrum)) return state;
+            spectrum.cycles = cycleCount() - begin;
+            EndSpectrum(now);
+            Serial.print("Fan spectrum: "); Serial.print(spectrum.dominantHz);
+            Serial.print("Hz, "); Serial.print(spectrum.rpm);
+            Serial.print(" rpm, "); Serial.print(spectrum.cycles); Serial.println(" cycles");
+            SendFrame(Protocol::SPECTRUM, Protocol::packSpectrum(spectrum, framePayload, sizeof(framePayload)));
+            return SPECTRUM_WAIT;
+        }
+    }
+    return state;
+}
+
+// scheduler profile since the last report, as its own frame
+static_assert(numTasks <= (int) Protocol::MAX_TASKS, "diagnostics frame holds MAX_TASKS tasks");
+
+int SendDiagnostics(int state)
+{
+    if (!send_diagnostics) return state;
+    Protocol::Diagnostics diagnostics;
+    diagnostics.cpuMHz = SystemCoreClock / 1000000;
+    diagnostics.cpuLoad = scheduler.getCpuLoad();
+    diagnostics.isrLoad = scheduler.getIsrLoad();
+    diagnostics.skippedTicks = scheduler.getSkippedTicks();
+    diagnostics.maxLatencyCycles = scheduler.getMaxLatencyCycles();
+    diagnostics.droppedWindows = droppedWindows;
+    diagnostics.scanOverruns = hardwareAPI.getScanOverruns();
+    diagnostics.uartTxDropped = espSerial.getTxDropped();
+    diagnostics.uartRxDropped = espSerial.getRxDropped();
+    diagnostics.idlePercent = scheduler.getIdlePercent();
+    diagnostics.mcuCurrent = mcu_sleep_milliamps * diagnostics.idlePercent / 100 +
+                             mcu_run_milliamps * (100 - diagnostics.idlePercent) / 100;
+    diagnostics.wakeupRate = scheduler.getWakeupRate();
+    diagnostics.logBacklog = flashLog.getBacklog();
+    diagnostics.logOverwritten = flashLog.getOverwritten();
+    diagnostics.captures = capture.getCaptures();
+    diagnostics.capturesMissed = capture.getMissed();
+    OvercurrentTrip trip = hardwareAPI.getOvercurrentTrip();
+    diagnostics.trips = trip.trips;
+    diagnostics.tripLatency = (float) trip.latencyCycles / (SystemCoreClock / 1000000);
+    diagnostics.telemetryWindows = telemetryReport.getWindows();
+    diagnostics.telemetryFrames = telemetryReport.getFrames();
+    diagnostics.taskCount = numTasks;
+    for (int i = 0; i < numTasks; i++) {
+        const TaskProfile& profile = scheduler.getProfile(i);
+        Protocol::TaskDiagnostics& task = diagnostics.tasks[i];
+        strncpy(task.name, scheduler.getName(i), sizeof(task.name) - 1);
+        task.name[sizeof(task.name) - 1] = '\0';
+        task.minCycles = profile.runs ? profile.minCycles : 0;
+        task.avgCycles = profile.avgCycles();
+        task.maxCycles = profile.maxCycles;
+        task.deadlineMisses = scheduler.getDeadlineMisses(i);
+        task.overruns = scheduler.getOverruns(i);
+    }
+    SendFrame(Protocol::DIAGNOSTICS, Protocol::packDiagnostics(diagnostics, framePayload, sizeof(framePayload)));
+    scheduler.resetProfile();
+    return state;
+}
+
+int ServiceUart(int state)
+{
+    espSerial.poll();
+    return state;
+}
+
+// a page write stalls the CPU, so only from loop() context
+void SaveCalibration(const SensorCalibration& calibration)
+{
+    if (!calibrationStore.save(calibration)) return;
+    storedCalibration = calibration;
+    lastCalibrationWrite = millis();
+    Serial.print("Calibration saved, write "); Serial.println(calibrationStore.getWrites());
+}
+
+// one sensor's baseline toward its filtered counts, if the relay has been off long enough
+void TrackBaseline(float& baseline, float counts, unsigned long lastOnMillis, bool relayOn, unsigned long now)
+{
+    // the whole filter impulse response has to be past the relay, plus a second for the load to stop
+    unsigned long settle = 2 * decimator.getDelayMillis() + 1000;
+    if (relayOn || now - lastOnMillis < settle) return;
+    if (fabsf(counts - baseline) > calibration_reject) return;
+    baseline += calibration_gain * (counts - baseline);
+}
+
+int TrackCalibration(int state)
+{
+    if (!controlReady) return state;
+
+    unsigned long now = millis();
+    SensorCalibration calibration = hardwareAPI.getCalibration();
+    bool drifted = false;
+    for (size_t i = 0; i < LOAD_COUNT; i++) {
+        float& baseline = calibration.currentBaseline[i];
+        TrackBaseline(baseline, calibrationCounts[i], lastOnMillis[i], hardwareAPI.getStatus((Channels::LoadChannel) i), now);
+        if (fabsf(baseline - storedCalibration.currentBaseline[i]) > calibration_drift) drifted = true;
+    }
+    hardwareAPI.setCalibration(calibration);
+    ConfigureCapture();
+    ConfigureEnergy();
+
+    if (drifted && now - lastCalibrationWrite >= calibration_write_interval) {
+        SaveCalibration(calibration);
+    }
+    return state;
+}
+
+// command channel
+// ESP -> STM32: C,<seq>,<opcode>,<arg>\n, and S\n once as the ESP starts
+// STM32 -> ESP: an ACK frame with seq, result, tick and every relay state
+// tick is the scheduler tick the relay switched on. Commands set an absolute state, so a
+// retried frame is acked again from the last result instead of switching a second time.
+// A restarted ESP counts seq from 1 again, and its first commands could match the last seq
+// seen before it went down and be acked without running; S starts a new session, after which
+// any seq runs.
+// CMD_CONTROL picks the control strategy, arg is an index into controlStrategies. A fan or
+// peltier command falls back to threshold control, or the next relay period would undo it.
+// CMD_THERMISTOR_OFFSET stores a thermistor correction in hundredths of a F, sent as a signed
+// number, e.g. C,7,4,-150 reads 1.5F lower.
+// CMD_CLEAR_FAULT releases a latched overcurrent trip, arg is ignored. Until then a relay on
+// command is refused with CMD_TRIPPED.
+// CMD_TELEMETRY sets the telemetry heartbeat in seconds, 0 sends every window.
+// CMD_DEADBAND_VOLTAGE, _CURRENT, _TEMPERATURE and _POWER set one telemetry deadband in
+// thousandths of a V, A, F or W, e.g. C,9,11,500 sends a window once the temperature moves 0.5F.
+// CMD_SCAN_RATE pins the ADC scan divider, 1 is the full rate, or 0 lets it adapt.
+// CMD_SPECTRUM sets the fan spectrum block, 256, 512 or 1024 samples, or 0 to stop it. A new
+// size drops a block under way and takes the next one at once.
+enum COMMAND_OPCODE {CMD_FAN = 1, CMD_PELTIER = 2, CMD_CONTROL = 3, CMD_THERMISTOR_OFFSET = 4, CMD_CLEAR_FAULT = 5,
+                     CMD_TELEMETRY = 6, CMD_SCAN_RATE = 7, CMD_SPECTRUM = 8, CMD_DEADBAND_VOLTAGE = 9,
+                     CMD_DEADBAND_CURRENT = 10, CMD_DEADBAND_TEMPERATURE = 11, CMD_DEADBAND_POWER = 12};
+enum COMMAND_RESULT {CMD_OK = 0, CMD_MALFORMED = 1, CMD_UNKNOWN_OPCODE = 2, CMD_BAD_ARGUMENT = 3, CMD_TRIPPED = 4};
+
+unsigned long lastCommandSeq = 0;   // 0 is never sent by the ESP
+int lastCommandResult = CMD_OK;
+unsigned long lastCommandTick = 0;
+
+void SendAck(unsigned long seq, int result, unsigned long tick)
+{
+    Protocol::Ack ack;
+    ack.seq = seq;
+    ack.result = result;
+    ack.tick = tick;
+    ack.loadCount = LOAD_COUNT;
+    RelayStates(ack.status);
+    SendFrame(Protocol::ACK, Protocol::packAck(ack, framePayload, sizeof(framePayload)));
+}
+
+// one unsigned field followed by terminator
+bool ParseField(const char*& p, unsigned long& value, char terminator)
+{
+    char* end;
+    value = strtoul(p, &end, 10);
+    if (end == p || *end != terminator) return false;
+    p = end + 1;
+    return true;
+}
+
+int ExecuteCommand(unsigned long opcode, unsigned long arg)
+{
+    if (opcode == CMD_CONTROL) {
+        if (arg >= numControlStrategies) return CMD_BAD_ARGUMENT;
+        SelectControl(arg);
+        return CMD_OK;
+    }
+    if (opcode == CMD_THERMISTOR_OFFSET) {
+        long hundredths = (long) arg;   // strtoul wraps a leading minus, this undoes it
+        if (hundredths < -2000 || hundredths > 2000) return CMD_BAD_ARGUMENT;
+        SensorCalibration calibration = hardwareAPI.getCalibration();
+        calibration.thermistorOffset = hundredths / 100.0f;
+        hardwareAPI.setCalibration(calibration);
+        SaveCalibration(calibration);
+        return CMD_OK;
+    }
+    if (opcode == CMD_CLEAR_FAULT) {
+        hardwareAPI.clearOvercurrentTrip();
+        Serial.println("Overcurrent trip cleared");
+        return CMD_OK;
+    }
+    if (opcode == CMD_TELEMETRY) {
+        if (arg > telemetry_max_heartbeat) return CMD_BAD_ARGUMENT;
+        telemetryReport.setHeartbeat(arg * telemetry_rate);
+        Serial.print("Telemetry heartbeat (s): "); Serial.println(arg);
+        return CMD_OK;
     }
-    else if (message == "PELTIER_ON") {
-        hardwareAPI.turnPeltierOn();
-        Serial.println("Peltier turned on");
+    if (opcode >= CMD_DEADBAND_VOLTAGE && opcode <= CMD_DEADBAND_POWER) {
+        if (arg > telemetry_max_deadband) return CMD_BAD_ARGUMENT;
+        TelemetryDeadbands deadbands = telemetryReport.getDeadbands();
+        float deadband = arg / 1000.0f;
+        if (opcode == CMD_DEADBAND_VOLTAGE) deadbands.voltage = deadband;
+        else if (opcode == CMD_DEADBAND_CURRENT) deadbands.current = deadband;
+        else if (opcode == CMD_DEADBAND_TEMPERATURE) deadbands.temperature = deadband;
+        else deadbands.power = deadband;
+        telemetryReport.setDeadbands(deadbands);
+        Serial.print("Telemetry deadband (thousandths): "); Serial.println(arg);
+        return CMD_OK;
     }
-    else if (message == "PELTIER_OFF") {
-        hardwareAPI.turnPeltierOff();
-        Serial.println("Peltier turned off");
+    if (opcode == CMD_SCAN_RATE) {
+        if (arg > HardwareAPI::SCAN_MAX_DIVIDER) return CMD_BAD_ARGUMENT;
+        adaptiveScan.setFixedDivider(arg);
+        WakeScan();
+        Serial.print("Scan rate (hz): "); Serial.println(hardwareAPI.getScanRate());
+        return CMD_OK;
     }
-    else {
-        Serial.println("Unknown command");
+    if (opcode == CMD_SPECTRUM) {
+        if (arg != 0 && !FanSpectrum::supportedBlock(arg)) return CMD_BAD_ARGUMENT;
+        spectrumBlock = arg;
+        if (arg) fanSpectrum.setBlockSize(arg);
+        else fanSpectrum.cancel();
+        lastSpectrumMillis = millis() - spectrum_interval;
+        Serial.print("Fan spectrum block: "); Serial.println(arg);
+        return CMD_OK;
+    }
+    if (opcode != CMD_FAN && opcode != CMD_PELTIER) return CMD_UNKNOWN_OPCODE;
+    if (arg > 1) return CMD_BAD_ARGUMENT;
+    if (arg && hardwareAPI.getOvercurrentTrip().channel != TRIP_NONE) return CMD_TRIPPED;
+    if (controller->isAutomatic()) SelectControl(CONTROL_THRESHOLD);
+    WakeScan();
+
+    Channels::LoadChannel load = opcode == CMD_FAN ? FAN : PELTIER;
+    if (arg) hardwareAPI.turnOn(load);
+    else hardwareAPI.turnOff(load);
+    Serial.print(Channels::LOADS[load].name);
+    Serial.println(arg ? " turned on" : " turned off");
+    return CMD_OK;
+}
+
+// front end button handler, S for a new command session, and L,<record seq> acks for the flash log
+void Handle_My_ESP(const char* message) 
+{
+    unsigned long seq, opcode, arg;
+    const char* p = message + 2;
+    if (message[0] == 'L' && message[1] == ',') {
+        if (ParseField(p, seq, '\0')) flashLog.acknowledge(seq, millis());
+        else Serial.println("Malformed log ack");
+        return;
+    }
+    if (message[0] == 'S' && message[1] == '\0') {
+        lastCommandSeq = 0;
+        return;
+    }
+    if (message[0] != 'C' || message[1] != ',' ||
+        !ParseField(p, seq, ',') || !ParseField(p, opcode, ',') || !ParseField(p, arg, '\0') || seq == 0) {
+        Serial.println("Malformed command");
+        SendAck(0, CMD_MALFORMED, scheduler.getTicks());
+        return;
     }
 
+    if (seq != lastCommandSeq) {
+        lastCommandResult = ExecuteCommand(opcode, arg);
+        lastCommandTick = scheduler.getTicks();
+        lastCommandSeq = seq;
+    }
+    SendAck(seq, lastCommandResult, lastCommandTick);
 }
+
 // timer
-volatile bool TimerFlag = false;
+// ARR preload is off, so an overflow written here applies to the period that just started
+const unsigned long timerCountsPerMilli = 1000;
+unsigned long timerTicks = 1;
+
 void TimerISR()
 {
-    TimerFlag = true;
+    scheduler.tick(timerTicks);
+    unsigned long next = scheduler.ticksUntilRelease();
+    if (next != timerTicks) {
+        timerTicks = next;
+        Timer2.setOverflow(next * TICK * timerCountsPerMilli, TICK_FORMAT);
+    }
 }
 
 void setup() {
-    Serial1.setTx(PA9);
-    Serial1.setRx(PA10);
-    Serial1.begin(115200);
-    Serial1.println("Hey, ESP ! STM32 RTOS Initialized");
+    espSerial.begin(115200);
     Serial.begin(115200);
     Serial.println("RTOS STARTED");
 
-    // Callibrating Sensors
-    Serial.println("Callibrating Sensors...");
-    hardwareAPI.setBaseADC();
-    Serial.println("Sensors Callibrated!");
+    // Sensor baselines from flash, so sampling starts at once. Only a blank or corrupt
+    // record pays for the full calibration, which takes over 10s.
+    if (calibrationStore.load(storedCalibration)) {
+        hardwareAPI.setCalibration(storedCalibration);
+        Serial.println("Sensors calibrated from flash");
+    } else {
+        Serial.println("Callibrating Sensors...");
+        hardwareAPI.setBaseADC();
+        SaveCalibration(hardwareAPI.getCalibration());
+        storedCalibration = hardwareAPI.getCalibration();
+        Serial.println("Sensors Callibrated!");
+    }
+
+    telemetryReport.begin(telemetry_deadbands, telemetry_heartbeat * telemetry_rate);
+    flashLog.begin();
+    Serial.print("Flash log: boot "); Serial.print(flashLog.getBoot());
+    Serial.print(", "); Serial.print(flashLog.getBacklog()); Serial.println(" records to send");
+
+    // start continuous ADC scan, calibration above needs analogRead. The trip windows are set
+    // around the baselines as the scan starts.
+    float scanJump[AdaptiveScan::CHANNELS];
+    float scanQuiet[AdaptiveScan::CHANNELS];
+    for (size_t i = 0; i < THERMISTOR_COUNT; i++) {
+        scanJump[i] = scan_jump_thermistor;
+        scanQuiet[i] = scan_quiet_thermistor;
+    }
+    for (size_t i = 0; i < LOAD_COUNT; i++) {
+        Channels::LoadChannel load = (Channels::LoadChannel) i;
+        if (!hardwareAPI.armOvercurrentTrip(load, Channels::LOADS[i].tripAmps / HardwareAPI::ampsPerCount(load))) {
+            Serial.print("No trip watchdog left for "); Serial.println(Channels::LOADS[i].name);
+        }
+        scanJump[THERMISTOR_COUNT + i] = scan_jump_current / HardwareAPI::ampsPerCount(load);
+        scanQuiet[THERMISTOR_COUNT + i] = scan_quiet_current / HardwareAPI::ampsPerCount(load);
+    }
+    adaptiveScan.begin(scan_low_divider, scanJump, scanQuiet, scan_quiet_millis);
+    capture.begin(scan_rate);
+    fanSpectrum.begin(scan_rate, FanSpectrum::MAX_BLOCK, fan_ripples_per_turn);
+    ConfigureCapture();
+    Serial.println(energyMeter.begin(scan_rate) ? "Energy counters restored" : "Energy counters from 0");
+    ConfigureEnergy();
+    hardwareAPI.setScanTap(CaptureBlock);
+    hardwareAPI.beginScan(scan_rate);
 
     // intialize 3.3 V
     pinMode(THREE_VOLT, OUTPUT);
     digitalWrite(THREE_VOLT, HIGH);
 
     // turn fan and peltier on initially
-    hardwareAPI.turnFanOn();
-    hardwareAPI.turnPeltierOff();
-
-    tasks[0].state = SAMPLE_INIT;
-    tasks[0].period = samp_period;
-    tasks[0].elapsedTime = samp_period;
-    tasks[0].Function = &SampleData;
-
-    tasks[1].state = SEND;
-    tasks[1].period = send_period;
-    tasks[1].elapsedTime = send_period;
-    tasks[1].Function = &SendData;
-
-    tasks[2].state = RELAY;
-    tasks[2].period = relay_period;
-    tasks[2].elapsedTime = relay_period;
-    tasks[2].Function = &RelayControl;
-
-    tasks[3].state = LOG_DATA;
-    tasks[3].period = log_period;
-    tasks[3].elapsedTime = log_period;
-    tasks[3].Function = &LogData;
-
-    Timer2.setPrescaleFactor(80);
-    Timer2.setOverflow(1000, HERTZ_FORMAT);
+    hardwareAPI.turnOn(FAN);
+    hardwareAPI.turnOff(PELTIER);
+    RelayStates(captureStatus);
+
+    scheduler.begin();
+    Serial.print("Scheduler tick (ms): "); Serial.println(TICK);
+    Serial.print("Hyperperiod (ms): "); Serial.println(HYPERPERIOD);
+
+    // 1us counts, so TimerISR can move the overflow without touching the prescaler
+    Timer2.setPrescaleFactor(Timer2.getTimerClkFreq() / 1000000);
+    Timer2.setOverflow(TICK * timerCountsPerMilli, TICK_FORMAT);
+    Timer2.setPreloadEnable(false);
     Timer2.attachInterrupt(TimerISR);
     Timer2.resume();
 }
 
+// micros() with interrupts masked: a SysTick that woke the core hasn't counted its ms yet
+uint32_t MaskedMicros()
+{
+    uint32_t now = micros();
+    if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) now += 1000;
+    return now;
+}
+
 void loop() {
-    if (TimerFlag) {
-        TimerFlag = false;
-        for (int i = 0; i < numTasks; i++)
-        {
-            if (tasks[i].elapsedTime >= tasks[i].period){
-                tasks[i].state = tasks[i].Function(tasks[i].state);
-                tasks[i].elapsedTime = 0;
-            }
-            tasks[i].elapsedTime += TICK;
-        }
-    }
-    if (Serial1.available()) {
-        String message = Serial1.readStringUntil('\n');
+    // background tasks, highest priority first
+    while (scheduler.runNext());
+
+    // never blocks, a frame is only returned once it is complete
+    char message[32];
+    if (espSerial.readFrame(message, sizeof(message))) {
         Handle_My_ESP(message);
-        Serial.print(message);
+        if (message[0] != 'L') Serial.println(message);  // log acks come 20 a second while replaying
+    }
+
+    // sleep until the next interrupt: the tick, a scan DMA half, UART DMA or the core's SysTick.
+    // Checked with interrupts masked, so a release can't land between the check and the WFI;
+    // a masked interrupt still wakes the core, and runs once they are unmasked.
+    noInterrupts();
+    if (!scheduler.hasPending() && !espSerial.hasUnread()) {
+        uint32_t start = MaskedMicros();
+        __DSB();
+        __WFI();
+        scheduler.addSleep(MaskedMicros() - start);
     }
+    interrupts();
 }
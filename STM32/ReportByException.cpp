@@ -0,0 +1,54 @@
+#include "ReportByException.h"
+#include <math.h>
+
+
+static bool _outside(float value, float last, float deadband) {
+    return fabsf(value - last) > deadband;
+}
+
+void ReportByException::begin(const TelemetryDeadbands& deadbands, unsigned long heartbeatWindows) {
+    _deadbands = deadbands;
+    setHeartbeat(heartbeatWindows);
+}
+
+void ReportByException::setDeadbands(const TelemetryDeadbands& deadbands) {
+    _deadbands = deadbands;
+    _primed = false;
+}
+
+void ReportByException::setHeartbeat(unsigned long heartbeatWindows) {
+    _heartbeat = heartbeatWindows;
+    _primed = false;
+}
+
+bool ReportByException::offer(Protocol::Telemetry& telemetry) {
+    _windows++;
+    bool send = _heartbeat == 0 || !_primed || _held + 1 >= _heartbeat || _changed(telemetry);
+    if (!send) {
+        _held++;
+        return false;
+    }
+
+    telemetry.held = _held > 0xFFFF ? 0xFFFF : _held;
+    _held = 0;
+    _last = telemetry;
+    _primed = true;
+    _frames++;
+    return true;
+}
+
+bool ReportByException::_changed(const Protocol::Telemetry& telemetry) {
+    if (telemetry.textStatus != 0 || telemetry.scanRate != _last.scanRate) return true;
+    for (size_t i = 0; i < telemetry.loadCount; i++) {
+        if (telemetry.status[i] != _last.status[i]) return true;
+        if (_outside(telemetry.voltage[i], _last.voltage[i], _deadbands.voltage) ||
+            _outside(telemetry.current[i], _last.current[i], _deadbands.current)) return true;
+    }
+    for (size_t i = 0; i < telemetry.thermistorCount; i++) {
+        if (_outside(telemetry.temperature[i], _last.temperature[i], _deadbands.temperature)) return true;
+    }
+    return _outside(telemetry.powerAvg, _last.powerAvg, _deadbands.power) ||
+           _outside(telemetry.powerMin, _last.powerMin, _deadbands.power) ||
+           _outside(telemetry.powerMax, _last.powerMax, _deadbands.power) ||
+           _outside(telemetry.powerStd, _last.powerStd, _deadbands.power);
+}
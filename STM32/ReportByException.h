@@ -0,0 +1,49 @@
+#pragma once
+
+#include "Arduino.h"
+#include "TelemetryProtocol.h"
+
+
+// How far each telemetry value may move from the last frame sent before a window goes out
+struct TelemetryDeadbands {
+    float voltage;          // V
+    float current;          // A
+    float temperature;      // F
+    float power;            // W, for the power average, min, max and deviation
+};
+
+
+// Report by exception for SendData. Every filter window is offered; one goes out when a value
+// has left its deadband around the last frame sent, a relay status or the scan rate changes, it carries a text
+// alert, or heartbeat windows have passed without a frame. The others are held back and
+// counted into the next frame's held field, so the receiver can fill them forward. Deadbands
+// compare against the last frame sent rather than the last window, so a slow drift still gets
+// out once it adds up. A heartbeat of 0 sends every window. The minute log flag alone does not
+// send a window, the record goes out on its own.
+class ReportByException {
+
+public:
+    void begin(const TelemetryDeadbands& deadbands, unsigned long heartbeatWindows);
+    void setHeartbeat(unsigned long heartbeatWindows);  // Next window always goes out
+    unsigned long getHeartbeat() { return _heartbeat; }
+    void setDeadbands(const TelemetryDeadbands& deadbands);  // Next window always goes out
+    const TelemetryDeadbands& getDeadbands() { return _deadbands; }
+
+    // True when telemetry should be sent, with its held field filled in
+    bool offer(Protocol::Telemetry& telemetry);
+
+    unsigned long getWindows() { return _windows; }
+    unsigned long getFrames() { return _frames; }
+
+private:
+    TelemetryDeadbands _deadbands = {};
+    unsigned long _heartbeat = 0;
+    Protocol::Telemetry _last = {};
+    bool _primed = false;       // _last holds a sent frame
+    unsigned long _held = 0;
+    unsigned long _windows = 0;
+    unsigned long _frames = 0;
+
+    bool _changed(const Protocol::Telemetry& telemetry);
+
+};
@@ -0,0 +1,271 @@
+#pragma once
+
+#include "Arduino.h"
+#include <limits.h>
+
+
+typedef int (*TaskFunction)(int);
+
+// One row of the task table. Periods and deadlines are in ms.
+struct TaskDescriptor {
+    const char* name;
+    TaskFunction function;
+    int initialState;
+    unsigned long period;
+    unsigned long deadline;   // From release to completion, background tasks only
+    uint8_t priority;         // 0 runs first
+    bool fromISR;             // Runs inside the tick interrupt instead of being deferred
+};
+
+
+// Per task execution time in DWT cycles, reset with resetProfile()
+struct TaskProfile {
+    uint32_t minCycles;
+    uint32_t maxCycles;
+    uint64_t totalCycles;
+    uint32_t runs;
+    uint32_t avgCycles() const { return runs ? totalCycles / runs : 0; }
+};
+
+
+// Cortex-M DWT cycle counter
+inline void cycleCounterBegin() {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+inline uint32_t cycleCount() {
+    return DWT->CYCCNT;
+}
+
+
+// Compile time helpers for a constexpr task table
+constexpr unsigned long schedulerGcd(unsigned long a, unsigned long b) {
+    return b == 0 ? a : schedulerGcd(b, a % b);
+}
+
+template <int N>
+constexpr unsigned long schedulerTick(const TaskDescriptor (&tasks)[N]) {
+    unsigned long tick = 0;
+    for (int i = 0; i < N; i++) tick = schedulerGcd(tasks[i].period, tick);
+    return tick;
+}
+
+template <int N>
+constexpr unsigned long schedulerHyperperiod(const TaskDescriptor (&tasks)[N]) {
+    unsigned long hyperperiod = 1;
+    for (int i = 0; i < N; i++) hyperperiod = hyperperiod / schedulerGcd(hyperperiod, tasks[i].period) * tasks[i].period;
+    return hyperperiod;
+}
+
+
+// Tick driven scheduler. tick() runs from the timer interrupt: it executes fromISR tasks on
+// the spot and marks due background tasks pending. runNext() runs from loop() and executes
+// the highest priority pending task, so a slow low priority task only delays tasks that are
+// released while it runs, and never the ISR tasks.
+// The timer doesn't have to interrupt on every tick: ticksUntilRelease() says how far it can
+// be stretched, and tick() is told how many ticks went by.
+// Every dispatch is timed with the DWT cycle counter: per task min/avg/max cycles and release
+// to start latency of background tasks. Ticks the timer interrupt missed and the time loop()
+// spent asleep, which gives the CPU load, are timed with micros(), which keeps counting while
+// the core sleeps. The tick interrupt, ISR tasks included, is timed in cycles as well and
+// reported as its own share of the load, and never counts as asleep: a sleep the tick cut short
+// can't take in the interrupt that ended it.
+template <int N>
+class Scheduler {
+
+public:
+    Scheduler(const TaskDescriptor (&tasks)[N], unsigned long tickMillis) {
+        _tasks = tasks;
+        _tickMillis = tickMillis;
+    }
+
+    void begin() {
+        cycleCounterBegin();
+        _ticks = 0;
+        _skippedTicks = 0;
+        _lastTickMicros = micros();
+        _tickMicros = 1000 * _tickMillis;
+        resetProfile();
+        for (int i = 0; i < N; i++) {
+            _runtime[i].state = _tasks[i].initialState;
+            _runtime[i].elapsed = _tasks[i].period;  // Release everything on the first tick
+            _runtime[i].pending = false;
+            _runtime[i].releaseTick = 0;
+            _runtime[i].overruns = 0;
+            _runtime[i].deadlineMisses = 0;
+        }
+    }
+
+    // ticks: how many ticks the timer interrupt was stretched over, at most ticksUntilRelease()
+    void tick(unsigned long ticks = 1) {
+        uint32_t now = cycleCount();
+        // An interrupt that arrives a whole tick late means ticks were lost
+        uint32_t nowMicros = micros();
+        uint32_t sinceLast = nowMicros - _lastTickMicros;
+        if (sinceLast > ticks * _tickMicros + _tickMicros / 2) _skippedTicks += sinceLast / _tickMicros - ticks;
+        _lastTickMicros = nowMicros;
+
+        _ticks += ticks;
+        for (int i = 0; i < N; i++) {
+            TaskRuntime& task = _runtime[i];
+            task.elapsed += (ticks - 1) * _tickMillis;  // The ticks nothing was due on
+            if (task.elapsed >= _tasks[i].period) {
+                task.elapsed = 0;
+                if (_tasks[i].fromISR) {
+                    uint32_t start = cycleCount();
+                    task.state = _tasks[i].function(task.state);
+                    _record(task.profile, cycleCount() - start);
+                } else if (task.pending) {
+                    task.overruns++;  // Previous release never got to run
+                } else {
+                    task.pending = true;
+                    task.releaseTick = _ticks;
+                    task.releaseCycle = now;
+                }
+            }
+            task.elapsed += _tickMillis;
+        }
+        _isrCycles += cycleCount() - now;
+    }
+
+    bool runNext() {
+        int next = -1;
+        noInterrupts();
+        for (int i = 0; i < N; i++) {
+            if (!_runtime[i].pending) continue;
+            if (next < 0 || _tasks[i].priority < _tasks[next].priority) next = i;
+        }
+        unsigned long releaseTick = 0;
+        uint32_t releaseCycle = 0;
+        if (next >= 0) {
+            _runtime[next].pending = false;
+            releaseTick = _runtime[next].releaseTick;
+            releaseCycle = _runtime[next].releaseCycle;
+        }
+        interrupts();
+        if (next < 0) return false;
+
+        uint32_t start = cycleCount();
+        if (start - releaseCycle > _maxLatencyCycles) _maxLatencyCycles = start - releaseCycle;
+        _runtime[next].state = _tasks[next].function(_runtime[next].state);
+        _record(_runtime[next].profile, cycleCount() - start);
+        if ((_ticks - releaseTick) * _tickMillis > _tasks[next].deadline) _runtime[next].deadlineMisses++;
+        return true;
+    }
+
+    // Ticks until the next task release, counting the one it happens on. Stretching the timer
+    // interrupt that far releases nothing late.
+    unsigned long ticksUntilRelease() {
+        unsigned long ticks = ULONG_MAX;
+        for (int i = 0; i < N; i++) {
+            unsigned long elapsed = _runtime[i].elapsed;
+            unsigned long period = _tasks[i].period;
+            unsigned long due = elapsed >= period ? 1 : (period - elapsed + _tickMillis - 1) / _tickMillis + 1;
+            if (due < ticks) ticks = due;
+        }
+        return ticks;
+    }
+
+    // loop() reports each sleep, from going to sleep to the interrupt that woke it
+    void addSleep(uint32_t micros) {
+        _sleepMicros += micros;
+        _sleeps++;
+    }
+
+    void resetProfile() {
+        noInterrupts();
+        for (int i = 0; i < N; i++) {
+            _runtime[i].profile.minCycles = UINT32_MAX;
+            _runtime[i].profile.maxCycles = 0;
+            _runtime[i].profile.totalCycles = 0;
+            _runtime[i].profile.runs = 0;
+        }
+        _maxLatencyCycles = 0;
+        _sleepMicros = 0;
+        _sleeps = 0;
+        _isrCycles = 0;
+        _profileStartMicros = micros();
+        interrupts();
+    }
+
+    // Since resetProfile(): percent of the time asleep, the rest as CPU load, the part of it in
+    // the tick interrupt, and wakeups
+    float getIdlePercent() {
+        uint32_t elapsed = micros() - _profileStartMicros;
+        if (elapsed == 0) return 0;
+        float idle = _sleepMicros >= elapsed ? 100 : 100.0f * _sleepMicros / elapsed;
+        float awake = 100 - getIsrLoad();
+        return idle < awake ? idle : awake;
+    }
+
+    float getCpuLoad() {
+        return 100 - getIdlePercent();
+    }
+
+    float getIsrLoad() {
+        uint32_t elapsed = micros() - _profileStartMicros;
+        if (elapsed == 0) return 0;
+        noInterrupts();
+        uint64_t cycles = _isrCycles;  // Two words, and the tick adds to it
+        interrupts();
+        float load = 100.0f * cycles / ((float) elapsed * (SystemCoreClock / 1000000));
+        return load < 100 ? load : 100;
+    }
+
+    float getWakeupRate() {
+        uint32_t elapsed = micros() - _profileStartMicros;
+        return elapsed ? _sleeps * 1e6f / elapsed : 0;
+    }
+
+    const TaskProfile& getProfile(int task) { return _runtime[task].profile; }
+    uint32_t getMaxLatencyCycles() { return _maxLatencyCycles; }
+    unsigned long getSkippedTicks() { return _skippedTicks; }
+
+    bool hasPending() {
+        for (int i = 0; i < N; i++) {
+            if (_runtime[i].pending) return true;
+        }
+        return false;
+    }
+
+    unsigned long getTicks() { return _ticks; }
+    unsigned long getOverruns(int task) { return _runtime[task].overruns; }
+    unsigned long getDeadlineMisses(int task) { return _runtime[task].deadlineMisses; }
+    const char* getName(int task) { return _tasks[task].name; }
+
+private:
+
+    struct TaskRuntime {
+        int state;
+        unsigned long elapsed;
+        volatile bool pending;
+        volatile unsigned long releaseTick;
+        volatile uint32_t releaseCycle;
+        volatile unsigned long overruns;
+        unsigned long deadlineMisses;
+        TaskProfile profile;
+    };
+
+    void _record(TaskProfile& profile, uint32_t cycles) {
+        if (cycles < profile.minCycles) profile.minCycles = cycles;
+        if (cycles > profile.maxCycles) profile.maxCycles = cycles;
+        profile.totalCycles += cycles;
+        profile.runs++;
+    }
+
+    const TaskDescriptor* _tasks;
+    unsigned long _tickMillis;
+    volatile unsigned long _ticks = 0;
+    volatile unsigned long _skippedTicks = 0;
+    uint32_t _lastTickMicros = 0;
+    uint32_t _tickMicros = 0;
+    uint32_t _maxLatencyCycles = 0;
+    uint32_t _sleepMicros = 0;
+    uint32_t _sleeps = 0;
+    uint64_t _isrCycles = 0;
+    uint32_t _profileStartMicros = 0;
+    TaskRuntime _runtime[N];
+
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+// Lock-free single producer / single consumer byte ring. The producer only writes _head and
+// the consumer only writes _tail, so one side may be an interrupt without any locking.
+// N must be a power of two; indexes run freely and are masked on access.
+template <uint32_t N>
+class SpscRing {
+
+    static_assert((N & (N - 1)) == 0, "SpscRing size must be a power of two");
+
+public:
+    // Producer side
+    size_t push(const uint8_t* data, size_t length) {
+        uint32_t head = _head;
+        uint32_t tail = __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+        size_t space = N - (head - tail);
+        if (length > space) length = space;
+        for (size_t i = 0; i < length; i++) {
+            _data[(head + i) & (N - 1)] = data[i];
+        }
+        __atomic_store_n(&_head, head + length, __ATOMIC_RELEASE);
+        return length;
+    }
+
+    bool push(uint8_t value) {
+        return push(&value, 1) == 1;
+    }
+
+    // Consumer side
+    size_t pop(uint8_t* data, size_t length) {
+        uint32_t tail = _tail;
+        uint32_t head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+        if (length > head - tail) length = head - tail;
+        for (size_t i = 0; i < length; i++) {
+            data[i] = _data[(tail + i) & (N - 1)];
+        }
+        __atomic_store_n(&_tail, tail + length, __ATOMIC_RELEASE);
+        return length;
+    }
+
+    bool pop(uint8_t& value) {
+        return pop(&value, 1) == 1;
+    }
+
+    // Longest run readable without wrapping, for handing straight to a DMA channel.
+    // The bytes stay owned by the consumer until consume() is called.
+    const uint8_t* peekContiguous(size_t& length) {
+        uint32_t tail = _tail;
+        uint32_t head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+        uint32_t offset = tail & (N - 1);
+        length = head - tail;
+        if (length > N - offset) length = N - offset;
+        return &_data[offset];
+    }
+
+    void consume(size_t length) {
+        __atomic_store_n(&_tail, _tail + length, __ATOMIC_RELEASE);
+    }
+
+    // Either side
+    size_t available() {
+        return __atomic_load_n(&_head, __ATOMIC_ACQUIRE) - __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+    }
+
+    size_t space() {
+        return N - available();
+    }
+
+private:
+    volatile uint32_t _head = 0;
+    volatile uint32_t _tail = 0;
+    uint8_t _data[N];
+
+};
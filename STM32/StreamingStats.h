@@ -0,0 +1,125 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+
+
+// Sliding window statistics over the last N values, every update O(1) (amortized for min/max).
+// Mean and variance come from running sums, min and max from monotonic queues of sample
+// numbers, and the EWMA runs over the whole stream rather than the window.
+template <typename T, int N>
+class StreamingStats {
+
+public:
+    StreamingStats(float ewmaAlpha = 0.1) {
+        _ewmaAlpha = ewmaAlpha;
+        reset();
+    }
+
+    void reset() {
+        _pushed = 0;
+        _count = 0;
+        _sum = 0;
+        _sumSquares = 0;
+        _ewma = 0;
+        _min.reset();
+        _max.reset();
+    }
+
+    void push(T value) {
+        uint32_t sample = _pushed;
+        int slot = sample % N;
+        _min.expire(sample);
+        _max.expire(sample);
+        if (_count == N) {
+            T expired = _values[slot];
+            _sum -= expired;
+            _sumSquares -= (double) expired * expired;
+        } else {
+            _count++;
+        }
+        _values[slot] = value;
+        _sum += value;
+        _sumSquares += (double) value * value;
+        _ewma = sample == 0 ? value : _ewma + _ewmaAlpha * (value - _ewma);
+        _min.push(_values, sample, value, false);
+        _max.push(_values, sample, value, true);
+        _pushed++;
+
+        // Resum once per lap so add/subtract rounding never accumulates
+        if (_pushed % N == 0) _resum();
+    }
+
+    int count() const { return _count; }
+    bool full() const { return _count == N; }
+    int capacity() const { return N; }
+
+    T latest() const { return _count ? _values[(_pushed - 1) % N] : 0; }
+    T min() const { return _count ? _values[_min.front() % N] : 0; }
+    T max() const { return _count ? _values[_max.front() % N] : 0; }
+    float ewma() const { return _ewma; }
+    void setEwmaAlpha(float alpha) { _ewmaAlpha = alpha; }
+
+    // Averages over the full window length, so a half filled window reads low like a zeroed buffer would
+    float windowMean() const { return _sum / N; }
+    float mean() const { return _count ? _sum / _count : 0; }
+
+    float variance() const {
+        if (_count < 2) return 0;
+        double mean = _sum / _count;
+        double variance = _sumSquares / _count - mean * mean;
+        return variance > 0 ? variance : 0;
+    }
+
+    float stddev() const { return sqrt(variance()); }
+
+private:
+
+    // Ring of sample numbers whose values are monotonic from front to back
+    struct MonotonicQueue {
+        uint32_t samples[N];
+        int front_;
+        int size;
+
+        void reset() { front_ = 0; size = 0; }
+        uint32_t front() const { return samples[front_]; }
+
+        void push(const T* values, uint32_t sample, T value, bool keepLargest) {
+            while (size > 0) {
+                T back = values[samples[(front_ + size - 1) % N] % N];
+                if (keepLargest ? back > value : back < value) break;
+                size--;
+            }
+            samples[(front_ + size) % N] = sample;
+            size++;
+        }
+
+        // Drops the sample that leaves the window when sample is pushed
+        void expire(uint32_t sample) {
+            if (size > 0 && sample - samples[front_] >= (uint32_t) N) {
+                front_ = (front_ + 1) % N;
+                size--;
+            }
+        }
+    };
+
+    T _values[N];
+    uint32_t _pushed;
+    int _count;
+    double _sum;
+    double _sumSquares;
+    float _ewma;
+    float _ewmaAlpha;
+    MonotonicQueue _min;
+    MonotonicQueue _max;
+
+    void _resum() {
+        _sum = 0;
+        _sumSquares = 0;
+        for (int i = 0; i < _count; i++) {
+            _sum += _values[i];
+            _sumSquares += (double) _values[i] * _values[i];
+        }
+    }
+
+};
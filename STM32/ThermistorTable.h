@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+
+
+// ADC count to Fahrenheit lookup for the thermistor divider, generated at compile time.
+// Matches HardwareAPI's exact math: Beta 3950, 10k at 25C, 10k fixed resistor, 12-bit ADC.
+// One entry every 16 counts, linearly interpolated; within 0.025F of the exact
+// formula between 0F and 200F, checked at every count by sim/test.cpp.
+namespace ThermistorTable {
+
+    constexpr int ADC_RANGE = 4095;
+    constexpr int STEP_SHIFT = 4;
+    constexpr int STEP = 1 << STEP_SHIFT;
+    constexpr int ENTRIES = (ADC_RANGE + 1) / STEP + 1;
+
+    constexpr double BETA = 3950;
+    constexpr double NOMINAL_RESISTANCE = 10000;
+    constexpr double NOMINAL_KELVIN = 298.15;
+    constexpr double DIVIDER_RESISTANCE = 10000;
+
+    // Natural log usable in constant expressions: range reduce to [1, 2), then atanh series
+    constexpr double ln(double x) {
+        int exponent = 0;
+        while (x >= 2.0) { x /= 2.0; exponent++; }
+        while (x < 1.0) { x *= 2.0; exponent--; }
+        double y = (x - 1.0) / (x + 1.0);
+        double y2 = y * y;
+        double term = y;
+        double sum = 0;
+        for (int n = 1; n < 41; n += 2) {
+            sum += term / n;
+            term *= y2;
+        }
+        return 2.0 * sum + exponent * 0.693147180559945309417;
+    }
+
+    constexpr double fahrenheit(int adcValue) {
+        // The end points are open or shorted thermistors, clamp to the last real reading
+        if (adcValue < 1) adcValue = 1;
+        if (adcValue > ADC_RANGE - 1) adcValue = ADC_RANGE - 1;
+        double resistance = DIVIDER_RESISTANCE * ((double) ADC_RANGE / adcValue - 1.0);
+        double kelvin = 1.0 / ((1.0 / NOMINAL_KELVIN) + (1.0 / BETA) * ln(resistance / NOMINAL_RESISTANCE));
+        return (kelvin - 273.15) * 9.0 / 5.0 + 32.0;
+    }
+
+    struct Table {
+        float values[ENTRIES];
+    };
+
+    constexpr Table build() {
+        Table table = {};
+        for (int i = 0; i < ENTRIES; i++) {
+            table.values[i] = (float) fahrenheit(i * STEP);
+        }
+        return table;
+    }
+
+    constexpr Table table = build();
+
+    inline float lookup(float adcValue) {
+        if (adcValue <= 0) return table.values[0];
+        if (adcValue >= ADC_RANGE) adcValue = ADC_RANGE;
+        float position = adcValue * (1.0f / STEP);
+        int index = (int) position;
+        float fraction = position - index;
+        return table.values[index] + (table.values[index + 1] - table.values[index]) * fraction;
+    }
+
+}
@@ -0,0 +1,200 @@
+#include "UartDriver.h"
+#include "stm32yyxx_ll_bus.h"
+#include "stm32yyxx_ll_dma.h"
+#include "stm32yyxx_ll_usart.h"
+
+
+// USART1 on DMA1: channel 4 for TX and channel 5 for RX, both on request 2
+static UartDriver* _txInstance = NULL;
+
+
+UartDriver::UartDriver(int rxPin, int txPin) {
+    _rxPin = rxPin;
+    _txPin = txPin;
+}
+
+bool UartDriver::begin(unsigned long baud) {
+    _txInstance = this;
+
+    LL_APB2_GRP1_EnableClock(LL_APB2_GRP1_PERIPH_USART1);
+    LL_AHB1_GRP1_EnableClock(LL_AHB1_GRP1_PERIPH_DMA1);
+    pinmap_pinout(digitalPinToPinName(_txPin), PinMap_UART_TX);
+    pinmap_pinout(digitalPinToPinName(_rxPin), PinMap_UART_RX);
+
+    // 8N1, DMA in both directions. Overrun detection is off so a late poll can never stall RX.
+    LL_USART_Disable(USART1);
+    LL_USART_SetTransferDirection(USART1, LL_USART_DIRECTION_TX_RX);
+    LL_USART_ConfigCharacter(USART1, LL_USART_DATAWIDTH_8B, LL_USART_PARITY_NONE, LL_USART_STOPBITS_1);
+    LL_USART_SetOverSampling(USART1, LL_USART_OVERSAMPLING_16);
+    LL_USART_SetBaudRate(USART1, HAL_RCC_GetPCLK2Freq(), LL_USART_OVERSAMPLING_16, baud);
+    LL_USART_DisableOverrunDetect(USART1);
+    LL_USART_EnableDMAReq_RX(USART1);
+    LL_USART_EnableDMAReq_TX(USART1);
+
+    // RX: circular, never stopped
+    LL_DMA_DisableChannel(DMA1, LL_DMA_CHANNEL_5);
+    LL_DMA_SetPeriphRequest(DMA1, LL_DMA_CHANNEL_5, LL_DMA_REQUEST_2);
+    LL_DMA_ConfigTransfer(DMA1, LL_DMA_CHANNEL_5,
+                          LL_DMA_DIRECTION_PERIPH_TO_MEMORY | LL_DMA_MODE_CIRCULAR |
+                          LL_DMA_PERIPH_NOINCREMENT | LL_DMA_MEMORY_INCREMENT |
+                          LL_DMA_PDATAALIGN_BYTE | LL_DMA_MDATAALIGN_BYTE |
+                          LL_DMA_PRIORITY_MEDIUM);
+    LL_DMA_ConfigAddresses(DMA1, LL_DMA_CHANNEL_5,
+                           LL_USART_DMA_GetRegAddr(USART1, LL_USART_DMA_REG_DATA_RECEIVE),
+                           (uint32_t) (uintptr_t) _rxDma, LL_DMA_DIRECTION_PERIPH_TO_MEMORY);
+    LL_DMA_SetDataLength(DMA1, LL_DMA_CHANNEL_5, RX_DMA_SIZE);
+    LL_DMA_EnableChannel(DMA1, LL_DMA_CHANNEL_5);
+    _rxDmaRead = 0;
+
+    // TX: one contiguous run of the ring per transfer, next run started from the interrupt
+    LL_DMA_DisableChannel(DMA1, LL_DMA_CHANNEL_4);
+    LL_DMA_SetPeriphRequest(DMA1, LL_DMA_CHANNEL_4, LL_DMA_REQUEST_2);
+    LL_DMA_ConfigTransfer(DMA1, LL_DMA_CHANNEL_4,
+                          LL_DMA_DIRECTION_MEMORY_TO_PERIPH | LL_DMA_MODE_NORMAL |
+                          LL_DMA_PERIPH_NOINCREMENT | LL_DMA_MEMORY_INCREMENT |
+                          LL_DMA_PDATAALIGN_BYTE | LL_DMA_MDATAALIGN_BYTE |
+                          LL_DMA_PRIORITY_LOW);
+    LL_DMA_SetPeriphAddress(DMA1, LL_DMA_CHANNEL_4,
+                            LL_USART_DMA_GetRegAddr(USART1, LL_USART_DMA_REG_DATA_TRANSMIT));
+    LL_DMA_EnableIT_TC(DMA1, LL_DMA_CHANNEL_4);
+    NVIC_SetPriority(DMA1_Channel4_IRQn, 2);
+    NVIC_EnableIRQ(DMA1_Channel4_IRQn);
+    _txBusy = false;
+
+    LL_USART_Enable(USART1);
+    while (!LL_USART_IsActiveFlag_TEACK(USART1) || !LL_USART_IsActiveFlag_REACK(USART1));
+    return true;
+}
+
+
+
+// Transmit
+
+size_t UartDriver::write(uint8_t value) {
+    return write(&value, 1);
+}
+
+size_t UartDriver::write(const uint8_t* data, size_t length) {
+    size_t queued = _tx.push(data, length);
+    if (queued < length) _txDropped += length - queued;
+
+    noInterrupts();
+    if (!_txBusy) _startTx();
+    interrupts();
+    return queued;
+}
+
+// Interrupts must be masked, or this must run from the DMA interrupt
+void UartDriver::_startTx() {
+    size_t length;
+    const uint8_t* run = _tx.peekContiguous(length);
+    if (length == 0) {
+        _txBusy = false;
+        return;
+    }
+
+    _txBusy = true;
+    _txRunLength = length;
+    LL_DMA_DisableChannel(DMA1, LL_DMA_CHANNEL_4);
+    LL_DMA_SetMemoryAddress(DMA1, LL_DMA_CHANNEL_4, (uint32_t) (uintptr_t) run);
+    LL_DMA_SetDataLength(DMA1, LL_DMA_CHANNEL_4, length);
+    LL_DMA_EnableChannel(DMA1, LL_DMA_CHANNEL_4);
+}
+
+void UartDriver::onTxComplete() {
+    _tx.consume(_txRunLength);
+    _startTx();
+}
+
+size_t UartDriver::getTxSpace() {
+    return _tx.space();
+}
+
+unsigned long UartDriver::getTxDropped() {
+    return _txDropped;
+}
+
+
+
+// Receive
+
+void UartDriver::poll() {
+    // The DMA write position follows from the remaining transfer count
+    uint32_t write = RX_DMA_SIZE - LL_DMA_GetDataLength(DMA1, LL_DMA_CHANNEL_5);
+    while (_rxDmaRead != write) {
+        uint32_t end = write > _rxDmaRead ? write : RX_DMA_SIZE;
+        size_t length = end - _rxDmaRead;
+        size_t pushed = _rx.push(&_rxDma[_rxDmaRead], length);
+        if (pushed < length) _rxDropped += length - pushed;
+        _rxDmaRead = end % RX_DMA_SIZE;
+    }
+}
+
+bool UartDriver::readFrame(char* buffer, size_t capacity) {
+    uint8_t c;
+    while (_rx.pop(c)) {
+        _lastRxMillis = millis();
+        if (c == '\n' || c == '\r') {
+            if (_finishFrame(buffer, capacity)) return true;
+            continue;
+        }
+        if (_frameLength < sizeof(_frame) - 1) {
+            _frame[_frameLength++] = c;
+        } else {
+            _frameOverflow = true;
+        }
+    }
+
+    // An idle line ends a frame that was sent without a newline
+    if (_frameLength > 0 && millis() - _lastRxMillis >= RX_IDLE_MILLIS) return _finishFrame(buffer, capacity);
+    return false;
+}
+
+bool UartDriver::_finishFrame(char* buffer, size_t capacity) {
+    size_t start = 0;
+    size_t end = _frameLength;
+    bool overflow = _frameOverflow;
+    _frameLength = 0;
+    _frameOverflow = false;
+
+    if (overflow) {
+        _rxDropped += end;
+        return false;
+    }
+
+    while (start < end && _frame[start] == ' ') start++;
+    while (end > start && _frame[end - 1] == ' ') end--;
+    if (start == end || capacity == 0) return false;
+
+    // A cut short command could still parse and run, so it goes whole or not at all
+    size_t length = end - start;
+    if (length > capacity - 1) {
+        _rxDropped += length;
+        return false;
+    }
+    memcpy(buffer, &_frame[start], length);
+    buffer[length] = '\0';
+    return true;
+}
+
+int UartDriver::available() {
+    return _rx.available() + _frameLength;
+}
+
+bool UartDriver::hasUnread() {
+    return _rx.available() > 0;
+}
+
+unsigned long UartDriver::getRxDropped() {
+    return _rxDropped;
+}
+
+
+
+// DMA transfer complete: the current TX run is out
+extern "C" void DMA1_Channel4_IRQHandler(void) {
+    if (LL_DMA_IsActiveFlag_TC4(DMA1)) {
+        LL_DMA_ClearFlag_TC4(DMA1);
+        if (_txInstance != NULL) _txInstance->onTxComplete();
+    }
+}
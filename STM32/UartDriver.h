@@ -0,0 +1,69 @@
+#pragma once
+
+#include "Arduino.h"
+#include "SpscRing.h"
+
+
+// Non-blocking USART1 driver for the ESP link.
+// TX: print()/write() copy into a ring and return at once; DMA drains the ring one contiguous
+// run at a time and the transfer complete interrupt starts the next run. A full ring drops
+// the bytes and counts them instead of waiting.
+// RX: DMA writes into a circular buffer; poll() runs from the tick interrupt and moves new
+// bytes into the receive ring, and readFrame() pulls complete frames out of it from loop().
+// A frame ends at a newline or when the line has been idle for RX_IDLE_MILLIS.
+class UartDriver : public Print {
+
+public:
+    static const uint32_t TX_RING_SIZE = 1024;  // A waveform chunk and a full diagnostics frame at once
+    static const uint32_t RX_RING_SIZE = 256;
+    static const uint32_t RX_DMA_SIZE = 128;
+    static const unsigned long RX_IDLE_MILLIS = 5;
+
+    UartDriver(int rxPin, int txPin);
+
+    bool begin(unsigned long baud);
+
+    // Print
+    size_t write(uint8_t value);
+    size_t write(const uint8_t* data, size_t length);
+    using Print::write;
+
+    // Service, from the tick interrupt
+    void poll();
+
+    // Frames, from loop(). Returns true with a trimmed, null terminated frame in buffer. A frame
+    // that doesn't fit buffer is dropped and counted like one that overflowed the driver.
+    bool readFrame(char* buffer, size_t capacity);
+    int available();
+    bool hasUnread();   // Bytes readFrame() hasn't looked at yet, not a part frame waiting for idle
+
+    size_t getTxSpace();    // Bytes write() can take now without dropping
+    unsigned long getTxDropped();
+    unsigned long getRxDropped();
+
+    // Called from the DMA interrupt
+    void onTxComplete();
+
+private:
+    int _rxPin;
+    int _txPin;
+
+    SpscRing<TX_RING_SIZE> _tx;
+    SpscRing<RX_RING_SIZE> _rx;
+    uint8_t _rxDma[RX_DMA_SIZE];
+    uint32_t _rxDmaRead = 0;
+
+    volatile bool _txBusy = false;
+    volatile size_t _txRunLength = 0;
+    volatile unsigned long _txDropped = 0;
+    volatile unsigned long _rxDropped = 0;
+
+    char _frame[64];
+    size_t _frameLength = 0;
+    bool _frameOverflow = false;
+    unsigned long _lastRxMillis = 0;
+
+    void _startTx();
+    bool _finishFrame(char* buffer, size_t capacity);
+
+};
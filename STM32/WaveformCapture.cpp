@@ -0,0 +1,168 @@
+#include "WaveformCapture.h"
+#include <string.h>
+
+
+void WaveformCapture::begin(unsigned long sampleRateHz) {
+    _sampleRate = sampleRateHz;
+    _write = 0;
+    _filled = 0;
+    _state = ARMED;
+}
+
+void WaveformCapture::setChannel(Channels::LoadChannel load, float zero, float ampsPerCount, float limit, float step) {
+    ChannelTrigger& trigger = _channels[load];
+    trigger.zero = zero;
+    trigger.ampsPerCount = ampsPerCount;
+    trigger.zeroCounts = (int32_t) (zero + 0.5f);
+    trigger.limit = (int32_t) limit;
+    trigger.step = (int32_t) step;
+}
+
+void WaveformCapture::trigger(uint8_t cause) {
+    _pendingCause = cause;
+}
+
+void WaveformCapture::push(const ScanFrame* frames, int count) {
+    // Triggers are still watched while frozen, to count the ones missed
+    int at = 0;
+    uint8_t cause = _pendingCause;
+    _pendingCause = 0;
+    uint8_t blockCause = _blockCause(frames, count, at);
+    if (cause == 0) cause = blockCause;
+    else at = 0;
+
+    int postFrom = 0;   // frames before the trigger frame of this block are still pre-trigger
+    if (cause != 0) {
+        if (_state == ARMED && _canTrigger()) {
+            _start(cause);
+            postFrom = at;
+        } else if (_state != TRIGGERED) {
+            _missed++;
+        }
+    }
+    if (_state == FROZEN) return;
+
+    for (int i = 0; i < count; i++) {
+        memcpy(_ring[_write], frames[i].current, sizeof(_ring[_write]));
+        _write = (_write + 1) % FRAMES;
+        if (_filled < FRAMES) _filled++;
+
+        if (_state == TRIGGERED && i >= postFrom && --_postLeft == 0) {
+            // Chunks that would start in frames the ring never held are skipped
+            _nextChunk = (FRAMES - _filled + CHUNK_FRAMES - 1) / CHUNK_FRAMES;
+            _state = FROZEN;
+            return;
+        }
+    }
+}
+
+void WaveformCapture::restart() {
+    if (_state != ARMED) return;    // A capture under way keeps its frames and waits for more
+    _filled = 0;
+    _restarted = true;
+    _rearmSteps();
+}
+
+bool WaveformCapture::takeChunk(Protocol::CaptureChunk& chunk, unsigned long now) {
+    if (__atomic_load_n(&_state, __ATOMIC_ACQUIRE) != FROZEN) return false;
+
+    // Frozen with the ring full, or at least its newest _filled frames, so the oldest frame is
+    // the next one to be written
+    uint32_t first = _nextChunk * CHUNK_FRAMES;
+    uint32_t count = FRAMES - first < CHUNK_FRAMES ? FRAMES - first : CHUNK_FRAMES;
+    chunk.id = _id;
+    chunk.cause = _cause;
+    chunk.index = _nextChunk;
+    chunk.chunks = CHUNKS;
+    chunk.sampleRate = _sampleRate;
+    chunk.preFrames = PRE_FRAMES;
+    chunk.frames = FRAMES;
+    chunk.ageMillis = now - _triggerMillis;
+    chunk.loadCount = CHANNELS;
+    for (size_t c = 0; c < CHANNELS; c++) {
+        chunk.zero[c] = _channels[c].zero;
+        chunk.ampsPerCount[c] = _channels[c].ampsPerCount;
+    }
+    chunk.frameCount = count;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t frame = (_write + first + i) % FRAMES;
+        memcpy(&chunk.counts[i * CHANNELS], _ring[frame], sizeof(_ring[frame]));
+    }
+
+    // Rearm once the last chunk is out, the ring refills its pre-trigger frames first
+    if (++_nextChunk == CHUNKS) {
+        _nextChunk = 0;
+        _filled = 0;
+        _rearmSteps();
+        __atomic_store_n(&_state, (uint8_t) ARMED, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+bool WaveformCapture::_canTrigger() {
+    if (_filled < PRE_FRAMES && !_restarted) return false;
+    return _captures == 0 || millis() - _triggerMillis >= HOLDOFF_MILLIS;
+}
+
+void WaveformCapture::_start(uint8_t cause) {
+    _state = TRIGGERED;
+    _postLeft = POST_FRAMES;
+    _restarted = false;
+    _cause = cause;
+    _id++;
+    _captures++;
+    _triggerMillis = millis();
+}
+
+// No step until a block has been seen again
+void WaveformCapture::_rearmSteps() {
+    for (size_t c = 0; c < CHANNELS; c++) _channels[c].lastCount = 0;
+}
+
+// A limit crossing before a step, at the frame it crossed on. Every load is looked at, so each
+// keeps its limit state and last block.
+uint8_t WaveformCapture::_blockCause(const ScanFrame* frames, int count, int& at) {
+    uint8_t cause = 0;
+    for (size_t c = 0; c < CHANNELS; c++) {
+        int channelAt = 0;
+        uint8_t channelCause = _channelCause(c, frames, count, channelAt);
+        if (channelCause == 0) continue;
+        if (cause == 0 || (Protocol::captureKind(channelCause) == Protocol::CAPTURE_LIMIT &&
+                           Protocol::captureKind(cause) != Protocol::CAPTURE_LIMIT)) {
+            cause = channelCause;
+            at = channelAt;
+        }
+    }
+    return cause;
+}
+
+uint8_t WaveformCapture::_channelCause(size_t load, const ScanFrame* frames, int count, int& at) {
+    ChannelTrigger& channel = _channels[load];
+    uint8_t cause = 0;
+    int32_t sum = 0;
+    for (int i = 0; i < count; i++) {
+        int32_t value = frames[i].current[load];
+        sum += value;
+        // An eighth of the limit as hysteresis, so noise around it is one crossing
+        int32_t distance = abs(value - channel.zeroCounts);
+        if (!channel.over && channel.limit > 0 && distance > channel.limit) {
+            channel.over = true;
+            if (cause == 0) {
+                cause = Protocol::captureCause(Protocol::CAPTURE_LIMIT, load);
+                at = i;
+            }
+        } else if (channel.over && distance <= channel.limit - channel.limit / 8) {
+            channel.over = false;
+        }
+    }
+
+    // Means compared without dividing: sum / count against lastSum / lastCount
+    if (cause == 0 && channel.step > 0 && channel.lastCount > 0 &&
+        abs(sum * channel.lastCount - channel.lastSum * count) > channel.step * count * channel.lastCount) {
+        cause = Protocol::captureCause(Protocol::CAPTURE_STEP, load);
+        at = 0;
+    }
+    channel.lastSum = sum;
+    channel.lastCount = count;
+    return cause;
+}
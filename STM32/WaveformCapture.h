@@ -0,0 +1,90 @@
+#pragma once
+
+#include "Arduino.h"
+#include "HardwareAPI.h"
+#include "TelemetryProtocol.h"
+
+
+// Raw current of every load around an event, at the full scan rate. Every scan block goes
+// through push() from the tick interrupt into a ring of FRAMES frames. A trigger lets another
+// POST_FRAMES frames in and then freezes the ring, so it holds PRE_FRAMES before the trigger
+// and the rest after. The frozen capture goes out a chunk at a time through takeChunk() and
+// the ring rearms once the last chunk has been taken; triggers while frozen, or within
+// HOLDOFF_MILLIS of the last capture, are counted and dropped.
+// Only full rate frames go into the ring. restart() drops what it holds when the scan slows, and
+// a trigger before PRE_FRAMES have come back in still starts a capture; its oldest chunks, the
+// frames it never had, are then not sent.
+// Triggers:
+//   relay    trigger(), on a relay change. The block being pushed can be up to a DMA half
+//            older than the switch, so the switch lands a few ms after the trigger point.
+//   step     the mean of one pushed block differs from the previous one by more than step,
+//            the dI/dt of a relay inrush or a stall
+//   limit    one sample further than limit from the zero, either way
+// Within a block a limit crossing wins over a step, and the first load in the list over later
+// ones.
+class WaveformCapture {
+
+public:
+    static const size_t CHANNELS = Channels::LOAD_COUNT;
+    static const uint32_t FRAMES = 2000;            // 200ms at 10khz, 4KB a load
+    static const uint32_t PRE_FRAMES = 500;
+    static const uint32_t POST_FRAMES = FRAMES - PRE_FRAMES;
+    static const uint32_t CHUNK_FRAMES = Protocol::CAPTURE_CHUNK_SAMPLES / CHANNELS;
+    static const uint32_t CHUNKS = (FRAMES + CHUNK_FRAMES - 1) / CHUNK_FRAMES;
+    static const unsigned long HOLDOFF_MILLIS = 10000;
+    static_assert(CHANNELS <= Protocol::MAX_LOADS, "every load fits a capture chunk");
+    static_assert(CHUNKS <= 255, "chunk index fits its byte");
+
+    void begin(unsigned long sampleRateHz);
+
+    // Zero and limits in ADC counts, a limit or step of 0 turns that trigger off
+    void setChannel(Channels::LoadChannel load, float zero, float ampsPerCount, float limit, float step);
+
+    // From the tick interrupt, cause from Protocol::captureCause()
+    void trigger(uint8_t cause);
+    void push(const ScanFrame* frames, int count);
+    void restart();
+
+    // From loop(). The next chunk of a frozen capture, false when there is none.
+    bool takeChunk(Protocol::CaptureChunk& chunk, unsigned long now);
+
+    unsigned long getCaptures() { return _captures; }
+    unsigned long getMissed() { return _missed; }
+
+private:
+    enum State : uint8_t {ARMED, TRIGGERED, FROZEN};
+
+    struct ChannelTrigger {
+        float zero = 0;
+        float ampsPerCount = 0;
+        int32_t zeroCounts = 0;
+        int32_t limit = 0;      // counts
+        int32_t step = 0;       // counts
+        bool over = false;      // past the limit, which fires on the crossing
+        int32_t lastSum = 0;    // previous block
+        int32_t lastCount = 0;  // 0 after a rearm, no step until a block has been seen
+    };
+
+    uint16_t _ring[FRAMES][CHANNELS];
+    uint32_t _write = 0;
+    uint32_t _filled = 0;
+    uint32_t _postLeft = 0;
+    bool _restarted = false;    // The ring lost frames to a rate change, trigger without PRE_FRAMES
+    volatile uint8_t _state = ARMED;
+    volatile uint8_t _pendingCause = 0;
+    uint8_t _cause = 0;
+    uint8_t _nextChunk = 0;
+    uint16_t _id = 0;
+    unsigned long _sampleRate = 0;
+    unsigned long _triggerMillis = 0;
+    unsigned long _captures = 0;
+    volatile unsigned long _missed = 0;
+    ChannelTrigger _channels[CHANNELS];
+
+    bool _canTrigger();
+    void _start(uint8_t cause);
+    void _rearmSteps();
+    uint8_t _blockCause(const ScanFrame* frames, int count, int& at);
+    uint8_t _channelCause(size_t load, const ScanFrame* frames, int count, int& at);
+
+};
@@ -0,0 +1,203 @@
+#include "Arduino.h"
+#include "Board.h"
+#include "Machine.h"
+
+
+HardwareSerial Serial;
+uint32_t SystemCoreClock = 80000000;
+bool serialQuiet = false;
+
+const int PinMap_ADC[] = {0};
+const int PinMap_UART_TX[] = {0};
+const int PinMap_UART_RX[] = {0};
+
+
+// Time
+
+unsigned long millis() {
+    return machine.now() / Machine::NANOS_PER_MILLI;
+}
+
+unsigned long micros() {
+    return machine.now() / 1000;
+}
+
+void delay(unsigned long ms) {
+    machine.runUntil(machine.now() + ms * Machine::NANOS_PER_MILLI, false);
+}
+
+void delayMicroseconds(unsigned long us) {
+    machine.runUntil(machine.now() + us * 1000ULL, false);
+}
+
+
+
+// GPIO and analog
+
+void pinMode(int pin, int mode) {
+    board.pinMode(pin, mode);
+}
+
+void digitalWrite(int pin, int value) {
+    board.digitalWrite(pin, value);
+}
+
+int digitalRead(int pin) {
+    return board.digitalRead(pin);
+}
+
+int analogRead(int pin) {
+    return board.convert(pin, machine.now());
+}
+
+void analogReadResolution(int) {}
+
+long random(long max) {
+    return max > 0 ? board.random() % max : 0;
+}
+
+long random(long min, long max) {
+    return max > min ? min + random(max - min) : min;
+}
+
+
+
+// Serial, one line at a time stamped with virtual seconds
+
+size_t HardwareSerial::write(uint8_t value) {
+    if (value == '\r') return 1;
+    if (value != '\n') {
+        _line += (char) value;
+        return 1;
+    }
+    if (!serialQuiet) printf("[%12.3f] %s\n", machine.now() / 1e9, _line.c_str());
+    _line.clear();
+    return 1;
+}
+
+
+
+// Core peripherals
+
+void NVIC_EnableIRQ(IRQn_Type irq) {
+    machine.enableIrq(irq, true);
+}
+
+void NVIC_DisableIRQ(IRQn_Type irq) {
+    machine.enableIrq(irq, false);
+}
+
+void NVIC_SetPriority(IRQn_Type, uint32_t) {}   // Handlers never preempt each other here
+
+uint32_t HAL_RCC_GetPCLK2Freq() {
+    return SystemCoreClock;
+}
+
+static DWT_Type _dwt;
+static CoreDebug_Type _coreDebug;
+static SCB_Type _scb;
+DWT_Type* const DWT = &_dwt;
+CoreDebug_Type* const CoreDebug = &_coreDebug;
+SCB_Type* const SCB = &_scb;
+
+// The core's SysTick keeps millis() going on the board and so ends any WFI within 1 ms.
+// Here millis() reads the virtual clock and the handler has nothing to do but wake the core.
+class SysTickDevice : public Device {
+public:
+    uint64_t nextEvent() { return _next; }
+    void run(uint64_t now) {
+        while (_next <= now) _next += 1000000;
+        machine.interrupt(NULL);
+    }
+private:
+    uint64_t _next = 1000000;
+};
+
+void interrupts() {
+    machine.unmask();
+}
+
+void __WFI() {
+    static bool attached = false;
+    if (!attached) {
+        machine.attach(new SysTickDevice());
+        attached = true;
+    }
+    machine.wfi();
+}
+
+static uint32_t _cycleOffset = 0;
+
+static uint32_t _cycles() {
+    uint64_t now = machine.now();
+    uint64_t perMicro = SystemCoreClock / 1000000;
+    return (uint32_t) (now / 1000 * perMicro + now % 1000 * perMicro / 1000);
+}
+
+SimCycleCounter::operator uint32_t() const {
+    return _cycles() - _cycleOffset;
+}
+
+SimCycleCounter& SimCycleCounter::operator=(uint32_t value) {
+    _cycleOffset = _cycles() - value;
+    return *this;
+}
+
+
+
+// HardwareTimer, driven by the machine through a small adapter
+
+class TimerDevice : public Device {
+public:
+    TimerDevice(HardwareTimer* timer) : _timer(timer) {}
+    uint64_t nextEvent() { return _timer->nextEvent(); }
+    void run(uint64_t now) { _timer->run(now); }
+private:
+    HardwareTimer* _timer;
+};
+
+HardwareTimer::HardwareTimer(TIM_TypeDef*) {}
+
+void HardwareTimer::setPrescaleFactor(uint32_t prescaler) {
+    _prescaler = prescaler ? prescaler : 1;
+}
+
+void HardwareTimer::setOverflow(uint32_t overflow, int format) {
+    if (format == MICROSEC_FORMAT) _periodNanos = overflow * 1000ULL;
+    else if (format == HERTZ_FORMAT) _periodNanos = overflow ? 1000000000ULL / overflow : 0;
+    else _periodNanos = (uint64_t) overflow * _prescaler * 1000000000ULL / SystemCoreClock;
+
+    // Without preload a new overflow applies to the period under way
+    if (_running && !_preload) _next = _periodStart + _periodNanos;
+}
+
+void HardwareTimer::attachInterrupt(callback_function_t callback) {
+    _callback = callback;
+}
+
+void HardwareTimer::resume() {
+    if (!_attached) {
+        machine.attach(new TimerDevice(this));
+        _attached = true;
+    }
+    _periodStart = machine.now();
+    _next = _periodStart + _periodNanos;
+    _running = _periodNanos > 0;
+}
+
+void HardwareTimer::pause() {
+    _running = false;
+}
+
+uint64_t HardwareTimer::nextEvent() const {
+    return _running ? _next : Machine::NEVER;
+}
+
+void HardwareTimer::run(uint64_t now) {
+    // Update events missed while the firmware held the CPU are lost, as on the hardware
+    while (_next <= now) {
+        _periodStart = _next;
+        _next += _periodNanos;
+    }
+    if (_callback != NULL) machine.interrupt(_callback);
+}
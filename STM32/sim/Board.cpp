@@ -0,0 +1,121 @@
+#include "Board.h"
+#include "Peripherals.h"
+#include "Plant.h"
+#include "Scenario.h"
+
+#include <math.h>
+
+
+Board board;
+
+// Sensor constants, matching the conversions in HardwareAPI
+static const float ADC_RANGE = 4095;
+static const float VCC = 3.3f;
+static const float THERMISTOR_BETA = 3950;
+static const float CURRENT_OFFSET_COUNTS = 1798;
+static const float FAN_VOLTS_PER_AMP = 0.185f * 0.51f / 2;
+static const float PELTIER_VOLTS_PER_AMP = 0.185f * 0.92f / 2;
+static const float INRUSH_NANOS = 20e6f;       // decay time constant
+
+
+static float _thermistorCounts(float fahrenheit) {
+    // 10k NTC to ground under a 10k pull-up
+    float kelvin = (fahrenheit - 32) * 5 / 9 + 273.15f;
+    float ratio = expf(THERMISTOR_BETA * (1 / kelvin - 1 / 298.15f));
+    return ADC_RANGE / (ratio + 1);
+}
+
+static float _currentCounts(float amps, float voltsPerAmp, float offset) {
+    return CURRENT_OFFSET_COUNTS + offset + amps * voltsPerAmp * ADC_RANGE / VCC;
+}
+
+uint16_t Board::convert(int channel, uint64_t at) {
+    float counts;
+    int signal;
+    if (channel == THERMISTOR_PIN) {
+        signal = TEMPERATURE;
+        // The exp() is the costly part of a conversion, reuse it while the temperature holds
+        float fahrenheit = plant.isEnabled() ? plant.getTemperature() : scenario.value(TEMPERATURE, at);
+        if (fahrenheit != _lastFahrenheit) {
+            _lastFahrenheit = fahrenheit;
+            _lastThermistorCounts = _thermistorCounts(fahrenheit);
+        }
+        counts = _lastThermistorCounts;
+    } else if (channel == FAN_CURRENT_PIN) {
+        signal = FAN_CURRENT;
+        counts = _currentCounts(_relayCurrent(FAN_RELAY_PIN, FAN_CURRENT, at), FAN_VOLTS_PER_AMP,
+                                scenario.value(SENSOR_OFFSET, at));
+    } else if (channel == PELTIER_CURRENT_PIN) {
+        signal = PELTIER_CURRENT;
+        counts = _currentCounts(_relayCurrent(PELTIER_RELAY_PIN, PELTIER_CURRENT, at), PELTIER_VOLTS_PER_AMP,
+                                scenario.value(SENSOR_OFFSET, at));
+    } else {
+        return 0;
+    }
+
+    float noise = scenario.getNoise(signal);
+    if (noise > 0) counts += noise * _gaussian();
+
+    if (counts < 0) return 0;
+    if (counts > ADC_RANGE) return ADC_RANGE;
+    return (uint16_t) (counts + 0.5f);
+}
+
+
+float Board::_relayCurrent(int pin, int signal, uint64_t at) {
+    if (!_level[pin]) return 0;
+    float amps = scenario.value(signal, at);
+    float inrush = scenario.value(INRUSH, at);
+    if (inrush > 0 && at >= _closedAt[pin]) amps *= 1 + inrush * expf(-(float) (at - _closedAt[pin]) / INRUSH_NANOS);
+    if (signal == FAN_CURRENT) {
+        float ripple = scenario.value(FAN_RIPPLE, at);
+        if (at > _rippleAt) {
+            _ripplePhase += scenario.value(FAN_RIPPLE_HZ, at) * ((at - _rippleAt) * 1e-9);
+            _ripplePhase -= floor(_ripplePhase);
+            _rippleAt = at;
+        }
+        if (ripple > 0) amps += ripple * sinf(6.28318531f * (float) _ripplePhase);
+    }
+    return amps;
+}
+
+
+
+// GPIO
+
+void Board::pinMode(int pin, int mode) {
+    if (pin >= 0 && pin < PIN_COUNT) _mode[pin] = mode;
+}
+
+void Board::digitalWrite(int pin, int value) {
+    if (pin < 0 || pin >= PIN_COUNT) return;
+    uint8_t level = value ? 1 : 0;
+    if (level == _level[pin]) return;
+    adcModel.invalidate(machine.now());    // Conversions before the switch saw the old level
+    _switches[pin]++;
+    if (level) _closedAt[pin] = machine.now();
+    _level[pin] = level;
+}
+
+int Board::digitalRead(int pin) {
+    return pin >= 0 && pin < PIN_COUNT ? _level[pin] : 0;
+}
+
+
+
+// Noise
+
+uint32_t Board::random() {
+    // xorshift32
+    _random ^= _random << 13;
+    _random ^= _random >> 17;
+    _random ^= _random << 5;
+    return _random;
+}
+
+float Board::_gaussian() {
+    // Sum of four uniforms, scaled to unit variance. Close enough for ADC noise and cheap.
+    float sum = 0;
+    for (int i = 0; i < 4; i++) sum += random() * (1.0f / 4294967296.0f);
+    return (sum - 2) * 1.7320508f;
+}
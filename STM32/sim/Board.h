@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+
+
+// Everything outside the MCU, wired as in RTOS.c: the thermistor divider on PA0, the fan and
+// peltier ACS712 current sensors on PA1 and PA4, and the relays on PB10 and PB4. An analog
+// pin's ADC channel is its pin number. Signals come from the scenario, or the thermistor from
+// the plant model when the scenario turns it on, and the current sensors only see current
+// while their relay is closed, plus any inrush since it closed and the fan's ripple.
+// Plain data only, so the firmware's static constructors can use it before main().
+class Board {
+
+public:
+    static const int THERMISTOR_PIN = 0;        // PA0
+    static const int FAN_CURRENT_PIN = 1;       // PA1
+    static const int PELTIER_CURRENT_PIN = 4;   // PA4
+    static const int FAN_RELAY_PIN = 26;        // PB10
+    static const int PELTIER_RELAY_PIN = 20;    // PB4
+    static const int PIN_COUNT = 32;
+
+    // Counts an ADC conversion of a channel returns at a time
+    uint16_t convert(int channel, uint64_t at);
+
+    void pinMode(int pin, int mode);
+    void digitalWrite(int pin, int value);
+    int digitalRead(int pin);
+
+    bool isFanOn() { return _level[FAN_RELAY_PIN]; }
+    bool isPeltierOn() { return _level[PELTIER_RELAY_PIN]; }
+    unsigned long getRelaySwitches(int pin) { return _switches[pin]; }
+
+    void seed(uint32_t seed) { _random = seed ? seed : 1; }
+    uint32_t random();
+
+private:
+    uint8_t _mode[PIN_COUNT];
+    uint8_t _level[PIN_COUNT];
+    unsigned long _switches[PIN_COUNT];
+    uint64_t _closedAt[PIN_COUNT];      // virtual ns
+    uint32_t _random = 1;
+    float _lastFahrenheit = -1000;
+    float _lastThermistorCounts = 0;
+    double _ripplePhase = 0;            // turns, integrated so a frequency ramp stays continuous
+    uint64_t _rippleAt = 0;
+
+    float _gaussian();
+    float _relayCurrent(int pin, int signal, uint64_t at);
+};
+
+extern Board board;
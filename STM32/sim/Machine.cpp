@@ -0,0 +1,140 @@
+#include "Machine.h"
+
+#include <time.h>
+
+
+Machine machine;
+
+static const uint64_t POLL_NANOS = 1000000;     // Host input checked every host ms
+static const uint64_t PACE_SLEEP_NANOS = 2000000;
+
+
+void Machine::attach(Device* device) {
+    _devices.push_back(device);
+}
+
+uint64_t Machine::_hostNanos() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t host = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (_hostStart == 0) _hostStart = host;
+    return host;
+}
+
+uint64_t Machine::hostElapsed() {
+    return _hostNanos() - _hostStart;
+}
+
+uint64_t Machine::now() {
+    if (_cpuScale > 0) {
+        uint64_t host = _hostNanos();
+        _now += (uint64_t) ((host - _hostMark) * _cpuScale);
+        _hostMark = host;
+    }
+    return _now;
+}
+
+void Machine::setSpeed(double speed) {
+    _speed = speed;
+}
+
+void Machine::setCpuScale(double scale) {
+    _cpuScale = scale;
+    _hostMark = _hostNanos();
+}
+
+
+
+// Event loop
+
+void Machine::_pollHost() {
+    uint64_t host = _hostNanos();
+    if (host - _lastPoll < POLL_NANOS) return;
+    _lastPoll = host;
+    for (Device* device : _devices) device->pollHost();
+}
+
+// Holds virtual time back to speed times host time. Returns true after a short sleep, so
+// the caller looks at the devices again in case host input arrived meanwhile.
+bool Machine::_pace(uint64_t until) {
+    uint64_t target = (uint64_t) (until / _speed);
+    uint64_t elapsed = hostElapsed();
+    if (elapsed >= target) return false;
+
+    uint64_t wait = target - elapsed;
+    if (wait > PACE_SLEEP_NANOS) wait = PACE_SLEEP_NANOS;
+    timespec ts = {(time_t) (wait / 1000000000ULL), (long) (wait % 1000000000ULL)};
+    nanosleep(&ts, NULL);
+    return true;
+}
+
+bool Machine::runUntil(uint64_t limit, bool stopAtInterrupt) {
+    now();
+    _interrupted = false;
+
+    while (true) {
+        _pollHost();
+
+        Device* next = NULL;
+        uint64_t at = NEVER;
+        for (Device* device : _devices) {
+            uint64_t event = device->nextEvent();
+            if (event < at) {
+                at = event;
+                next = device;
+            }
+        }
+
+        uint64_t until = at < limit ? at : limit;
+        if (_speed > 0 && _pace(until)) continue;
+        if (next == NULL || at > limit) break;
+
+        if (at > _now) _now = at;
+        if (_cpuScale > 0) _hostMark = _hostNanos();   // Only the firmware's share is charged
+        next->run(_now);
+        now();
+        if (stopAtInterrupt && _interrupted) return true;
+    }
+
+    if (limit > _now) _now = limit;
+    if (_cpuScale > 0) _hostMark = _hostNanos();
+    return false;
+}
+
+
+
+// Interrupts
+
+void Machine::setHandler(int irq, Handler handler) {
+    if (irq >= 0 && irq < IRQ_COUNT) _handlers[irq] = handler;
+}
+
+void Machine::enableIrq(int irq, bool enabled) {
+    if (irq >= 0 && irq < IRQ_COUNT) _enabled[irq] = enabled;
+}
+
+void Machine::raise(int irq) {
+    if (irq < 0 || irq >= IRQ_COUNT || !_enabled[irq] || _handlers[irq] == NULL) return;
+    interrupt(_handlers[irq]);
+}
+
+void Machine::interrupt(Handler handler) {
+    _interrupted = true;
+    if (handler == NULL) return;
+    if (_masked) _held.push_back(handler);
+    else handler();
+}
+
+bool Machine::wfi() {
+    _masked = true;
+    bool interrupted = idle(_end);
+    _masked = false;
+    return interrupted;
+}
+
+void Machine::unmask() {
+    // A handler may itself unmask, so take the list first
+    std::vector<Handler> held;
+    held.swap(_held);
+    for (Handler handler : held) handler();
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+
+// Something that acts at points in virtual time: a timer, a peripheral model, the scenario.
+// Times are virtual nanoseconds since reset.
+class Device {
+public:
+    virtual ~Device() {}
+    virtual uint64_t nextEvent() = 0;   // Machine::NEVER when nothing is due
+    virtual void run(uint64_t now) = 0;
+    virtual void pollHost() {}          // Host side input, about once per host millisecond
+};
+
+
+// Virtual clock and interrupt controller.
+// Firmware code takes no virtual time unless cpu scaling charges host time for it, and
+// interrupts are only delivered inside delay(), idle() and wfi(). The clock jumps from event to event, so a run is as fast as the host
+// allows and exactly repeatable for a given scenario and seed.
+class Machine {
+
+public:
+    static const uint64_t NEVER = UINT64_MAX;
+    static const uint64_t NANOS_PER_MILLI = 1000000;
+
+    void attach(Device* device);
+
+    uint64_t now();
+    uint64_t hostElapsed();     // Host ns since the first call
+
+    // Runs every event up to limit. With stopAtInterrupt it returns true as soon as an
+    // interrupt handler ran, otherwise the clock ends at limit.
+    bool runUntil(uint64_t limit, bool stopAtInterrupt);
+    bool idle(uint64_t limit) { return runUntil(limit, true); }
+
+    // The firmware's WFI, entered with interrupts masked: idle() until an interrupt, or the end
+    // of the run, and hold its handler until unmask(), which interrupts() calls
+    void setEnd(uint64_t end) { _end = end; }
+    bool wfi();
+    void unmask();
+
+    // The CPU is held, e.g. by a flash erase: time passes, nothing runs, and events that came
+    // due are handled late
+    void stall(uint64_t nanos) { now(); _now += nanos; }
+
+    // Interrupts, numbered as IRQn_Type
+    typedef void (*Handler)();
+    void setHandler(int irq, Handler handler);
+    void enableIrq(int irq, bool enabled);
+    void raise(int irq);        // Runs the handler now if the IRQ is enabled
+    void interrupt(Handler handler);    // An interrupt outside the NVIC, e.g. a timer callback
+
+    void setSpeed(double speed);        // Virtual seconds per host second, 0 is unpaced
+    void setCpuScale(double scale);     // Virtual ns charged per host ns of firmware code
+
+private:
+    static const int IRQ_COUNT = 96;
+
+    std::vector<Device*> _devices;
+    uint64_t _now = 0;
+    uint64_t _end = NEVER;
+    bool _interrupted = false;
+    bool _masked = false;
+    std::vector<Handler> _held;
+
+    Handler _handlers[IRQ_COUNT] = {};
+    bool _enabled[IRQ_COUNT] = {};
+
+    double _speed = 0;
+    double _cpuScale = 0;
+    uint64_t _hostStart = 0;
+    uint64_t _hostMark = 0;
+    uint64_t _lastPoll = 0;
+
+    uint64_t _hostNanos();
+    void _pollHost();
+    bool _pace(uint64_t until);
+};
+
+extern Machine machine;
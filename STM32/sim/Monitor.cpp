@@ -0,0 +1,261 @@
+#include "Monitor.h"
+#include "Machine.h"
+#include "Peripherals.h"
+#include "Scenario.h"
+#include <math.h>
+
+
+Monitor monitor;
+
+
+bool Monitor::openCsv(const char* path) {
+    _csv = fopen(path, "w");
+    if (_csv == NULL) return false;
+    fprintf(_csv, "time,seq,tick");
+    for (const Channels::Thermistor& thermistor : Channels::THERMISTORS) fprintf(_csv, ",%sTemperature", thermistor.name);
+    for (const Channels::Load& load : Channels::LOADS) fprintf(_csv, ",%sCurrent", load.name);
+    for (const Channels::Load& load : Channels::LOADS) fprintf(_csv, ",%sStatus", load.name);
+    fprintf(_csv, ",powerAvg,textStatus,held,scanRate\n");
+    return true;
+}
+
+bool Monitor::openCaptureCsv(const char* path) {
+    _captureCsv = fopen(path, "w");
+    if (_captureCsv == NULL) return false;
+    fprintf(_captureCsv, "capture,cause,ms");
+    for (const Channels::Load& load : Channels::LOADS) fprintf(_captureCsv, ",%sCurrent", load.name);
+    fprintf(_captureCsv, "\n");
+    return true;
+}
+
+void Monitor::push(const uint8_t* data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (_receiver.push(data[i])) _handleFrame();
+    }
+}
+
+void Monitor::_handleFrame() {
+    const Protocol::Header& header = _receiver.header();
+    const uint8_t* payload = _receiver.payload();
+    size_t length = _receiver.payloadLength();
+
+    switch (header.type) {
+        case Protocol::TELEMETRY: {
+            Protocol::Telemetry telemetry;
+            if (!Protocol::unpackTelemetry(payload, length, telemetry)) break;
+            if (_telemetryFrames++ == 0) {
+                _firstTelemetry = machine.now();
+                _firstTelemetryFrame = telemetry;
+            }
+            _lastTelemetryFrame = telemetry;
+            _lastTelemetry = machine.now();
+            if (telemetry.textStatus != 0) _textAlerts++;
+            float temperature = telemetry.temperature[Channels::BOX];
+            if (temperature < _minTemperature) _minTemperature = temperature;
+            if (temperature > _maxTemperature) _maxTemperature = temperature;
+            _lastTemperature = temperature;
+            _telemetryWindows += telemetry.held + 1;
+            if (telemetry.held > _maxHeld) _maxHeld = telemetry.held;
+            // a held window ran at the rate of the frame before it, a changed rate always goes out
+            _scanWindows[telemetry.scanRate] += 1;
+            _scanWindows[_lastScanRate] += telemetry.held;
+            if (_lastScanRate != 0 && telemetry.scanRate != _lastScanRate) _scanChanges++;
+            _lastScanRate = telemetry.scanRate;
+            if (_csv != NULL) {
+                fprintf(_csv, "%.3f,%u,%lu", machine.now() / 1e9, header.seq, (unsigned long) header.tick);
+                for (size_t i = 0; i < telemetry.thermistorCount; i++) fprintf(_csv, ",%.2f", telemetry.temperature[i]);
+                for (size_t i = 0; i < telemetry.loadCount; i++) fprintf(_csv, ",%.3f", telemetry.current[i]);
+                for (size_t i = 0; i < telemetry.loadCount; i++) fprintf(_csv, ",%d", telemetry.status[i]);
+                fprintf(_csv, ",%.2f,%d,%u,%u\n", telemetry.powerAvg, telemetry.textStatus, telemetry.held,
+                        telemetry.scanRate);
+            }
+            break;
+        }
+        case Protocol::DIAGNOSTICS: {
+            Protocol::Diagnostics& diagnostics = _lastDiagnostics;
+            if (!Protocol::unpackDiagnostics(payload, length, diagnostics)) break;
+            _diagnosticsFrames++;
+            if (diagnostics.cpuLoad > _maxCpuLoad) _maxCpuLoad = diagnostics.cpuLoad;
+            if (diagnostics.maxLatencyCycles > _maxLatencyCycles) _maxLatencyCycles = diagnostics.maxLatencyCycles;
+            for (int i = 0; i < diagnostics.taskCount && i < (int) Protocol::MAX_TASKS; i++) {
+                if (diagnostics.tasks[i].maxCycles > _maxTaskCycles[i]) _maxTaskCycles[i] = diagnostics.tasks[i].maxCycles;
+            }
+            break;
+        }
+        case Protocol::ACK:
+            _ackFrames++;
+            break;
+        case Protocol::RECORD: {
+            Protocol::Record record;
+            if (!Protocol::unpackRecord(payload, length, record)) break;
+            _recordFrames++;
+            if (_records.insert(record.seq).second && record.ageMillis > 120000) _replayedRecords++;
+            if (record.ageMillis != Protocol::UNKNOWN_AGE && record.ageMillis > _maxRecordAge) {
+                _maxRecordAge = record.ageMillis;
+            }
+            if (_ackRecords && scenario.value(LINK, machine.now()) >= 0.5f) {
+                char line[24];
+                int lineLength = snprintf(line, sizeof(line), "L,%lu\n", (unsigned long) record.seq);
+                uartModel.receive((const uint8_t*) line, lineLength);
+            }
+            break;
+        }
+        case Protocol::CAPTURE: {
+            static Protocol::CaptureChunk chunk;
+            if (!Protocol::unpackCaptureChunk(payload, length, chunk)) break;
+            _captureFrames++;
+            _addChunk(chunk);
+            break;
+        }
+        case Protocol::SPECTRUM: {
+            Protocol::Spectrum& spectrum = _lastSpectrum;
+            if (!Protocol::unpackSpectrum(payload, length, spectrum)) break;
+            _spectrumFrames++;
+            SpectrumCost& cost = _spectrumCosts[spectrum.blockSize];
+            cost.blocks++;
+            cost.cycles += spectrum.cycles;
+            if (spectrum.cycles > cost.maxCycles) cost.maxCycles = spectrum.cycles;
+            break;
+        }
+        default:
+            _otherFrames++;
+            break;
+    }
+}
+
+void Monitor::_addChunk(const Protocol::CaptureChunk& chunk) {
+    if (_captureOpen && chunk.id != _capture.first.id) _finishCapture();
+    if (!_captureOpen) {
+        _capture.first = chunk;
+        for (size_t c = 0; c < Protocol::MAX_LOADS; c++) _capture.amps[c].assign(c < chunk.loadCount ? chunk.frames : 0, NAN);
+        _capture.chunks = 0;
+        _captureOpen = true;
+    }
+    if (chunk.loadCount == 0 || chunk.loadCount != _capture.first.loadCount) return;
+    size_t first = (size_t) chunk.index * (Protocol::CAPTURE_CHUNK_SAMPLES / chunk.loadCount);
+    for (size_t i = 0; i < chunk.frameCount && first + i < chunk.frames; i++) {
+        for (size_t c = 0; c < chunk.loadCount; c++) {
+            _capture.amps[c][first + i] = (chunk.counts[i * chunk.loadCount + c] - chunk.zero[c]) * chunk.ampsPerCount[c];
+        }
+    }
+    _capture.chunks++;
+    if (chunk.index + 1 == chunk.chunks) _finishCapture();
+}
+
+void Monitor::_finishCapture() {
+    _captureOpen = false;
+    const Protocol::CaptureChunk& description = _capture.first;
+    _captures++;
+    if (_capture.chunks < description.chunks) _incompleteCaptures++;
+    uint8_t kind = Protocol::captureKind(description.cause);
+    uint8_t load = Protocol::captureLoad(description.cause);
+    if (kind < 4 && load < Protocol::MAX_LOADS) _capturesByCause[kind][load]++;
+    for (size_t i = 0; i < description.frames; i++) {
+        for (size_t c = 0; c < description.loadCount; c++) {
+            if (_capture.amps[c][i] > _maxInrush[c]) _maxInrush[c] = _capture.amps[c][i];
+        }
+        if (_captureCsv != NULL) {
+            double ms = ((double) i - description.preFrames) * 1000.0 / description.sampleRate;
+            fprintf(_captureCsv, "%u,%u,%.2f", description.id, description.cause, ms);
+            for (size_t c = 0; c < description.loadCount; c++) fprintf(_captureCsv, ",%.3f", _capture.amps[c][i]);
+            fprintf(_captureCsv, "\n");
+        }
+    }
+}
+
+void Monitor::report(FILE* out) {
+    if (_csv != NULL) fclose(_csv);
+    _csv = NULL;
+    if (_captureOpen) _finishCapture();
+    if (_captureCsv != NULL) fclose(_captureCsv);
+    _captureCsv = NULL;
+
+    fprintf(out, "frames: %lu telemetry, %lu diagnostics, %lu acks, %lu records, %lu captures, %lu spectra, "
+            "%lu other\n", _telemetryFrames, _diagnosticsFrames, _ackFrames, _recordFrames, _captureFrames,
+            _spectrumFrames, _otherFrames);
+    fprintf(out, "link: %lu lost, %lu crc errors, %lu framing errors, %lu restarts\n",
+            (unsigned long) _receiver.lostFrames(), (unsigned long) _receiver.crcErrors(),
+            (unsigned long) _receiver.framingErrors(), (unsigned long) _receiver.restarts());
+    if (_telemetryFrames > 0) {
+        fprintf(out, "temperature: %.2f F last, %.2f to %.2f F, %lu text alerts\n",
+                _lastTemperature, _minTemperature, _maxTemperature, _textAlerts);
+        fprintf(out, "boot: first telemetry at %.1f ms\n", _firstTelemetry / 1e6);
+        fprintf(out, "telemetry: %lu frames for %lu windows, %.1f:1, at most %lu held in a row\n", _telemetryFrames,
+                _telemetryWindows, (double) _telemetryWindows / _telemetryFrames, _maxHeld);
+        fprintf(out, "scan:");
+        for (auto it = _scanWindows.rbegin(); it != _scanWindows.rend(); ++it) {
+            if (it->second > 0) fprintf(out, " %u hz for %lu windows,", it->first, it->second);
+        }
+        fprintf(out, " %lu changes\n", _scanChanges);
+        const Protocol::Telemetry& first = _firstTelemetryFrame;
+        const Protocol::Telemetry& last = _lastTelemetryFrame;
+        fprintf(out, "energy:");
+        for (size_t i = 0; i < last.loadCount && i < Channels::LOAD_COUNT; i++) {
+            fprintf(out, "%s %s %lu C %lu J", i ? "," : "", Channels::LOADS[i].name, (unsigned long) last.coulombs[i],
+                    (unsigned long) last.joules[i]);
+        }
+        fprintf(out, " at %.1f s; this run", _lastTelemetry / 1e9);
+        for (size_t i = 0; i < last.loadCount && i < Channels::LOAD_COUNT; i++) {
+            fprintf(out, "%s %lu J %s", i ? "," : "", (unsigned long) (last.joules[i] - first.joules[i]),
+                    Channels::LOADS[i].name);
+        }
+        fprintf(out, "\n");
+    }
+    if (_recordFrames > 0) {
+        uint32_t span = *_records.rbegin() - *_records.begin() + 1;
+        fprintf(out, "log: %lu records, seq %lu to %lu, %lu missing, %lu resent, %lu replayed late, "
+                "%.1f min max age\n", (unsigned long) _records.size(), (unsigned long) *_records.begin(),
+                (unsigned long) *_records.rbegin(), (unsigned long) (span - _records.size()),
+                _recordFrames - (unsigned long) _records.size(), _replayedRecords, _maxRecordAge / 60000.0);
+    }
+    if (_captures > 0) {
+        // relay 3/1, step 0/2, limit 1/0 fan/peltier, counts in load order
+        static const char* const kinds[] = {"relay", "step", "limit"};
+        fprintf(out, "captures: %lu received, %lu incomplete;", _captures, _incompleteCaptures);
+        for (int kind = Protocol::CAPTURE_RELAY; kind <= Protocol::CAPTURE_LIMIT; kind++) {
+            fprintf(out, "%s %s ", kind == Protocol::CAPTURE_RELAY ? "" : ",", kinds[kind - 1]);
+            for (size_t i = 0; i < Channels::LOAD_COUNT; i++) fprintf(out, "%s%lu", i ? "/" : "", _capturesByCause[kind][i]);
+        }
+        for (size_t i = 0; i < Channels::LOAD_COUNT; i++) fprintf(out, "%s%s", i ? "/" : " ", Channels::LOADS[i].name);
+        fprintf(out, ";");
+        for (size_t i = 0; i < Channels::LOAD_COUNT; i++) {
+            fprintf(out, "%s %.2f A %s", i ? "," : "", _maxInrush[i], Channels::LOADS[i].name);
+        }
+        fprintf(out, " peak\n");
+    }
+    if (_spectrumFrames > 0) {
+        const Protocol::Spectrum& spectrum = _lastSpectrum;
+        fprintf(out, "spectrum: last %.1f Hz, %u rpm, %.3f A, %.4f A ripple; bands", spectrum.dominantHz,
+                spectrum.rpm, spectrum.current, spectrum.rippleRms);
+        for (size_t i = 0; i < Protocol::SPECTRUM_BANDS; i++) {
+            fprintf(out, " %u-%u Hz %.4f,", Protocol::SPECTRUM_BAND_HZ[i], Protocol::SPECTRUM_BAND_HZ[i + 1],
+                    spectrum.bands[i]);
+        }
+        fprintf(out, " A\n");
+        for (auto& size : _spectrumCosts) {
+            fprintf(out, "spectrum %u: %lu blocks, %lu avg %lu max cycles\n", size.first, size.second.blocks,
+                    (unsigned long) (size.second.cycles / size.second.blocks), (unsigned long) size.second.maxCycles);
+        }
+    }
+    if (_diagnosticsFrames == 0) return;
+
+    const Protocol::Diagnostics& diagnostics = _lastDiagnostics;
+    fprintf(out, "scheduler: %.2f%% max load, %.2f%% in the tick interrupt, %lu skipped ticks, "
+            "%lu max latency cycles, %lu dropped windows, %lu scan overruns, uart %lu/%lu tx/rx dropped\n",
+            _maxCpuLoad, diagnostics.isrLoad, (unsigned long) diagnostics.skippedTicks, (unsigned long) _maxLatencyCycles,
+            (unsigned long) diagnostics.droppedWindows, (unsigned long) diagnostics.scanOverruns,
+            (unsigned long) diagnostics.uartTxDropped, (unsigned long) diagnostics.uartRxDropped);
+    fprintf(out, "power: %.2f%% idle, %.2f mA MCU, %.0f wakeups/s\n", diagnostics.idlePercent,
+            diagnostics.mcuCurrent, diagnostics.wakeupRate);
+    fprintf(out, "flash log: %u records not acked, %lu overwritten\n", diagnostics.logBacklog,
+            (unsigned long) diagnostics.logOverwritten);
+    fprintf(out, "capture: %u triggered, %u missed\n", diagnostics.captures, diagnostics.capturesMissed);
+    fprintf(out, "overcurrent: %u trips, last %.2f us from the sample to the relay pins\n", diagnostics.trips,
+            diagnostics.tripLatency);
+    fprintf(out, "%-8s %10s %10s %10s %8s %8s\n", "task", "avg", "last max", "run max", "misses", "overruns");
+    for (int i = 0; i < diagnostics.taskCount && i < (int) Protocol::MAX_TASKS; i++) {
+        const Protocol::TaskDiagnostics& task = diagnostics.tasks[i];
+        fprintf(out, "%-8s %10lu %10lu %10lu %8u %8u\n", task.name, (unsigned long) task.avgCycles,
+                (unsigned long) task.maxCycles, (unsigned long) _maxTaskCycles[i], task.deadlineMisses, task.overruns);
+    }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "Channels.h"
+#include "TelemetryProtocol.h"
+#include <stdio.h>
+#include <map>
+#include <set>
+#include <vector>
+
+
+// The ESP's view of the link: decodes every frame the firmware transmits, keeps what the
+// end of run report needs and optionally writes the telemetry to a CSV file. Flash log records
+// are acked back as the ESP and the server would, while the scenario's link signal is up.
+// Waveform captures are put back together from their chunks and optionally written out, and
+// fan spectrum features are kept per block size for their analysis cost. Channels are reported
+// under their names in Channels.h, which the firmware was built with.
+class Monitor {
+
+public:
+    bool openCsv(const char* path);
+    bool openCaptureCsv(const char* path);
+    void push(const uint8_t* data, size_t length);
+    void report(FILE* out);
+    void setAckRecords(bool ack) { _ackRecords = ack; }    // Off when a real ESP is on the pty
+
+private:
+    Protocol::FrameReceiver _receiver;
+    FILE* _csv = NULL;
+
+    unsigned long _telemetryFrames = 0;
+    unsigned long _diagnosticsFrames = 0;
+    unsigned long _ackFrames = 0;
+    unsigned long _recordFrames = 0;
+    unsigned long _captureFrames = 0;
+    unsigned long _spectrumFrames = 0;
+    unsigned long _otherFrames = 0;
+    unsigned long _textAlerts = 0;
+    unsigned long _telemetryWindows = 0;    // windows the telemetry frames stand for, held ones included
+    unsigned long _maxHeld = 0;
+    std::map<uint16_t, unsigned long> _scanWindows;    // windows at each scan rate, by hz
+    unsigned long _scanChanges = 0;
+    uint16_t _lastScanRate = 0;
+    Protocol::Telemetry _firstTelemetryFrame = {};
+    Protocol::Telemetry _lastTelemetryFrame = {};
+    uint64_t _lastTelemetry = 0;
+    uint64_t _firstTelemetry = 0;   // virtual ns, boot to the first valid sample
+
+    float _minTemperature = 1e9f;       // F, the box thermistor
+    float _maxTemperature = -1e9f;
+    float _lastTemperature = 0;
+
+    float _maxCpuLoad = 0;
+    uint32_t _maxLatencyCycles = 0;
+    uint32_t _maxTaskCycles[Protocol::MAX_TASKS] = {};
+    Protocol::Diagnostics _lastDiagnostics = {};
+
+    bool _ackRecords = true;
+    std::set<uint32_t> _records;        // seq of every record received
+    unsigned long _replayedRecords = 0; // received over two log periods late
+    uint32_t _maxRecordAge = 0;         // ms
+
+    struct Capture {
+        Protocol::CaptureChunk first;   // description, from the first chunk seen
+        std::vector<float> amps[Protocol::MAX_LOADS];  // NAN where a chunk is missing
+        unsigned long chunks = 0;
+    };
+    Capture _capture;
+    bool _captureOpen = false;
+    FILE* _captureCsv = NULL;
+    unsigned long _captures = 0;
+    unsigned long _incompleteCaptures = 0;
+    unsigned long _capturesByCause[4][Protocol::MAX_LOADS] = {};   // by kind and load
+    float _maxInrush[Protocol::MAX_LOADS] = {};     // A, largest sample of any capture
+
+    struct SpectrumCost {
+        unsigned long blocks = 0;
+        uint64_t cycles = 0;
+        uint32_t maxCycles = 0;
+    };
+    Protocol::Spectrum _lastSpectrum = {};
+    std::map<uint16_t, SpectrumCost> _spectrumCosts;   // by block size
+
+    void _handleFrame();
+    void _addChunk(const Protocol::CaptureChunk& chunk);
+    void _finishCapture();
+};
+
+extern Monitor monitor;
@@ -0,0 +1,846 @@
+#include "Peripherals.h"
+#include "Board.h"
+#include "stm32yyxx_ll_adc.h"
+#include "stm32yyxx_ll_dma.h"
+#include "stm32yyxx_ll_gpio.h"
+#include "stm32yyxx_ll_rtc.h"
+#include "stm32yyxx_ll_tim.h"
+#include "stm32yyxx_ll_usart.h"
+#include "stm32_eeprom.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <termios.h>
+#include <unistd.h>
+
+
+AdcModel adcModel;
+UartModel uartModel;
+FlashModel flashModel;
+FlashBankModel flashBankModel;
+BackupModel backupModel;
+
+
+// Register state of each modelled peripheral
+
+struct TIM_TypeDef {
+    uint32_t prescaler;
+    uint32_t autoReload;
+    uint32_t triggerOutput;
+    bool enabled;
+};
+
+struct ADC_TypeDef {
+    bool enabled;
+    bool converting;
+    uint32_t triggerSource;
+    uint32_t dmaTransfer;
+    uint32_t sequenceLength;
+    uint32_t ranks[16];
+    uint16_t data;
+    uint32_t watchdogChannels[3];   // AWD1-3, a bit per channel
+    uint32_t watchdogHigh[3];
+    uint32_t watchdogLow[3];
+    bool watchdogInterrupt[3];
+    bool watchdogFlag[3];
+};
+
+struct DMA_Channel {
+    uint32_t config;        // CCR bits as set by LL_DMA_ConfigTransfer
+    uint32_t periphAddress;
+    uint32_t memoryAddress;
+    uint32_t request;
+    uint32_t length;        // CNDTR
+    uint32_t reload;        // Length as programmed, for circular mode
+    bool enabled;
+    bool htInterrupt;
+    bool tcInterrupt;
+    bool htFlag;
+    bool tcFlag;
+};
+
+struct DMA_TypeDef {
+    DMA_Channel channels[8];    // 1-7, index 0 unused
+};
+
+struct GPIO_TypeDef {
+    int firstPin;
+};
+
+struct USART_TypeDef {
+    bool enabled;
+    bool dmaTx;
+    bool dmaRx;
+    uint32_t baud;
+};
+
+struct RTC_TypeDef {
+    int unused;
+};
+
+static TIM_TypeDef _tim2, _tim6;
+static ADC_TypeDef _adc1;
+static DMA_TypeDef _dma1;
+static USART_TypeDef _usart1;
+static RTC_TypeDef _rtc;
+static GPIO_TypeDef _gpioa = {PA0}, _gpiob = {PB0};
+
+TIM_TypeDef* const TIM2 = &_tim2;
+TIM_TypeDef* const TIM6 = &_tim6;
+ADC_TypeDef* const ADC1 = &_adc1;
+DMA_TypeDef* const DMA1 = &_dma1;
+USART_TypeDef* const USART1 = &_usart1;
+RTC_TypeDef* const RTC = &_rtc;
+
+// Channel interrupt numbers, DMA1 channel n is IRQ 10 + n
+static int _dmaIrq(uint32_t channel) {
+    return 10 + channel;
+}
+
+// Default handlers for channels the firmware does not service
+extern "C" __attribute__((weak)) void ADC1_2_IRQHandler(void) {}
+extern "C" __attribute__((weak)) void DMA1_Channel1_IRQHandler(void) {}
+extern "C" __attribute__((weak)) void DMA1_Channel4_IRQHandler(void) {}
+extern "C" __attribute__((weak)) void DMA1_Channel5_IRQHandler(void) {}
+
+
+
+// DMA
+
+// One peripheral to memory transfer. Raises the channel interrupt for a newly set flag.
+static void _dmaStore(uint32_t channelNumber, uint32_t value) {
+    DMA_Channel& channel = DMA1->channels[channelNumber];
+    if (!channel.enabled || channel.length == 0) return;
+
+    uint32_t size = 1 << ((channel.config >> 10) & 3);
+    uint32_t index = (channel.config & LL_DMA_MEMORY_INCREMENT) ? channel.reload - channel.length : 0;
+    memcpy((uint8_t*) (uintptr_t) channel.memoryAddress + index * size, &value, size);  // Both little endian
+
+    bool raise = false;
+    channel.length--;
+    if (channel.length == channel.reload / 2) {
+        channel.htFlag = true;
+        raise |= channel.htInterrupt;
+    }
+    if (channel.length == 0) {
+        channel.tcFlag = true;
+        raise |= channel.tcInterrupt;
+        if (channel.config & LL_DMA_MODE_CIRCULAR) channel.length = channel.reload;
+    }
+    if (raise) machine.raise(_dmaIrq(channelNumber));
+}
+
+static bool _channelValid(uint32_t channel) {
+    return channel >= 1 && channel <= 7;
+}
+
+void LL_DMA_EnableChannel(DMA_TypeDef* dma, uint32_t channel) {
+    if (!_channelValid(channel)) return;
+    if (channel == LL_DMA_CHANNEL_1) adcModel.invalidate(machine.now());
+    dma->channels[channel].enabled = true;
+    if (channel == LL_DMA_CHANNEL_4) uartModel.startTx(machine.now());
+}
+
+void LL_DMA_DisableChannel(DMA_TypeDef* dma, uint32_t channel) {
+    if (!_channelValid(channel)) return;
+    if (channel == LL_DMA_CHANNEL_1) adcModel.invalidate(machine.now());
+    dma->channels[channel].enabled = false;
+}
+
+void LL_DMA_ConfigTransfer(DMA_TypeDef* dma, uint32_t channel, uint32_t configuration) {
+    if (_channelValid(channel)) dma->channels[channel].config = configuration;
+}
+
+void LL_DMA_ConfigAddresses(DMA_TypeDef* dma, uint32_t channel, uint32_t source, uint32_t destination, uint32_t direction) {
+    if (!_channelValid(channel)) return;
+    bool toMemory = direction == LL_DMA_DIRECTION_PERIPH_TO_MEMORY;
+    dma->channels[channel].periphAddress = toMemory ? source : destination;
+    dma->channels[channel].memoryAddress = toMemory ? destination : source;
+}
+
+void LL_DMA_SetMemoryAddress(DMA_TypeDef* dma, uint32_t channel, uint32_t address) {
+    if (_channelValid(channel)) dma->channels[channel].memoryAddress = address;
+}
+
+void LL_DMA_SetPeriphAddress(DMA_TypeDef* dma, uint32_t channel, uint32_t address) {
+    if (_channelValid(channel)) dma->channels[channel].periphAddress = address;
+}
+
+void LL_DMA_SetPeriphRequest(DMA_TypeDef* dma, uint32_t channel, uint32_t request) {
+    if (_channelValid(channel)) dma->channels[channel].request = request;
+}
+
+void LL_DMA_SetDataLength(DMA_TypeDef* dma, uint32_t channel, uint32_t length) {
+    if (!_channelValid(channel)) return;
+    dma->channels[channel].length = length;
+    dma->channels[channel].reload = length;
+}
+
+uint32_t LL_DMA_GetDataLength(DMA_TypeDef* dma, uint32_t channel) {
+    if (dma == DMA1 && channel == LL_DMA_CHANNEL_1) adcModel.catchUp(machine.now());   // Conversions are batched
+    return _channelValid(channel) ? dma->channels[channel].length : 0;
+}
+
+void LL_DMA_EnableIT_HT(DMA_TypeDef* dma, uint32_t channel) {
+    if (_channelValid(channel)) dma->channels[channel].htInterrupt = true;
+}
+
+void LL_DMA_EnableIT_TC(DMA_TypeDef* dma, uint32_t channel) {
+    if (_channelValid(channel)) dma->channels[channel].tcInterrupt = true;
+}
+
+uint32_t LL_DMA_IsActiveFlag_HT(DMA_TypeDef* dma, uint32_t channel) {
+    return _channelValid(channel) && dma->channels[channel].htFlag;
+}
+
+uint32_t LL_DMA_IsActiveFlag_TC(DMA_TypeDef* dma, uint32_t channel) {
+    return _channelValid(channel) && dma->channels[channel].tcFlag;
+}
+
+void LL_DMA_ClearFlag_HT(DMA_TypeDef* dma, uint32_t channel) {
+    if (_channelValid(channel)) dma->channels[channel].htFlag = false;
+}
+
+void LL_DMA_ClearFlag_TC(DMA_TypeDef* dma, uint32_t channel) {
+    if (_channelValid(channel)) dma->channels[channel].tcFlag = false;
+}
+
+
+
+// TIM6
+
+void LL_TIM_EnableCounter(TIM_TypeDef* tim) {
+    if (tim->enabled) return;
+    tim->enabled = true;
+    if (tim == TIM6) adcModel.startTimer(machine.now());
+}
+
+void LL_TIM_DisableCounter(TIM_TypeDef* tim) {
+    if (tim == TIM6) adcModel.invalidate(machine.now());
+    tim->enabled = false;
+}
+
+void LL_TIM_SetPrescaler(TIM_TypeDef* tim, uint32_t prescaler) {
+    tim->prescaler = prescaler;
+}
+
+// ARR is always preloaded here, as HardwareAPI runs TIM6: a new period starts at the next update
+void LL_TIM_SetAutoReload(TIM_TypeDef* tim, uint32_t autoReload) {
+    if (tim == TIM6 && tim->enabled && autoReload != tim->autoReload) adcModel.setAutoReload(machine.now(), autoReload);
+    else tim->autoReload = autoReload;
+}
+
+void LL_TIM_EnableARRPreload(TIM_TypeDef*) {}
+
+uint32_t LL_TIM_GetAutoReload(TIM_TypeDef* tim) {
+    return tim->autoReload;
+}
+
+uint32_t LL_TIM_GetPrescaler(TIM_TypeDef* tim) {
+    return tim->prescaler;
+}
+
+// Only TIM6 counts here, TIM2 is the HardwareTimer's
+uint32_t LL_TIM_GetCounter(TIM_TypeDef* tim) {
+    return tim == TIM6 && tim->enabled ? adcModel.getTimerCounter(machine.now()) : 0;
+}
+
+void LL_TIM_SetTriggerOutput(TIM_TypeDef* tim, uint32_t source) {
+    tim->triggerOutput = source;
+}
+
+void LL_TIM_GenerateEvent_UPDATE(TIM_TypeDef*) {}
+
+
+
+// ADC
+
+void LL_ADC_SetCommonClock(ADC_Common_TypeDef*, uint32_t) {}
+void LL_ADC_DisableDeepPowerDown(ADC_TypeDef*) {}
+void LL_ADC_EnableInternalRegulator(ADC_TypeDef*) {}
+void LL_ADC_StartCalibration(ADC_TypeDef*, uint32_t) {}
+uint32_t LL_ADC_IsCalibrationOnGoing(ADC_TypeDef*) { return 0; }
+void LL_ADC_SetResolution(ADC_TypeDef*, uint32_t) {}
+void LL_ADC_SetDataAlignment(ADC_TypeDef*, uint32_t) {}
+void LL_ADC_SetChannelSamplingTime(ADC_TypeDef*, uint32_t, uint32_t) {}
+void LL_ADC_SetChannelSingleDiff(ADC_TypeDef*, uint32_t, uint32_t) {}
+void LL_ADC_REG_SetTriggerEdge(ADC_TypeDef*, uint32_t) {}
+void LL_ADC_REG_SetContinuousMode(ADC_TypeDef*, uint32_t) {}
+void LL_ADC_REG_SetOverrun(ADC_TypeDef*, uint32_t) {}
+uint32_t LL_ADC_REG_IsStopConversionOngoing(ADC_TypeDef*) { return 0; }
+uint32_t LL_ADC_DMA_GetRegAddr(ADC_TypeDef* adc, uint32_t) { return (uint32_t) (uintptr_t) &adc->data; }
+
+void LL_ADC_Enable(ADC_TypeDef* adc) {
+    adc->enabled = true;
+}
+
+void LL_ADC_Disable(ADC_TypeDef* adc) {
+    adcModel.invalidate(machine.now());
+    adc->enabled = false;
+    adc->converting = false;
+}
+
+uint32_t LL_ADC_IsEnabled(ADC_TypeDef* adc) {
+    return adc->enabled;
+}
+
+uint32_t LL_ADC_IsActiveFlag_ADRDY(ADC_TypeDef* adc) {
+    return adc->enabled;
+}
+
+void LL_ADC_REG_SetTriggerSource(ADC_TypeDef* adc, uint32_t source) {
+    adc->triggerSource = source;
+}
+
+void LL_ADC_REG_SetDMATransfer(ADC_TypeDef* adc, uint32_t mode) {
+    adc->dmaTransfer = mode;
+}
+
+void LL_ADC_REG_SetSequencerLength(ADC_TypeDef* adc, uint32_t length) {
+    adc->sequenceLength = length + 1;   // SCAN_ENABLE_nRANKS is n - 1
+}
+
+void LL_ADC_REG_SetSequencerRanks(ADC_TypeDef* adc, uint32_t rank, uint32_t channel) {
+    if (rank < 16) adc->ranks[rank] = channel;
+}
+
+void LL_ADC_REG_StartConversion(ADC_TypeDef* adc) {
+    adc->converting = adc->enabled;
+}
+
+void LL_ADC_REG_StopConversion(ADC_TypeDef* adc) {
+    adcModel.invalidate(machine.now());
+    adc->converting = false;
+}
+
+static bool _watchdogValid(uint32_t watchdog) {
+    return watchdog <= LL_ADC_AWD3;
+}
+
+void LL_ADC_SetAnalogWDMonitChannels(ADC_TypeDef* adc, uint32_t watchdog, uint32_t channels) {
+    if (!_watchdogValid(watchdog)) return;
+    adcModel.invalidate(machine.now());
+    adc->watchdogChannels[watchdog] = channels;
+}
+
+void LL_ADC_ConfigAnalogWDThresholds(ADC_TypeDef* adc, uint32_t watchdog, uint32_t high, uint32_t low) {
+    if (!_watchdogValid(watchdog)) return;
+    adcModel.invalidate(machine.now());
+    adc->watchdogHigh[watchdog] = high;
+    adc->watchdogLow[watchdog] = low;
+}
+
+void LL_ADC_SetAnalogWDInterrupt(ADC_TypeDef* adc, uint32_t watchdog, bool enabled) {
+    if (!_watchdogValid(watchdog)) return;
+    adcModel.invalidate(machine.now());
+    adc->watchdogInterrupt[watchdog] = enabled;
+}
+
+uint32_t LL_ADC_IsActiveFlag_AWD(ADC_TypeDef* adc, uint32_t watchdog) {
+    return _watchdogValid(watchdog) && adc->watchdogFlag[watchdog];
+}
+
+void LL_ADC_ClearFlag_AWD(ADC_TypeDef* adc, uint32_t watchdog) {
+    if (_watchdogValid(watchdog)) adc->watchdogFlag[watchdog] = false;
+}
+
+bool AdcModel::_running() {
+    return TIM6->enabled && TIM6->triggerOutput == LL_TIM_TRGO_UPDATE &&
+           ADC1->converting && ADC1->triggerSource == LL_ADC_REG_TRIG_EXT_TIM6_TRGO;
+}
+
+bool AdcModel::_watching() {
+    for (uint32_t watchdog = LL_ADC_AWD1; watchdog <= LL_ADC_AWD3; watchdog++) {
+        if (ADC1->watchdogInterrupt[watchdog] && ADC1->watchdogChannels[watchdog] != 0) return true;
+    }
+    return false;
+}
+
+uint64_t AdcModel::_triggerPicos() {
+    // Update events every (PSC + 1) * (ARR + 1) timer clocks, in picoseconds to stay exact
+    return (uint64_t) (TIM6->prescaler + 1) * (TIM6->autoReload + 1) * 1000000000000ULL / SystemCoreClock;
+}
+
+uint64_t AdcModel::_triggerTime(uint64_t trigger) {
+    return _start + (trigger - _startTrigger) * _triggerPicos() / 1000;
+}
+
+void AdcModel::startTimer(uint64_t now) {
+    _start = now;
+    _startTrigger = 0;
+    _previousPicos = 0;
+    _nextTrigger = 1;
+    _ahead.clear();
+    _aheadRead = 0;
+    _aheadTrigger = 1;
+    _watchdogTrigger = Machine::NEVER;
+}
+
+void AdcModel::setAutoReload(uint64_t now, uint32_t autoReload) {
+    // The next trigger keeps the old period, the new one counts from there
+    invalidate(now);
+    _start = _triggerTime(_nextTrigger);
+    _startTrigger = _nextTrigger;
+    _previousPicos = _triggerPicos();
+    TIM6->autoReload = autoReload;
+}
+
+uint32_t AdcModel::getTimerCounter(uint64_t now) {
+    uint64_t intoPeriod;
+    if (now < _start) {
+        // Before the update that loads a new ARR, still counting the old period
+        uint64_t left = (_start - now) * 1000;
+        intoPeriod = left < _previousPicos ? _previousPicos - left : 0;
+    } else {
+        intoPeriod = (now - _start) * 1000 % _triggerPicos();
+    }
+    return (uint32_t) (intoPeriod * SystemCoreClock / 1000000000000ULL / (TIM6->prescaler + 1));
+}
+
+uint64_t AdcModel::nextEvent() {
+    if (!_running()) return Machine::NEVER;
+
+    // Wake up when the next half or full transfer completes
+    const DMA_Channel& channel = DMA1->channels[LL_DMA_CHANNEL_1];
+    uint64_t triggers = 1;
+    if (channel.enabled && channel.length > 0 && ADC1->sequenceLength > 0) {
+        uint32_t half = channel.reload / 2;
+        uint32_t transfers = channel.length > half ? channel.length - half : channel.length;
+        triggers = (transfers + ADC1->sequenceLength - 1) / ADC1->sequenceLength;
+    }
+    uint64_t lastTrigger = _nextTrigger + triggers - 1;
+
+    // Or with the conversion a watchdog interrupts on
+    if (_watching()) {
+        _lookAhead(lastTrigger);
+        if (_watchdogTrigger <= lastTrigger) return _watchdogTime();
+    }
+    return _triggerTime(lastTrigger);
+}
+
+void AdcModel::run(uint64_t now) {
+    catchUp(now);
+}
+
+void AdcModel::catchUp(uint64_t now) {
+    uint16_t data[16];
+    bool raise = false;
+    while (_running() && _triggerTime(_nextTrigger) <= now) {
+        if (_nextTrigger == _watchdogTrigger && now < _watchdogTime()) break;
+        size_t length = ADC1->sequenceLength;
+        if (_aheadRead < _ahead.size()) {
+            memcpy(data, &_ahead[_aheadRead], length * sizeof(uint16_t));
+            _aheadRead += length;
+        } else {
+            _convert(_triggerTime(_nextTrigger), data);
+            _aheadTrigger = _nextTrigger + 1;
+        }
+        raise |= _store(data);
+        _nextTrigger++;
+    }
+    if (_aheadRead >= _ahead.size()) {
+        _ahead.clear();
+        _aheadRead = 0;
+        _watchdogTrigger = Machine::NEVER;
+    }
+
+    // Once the batch is done, a handler may switch a relay and call back in here
+    if (raise) machine.raise(ADC1_2_IRQn);
+}
+
+void AdcModel::invalidate(uint64_t now) {
+    catchUp(now);
+    _ahead.clear();
+    _aheadRead = 0;
+    _aheadTrigger = _nextTrigger;
+    _watchdogTrigger = Machine::NEVER;
+}
+
+uint64_t AdcModel::_watchdogTime() {
+    return _triggerTime(_watchdogTrigger) + (_watchdogRank + 1) * RANK_NANOS;
+}
+
+void AdcModel::_lookAhead(uint64_t lastTrigger) {
+    uint16_t data[16];
+    while (_watchdogTrigger == Machine::NEVER && _aheadTrigger <= lastTrigger) {
+        uint64_t at = _triggerTime(_aheadTrigger);
+        _convert(at, data);
+        _ahead.insert(_ahead.end(), data, data + ADC1->sequenceLength);
+        for (uint32_t rank = 0; rank < ADC1->sequenceLength && _watchdogTrigger == Machine::NEVER; rank++) {
+            for (uint32_t watchdog = LL_ADC_AWD1; watchdog <= LL_ADC_AWD3; watchdog++) {
+                if (ADC1->watchdogInterrupt[watchdog] && _outside(watchdog, ADC1->ranks[rank], data[rank])) {
+                    _watchdogTrigger = _aheadTrigger;
+                    _watchdogRank = rank;
+                }
+            }
+        }
+        _aheadTrigger++;
+    }
+}
+
+bool AdcModel::_outside(uint32_t watchdog, uint32_t channel, uint16_t data) {
+    if (!(ADC1->watchdogChannels[watchdog] & (1UL << channel))) return false;
+    uint32_t value = watchdog == LL_ADC_AWD1 ? data : data >> 4;
+    return value > ADC1->watchdogHigh[watchdog] || value < ADC1->watchdogLow[watchdog];
+}
+
+void AdcModel::_convert(uint64_t at, uint16_t* data) {
+    // One trigger converts the whole sequence
+    for (uint32_t rank = 0; rank < ADC1->sequenceLength; rank++) {
+        data[rank] = board.convert(ADC1->ranks[rank], at + rank * RANK_NANOS);
+        _conversions++;
+    }
+}
+
+// Each result moved by DMA and checked by the watchdogs, true for an enabled watchdog interrupt
+bool AdcModel::_store(const uint16_t* data) {
+    bool dma = ADC1->dmaTransfer != LL_ADC_REG_DMA_TRANSFER_NONE &&
+               DMA1->channels[LL_DMA_CHANNEL_1].request == LL_DMA_REQUEST_0;
+    bool raise = false;
+    for (uint32_t rank = 0; rank < ADC1->sequenceLength; rank++) {
+        ADC1->data = data[rank];
+        if (dma) _dmaStore(LL_DMA_CHANNEL_1, ADC1->data);
+        for (uint32_t watchdog = LL_ADC_AWD1; watchdog <= LL_ADC_AWD3; watchdog++) {
+            if (!_outside(watchdog, ADC1->ranks[rank], data[rank])) continue;
+            ADC1->watchdogFlag[watchdog] = true;
+            raise |= ADC1->watchdogInterrupt[watchdog];
+        }
+    }
+    return raise;
+}
+
+
+
+// GPIO
+
+GPIO_TypeDef* digitalPinToPort(int pin) {
+    return pin < PB0 ? &_gpioa : &_gpiob;
+}
+
+uint32_t digitalPinToBitMask(int pin) {
+    return 1UL << (pin % 16);
+}
+
+static void _gpioWrite(GPIO_TypeDef* gpio, uint32_t pinMask, int value) {
+    for (int bit = 0; bit < 16; bit++) {
+        if (pinMask & (1UL << bit)) board.digitalWrite(gpio->firstPin + bit, value);
+    }
+}
+
+void LL_GPIO_ResetOutputPin(GPIO_TypeDef* gpio, uint32_t pinMask) {
+    _gpioWrite(gpio, pinMask, LOW);
+}
+
+void LL_GPIO_SetOutputPin(GPIO_TypeDef* gpio, uint32_t pinMask) {
+    _gpioWrite(gpio, pinMask, HIGH);
+}
+
+
+
+// USART1
+
+void LL_USART_Enable(USART_TypeDef* usart) { usart->enabled = true; }
+void LL_USART_Disable(USART_TypeDef* usart) { usart->enabled = false; }
+void LL_USART_SetTransferDirection(USART_TypeDef*, uint32_t) {}
+void LL_USART_ConfigCharacter(USART_TypeDef*, uint32_t, uint32_t, uint32_t) {}
+void LL_USART_SetOverSampling(USART_TypeDef*, uint32_t) {}
+void LL_USART_SetBaudRate(USART_TypeDef* usart, uint32_t, uint32_t, uint32_t baud) { usart->baud = baud; }
+void LL_USART_DisableOverrunDetect(USART_TypeDef*) {}
+void LL_USART_EnableDMAReq_RX(USART_TypeDef* usart) { usart->dmaRx = true; }
+void LL_USART_EnableDMAReq_TX(USART_TypeDef* usart) { usart->dmaTx = true; }
+uint32_t LL_USART_IsActiveFlag_TEACK(USART_TypeDef* usart) { return usart->enabled; }
+uint32_t LL_USART_IsActiveFlag_REACK(USART_TypeDef* usart) { return usart->enabled; }
+uint32_t LL_USART_DMA_GetRegAddr(USART_TypeDef* usart, uint32_t) { return (uint32_t) (uintptr_t) usart; }
+
+uint64_t UartModel::_byteNanos() {
+    // Start, 8 data and stop bit
+    return USART1->baud ? 10 * 1000000000ULL / USART1->baud : 0;
+}
+
+bool UartModel::openPty(std::string& name) {
+    _pty = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (_pty < 0 || grantpt(_pty) != 0 || unlockpt(_pty) != 0) return false;
+    name = ptsname(_pty);
+
+    // Raw bytes both ways. The slave stays open here so the master never reads EOF while
+    // nothing is attached.
+    _ptySlave = open(name.c_str(), O_RDWR | O_NOCTTY);
+    if (_ptySlave < 0) return false;
+    termios settings;
+    tcgetattr(_ptySlave, &settings);
+    cfmakeraw(&settings);
+    tcsetattr(_ptySlave, TCSANOW, &settings);
+    return true;
+}
+
+void UartModel::pollHost() {
+    if (_pty < 0) return;
+    uint8_t buffer[256];
+    ssize_t length = read(_pty, buffer, sizeof(buffer));
+    if (length > 0) receive(buffer, length);
+}
+
+void UartModel::receive(const uint8_t* data, size_t length) {
+    if (_rxHead == _rxTail) {
+        uint64_t now = machine.now();
+        if (_rxLineFree < now) _rxLineFree = now;
+    }
+    for (size_t i = 0; i < length; i++) {
+        size_t next = (_rxHead + 1) % RX_QUEUE_SIZE;
+        if (next == _rxTail) break;
+        _rxQueue[_rxHead] = data[i];
+        _rxHead = next;
+    }
+}
+
+void UartModel::startTx(uint64_t now) {
+    const DMA_Channel& channel = DMA1->channels[LL_DMA_CHANNEL_4];
+    if (!USART1->enabled || !USART1->dmaTx || channel.length == 0) return;
+    _txDone = now + channel.length * _byteNanos();
+}
+
+void UartModel::_finishTx() {
+    DMA_Channel& channel = DMA1->channels[LL_DMA_CHANNEL_4];
+    _txDone = Machine::NEVER;
+    if (!channel.enabled) return;
+
+    const uint8_t* data = (const uint8_t*) (uintptr_t) channel.memoryAddress;
+    size_t length = channel.length;
+    _txBytes += length;
+    if (_sink != NULL) _sink(data, length);
+    if (_pty >= 0) {
+        ssize_t written = write(_pty, data, length);
+        if (written < (ssize_t) length) _ptyDropped += length - (written > 0 ? written : 0);
+    }
+
+    channel.length = 0;
+    channel.tcFlag = true;
+    if (channel.tcInterrupt) machine.raise(_dmaIrq(LL_DMA_CHANNEL_4));
+}
+
+uint64_t UartModel::nextEvent() {
+    uint64_t next = _txDone;
+    if (_rxHead != _rxTail && _rxLineFree + _byteNanos() < next) next = _rxLineFree + _byteNanos();
+    return next;
+}
+
+void UartModel::run(uint64_t now) {
+    if (_txDone <= now) _finishTx();
+
+    // Every byte whose stop bit has gone by
+    while (_rxHead != _rxTail && _rxLineFree + _byteNanos() <= now) {
+        _rxLineFree += _byteNanos();
+        uint8_t value = _rxQueue[_rxTail];
+        _rxTail = (_rxTail + 1) % RX_QUEUE_SIZE;
+        _rxBytes++;
+        if (USART1->enabled && USART1->dmaRx && DMA1->channels[LL_DMA_CHANNEL_5].request == LL_DMA_REQUEST_2) {
+            _dmaStore(LL_DMA_CHANNEL_5, value);
+        }
+    }
+}
+
+
+
+// Emulated EEPROM
+
+void FlashModel::_erase() {
+    if (_erased) return;
+    memset(_page, 0xFF, sizeof(_page));
+    memset(_buffer, 0xFF, sizeof(_buffer));
+    _erased = true;
+}
+
+bool FlashModel::open(const char* path) {
+    _erase();
+    _path = path;
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return true;     // A blank page until the first write
+    size_t read = fread(_page, 1, sizeof(_page), file);
+    fclose(file);
+    if (read != sizeof(_page)) memset(_page, 0xFF, sizeof(_page));
+    return true;
+}
+
+void FlashModel::fill() {
+    _erase();
+    memcpy(_buffer, _page, sizeof(_page));
+}
+
+void FlashModel::flush() {
+    _erase();
+    memcpy(_page, _buffer, sizeof(_page));
+    _pageWrites++;
+    machine.stall(WRITE_NANOS);
+
+    if (_path.empty()) return;
+    FILE* file = fopen(_path.c_str(), "wb");
+    if (file == NULL) return;
+    fwrite(_page, 1, sizeof(_page), file);
+    fclose(file);
+}
+
+uint8_t FlashModel::read(uint32_t position) {
+    _erase();
+    return position < PAGE_SIZE ? _buffer[position] : 0xFF;
+}
+
+void FlashModel::write(uint32_t position, uint8_t value) {
+    _erase();
+    if (position < PAGE_SIZE) _buffer[position] = value;
+}
+
+void eeprom_buffer_fill() {
+    flashModel.fill();
+}
+
+void eeprom_buffer_flush() {
+    flashModel.flush();
+}
+
+uint8_t eeprom_buffered_read_byte(const uint32_t pos) {
+    return flashModel.read(pos);
+}
+
+void eeprom_buffered_write_byte(uint32_t pos, uint8_t value) {
+    flashModel.write(pos, value);
+}
+
+
+
+// Flash bank 2
+
+bool FlashBankModel::map() {
+    void* bank = mmap((void*) (uintptr_t) BASE, SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (bank == MAP_FAILED || bank != (void*) (uintptr_t) BASE) return false;
+    _bank = (uint8_t*) bank;
+    memset(_bank, 0xFF, SIZE);
+    return true;
+}
+
+bool FlashBankModel::open(const char* path) {
+    _path = path;
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return true;     // Blank until the end of the run
+    size_t read = fread(_bank, 1, SIZE, file);
+    fclose(file);
+    if (read != SIZE) memset(_bank, 0xFF, SIZE);
+    return true;
+}
+
+void FlashBankModel::save() {
+    if (_path.empty()) return;
+    FILE* file = fopen(_path.c_str(), "wb");
+    if (file == NULL) return;
+    fwrite(_bank, 1, SIZE, file);
+    fclose(file);
+}
+
+HAL_StatusTypeDef FlashBankModel::program(uint32_t address, uint64_t data) {
+    if (!_unlocked || address < BASE || address + 8 > BASE + SIZE || address % 8 != 0) return HAL_ERROR;
+    if (_eraseEnd != Machine::NEVER) return HAL_BUSY;
+    uint8_t* target = &_bank[address - BASE];
+    for (int i = 0; i < 8; i++) {
+        if (target[i] != 0xFF) return HAL_ERROR;
+    }
+    memcpy(target, &data, 8);
+    _programs++;
+    machine.runUntil(machine.now() + PROGRAM_NANOS, false);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef FlashBankModel::erase(uint32_t bank, uint32_t page, bool interrupt) {
+    if (!_unlocked || bank != FLASH_BANK_2 || page >= SIZE / PAGE_SIZE) return HAL_ERROR;
+    if (_eraseEnd != Machine::NEVER) return HAL_BUSY;
+    if (interrupt) {
+        _erasePage = page;
+        _eraseEnd = machine.now() + ERASE_NANOS;
+        return HAL_OK;
+    }
+    memset(&_bank[page * PAGE_SIZE], 0xFF, PAGE_SIZE);
+    _pageErases++;
+    machine.runUntil(machine.now() + ERASE_NANOS, false);
+    return HAL_OK;
+}
+
+void FlashBankModel::run(uint64_t now) {
+    memset(&_bank[_erasePage * PAGE_SIZE], 0xFF, PAGE_SIZE);
+    _pageErases++;
+    _eraseEnd = Machine::NEVER;
+    _eraseDone = true;
+    machine.raise(FLASH_IRQn);
+}
+
+bool FlashBankModel::takeEraseDone() {
+    bool done = _eraseDone;
+    _eraseDone = false;
+    return done;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock() {
+    flashBankModel.setUnlocked(true);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock() {
+    flashBankModel.setUnlocked(false);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t, uint32_t Address, uint64_t Data) {
+    return flashBankModel.program(Address, Data);
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef* pEraseInit, uint32_t* PageError) {
+    *PageError = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < pEraseInit->NbPages; i++) {
+        HAL_StatusTypeDef status = flashBankModel.erase(pEraseInit->Banks, pEraseInit->Page + i, false);
+        if (status != HAL_OK) {
+            *PageError = pEraseInit->Page + i;
+            return status;
+        }
+    }
+    return HAL_OK;
+}
+
+// One page only, which is all the firmware asks for
+HAL_StatusTypeDef HAL_FLASHEx_Erase_IT(FLASH_EraseInitTypeDef* pEraseInit) {
+    if (pEraseInit->NbPages != 1) return HAL_ERROR;
+    return flashBankModel.erase(pEraseInit->Banks, pEraseInit->Page, true);
+}
+
+void HAL_FLASH_IRQHandler() {
+    if (flashBankModel.takeEraseDone()) HAL_FLASH_EndOfOperationCallback(0xFFFFFFFF);
+}
+
+
+// Backup registers
+
+bool BackupModel::open(const char* path) {
+    _path = path;
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return true;     // Cleared, as after the backup domain lost its supply
+    size_t read = fread(_registers, sizeof(uint32_t), REGISTERS, file);
+    fclose(file);
+    if (read != REGISTERS) memset(_registers, 0, sizeof(_registers));
+    return true;
+}
+
+void BackupModel::save() {
+    if (_path.empty()) return;
+    FILE* file = fopen(_path.c_str(), "wb");
+    if (file == NULL) return;
+    fwrite(_registers, sizeof(uint32_t), REGISTERS, file);
+    fclose(file);
+}
+
+void LL_RTC_BAK_SetRegister(RTC_TypeDef*, uint32_t backupRegister, uint32_t data) {
+    backupModel.write(backupRegister, data);
+}
+
+uint32_t LL_RTC_BAK_GetRegister(RTC_TypeDef*, uint32_t backupRegister) {
+    return backupModel.read(backupRegister);
+}
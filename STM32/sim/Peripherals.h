@@ -0,0 +1,191 @@
+#pragma once
+
+#include "Arduino.h"
+#include "Machine.h"
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+
+// TIM6 triggered ADC1 scan, written into memory by DMA1 channel 1.
+// Conversions are not events of their own: run() performs every conversion triggered since
+// the last one in a batch, timed so the batch ends at the next half or full transfer.
+// While an analog watchdog interrupt is enabled, the sequences up to the next transfer are
+// converted ahead to find the first sample outside a window, and the batch ends when that
+// sample's conversion does, which is when the watchdog interrupts. Anything that changes what
+// the sensors see, a relay or the scan setup, first catches up and drops what was converted ahead.
+class AdcModel : public Device {
+
+public:
+    static const uint64_t RANK_NANOS = 3000;    // 47.5 cycle sample and 12.5 cycle conversion at 20MHz
+
+    uint64_t nextEvent();
+    void run(uint64_t now);
+    void catchUp(uint64_t now);
+    void invalidate(uint64_t now);  // Before anything changes the scan setup or the sensors
+
+    void startTimer(uint64_t now);
+    void setAutoReload(uint64_t now, uint32_t autoReload);  // TIM6 ARR, preloaded
+    uint32_t getTimerCounter(uint64_t now);     // TIM6 CNT
+    unsigned long getConversions() { return _conversions; }
+
+private:
+    uint64_t _start = 0;            // Time of _startTrigger
+    uint64_t _startTrigger = 0;     // Trigger the current period counts from
+    uint64_t _previousPicos = 0;    // Period before the last ARR change
+    uint64_t _nextTrigger = 1;
+    unsigned long _conversions = 0;
+
+    std::vector<uint16_t> _ahead;   // Whole sequences converted ahead, from _nextTrigger
+    size_t _aheadRead = 0;
+    uint64_t _aheadTrigger = 1;     // Next trigger to convert ahead
+    uint64_t _watchdogTrigger = Machine::NEVER;     // First sequence outside a window
+    uint32_t _watchdogRank = 0;
+
+    bool _running();
+    bool _watching();
+    uint64_t _triggerPicos();
+    uint64_t _triggerTime(uint64_t trigger);
+    void _lookAhead(uint64_t lastTrigger);
+    uint64_t _watchdogTime();
+    bool _outside(uint32_t watchdog, uint32_t channel, uint16_t data);
+    void _convert(uint64_t at, uint16_t* data);
+    bool _store(const uint16_t* data);
+};
+
+
+// USART1 on DMA1 channels 4 (TX) and 5 (RX), with the ESP side of the wire optionally on a
+// pseudo terminal. Bytes take ten bit times in both directions.
+class UartModel : public Device {
+
+public:
+    typedef void (*Sink)(const uint8_t* data, size_t length);
+
+    bool openPty(std::string& name);
+    void onTransmit(Sink sink) { _sink = sink; }
+
+    void receive(const uint8_t* data, size_t length);  // From the ESP, starting now
+    void startTx(uint64_t now);                         // TX channel was enabled
+
+    unsigned long getTxBytes() { return _txBytes; }
+    unsigned long getRxBytes() { return _rxBytes; }
+    unsigned long getPtyDropped() { return _ptyDropped; }
+
+    uint64_t nextEvent();
+    void run(uint64_t now);
+    void pollHost();
+
+private:
+    static const size_t RX_QUEUE_SIZE = 4096;
+
+    Sink _sink = NULL;
+    int _pty = -1;
+    int _ptySlave = -1;
+
+    uint64_t _txDone = Machine::NEVER;
+    uint64_t _rxLineFree = 0;
+    uint8_t _rxQueue[RX_QUEUE_SIZE];
+    size_t _rxHead = 0;
+    size_t _rxTail = 0;
+
+    unsigned long _txBytes = 0;
+    unsigned long _rxBytes = 0;
+    unsigned long _ptyDropped = 0;
+
+    uint64_t _byteNanos();
+    void _finishTx();
+};
+
+// The core's emulated EEPROM: one flash page, read into a RAM buffer and written back whole.
+// With a file the page outlives the run, so a second run boots as a warm reset would.
+// A write stalls the CPU for the page erase and program.
+class FlashModel {
+
+public:
+    static const size_t PAGE_SIZE = 2048;
+    static const uint64_t WRITE_NANOS = 40 * Machine::NANOS_PER_MILLI;
+
+    bool open(const char* path);
+
+    void fill();
+    void flush();
+    uint8_t read(uint32_t position);
+    void write(uint32_t position, uint8_t value);
+
+    unsigned long getPageWrites() { return _pageWrites; }
+
+private:
+    uint8_t _page[PAGE_SIZE];
+    uint8_t _buffer[PAGE_SIZE];
+    bool _erased = false;
+    std::string _path;
+    unsigned long _pageWrites = 0;
+
+    void _erase();
+};
+
+// Flash bank 2, mapped at its address on the chip so the firmware reads it through pointers.
+// Programming follows the chip's rules: unlocked first, one double word at a time, and only
+// into a double word still erased. The program and the blocking erase hold the caller for the
+// chip's typical times while interrupts run, as code running from bank 1 does. An interrupt
+// driven erase ends with FLASH_IRQn. With a file the bank outlives the run.
+// The EEPROM page at the end of the bank stays with FlashModel.
+class FlashBankModel : public Device {
+
+public:
+    static const uint32_t BASE = 0x08080000;
+    static const uint32_t SIZE = 0x80000;
+    static const uint32_t PAGE_SIZE = 2048;
+    static const uint64_t PROGRAM_NANOS = 82000;
+    static const uint64_t ERASE_NANOS = 22 * Machine::NANOS_PER_MILLI;
+
+    bool map();
+    bool open(const char* path);
+    void save();
+
+    void setUnlocked(bool unlocked) { _unlocked = unlocked; }
+    HAL_StatusTypeDef program(uint32_t address, uint64_t data);
+    HAL_StatusTypeDef erase(uint32_t bank, uint32_t page, bool interrupt);
+    bool takeEraseDone();
+
+    unsigned long getPrograms() { return _programs; }
+    unsigned long getPageErases() { return _pageErases; }
+
+    // Device: ends an interrupt driven erase
+    uint64_t nextEvent() { return _eraseEnd; }
+    void run(uint64_t now);
+
+private:
+    uint8_t* _bank = NULL;
+    std::string _path;
+    bool _unlocked = false;
+    uint64_t _eraseEnd = Machine::NEVER;
+    uint32_t _erasePage = 0;
+    bool _eraseDone = false;
+    unsigned long _programs = 0;
+    unsigned long _pageErases = 0;
+};
+
+// The RTC backup registers. With a file they outlive the run, as they outlive a reset while
+// the backup domain keeps its supply.
+class BackupModel {
+
+public:
+    static const uint32_t REGISTERS = 32;
+
+    bool open(const char* path);
+    void save();
+
+    void write(uint32_t index, uint32_t value) { if (index < REGISTERS) _registers[index] = value; }
+    uint32_t read(uint32_t index) { return index < REGISTERS ? _registers[index] : 0; }
+
+private:
+    uint32_t _registers[REGISTERS] = {};
+    std::string _path;
+};
+
+extern AdcModel adcModel;
+extern UartModel uartModel;
+extern FlashModel flashModel;
+extern FlashBankModel flashBankModel;
+extern BackupModel backupModel;
@@ -0,0 +1,91 @@
+#include "Plant.h"
+#include "Board.h"
+#include "Scenario.h"
+
+
+Plant plant;
+
+static const uint64_t STEP_NANOS = 100 * Machine::NANOS_PER_MILLI;
+static const float SUPPLY_VOLTS = 5;    // HardwareAPI's power calculation voltage
+
+
+static float _kelvin(float fahrenheit) {
+    return (fahrenheit - 32) * 5 / 9 + 273.15f;
+}
+
+static float _fahrenheit(float kelvin) {
+    return (kelvin - 273.15f) * 9 / 5 + 32;
+}
+
+bool Plant::setParameter(const std::string& name, float value) {
+    if (name == "box_capacity") _parameters.boxCapacity = value;
+    else if (name == "wall_conductance") _parameters.wallConductance = value;
+    else if (name == "sink_capacity") _parameters.sinkCapacity = value;
+    else if (name == "sink_fan_on") _parameters.sinkFanOn = value;
+    else if (name == "sink_fan_off") _parameters.sinkFanOff = value;
+    else if (name == "seebeck") _parameters.seebeck = value;
+    else if (name == "resistance") _parameters.resistance = value;
+    else if (name == "conductance") _parameters.conductance = value;
+    else return false;
+    return true;
+}
+
+uint64_t Plant::nextEvent() {
+    return _enabled ? _next : Machine::NEVER;
+}
+
+void Plant::run(uint64_t now) {
+    while (_next <= now) {
+        _step(_next, STEP_NANOS / 1e9f);
+        _next += STEP_NANOS;
+    }
+}
+
+void Plant::_step(uint64_t at, float seconds) {
+    const Parameters& p = _parameters;
+    float ambient = scenario.value(AMBIENT, at);
+    if (!_started) {
+        _box = ambient;
+        _sink = ambient;
+        _started = true;
+    }
+
+    bool fanOn = board.isFanOn();
+    bool peltierOn = board.isPeltierOn();
+    float fanCurrent = fanOn ? scenario.value(FAN_CURRENT, at) : 0;
+    float current = peltierOn ? scenario.value(PELTIER_CURRENT, at) : 0;
+
+    float cold = _kelvin(_box);
+    float hot = _kelvin(_sink);
+    float outside = _kelvin(ambient);
+
+    float pumped = p.seebeck * current * cold - current * current * p.resistance / 2 - p.conductance * (hot - cold);
+    float electrical = p.seebeck * current * (hot - cold) + current * current * p.resistance;
+    float sinkResistance = fanOn ? p.sinkFanOn : p.sinkFanOff;
+
+    cold += (p.wallConductance * (outside - cold) + scenario.value(HEAT_LOAD, at) - pumped) / p.boxCapacity * seconds;
+    hot += (pumped + electrical - (hot - outside) / sinkResistance) / p.sinkCapacity * seconds;
+    _box = _fahrenheit(cold);
+    _sink = _fahrenheit(hot);
+
+    _seconds += seconds;
+    _measuredJoules += SUPPLY_VOLTS * (fanCurrent + current) * seconds;
+    _peltierJoules += electrical * seconds;
+    _pumpedJoules += pumped * seconds;
+    if (ambient > _box) _coolingDegreeSeconds += (ambient - _box) * seconds;
+    _sumBox += _box * seconds;
+    if (_box > 80) _secondsAbove80 += seconds;
+    if (_box < _minBox) _minBox = _box;
+    if (_box > _maxBox) _maxBox = _box;
+}
+
+void Plant::report(FILE* out) {
+    if (!_enabled || _seconds == 0) return;
+    double measuredWh = _measuredJoules / 3600;
+    double coolingDegreeHours = _coolingDegreeSeconds / 3600;
+    fprintf(out, "plant: box %.2f F mean, %.2f to %.2f F, %.2f h above 80 F, %.2f F-h of cooling below ambient\n",
+            _sumBox / _seconds, _minBox, _maxBox, _secondsAbove80 / 3600, coolingDegreeHours);
+    fprintf(out, "energy: %.2f Wh at 5 V x sensed current, %.2f Wh per F-h of cooling, peltier COP %.2f\n",
+            measuredWh, coolingDegreeHours > 0 ? measuredWh / coolingDegreeHours : 0,
+            _peltierJoules > 0 ? _pumpedJoules / _peltierJoules : 0);
+}
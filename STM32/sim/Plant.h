@@ -0,0 +1,64 @@
+#pragma once
+
+#include "Machine.h"
+#include <stdio.h>
+#include <string>
+
+
+// Lumped thermal model of the cooled box, for comparing control strategies.
+// Two nodes: the box air and contents behind the thermistor, and the hot side heat sink.
+// The peltier pumps heat from the box to the sink with the usual module equations:
+//   cold side  Qc = S I Tc - I^2 R / 2 - K (Th - Tc)
+//   electrical P  = S I (Th - Tc) + I^2 R
+// the box gains heat through its walls and from the scenario's heat load, and the sink sheds
+// Qc + P to ambient through a resistance that depends on the fan. Stepped every 100 ms.
+// Scenarios set parameters by their snake case names, e.g. "plant box_capacity 2000".
+class Plant : public Device {
+
+public:
+    struct Parameters {
+        float boxCapacity = 1500;       // J/K
+        float wallConductance = 0.6f;   // W/K
+        float sinkCapacity = 300;       // J/K
+        float sinkFanOn = 0.6f;         // K/W, fan running
+        float sinkFanOff = 3.0f;        // K/W, natural convection
+        float seebeck = 0.053f;         // V/K, whole module
+        float resistance = 2.0f;        // ohm
+        float conductance = 0.4f;       // W/K, module
+    };
+
+    bool setParameter(const std::string& name, float value);
+    void enable() { _enabled = true; }
+    bool isEnabled() { return _enabled; }
+
+    float getTemperature() { return _box; }     // F
+
+    uint64_t nextEvent();
+    void run(uint64_t now);
+
+    void report(FILE* out);
+
+private:
+    Parameters _parameters;
+    bool _enabled = false;
+    bool _started = false;
+    uint64_t _next = 0;
+
+    float _box = 0;     // F
+    float _sink = 0;    // F
+
+    // Run totals
+    double _seconds = 0;
+    double _measuredJoules = 0;     // 5 V times sensed current, as the firmware counts power
+    double _peltierJoules = 0;      // electrical input from the module model
+    double _pumpedJoules = 0;
+    double _coolingDegreeSeconds = 0;
+    double _sumBox = 0;
+    double _secondsAbove80 = 0;
+    float _minBox = 1e9f;
+    float _maxBox = -1e9f;
+
+    void _step(uint64_t at, float seconds);
+};
+
+extern Plant plant;
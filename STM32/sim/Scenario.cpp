@@ -0,0 +1,156 @@
+#include "Scenario.h"
+#include "Peripherals.h"
+#include "Plant.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+Scenario scenario;
+
+static const char* const SIGNAL_NAMES[SIGNAL_COUNT] = {"temperature", "fan_current", "peltier_current", "ambient", "heat_load", "sensor_offset", "link", "inrush",
+                                                       "fan_ripple", "fan_ripple_hz"};
+static const float SIGNAL_DEFAULTS[SIGNAL_COUNT] = {74.0f, 0.75f, 1.2f, 74.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 160.0f};
+
+
+bool Scenario::parseTime(const char* text, uint64_t& nanos) {
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) return false;
+
+    double scale = 1;
+    if (strcmp(end, "m") == 0) scale = 60;
+    else if (strcmp(end, "h") == 0) scale = 3600;
+    else if (strcmp(end, "d") == 0) scale = 86400;
+    else if (*end != '\0' && strcmp(end, "s") != 0) return false;
+
+    nanos = (uint64_t) (value * scale * 1e9);
+    return true;
+}
+
+int Scenario::signalByName(const char* name) {
+    for (int i = 0; i < SIGNAL_COUNT; i++) {
+        if (strcmp(name, SIGNAL_NAMES[i]) == 0) return i;
+    }
+    return -1;
+}
+
+bool Scenario::load(const char* path) {
+    std::ifstream file(path);
+    if (!file) {
+        fprintf(stderr, "%s: cannot open\n", path);
+        return false;
+    }
+    std::stringstream text;
+    text << file.rdbuf();
+    return parse(text.str().c_str(), path);
+}
+
+bool Scenario::parse(const char* text, const char* name) {
+    std::istringstream lines(text);
+    std::string line;
+    int number = 0;
+
+    while (std::getline(lines, line)) {
+        number++;
+        size_t comment = line.find('#');
+        if (comment != std::string::npos) line.erase(comment);
+
+        std::istringstream fields(line);
+        std::string command;
+        if (!(fields >> command)) continue;
+
+        bool ok = false;
+        std::string a, b, c, d, e;
+        uint64_t start, end;
+        int signal;
+
+        if (command == "duration") {
+            ok = (fields >> a) && parseTime(a.c_str(), _duration);
+        } else if (command == "set") {
+            ok = (fields >> a >> b >> c) && parseTime(a.c_str(), start) &&
+                 (signal = signalByName(b.c_str())) >= 0;
+            if (ok) {
+                float value = atof(c.c_str());
+                _tracks[signal].segments.push_back({start, start, value, value});
+            }
+        } else if (command == "ramp") {
+            ok = (fields >> a >> b >> c >> d >> e) && parseTime(a.c_str(), start) &&
+                 parseTime(b.c_str(), end) && end >= start && (signal = signalByName(c.c_str())) >= 0;
+            if (ok) _tracks[signal].segments.push_back({start, end, (float) atof(d.c_str()), (float) atof(e.c_str())});
+        } else if (command == "noise") {
+            ok = (fields >> a >> b) && (signal = signalByName(a.c_str())) >= 0;
+            if (ok) _noise[signal] = atof(b.c_str());
+        } else if (command == "send") {
+            ok = (fields >> a) && parseTime(a.c_str(), start);
+            std::string rest;
+            std::getline(fields, rest);
+            size_t first = rest.find_first_not_of(' ');
+            ok = ok && first != std::string::npos;
+            if (ok) _sends.push_back({start, rest.substr(first) + "\n"});
+        } else if (command == "plant") {
+            ok = true;
+            if (fields >> a) ok = (fields >> b) && plant.setParameter(a, atof(b.c_str()));
+            plant.enable();
+        }
+
+        if (!ok) {
+            fprintf(stderr, "%s:%d: bad line: %s\n", name, number, line.c_str());
+            return false;
+        }
+    }
+
+    // Later lines win at equal times, so sort stably
+    for (Track& track : _tracks) {
+        std::stable_sort(track.segments.begin(), track.segments.end(),
+                         [](const Segment& x, const Segment& y) { return x.start < y.start; });
+    }
+    std::stable_sort(_sends.begin(), _sends.end(), [](const Send& x, const Send& y) { return x.at < y.at; });
+    return true;
+}
+
+void Scenario::addSend(uint64_t at, const std::string& text) {
+    _sends.push_back({at, text + "\n"});
+    std::stable_sort(_sends.begin() + _nextSend, _sends.end(), [](const Send& x, const Send& y) { return x.at < y.at; });
+}
+
+
+
+// Signals
+
+float Scenario::value(int signal, uint64_t at) {
+    Track& track = _tracks[signal];
+    if (at < track.lastAt) {
+        track.next = 0;
+        track.active = -1;
+    }
+    track.lastAt = at;
+
+    while (track.next < track.segments.size() && track.segments[track.next].start <= at) {
+        track.active = track.next++;
+    }
+    if (track.active < 0) return SIGNAL_DEFAULTS[signal];
+
+    const Segment& segment = track.segments[track.active];
+    if (at >= segment.end) return segment.to;
+    return segment.from + (segment.to - segment.from) * (float) (at - segment.start) / (segment.end - segment.start);
+}
+
+
+
+// Device
+
+uint64_t Scenario::nextEvent() {
+    return _nextSend < _sends.size() ? _sends[_nextSend].at : Machine::NEVER;
+}
+
+void Scenario::run(uint64_t now) {
+    while (_nextSend < _sends.size() && _sends[_nextSend].at <= now) {
+        const std::string& text = _sends[_nextSend++].text;
+        uartModel.receive((const uint8_t*) text.data(), text.size());
+    }
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "Machine.h"
+#include <string>
+#include <vector>
+
+
+// Board signals a scenario can drive
+enum Signal {
+    TEMPERATURE,        // F at the thermistor, unless the plant model is on
+    FAN_CURRENT,        // A through the fan while its relay is on
+    PELTIER_CURRENT,    // A through the peltier while its relay is on
+    AMBIENT,            // F around the box, plant model only
+    HEAT_LOAD,          // W into the box, plant model only
+    SENSOR_OFFSET,      // counts added to both current sensors' zero, for baseline drift
+    LINK,               // 1 while the ESP reaches the server and acks flash log records, else 0
+    INRUSH,             // extra current at a relay closing, times the steady current, decays in 20ms
+    FAN_RIPPLE,         // A peak of the fan's commutation ripple, a sine on its current
+    FAN_RIPPLE_HZ,      // Hz of that ripple, 4 periods per turn
+    SIGNAL_COUNT
+};
+
+
+// A scripted run, one command per line, # starts a comment. Times are seconds, or take an
+// s, m, h or d suffix.
+//   duration <time>
+//   set <time> <signal> <value>
+//   ramp <start> <end> <signal> <from> <to>
+//   noise <signal> <counts>                  ADC noise, standard deviation in counts
+//   send <time> <text>                       a line from the ESP, newline added
+//   plant [<parameter> <value>]              thermistor reads the plant model, see Plant.h
+// Signals are temperature, fan_current, peltier_current, ambient, heat_load, sensor_offset,
+// link, inrush, fan_ripple and fan_ripple_hz. Until a signal is first set it keeps its default:
+// 74 F, 0.75 A, 1.2 A, 74 F, 0 W, 0, 1, 0, 0 A and 160 Hz.
+class Scenario : public Device {
+
+public:
+    bool load(const char* path);
+    bool parse(const char* text, const char* name);
+
+    uint64_t getDuration() const { return _duration; }
+    void setDuration(uint64_t duration) { _duration = duration; }
+
+    // Signal value at a time, called with non-decreasing times in the common case
+    float value(int signal, uint64_t at);
+    float getNoise(int signal) const { return _noise[signal]; }
+
+    // Device: delivers send lines to the UART
+    uint64_t nextEvent();
+    void run(uint64_t now);
+
+    void addSend(uint64_t at, const std::string& text);
+
+    static bool parseTime(const char* text, uint64_t& nanos);
+    static int signalByName(const char* name);
+
+private:
+    struct Segment {
+        uint64_t start;
+        uint64_t end;
+        float from;
+        float to;
+    };
+
+    struct Track {
+        std::vector<Segment> segments;
+        size_t next = 0;
+        int active = -1;
+        uint64_t lastAt = 0;
+    };
+
+    struct Send {
+        uint64_t at;
+        std::string text;
+    };
+
+    uint64_t _duration = 60 * 1000 * Machine::NANOS_PER_MILLI;
+    Track _tracks[SIGNAL_COUNT];
+    float _noise[SIGNAL_COUNT] = {};
+    std::vector<Send> _sends;
+    size_t _nextSend = 0;
+};
+
+extern Scenario scenario;
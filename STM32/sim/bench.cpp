@@ -0,0 +1,287 @@
+#include "Arduino.h"
+#include "Machine.h"
+#include "Peripherals.h"
+#include "../HardwareAPI.h"
+#include "../DecimationFilter.h"
+#include "../FanSpectrum.h"
+#include "TelemetryProtocol.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+// Host microbenchmarks of the firmware's numeric hot paths and of the ESP's frame parser, built
+// from the same sources and stand-ins as the simulator. Each case runs a batch of operations
+// several times and reports the fastest round in host ns per operation, with the heap
+// allocations per operation over every round. The numbers compare one change against another on
+// the same machine; they are not Cortex-M4 or ESP32 timings, for which the firmware counts DWT
+// cycles itself in the diagnostics and spectrum frames.
+// usage: peltier_bench [substring], to run only the cases whose name contains it
+
+
+// The firmware, from RTOS.c
+extern HardwareAPI hardwareAPI;
+int SampleData(int state);
+static const int SAMPLE_INIT = 0;   // RTOS.c's SAMP_DATA_ST
+static const int SAMP_READ = 1;
+
+extern "C" void ADC1_2_IRQHandler(void);
+extern "C" void DMA1_Channel1_IRQHandler(void);
+
+extern bool serialQuiet;
+
+
+// Heap allocations, counted while a case runs. operator new comes through malloc in glibc.
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* pointer, size_t size);
+
+static bool _counting = false;
+static unsigned long _allocations = 0;
+
+extern "C" void* malloc(size_t size) {
+    if (_counting) _allocations++;
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+    if (_counting) _allocations++;
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* pointer, size_t size) {
+    if (_counting) _allocations++;
+    return __libc_realloc(pointer, size);
+}
+
+
+static const int ROUNDS = 7;
+static const char* _filter = NULL;
+static volatile float _sink;   // Keeps results the compiler would otherwise drop
+
+static uint64_t _hostNanos() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// run(ops) does ops operations and returns the host ns of the part to charge, so a case can
+// leave its setup out
+template <typename F>
+static void _bench(const char* name, unsigned long ops, F run) {
+    if (_filter != NULL && strstr(name, _filter) == NULL) return;
+    uint64_t best = UINT64_MAX;
+    _allocations = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        _counting = true;
+        uint64_t nanos = run(ops);
+        _counting = false;
+        if (nanos < best) best = nanos;
+    }
+    printf("%-36s %10.1f %11.2f\n", name, (double) best / ops, (double) _allocations / (ops * ROUNDS));
+}
+
+template <typename F>
+static uint64_t _timed(F f) {
+    uint64_t start = _hostNanos();
+    f();
+    return _hostNanos() - start;
+}
+
+// Counts across the ADC range, so the conversions see every branch
+static float _counts[1024];
+
+static void _conversions() {
+    for (int i = 0; i < 1024; i++) _counts[i] = 400 + i * 3.2f;
+
+    _bench("currentFromCounts", 1 << 20, [](unsigned long ops) {
+        return _timed([&] {
+            float sum = 0;
+            for (unsigned long i = 0; i < ops; i++) sum += hardwareAPI.currentFromCounts(Channels::FAN, _counts[i & 1023]);
+            _sink = sum;
+        });
+    });
+    hardwareAPI.useExactTemperature(false);
+    _bench("temperatureFromCounts, table", 1 << 20, [](unsigned long ops) {
+        return _timed([&] {
+            float sum = 0;
+            for (unsigned long i = 0; i < ops; i++) sum += hardwareAPI.temperatureFromCounts(_counts[i & 1023]);
+            _sink = sum;
+        });
+    });
+    hardwareAPI.useExactTemperature(true);
+    _bench("temperatureFromCounts, exact", 1 << 20, [](unsigned long ops) {
+        return _timed([&] {
+            float sum = 0;
+            for (unsigned long i = 0; i < ops; i++) sum += hardwareAPI.temperatureFromCounts(_counts[i & 1023]);
+            _sink = sum;
+        });
+    });
+    hardwareAPI.useExactTemperature(false);
+}
+
+// Needs the scan running: both read the newest scan frame
+static void _sensorReads() {
+    _bench("getCurrent, scanning", 1 << 20, [](unsigned long ops) {
+        return _timed([&] {
+            float sum = 0;
+            for (unsigned long i = 0; i < ops; i++) sum += hardwareAPI.getCurrent(Channels::FAN);
+            _sink = sum;
+        });
+    });
+    _bench("getTemperature, scanning", 1 << 20, [](unsigned long ops) {
+        return _timed([&] {
+            float sum = 0;
+            for (unsigned long i = 0; i < ops; i++) sum += hardwareAPI.getTemperature();
+            _sink = sum;
+        });
+    });
+}
+
+// One DMA half of virtual time, untimed, so the next half is complete and waiting
+static void _nextHalf() {
+    uint64_t half = 1000000000ULL * HardwareAPI::SCAN_HALF_BLOCKS * HardwareAPI::SCAN_BLOCK_FRAMES / 10000;
+    machine.runUntil(machine.now() + half, false);
+}
+
+// An operation is one 1ms block of 10 frames, drained a DMA half at a time as SampleData does
+static void _acquisition() {
+    _bench("readRawCounts, per block", 4096, [](unsigned long ops) {
+        uint64_t nanos = 0;
+        for (unsigned long done = 0; done < ops; done += HardwareAPI::SCAN_HALF_BLOCKS) {
+            _nextHalf();
+            nanos += _timed([] {
+                RawCounts counts = RawCounts();
+                uint32_t sum = 0;
+                while (hardwareAPI.readRawCounts(counts, HardwareAPI::SCAN_BLOCK_FRAMES) > 0) {
+                    if (counts.samples < HardwareAPI::SCAN_BLOCK_FRAMES) continue;
+                    sum += counts.current[Channels::FAN];
+                    counts = RawCounts();
+                }
+                _sink = sum;
+            });
+        }
+        return nanos;
+    });
+
+    SampleData(SAMPLE_INIT);
+    _bench("SampleData, per block", 4096, [](unsigned long ops) {
+        uint64_t nanos = 0;
+        for (unsigned long done = 0; done < ops; done += HardwareAPI::SCAN_HALF_BLOCKS) {
+            _nextHalf();
+            nanos += _timed([] { SampleData(SAMP_READ); });
+        }
+        return nanos;
+    });
+
+    static DecimationFilter filter;
+    filter.begin(1000, 1);
+    _bench("DecimationFilter::push, 1khz to 1hz", 1 << 16, [](unsigned long ops) {
+        return _timed([&] {
+            float input[DecimationFilter::CHANNELS];
+            float output[DecimationFilter::CHANNELS];
+            for (unsigned long i = 0; i < ops; i++) {
+                for (int c = 0; c < DecimationFilter::CHANNELS; c++) input[c] = _counts[(i + c) & 1023];
+                filter.push(input, output);
+            }
+            _sink = output[0];
+        });
+    });
+}
+
+// A 160hz ripple on the fan current, an operation is the analysis of one full block
+static void _spectrum() {
+    static FanSpectrum spectrum;
+    static ScanFrame frames[FanSpectrum::MAX_BLOCK];
+    for (int i = 0; i < FanSpectrum::MAX_BLOCK; i++) {
+        frames[i].current[Channels::FAN] = 1843 + lroundf(6 * sinf(6.2831853f * 160 * i / 10000) + random(-3, 4));
+    }
+    spectrum.begin(10000, FanSpectrum::MAX_BLOCK, 4);
+    spectrum.setChannel(1798, HardwareAPI::ampsPerCount(Channels::FAN));
+
+    static const int sizes[] = {256, 512, 1024};
+    for (int size : sizes) {
+        char name[40];
+        snprintf(name, sizeof(name), "FanSpectrum::analyse, %d", size);
+        spectrum.setBlockSize(size);
+        _bench(name, 64, [&](unsigned long ops) {
+            uint64_t nanos = 0;
+            Protocol::Spectrum features;
+            for (unsigned long i = 0; i < ops; i++) {
+                spectrum.start();
+                spectrum.push(frames, size);
+                nanos += _timed([&] { spectrum.analyse(features); });
+            }
+            _sink = features.dominantHz;
+            return nanos;
+        });
+    }
+}
+
+// The STM32 builds a telemetry frame, and the ESP takes it a byte at a time off its UART
+static void _protocol() {
+    static Protocol::Telemetry telemetry = {};
+    telemetry.thermistorCount = Channels::THERMISTOR_COUNT;
+    telemetry.loadCount = Channels::LOAD_COUNT;
+    telemetry.temperature[Channels::BOX] = 75.4f;
+    for (size_t i = 0; i < Channels::LOAD_COUNT; i++) {
+        telemetry.voltage[i] = Channels::LOADS[i].supplyVolts;
+        telemetry.current[i] = Channels::LOADS[i].testAmps;
+    }
+    telemetry.status[Channels::FAN] = true;
+    telemetry.powerAvg = 9.1f;
+    telemetry.scanRate = 10000;
+    static uint8_t payload[Protocol::MAX_PAYLOAD];
+    static uint8_t frame[Protocol::MAX_ENCODED_FRAME];
+    static size_t frameLength = 0;
+
+    _bench("telemetry pack and encode", 1 << 18, [](unsigned long ops) {
+        return _timed([&] {
+            for (unsigned long i = 0; i < ops; i++) {
+                size_t length = Protocol::packTelemetry(telemetry, payload, sizeof(payload));
+                frameLength = Protocol::encodeFrame(Protocol::TELEMETRY, i, i, payload, length, frame, sizeof(frame));
+            }
+        });
+    });
+
+    frameLength = Protocol::encodeFrame(Protocol::TELEMETRY, 1, 1, payload,
+                                        Protocol::packTelemetry(telemetry, payload, sizeof(payload)),
+                                        frame, sizeof(frame));
+    static Protocol::FrameReceiver receiver;
+    _bench("ESP frame receive and unpack", 1 << 18, [](unsigned long ops) {
+        return _timed([&] {
+            Protocol::Telemetry received = {};
+            for (unsigned long i = 0; i < ops; i++) {
+                for (size_t b = 0; b < frameLength; b++) {
+                    if (receiver.push(frame[b])) {
+                        Protocol::unpackTelemetry(receiver.payload(), receiver.payloadLength(), received);
+                    }
+                }
+            }
+            _sink = received.temperature[Channels::BOX];
+        });
+    });
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) _filter = argv[1];
+    serialQuiet = true;
+
+    machine.attach(&adcModel);
+    machine.setHandler(ADC1_2_IRQn, ADC1_2_IRQHandler);
+    machine.setHandler(DMA1_Channel1_IRQn, DMA1_Channel1_IRQHandler);
+
+    printf("%-36s %10s %11s\n", "benchmark", "ns/op", "allocs/op");
+    _conversions();
+    _protocol();
+    _spectrum();
+
+    hardwareAPI.beginScan(10000);
+    _nextHalf();
+    _sensorReads();
+    _acquisition();
+    hardwareAPI.endScan();
+    return 0;
+}
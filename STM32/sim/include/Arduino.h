@@ -0,0 +1,257 @@
+#pragma once
+
+// Host stand-in for the STM32duino core: just the parts of the Arduino API and the CMSIS
+// device header the firmware uses, backed by the simulated machine in Machine.h.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <cmath>
+#include <string>
+
+using std::abs;
+
+
+// Pins: port A is 0-15, port B 16-31, as a PinName would number them
+enum {
+    PA0 = 0, PA1, PA2, PA3, PA4, PA5, PA6, PA7, PA8, PA9, PA10, PA11, PA12, PA13, PA14, PA15,
+    PB0, PB1, PB2, PB3, PB4, PB5, PB6, PB7, PB8, PB9, PB10, PB11, PB12, PB13, PB14, PB15,
+};
+typedef int PinName;
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_ANALOG 3
+
+#define PI 3.1415926535897932384626433832795
+
+
+// Time, GPIO and analog, all on the virtual clock
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned long us);
+
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+int digitalRead(int pin);
+int analogRead(int pin);
+void analogReadResolution(int bits);
+
+long random(long max);
+long random(long min, long max);
+
+// Interrupts never preempt firmware code in the simulator, so masking is free
+// Handlers only run at points the machine picks, so masking is a no-op, except that a handler
+// held since a WFI runs when the firmware unmasks
+inline void noInterrupts() {}
+void interrupts();
+
+
+// Pin mapping: an analog pin's ADC channel number is its pin number
+extern const int PinMap_ADC[];
+extern const int PinMap_UART_TX[];
+extern const int PinMap_UART_RX[];
+inline PinName analogInputToPinName(int pin) { return pin; }
+inline PinName digitalPinToPinName(int pin) { return pin; }
+inline void pinmap_pinout(PinName, const int*) {}
+inline uint32_t pinmap_function(PinName pin, const int*) { return pin; }
+#define STM_PIN_CHANNEL(function) (function)
+
+// GPIO ports for the LL output calls: port A is pins 0-15, port B 16-31
+struct GPIO_TypeDef;
+GPIO_TypeDef* digitalPinToPort(int pin);
+uint32_t digitalPinToBitMask(int pin);
+
+
+// Strings and printing
+class String : public std::string {
+public:
+    String() {}
+    String(const char* text) : std::string(text) {}
+    String(const std::string& text) : std::string(text) {}
+};
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t value) = 0;
+    virtual size_t write(const uint8_t* data, size_t length) {
+        size_t written = 0;
+        while (written < length && write(data[written])) written++;
+        return written;
+    }
+    size_t write(const char* text) { return write((const uint8_t*) text, strlen(text)); }
+
+    size_t print(const char* text) { return write(text); }
+    size_t print(const String& text) { return write(text.c_str()); }
+    size_t print(char value) { return write((uint8_t) value); }
+    size_t print(int value) { return _printf("%d", value); }
+    size_t print(unsigned int value) { return _printf("%u", value); }
+    size_t print(long value) { return _printf("%ld", value); }
+    size_t print(unsigned long value) { return _printf("%lu", value); }
+    size_t print(double value, int digits = 2) { return _printf("%.*f", digits, value); }
+
+    template <typename T>
+    size_t println(T value) { size_t n = print(value); return n + println(); }
+    size_t println() { return write("\r\n"); }
+
+private:
+    template <typename... A>
+    size_t _printf(const char* format, A... args) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), format, args...);
+        return write(buffer);
+    }
+};
+
+
+// USB serial for debug output, printed with a virtual timestamp
+class HardwareSerial : public Print {
+public:
+    void begin(unsigned long) {}
+    int available() { return 0; }
+    int read() { return -1; }
+    size_t write(uint8_t value);
+    using Print::write;
+
+private:
+    std::string _line;
+};
+
+extern HardwareSerial Serial;
+
+
+// CMSIS
+typedef enum {
+    FLASH_IRQn = 4,
+    DMA1_Channel1_IRQn = 11,
+    DMA1_Channel4_IRQn = 14,
+    DMA1_Channel5_IRQn = 15,
+    ADC1_2_IRQn = 18,
+    TIM2_IRQn = 28,
+} IRQn_Type;
+
+void NVIC_EnableIRQ(IRQn_Type irq);
+void NVIC_DisableIRQ(IRQn_Type irq);
+void NVIC_SetPriority(IRQn_Type irq, uint32_t priority);
+
+extern uint32_t SystemCoreClock;
+uint32_t HAL_RCC_GetPCLK2Freq();
+
+// HAL flash for an STM32L476, 1MB in two banks of 2KB pages. Only bank 2 is modelled, see
+// FlashBankModel in Peripherals.h.
+#define FLASH_BASE 0x08000000UL
+#define FLASH_END 0x080FFFFFUL
+#define FLASH_BANK_SIZE 0x80000UL
+#define FLASH_PAGE_SIZE 0x800UL
+#define FLASH_BANK_1 1
+#define FLASH_BANK_2 2
+#define FLASH_TYPEERASE_PAGES 0
+#define FLASH_TYPEPROGRAM_DOUBLEWORD 0
+#define FLASH_FLAG_ALL_ERRORS 0
+#define __HAL_FLASH_CLEAR_FLAG(flags) ((void) (flags))
+
+typedef enum {HAL_OK = 0, HAL_ERROR = 1, HAL_BUSY = 2, HAL_TIMEOUT = 3} HAL_StatusTypeDef;
+
+typedef struct {
+    uint32_t TypeErase;
+    uint32_t Banks;
+    uint32_t Page;      // Within the bank
+    uint32_t NbPages;
+} FLASH_EraseInitTypeDef;
+
+HAL_StatusTypeDef HAL_FLASH_Unlock();
+HAL_StatusTypeDef HAL_FLASH_Lock();
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data);
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef* pEraseInit, uint32_t* PageError);
+HAL_StatusTypeDef HAL_FLASHEx_Erase_IT(FLASH_EraseInitTypeDef* pEraseInit);
+void HAL_FLASH_IRQHandler();
+extern "C" void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue);
+extern "C" void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue);
+
+// The cycle counter reads the virtual clock in core cycles
+struct SimCycleCounter {
+    operator uint32_t() const;
+    SimCycleCounter& operator=(uint32_t value);
+};
+
+struct DWT_Type {
+    uint32_t CTRL;
+    SimCycleCounter CYCCNT;
+};
+
+struct CoreDebug_Type {
+    uint32_t DEMCR;
+};
+
+extern DWT_Type* const DWT;
+extern CoreDebug_Type* const CoreDebug;
+#define CoreDebug_DEMCR_TRCENA_Msk (1UL << 24)
+#define DWT_CTRL_CYCCNTENA_Msk (1UL << 0)
+
+// millis() reads the virtual clock, so a SysTick is never left pending
+struct SCB_Type {
+    uint32_t ICSR;
+};
+
+extern SCB_Type* const SCB;
+#define SCB_ICSR_PENDSTSET_Msk (1UL << 26)
+
+// WFI: runs the machine until an interrupt handler has run, see Machine::wfi()
+void __WFI();
+inline void __DSB() {}
+
+
+// Peripheral instances, modelled in Peripherals.cpp
+struct TIM_TypeDef;
+struct ADC_TypeDef;
+struct ADC_Common_TypeDef;
+struct DMA_TypeDef;
+struct USART_TypeDef;
+struct RTC_TypeDef;
+extern TIM_TypeDef* const TIM2;
+extern TIM_TypeDef* const TIM6;
+extern ADC_TypeDef* const ADC1;
+extern DMA_TypeDef* const DMA1;
+extern USART_TypeDef* const USART1;
+extern RTC_TypeDef* const RTC;
+
+
+// HardwareTimer: an update interrupt at a fixed period
+#define MICROSEC_FORMAT 1
+#define HERTZ_FORMAT 2
+#define TICK_FORMAT 3
+
+typedef void (*callback_function_t)();
+
+class HardwareTimer {
+public:
+    HardwareTimer(TIM_TypeDef* instance);
+    void setPrescaleFactor(uint32_t prescaler);
+    void setOverflow(uint32_t overflow, int format = TICK_FORMAT);
+    void setPreloadEnable(bool preload) { _preload = preload; }
+    uint32_t getTimerClkFreq() { return SystemCoreClock; }
+    void attachInterrupt(callback_function_t callback);
+    void resume();
+    void pause();
+
+    // Simulator side
+    uint64_t nextEvent() const;
+    void run(uint64_t now);
+
+private:
+    uint32_t _prescaler = 1;
+    uint64_t _periodNanos = 0;
+    uint64_t _periodStart = 0;
+    uint64_t _next = 0;
+    bool _preload = true;
+    bool _running = false;
+    bool _attached = false;
+    callback_function_t _callback = nullptr;
+};
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+
+// The buffered half of the core's EEPROM emulation, backed by FlashModel in Peripherals.h
+#define E2END (2048 - 1)
+
+void eeprom_buffer_fill();
+void eeprom_buffer_flush();
+uint8_t eeprom_buffered_read_byte(const uint32_t pos);
+void eeprom_buffered_write_byte(uint32_t pos, uint8_t value);
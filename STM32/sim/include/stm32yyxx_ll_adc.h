@@ -0,0 +1,88 @@
+#pragma once
+
+#include "Arduino.h"
+
+
+// Channel numbers are used directly as channel identifiers
+#define __LL_ADC_DECIMAL_NB_TO_CHANNEL(number) (number)
+#define __LL_ADC_COMMON_INSTANCE(adc) ((ADC_Common_TypeDef*) 0)
+#define __LL_ADC_ANALOGWD_CHANNEL_GROUP(channel, group) (1UL << (channel))
+
+#define LL_ADC_CLOCK_SYNC_PCLK_DIV4 (3UL << 16)
+#define LL_ADC_RESOLUTION_12B 0
+#define LL_ADC_DATA_ALIGN_RIGHT 0
+#define LL_ADC_REG_TRIG_SOFTWARE 0
+#define LL_ADC_REG_TRIG_EXT_TIM6_TRGO 13
+#define LL_ADC_REG_TRIG_EXT_RISING (1UL << 10)
+#define LL_ADC_REG_CONV_SINGLE 0
+#define LL_ADC_REG_CONV_CONTINUOUS 1
+#define LL_ADC_REG_DMA_TRANSFER_NONE 0
+#define LL_ADC_REG_DMA_TRANSFER_UNLIMITED 3
+#define LL_ADC_REG_OVR_DATA_PRESERVED 0
+#define LL_ADC_REG_OVR_DATA_OVERWRITTEN 1
+#define LL_ADC_REG_SEQ_SCAN_DISABLE 0
+#define LL_ADC_REG_SEQ_SCAN_ENABLE_2RANKS 1
+#define LL_ADC_REG_SEQ_SCAN_ENABLE_3RANKS 2
+#define LL_ADC_REG_SEQ_SCAN_ENABLE_4RANKS 3
+#define LL_ADC_REG_SEQ_SCAN_ENABLE_5RANKS 4
+#define LL_ADC_REG_SEQ_SCAN_ENABLE_6RANKS 5
+#define LL_ADC_REG_SEQ_SCAN_ENABLE_7RANKS 6
+#define LL_ADC_REG_SEQ_SCAN_ENABLE_8RANKS 7
+#define LL_ADC_REG_RANK_1 0
+#define LL_ADC_REG_RANK_2 1
+#define LL_ADC_REG_RANK_3 2
+#define LL_ADC_REG_RANK_4 3
+#define LL_ADC_REG_RANK_5 4
+#define LL_ADC_REG_RANK_6 5
+#define LL_ADC_REG_RANK_7 6
+#define LL_ADC_REG_RANK_8 7
+#define LL_ADC_SAMPLINGTIME_47CYCLES_5 4
+#define LL_ADC_SINGLE_ENDED 0
+#define LL_ADC_DMA_REG_REGULAR_DATA 0
+#define LL_ADC_DELAY_INTERNAL_REGUL_STAB_US 20
+#define LL_ADC_GROUP_REGULAR 1
+
+// Analog watchdogs by index. AWD1 compares all 12 bits, AWD2 and AWD3 only the top 8.
+#define LL_ADC_AWD1 0
+#define LL_ADC_AWD2 1
+#define LL_ADC_AWD3 2
+
+void LL_ADC_SetCommonClock(ADC_Common_TypeDef* common, uint32_t clock);
+void LL_ADC_DisableDeepPowerDown(ADC_TypeDef* adc);
+void LL_ADC_EnableInternalRegulator(ADC_TypeDef* adc);
+void LL_ADC_Enable(ADC_TypeDef* adc);
+void LL_ADC_Disable(ADC_TypeDef* adc);
+uint32_t LL_ADC_IsEnabled(ADC_TypeDef* adc);
+uint32_t LL_ADC_IsActiveFlag_ADRDY(ADC_TypeDef* adc);
+void LL_ADC_StartCalibration(ADC_TypeDef* adc, uint32_t mode);
+uint32_t LL_ADC_IsCalibrationOnGoing(ADC_TypeDef* adc);
+void LL_ADC_SetResolution(ADC_TypeDef* adc, uint32_t resolution);
+void LL_ADC_SetDataAlignment(ADC_TypeDef* adc, uint32_t alignment);
+void LL_ADC_SetChannelSamplingTime(ADC_TypeDef* adc, uint32_t channel, uint32_t time);
+void LL_ADC_SetChannelSingleDiff(ADC_TypeDef* adc, uint32_t channel, uint32_t mode);
+void LL_ADC_REG_SetTriggerSource(ADC_TypeDef* adc, uint32_t source);
+void LL_ADC_REG_SetTriggerEdge(ADC_TypeDef* adc, uint32_t edge);
+void LL_ADC_REG_SetContinuousMode(ADC_TypeDef* adc, uint32_t mode);
+void LL_ADC_REG_SetDMATransfer(ADC_TypeDef* adc, uint32_t mode);
+void LL_ADC_REG_SetOverrun(ADC_TypeDef* adc, uint32_t mode);
+void LL_ADC_REG_SetSequencerLength(ADC_TypeDef* adc, uint32_t length);
+void LL_ADC_REG_SetSequencerRanks(ADC_TypeDef* adc, uint32_t rank, uint32_t channel);
+void LL_ADC_REG_StartConversion(ADC_TypeDef* adc);
+void LL_ADC_REG_StopConversion(ADC_TypeDef* adc);
+uint32_t LL_ADC_REG_IsStopConversionOngoing(ADC_TypeDef* adc);
+uint32_t LL_ADC_DMA_GetRegAddr(ADC_TypeDef* adc, uint32_t reg);
+
+void LL_ADC_SetAnalogWDMonitChannels(ADC_TypeDef* adc, uint32_t watchdog, uint32_t channels);
+void LL_ADC_ConfigAnalogWDThresholds(ADC_TypeDef* adc, uint32_t watchdog, uint32_t high, uint32_t low);
+void LL_ADC_SetAnalogWDInterrupt(ADC_TypeDef* adc, uint32_t watchdog, bool enabled);
+uint32_t LL_ADC_IsActiveFlag_AWD(ADC_TypeDef* adc, uint32_t watchdog);
+void LL_ADC_ClearFlag_AWD(ADC_TypeDef* adc, uint32_t watchdog);
+
+inline void LL_ADC_EnableIT_AWD2(ADC_TypeDef* adc) { LL_ADC_SetAnalogWDInterrupt(adc, LL_ADC_AWD2, true); }
+inline void LL_ADC_EnableIT_AWD3(ADC_TypeDef* adc) { LL_ADC_SetAnalogWDInterrupt(adc, LL_ADC_AWD3, true); }
+inline void LL_ADC_DisableIT_AWD2(ADC_TypeDef* adc) { LL_ADC_SetAnalogWDInterrupt(adc, LL_ADC_AWD2, false); }
+inline void LL_ADC_DisableIT_AWD3(ADC_TypeDef* adc) { LL_ADC_SetAnalogWDInterrupt(adc, LL_ADC_AWD3, false); }
+inline uint32_t LL_ADC_IsActiveFlag_AWD2(ADC_TypeDef* adc) { return LL_ADC_IsActiveFlag_AWD(adc, LL_ADC_AWD2); }
+inline uint32_t LL_ADC_IsActiveFlag_AWD3(ADC_TypeDef* adc) { return LL_ADC_IsActiveFlag_AWD(adc, LL_ADC_AWD3); }
+inline void LL_ADC_ClearFlag_AWD2(ADC_TypeDef* adc) { LL_ADC_ClearFlag_AWD(adc, LL_ADC_AWD2); }
+inline void LL_ADC_ClearFlag_AWD3(ADC_TypeDef* adc) { LL_ADC_ClearFlag_AWD(adc, LL_ADC_AWD3); }
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "Arduino.h"
+
+
+// Peripheral clocks are always running in the simulator
+#define LL_AHB1_GRP1_PERIPH_DMA1 (1UL << 0)
+#define LL_AHB2_GRP1_PERIPH_ADC (1UL << 13)
+#define LL_APB1_GRP1_PERIPH_TIM2 (1UL << 0)
+#define LL_APB1_GRP1_PERIPH_TIM6 (1UL << 4)
+#define LL_APB1_GRP1_PERIPH_PWR (1UL << 28)
+#define LL_APB2_GRP1_PERIPH_USART1 (1UL << 14)
+
+inline void LL_AHB1_GRP1_EnableClock(uint32_t) {}
+inline void LL_AHB2_GRP1_EnableClock(uint32_t) {}
+inline void LL_APB1_GRP1_EnableClock(uint32_t) {}
+inline void LL_APB2_GRP1_EnableClock(uint32_t) {}
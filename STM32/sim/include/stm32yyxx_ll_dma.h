@@ -0,0 +1,62 @@
+#pragma once
+
+#include "Arduino.h"
+
+
+// Channel numbers and CCR bit layout as on the STM32L4
+#define LL_DMA_CHANNEL_1 1
+#define LL_DMA_CHANNEL_2 2
+#define LL_DMA_CHANNEL_3 3
+#define LL_DMA_CHANNEL_4 4
+#define LL_DMA_CHANNEL_5 5
+#define LL_DMA_CHANNEL_6 6
+#define LL_DMA_CHANNEL_7 7
+
+#define LL_DMA_DIRECTION_PERIPH_TO_MEMORY 0
+#define LL_DMA_DIRECTION_MEMORY_TO_PERIPH (1UL << 4)
+#define LL_DMA_MODE_NORMAL 0
+#define LL_DMA_MODE_CIRCULAR (1UL << 5)
+#define LL_DMA_PERIPH_NOINCREMENT 0
+#define LL_DMA_PERIPH_INCREMENT (1UL << 6)
+#define LL_DMA_MEMORY_NOINCREMENT 0
+#define LL_DMA_MEMORY_INCREMENT (1UL << 7)
+#define LL_DMA_PDATAALIGN_BYTE 0
+#define LL_DMA_PDATAALIGN_HALFWORD (1UL << 8)
+#define LL_DMA_PDATAALIGN_WORD (2UL << 8)
+#define LL_DMA_MDATAALIGN_BYTE 0
+#define LL_DMA_MDATAALIGN_HALFWORD (1UL << 10)
+#define LL_DMA_MDATAALIGN_WORD (2UL << 10)
+#define LL_DMA_PRIORITY_LOW 0
+#define LL_DMA_PRIORITY_MEDIUM (1UL << 12)
+#define LL_DMA_PRIORITY_HIGH (2UL << 12)
+#define LL_DMA_PRIORITY_VERYHIGH (3UL << 12)
+
+#define LL_DMA_REQUEST_0 0
+#define LL_DMA_REQUEST_1 1
+#define LL_DMA_REQUEST_2 2
+
+void LL_DMA_EnableChannel(DMA_TypeDef* dma, uint32_t channel);
+void LL_DMA_DisableChannel(DMA_TypeDef* dma, uint32_t channel);
+void LL_DMA_ConfigTransfer(DMA_TypeDef* dma, uint32_t channel, uint32_t configuration);
+void LL_DMA_ConfigAddresses(DMA_TypeDef* dma, uint32_t channel, uint32_t source, uint32_t destination, uint32_t direction);
+void LL_DMA_SetMemoryAddress(DMA_TypeDef* dma, uint32_t channel, uint32_t address);
+void LL_DMA_SetPeriphAddress(DMA_TypeDef* dma, uint32_t channel, uint32_t address);
+void LL_DMA_SetPeriphRequest(DMA_TypeDef* dma, uint32_t channel, uint32_t request);
+void LL_DMA_SetDataLength(DMA_TypeDef* dma, uint32_t channel, uint32_t length);
+uint32_t LL_DMA_GetDataLength(DMA_TypeDef* dma, uint32_t channel);
+void LL_DMA_EnableIT_HT(DMA_TypeDef* dma, uint32_t channel);
+void LL_DMA_EnableIT_TC(DMA_TypeDef* dma, uint32_t channel);
+
+uint32_t LL_DMA_IsActiveFlag_HT(DMA_TypeDef* dma, uint32_t channel);
+uint32_t LL_DMA_IsActiveFlag_TC(DMA_TypeDef* dma, uint32_t channel);
+void LL_DMA_ClearFlag_HT(DMA_TypeDef* dma, uint32_t channel);
+void LL_DMA_ClearFlag_TC(DMA_TypeDef* dma, uint32_t channel);
+
+inline uint32_t LL_DMA_IsActiveFlag_HT1(DMA_TypeDef* dma) { return LL_DMA_IsActiveFlag_HT(dma, 1); }
+inline uint32_t LL_DMA_IsActiveFlag_TC1(DMA_TypeDef* dma) { return LL_DMA_IsActiveFlag_TC(dma, 1); }
+inline uint32_t LL_DMA_IsActiveFlag_TC4(DMA_TypeDef* dma) { return LL_DMA_IsActiveFlag_TC(dma, 4); }
+inline uint32_t LL_DMA_IsActiveFlag_TC5(DMA_TypeDef* dma) { return LL_DMA_IsActiveFlag_TC(dma, 5); }
+inline void LL_DMA_ClearFlag_HT1(DMA_TypeDef* dma) { LL_DMA_ClearFlag_HT(dma, 1); }
+inline void LL_DMA_ClearFlag_TC1(DMA_TypeDef* dma) { LL_DMA_ClearFlag_TC(dma, 1); }
+inline void LL_DMA_ClearFlag_TC4(DMA_TypeDef* dma) { LL_DMA_ClearFlag_TC(dma, 4); }
+inline void LL_DMA_ClearFlag_TC5(DMA_TypeDef* dma) { LL_DMA_ClearFlag_TC(dma, 5); }
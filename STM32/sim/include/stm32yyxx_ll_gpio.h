@@ -0,0 +1,8 @@
+#pragma once
+
+#include "Arduino.h"
+
+
+// Output data through BRR: every pin set in the mask goes low, the rest are untouched
+void LL_GPIO_ResetOutputPin(GPIO_TypeDef* gpio, uint32_t pinMask);
+void LL_GPIO_SetOutputPin(GPIO_TypeDef* gpio, uint32_t pinMask);
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "Arduino.h"
+
+
+// The backup domain is always writable in the simulator
+inline void LL_PWR_EnableBkUpAccess() {}
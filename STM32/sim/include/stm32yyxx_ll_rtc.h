@@ -0,0 +1,10 @@
+#pragma once
+
+#include "Arduino.h"
+
+
+// Only the backup registers are modelled, see BackupModel
+#define LL_RTC_BKP_DR0 0UL
+
+void LL_RTC_BAK_SetRegister(RTC_TypeDef* rtc, uint32_t backupRegister, uint32_t data);
+uint32_t LL_RTC_BAK_GetRegister(RTC_TypeDef* rtc, uint32_t backupRegister);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "Arduino.h"
+
+
+#define LL_TIM_TRGO_RESET 0
+#define LL_TIM_TRGO_UPDATE (2UL << 4)
+
+void LL_TIM_EnableCounter(TIM_TypeDef* tim);
+void LL_TIM_DisableCounter(TIM_TypeDef* tim);
+void LL_TIM_SetPrescaler(TIM_TypeDef* tim, uint32_t prescaler);
+void LL_TIM_SetAutoReload(TIM_TypeDef* tim, uint32_t autoReload);
+void LL_TIM_EnableARRPreload(TIM_TypeDef* tim);
+uint32_t LL_TIM_GetAutoReload(TIM_TypeDef* tim);
+uint32_t LL_TIM_GetPrescaler(TIM_TypeDef* tim);
+uint32_t LL_TIM_GetCounter(TIM_TypeDef* tim);
+void LL_TIM_SetTriggerOutput(TIM_TypeDef* tim, uint32_t source);
+void LL_TIM_GenerateEvent_UPDATE(TIM_TypeDef* tim);
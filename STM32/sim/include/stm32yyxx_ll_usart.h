@@ -0,0 +1,25 @@
+#pragma once
+
+#include "Arduino.h"
+
+
+#define LL_USART_DIRECTION_TX_RX 0x0C
+#define LL_USART_DATAWIDTH_8B 0
+#define LL_USART_PARITY_NONE 0
+#define LL_USART_STOPBITS_1 0
+#define LL_USART_OVERSAMPLING_16 0
+#define LL_USART_DMA_REG_DATA_TRANSMIT 0
+#define LL_USART_DMA_REG_DATA_RECEIVE 1
+
+void LL_USART_Enable(USART_TypeDef* usart);
+void LL_USART_Disable(USART_TypeDef* usart);
+void LL_USART_SetTransferDirection(USART_TypeDef* usart, uint32_t direction);
+void LL_USART_ConfigCharacter(USART_TypeDef* usart, uint32_t width, uint32_t parity, uint32_t stopBits);
+void LL_USART_SetOverSampling(USART_TypeDef* usart, uint32_t oversampling);
+void LL_USART_SetBaudRate(USART_TypeDef* usart, uint32_t clock, uint32_t oversampling, uint32_t baud);
+void LL_USART_DisableOverrunDetect(USART_TypeDef* usart);
+void LL_USART_EnableDMAReq_RX(USART_TypeDef* usart);
+void LL_USART_EnableDMAReq_TX(USART_TypeDef* usart);
+uint32_t LL_USART_IsActiveFlag_TEACK(USART_TypeDef* usart);
+uint32_t LL_USART_IsActiveFlag_REACK(USART_TypeDef* usart);
+uint32_t LL_USART_DMA_GetRegAddr(USART_TypeDef* usart, uint32_t reg);
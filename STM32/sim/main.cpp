@@ -0,0 +1,162 @@
+#include "Arduino.h"
+#include "Board.h"
+#include "Machine.h"
+#include "Monitor.h"
+#include "Peripherals.h"
+#include "Plant.h"
+#include "Scenario.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+
+// The firmware, from RTOS.c
+void setup();
+void loop();
+
+extern "C" void ADC1_2_IRQHandler(void);
+extern "C" void DMA1_Channel1_IRQHandler(void);
+extern "C" void DMA1_Channel4_IRQHandler(void);
+extern "C" void DMA1_Channel5_IRQHandler(void);
+extern "C" void FLASH_IRQHandler(void);
+
+extern bool serialQuiet;
+
+
+static void _usage() {
+    fprintf(stderr,
+            "usage: peltier_sim [options] [scenario]\n"
+            "  --duration <time>   run length, overrides the scenario (s, m, h or d suffix)\n"
+            "  --speed <x>         virtual seconds per real second, 0 runs as fast as possible (default)\n"
+            "  --pty               expose USART1 on a pseudo terminal\n"
+            "  --csv <file>        write the decoded telemetry\n"
+            "  --captures <file>   write the waveform captures, one row per sample\n"
+            "  --seed <n>          ADC noise seed\n"
+            "  --eeprom <file>     keep the emulated EEPROM in a file, so a second run boots warm\n"
+            "  --flash <file>      keep flash bank 2 and the flash log in it in a file\n"
+            "  --backup <file>     keep the RTC backup registers and the energy counters in them in a file\n"
+            "  --send <time> <text>  add a command line from the ESP to the scenario\n"
+            "  --cpu-scale <x>     charge host time spent in firmware code, x virtual ns per host ns\n"
+            "  --quiet             hide the firmware's Serial output\n");
+}
+
+static void _transmitted(const uint8_t* data, size_t length) {
+    monitor.push(data, length);
+}
+
+int main(int argc, char** argv) {
+    const char* scenarioPath = NULL;
+    const char* csvPath = NULL;
+    const char* capturePath = NULL;
+    const char* durationText = NULL;
+    const char* flashPath = NULL;
+    bool pty = false;
+    uint32_t seed = 1;
+    std::vector<std::pair<uint64_t, std::string>> sends;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (strcmp(arg, "--duration") == 0 && hasValue) durationText = argv[++i];
+        else if (strcmp(arg, "--speed") == 0 && hasValue) machine.setSpeed(atof(argv[++i]));
+        else if (strcmp(arg, "--pty") == 0) pty = true;
+        else if (strcmp(arg, "--csv") == 0 && hasValue) csvPath = argv[++i];
+        else if (strcmp(arg, "--captures") == 0 && hasValue) capturePath = argv[++i];
+        else if (strcmp(arg, "--seed") == 0 && hasValue) seed = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--eeprom") == 0 && hasValue) flashModel.open(argv[++i]);
+        else if (strcmp(arg, "--flash") == 0 && hasValue) flashPath = argv[++i];
+        else if (strcmp(arg, "--backup") == 0 && hasValue) backupModel.open(argv[++i]);
+        else if (strcmp(arg, "--send") == 0 && i + 2 < argc) {
+            uint64_t at;
+            if (!Scenario::parseTime(argv[i + 1], at)) {
+                _usage();
+                return 2;
+            }
+            sends.push_back(std::make_pair(at, std::string(argv[i + 2])));
+            i += 2;
+        }
+        else if (strcmp(arg, "--cpu-scale") == 0 && hasValue) machine.setCpuScale(atof(argv[++i]));
+        else if (strcmp(arg, "--quiet") == 0) serialQuiet = true;
+        else if (arg[0] != '-' && scenarioPath == NULL) scenarioPath = arg;
+        else {
+            _usage();
+            return 2;
+        }
+    }
+
+    if (scenarioPath != NULL && !scenario.load(scenarioPath)) return 1;
+    for (const auto& send : sends) scenario.addSend(send.first, send.second);
+    if (durationText != NULL) {
+        uint64_t duration;
+        if (!Scenario::parseTime(durationText, duration)) {
+            _usage();
+            return 2;
+        }
+        scenario.setDuration(duration);
+    }
+    if (!flashBankModel.map()) {
+        perror("flash bank mapping");
+        return 1;
+    }
+    if (flashPath != NULL) flashBankModel.open(flashPath);
+    if (csvPath != NULL && !monitor.openCsv(csvPath)) {
+        fprintf(stderr, "%s: cannot open\n", csvPath);
+        return 1;
+    }
+    if (capturePath != NULL && !monitor.openCaptureCsv(capturePath)) {
+        fprintf(stderr, "%s: cannot open\n", capturePath);
+        return 1;
+    }
+    if (pty) {
+        std::string name;
+        if (!uartModel.openPty(name)) {
+            perror("pty");
+            return 1;
+        }
+        fprintf(stderr, "USART1 on %s\n", name.c_str());
+        monitor.setAckRecords(false);
+    }
+
+    board.seed(seed);
+    machine.attach(&scenario);
+    machine.attach(&adcModel);
+    machine.attach(&uartModel);
+    machine.attach(&plant);
+    machine.attach(&flashBankModel);
+    machine.setHandler(ADC1_2_IRQn, ADC1_2_IRQHandler);
+    machine.setHandler(DMA1_Channel1_IRQn, DMA1_Channel1_IRQHandler);
+    machine.setHandler(DMA1_Channel4_IRQn, DMA1_Channel4_IRQHandler);
+    machine.setHandler(DMA1_Channel5_IRQn, DMA1_Channel5_IRQHandler);
+    machine.setHandler(FLASH_IRQn, FLASH_IRQHandler);
+    uartModel.onTransmit(_transmitted);
+
+    // Reset, then loop() as on the board. It sleeps in __WFI() when nothing is pending.
+    uint64_t end = scenario.getDuration();
+    machine.setEnd(end);
+    machine.hostElapsed();
+    setup();
+    unsigned long passes = 0;
+    while (machine.now() < end) {
+        loop();
+        passes++;
+    }
+
+    double virtualSeconds = machine.now() / 1e9;
+    double hostSeconds = machine.hostElapsed() / 1e9;
+    fprintf(stderr, "\nsimulated %.1f s in %.2f s (%.0fx), %lu loop passes, %lu ADC conversions\n",
+            virtualSeconds, hostSeconds, hostSeconds > 0 ? virtualSeconds / hostSeconds : 0, passes,
+            adcModel.getConversions());
+    fprintf(stderr, "relays: fan %s, %lu switches; peltier %s, %lu switches\n",
+            board.isFanOn() ? "on" : "off", board.getRelaySwitches(Board::FAN_RELAY_PIN),
+            board.isPeltierOn() ? "on" : "off", board.getRelaySwitches(Board::PELTIER_RELAY_PIN));
+    fprintf(stderr, "uart: %lu bytes out, %lu bytes in\n", uartModel.getTxBytes(), uartModel.getRxBytes());
+    flashBankModel.save();
+    backupModel.save();
+    fprintf(stderr, "flash: %lu page writes, log %lu double words programmed, %lu page erases\n",
+            flashModel.getPageWrites(), flashBankModel.getPrograms(), flashBankModel.getPageErases());
+    monitor.report(stderr);
+    plant.report(stderr);
+    return 0;
+}
@@ -0,0 +1,903 @@
+#include "../DecimationFilter.h"
+#include "../FanSpectrum.h"
+#include "../HardwareAPI.h"
+#include "../ReportByException.h"
+#include "../StreamingStats.h"
+#include "../ThermistorTable.h"
+#include "TelemetryProtocol.h"
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+
+// Host checks of the code both ends of the link share, built from the same sources as the
+// simulator. Every failed check prints a line and the exit status is non-zero if any did.
+// usage: peltier_test [substring], to run only the groups whose name contains it
+
+
+static const char* _filter = NULL;
+static int _checks = 0;
+static int _failures = 0;
+
+#define CHECK(condition, ...) _check((condition), __FILE__, __LINE__, #condition, __VA_ARGS__)
+
+static bool _check(bool passed, const char* file, int line, const char* condition, const char* format, ...)
+    __attribute__((format(printf, 5, 6)));
+
+static bool _check(bool passed, const char* file, int line, const char* condition, const char* format, ...) {
+    _checks++;
+    if (passed) return true;
+    _failures++;
+    printf("%s:%d: %s failed: ", file, line, condition);
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+    return false;
+}
+
+template <typename F>
+static void _group(const char* name, F run) {
+    if (_filter != NULL && strstr(name, _filter) == NULL) return;
+    int failures = _failures;
+    run();
+    printf("%-40s %s\n", name, _failures == failures ? "ok" : "FAILED");
+}
+
+
+// Protocol
+
+static uint8_t _wire[Protocol::MAX_ENCODED_FRAME];
+
+static size_t _frame(uint8_t type, uint16_t seq, uint32_t tick, const uint8_t* payload, size_t length) {
+    return Protocol::encodeFrame(type, seq, tick, payload, length, _wire, sizeof(_wire));
+}
+
+// Pushes a whole buffer and returns the number of frames it completed
+static int _receive(Protocol::FrameReceiver& receiver, const uint8_t* data, size_t length) {
+    int frames = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (receiver.push(data[i])) frames++;
+    }
+    return frames;
+}
+
+// Frames a payload, takes it back off the wire and checks the header and payload came through
+// unchanged
+static bool _throughReceiver(uint8_t type, const uint8_t* payload, size_t length) {
+    static uint16_t seq = 0;
+    static uint32_t tick = 1000;
+    seq++;
+    tick += 7;
+
+    size_t wireLength = _frame(type, seq, tick, payload, length);
+    if (!CHECK(wireLength > 0, "type %d, %zu byte payload did not frame", type, length)) return false;
+    CHECK(memchr(_wire, 0, wireLength - 1) == NULL, "type %d has a zero before the delimiter", type);
+    CHECK(_wire[wireLength - 1] == 0, "type %d is not delimited", type);
+
+    static Protocol::FrameReceiver receiver;
+    if (!CHECK(_receive(receiver, _wire, wireLength) == 1, "type %d not received", type)) return false;
+    const Protocol::Header& header = receiver.header();
+    CHECK(header.version == Protocol::VERSION && header.type == type && header.seq == seq && header.tick == tick,
+          "type %d header came back as version %u type %u seq %u tick %lu", type, header.version, header.type,
+          header.seq, (unsigned long) header.tick);
+    return CHECK(receiver.payloadLength() == length && memcmp(receiver.payload(), payload, length) == 0,
+                 "type %d payload changed on the wire", type);
+}
+
+static bool _near(float a, float b, float scale) {
+    return fabsf(a - b) <= 0.5f / scale + 1e-6f;
+}
+
+// Each payload packs, survives the wire, unpacks to the values it was packed from and packs
+// again to the same bytes
+static void _protocolRoundTrip() {
+    uint8_t payload[Protocol::MAX_PAYLOAD];
+    uint8_t repacked[Protocol::MAX_PAYLOAD];
+
+    // One thermistor and two loads, as the board has, then every channel the wire takes
+    Protocol::Telemetry telemetry = {};
+    telemetry.thermistorCount = 1;
+    telemetry.loadCount = 2;
+    telemetry.temperature[0] = -12.34f;
+    telemetry.voltage[0] = 5.012f;
+    telemetry.current[0] = -0.771f;
+    telemetry.voltage[1] = 4.987f;
+    telemetry.current[1] = 1.234f;
+    telemetry.status[0] = true;
+    telemetry.logData = true;
+    telemetry.textStatus = 4;
+    telemetry.powerAvg = 9.12f;
+    telemetry.powerMin = 0.5f;
+    telemetry.powerMax = 10.01f;
+    telemetry.powerStd = 0.33f;
+    telemetry.held = 59;
+    telemetry.scanRate = 10000;
+    telemetry.coulombs[0] = 0x12345678;
+    telemetry.joules[0] = 0xFFFFFFFF;
+    telemetry.coulombs[1] = 0;
+    telemetry.joules[1] = 256;
+    size_t length = Protocol::packTelemetry(telemetry, payload, sizeof(payload));
+    CHECK(length == 42, "telemetry packed to %zu bytes", length);
+    if (_throughReceiver(Protocol::TELEMETRY, payload, length)) {
+        Protocol::Telemetry back;
+        CHECK(Protocol::unpackTelemetry(payload, length, back), "telemetry did not unpack");
+        CHECK(back.thermistorCount == 1 && back.loadCount == 2, "telemetry channel counts changed");
+        CHECK(_near(back.voltage[0], telemetry.voltage[0], Protocol::VOLTAGE_SCALE) &&
+              _near(back.current[0], telemetry.current[0], Protocol::CURRENT_SCALE) &&
+              _near(back.voltage[1], telemetry.voltage[1], Protocol::VOLTAGE_SCALE) &&
+              _near(back.current[1], telemetry.current[1], Protocol::CURRENT_SCALE) &&
+              _near(back.temperature[0], telemetry.temperature[0], Protocol::TEMPERATURE_SCALE) &&
+              _near(back.powerMax, telemetry.powerMax, Protocol::POWER_SCALE), "telemetry measurements changed");
+        CHECK(back.status[0] && !back.status[1] && back.logData && back.textStatus == 4 && back.held == 59 &&
+              back.scanRate == 10000 && back.coulombs[0] == 0x12345678 && back.joules[0] == 0xFFFFFFFF &&
+              back.joules[1] == 256, "telemetry fields changed");
+        CHECK(Protocol::packTelemetry(back, repacked, sizeof(repacked)) == length && !memcmp(payload, repacked, length),
+              "telemetry repacked differently");
+        CHECK(!Protocol::unpackTelemetry(payload, length - 1, back), "short telemetry unpacked");
+    }
+    telemetry.thermistorCount = Protocol::MAX_THERMISTORS;
+    telemetry.loadCount = Protocol::MAX_LOADS;
+    for (size_t i = 0; i < Protocol::MAX_THERMISTORS; i++) telemetry.temperature[i] = 60 + i;
+    for (size_t i = 0; i < Protocol::MAX_LOADS; i++) {
+        telemetry.current[i] = 0.25f * i;
+        telemetry.status[i] = i % 3 == 1;
+        telemetry.joules[i] = 1000 * i;
+    }
+    length = Protocol::packTelemetry(telemetry, payload, sizeof(payload));
+    CHECK(length == 16 + 2 * Protocol::MAX_THERMISTORS + 12 * Protocol::MAX_LOADS,
+          "telemetry of every channel packed to %zu bytes", length);
+    if (_throughReceiver(Protocol::TELEMETRY, payload, length)) {
+        Protocol::Telemetry back;
+        CHECK(Protocol::unpackTelemetry(payload, length, back) && back.loadCount == Protocol::MAX_LOADS &&
+              _near(back.temperature[3], 63, Protocol::TEMPERATURE_SCALE) &&
+              _near(back.current[7], 1.75f, Protocol::CURRENT_SCALE) && back.status[7] && !back.status[6] &&
+              back.joules[7] == 7000, "telemetry of every channel changed");
+    }
+    telemetry.loadCount = Protocol::MAX_LOADS + 1;
+    CHECK(Protocol::packTelemetry(telemetry, payload, sizeof(payload)) == 0, "telemetry of too many loads packed");
+
+    // A full table of tasks, the largest frame, so COBS runs past a 254 byte block
+    Protocol::Diagnostics diagnostics = {};
+    diagnostics.cpuMHz = 80;
+    diagnostics.cpuLoad = 12.34f;
+    diagnostics.isrLoad = 3.21f;
+    diagnostics.maxLatencyCycles = 1234;
+    diagnostics.uartTxDropped = 3;
+    diagnostics.idlePercent = 87.65f;
+    diagnostics.mcuCurrent = 4.56f;
+    diagnostics.wakeupRate = 1250;
+    diagnostics.logOverwritten = 0x01020304;
+    diagnostics.tripLatency = 9.25f;
+    diagnostics.telemetryWindows = 100000;
+    diagnostics.taskCount = Protocol::MAX_TASKS;
+    for (size_t i = 0; i < Protocol::MAX_TASKS; i++) {
+        Protocol::TaskDiagnostics& task = diagnostics.tasks[i];
+        snprintf(task.name, sizeof(task.name), i == 0 ? "longname" : "task%zu", i);
+        task.minCycles = 100 + i;
+        task.avgCycles = 1000 + i;
+        task.maxCycles = 100000 + i;
+        task.deadlineMisses = i;
+        task.overruns = 2 * i;
+    }
+    length = Protocol::packDiagnostics(diagnostics, payload, sizeof(payload));
+    CHECK(length == Protocol::MAX_PAYLOAD, "full diagnostics packed to %zu bytes", length);
+    if (_throughReceiver(Protocol::DIAGNOSTICS, payload, length)) {
+        Protocol::Diagnostics back;
+        CHECK(Protocol::unpackDiagnostics(payload, length, back), "diagnostics did not unpack");
+        CHECK(back.cpuMHz == 80 && _near(back.cpuLoad, 12.34f, Protocol::LOAD_SCALE) &&
+              _near(back.isrLoad, 3.21f, Protocol::LOAD_SCALE) &&
+              _near(back.idlePercent, 87.65f, Protocol::LOAD_SCALE) && back.logOverwritten == 0x01020304 &&
+              back.taskCount == Protocol::MAX_TASKS, "diagnostics fields changed");
+        CHECK(!strcmp(back.tasks[0].name, "longname") && !strcmp(back.tasks[9].name, "task9") &&
+              back.tasks[9].maxCycles == 100009 && back.tasks[9].overruns == 18, "task diagnostics changed");
+        CHECK(Protocol::packDiagnostics(back, repacked, sizeof(repacked)) == length && !memcmp(payload, repacked, length),
+              "diagnostics repacked differently");
+    }
+
+    Protocol::Ack ack = {};
+    ack.seq = 255;
+    ack.result = 2;
+    ack.tick = 0x80000001;
+    ack.loadCount = 2;
+    ack.status[1] = true;
+    length = Protocol::packAck(ack, payload, sizeof(payload));
+    if (_throughReceiver(Protocol::ACK, payload, length)) {
+        Protocol::Ack back;
+        CHECK(Protocol::unpackAck(payload, length, back), "ack did not unpack");
+        CHECK(back.seq == 255 && back.result == 2 && back.tick == 0x80000001 && back.loadCount == 2 &&
+              !back.status[0] && back.status[1], "ack fields changed");
+    }
+
+    Protocol::Record record = {};
+    record.seq = 70000;
+    record.boot = 12;
+    record.millis = 3600000;
+    record.ageMillis = Protocol::UNKNOWN_AGE;
+    record.thermistorCount = 1;
+    record.loadCount = 2;
+    record.temperature[0] = 68.5f;
+    record.voltage[0] = 5;
+    record.current[0] = 0.77f;
+    record.voltage[1] = 5;
+    record.current[1] = 1.2f;
+    record.status[0] = true;
+    record.status[1] = true;
+    record.powerAvg = 9.85f;
+    length = Protocol::packRecord(record, payload, sizeof(payload));
+    CHECK(length == Protocol::recordSize(1, 2) && length == 29, "record packed to %zu bytes", length);
+    if (_throughReceiver(Protocol::RECORD, payload, length)) {
+        Protocol::Record back;
+        CHECK(Protocol::unpackRecord(payload, length, back), "record did not unpack");
+        CHECK(back.seq == 70000 && back.boot == 12 && back.ageMillis == Protocol::UNKNOWN_AGE &&
+              back.thermistorCount == 1 && back.loadCount == 2 &&
+              _near(back.temperature[0], 68.5f, Protocol::TEMPERATURE_SCALE) &&
+              _near(back.current[1], 1.2f, Protocol::CURRENT_SCALE) && back.status[0] && back.status[1],
+              "record fields changed");
+        CHECK(Protocol::packRecord(back, repacked, sizeof(repacked)) == length && !memcmp(payload, repacked, length),
+              "record repacked differently");
+    }
+
+    // Two loads interleave 48 frames a chunk
+    static Protocol::CaptureChunk chunk = {};
+    chunk.id = 3;
+    chunk.cause = Protocol::captureCause(Protocol::CAPTURE_LIMIT, 1);
+    chunk.index = 1;
+    chunk.chunks = 5;
+    chunk.sampleRate = 10000;
+    chunk.preFrames = 50;
+    chunk.frames = 200;
+    chunk.ageMillis = 40;
+    chunk.loadCount = 2;
+    chunk.zero[0] = 1797.3f;
+    chunk.ampsPerCount[0] = 0.00434f;
+    chunk.zero[1] = 1801.8f;
+    chunk.ampsPerCount[1] = 0.00434f;
+    chunk.frameCount = Protocol::CAPTURE_CHUNK_SAMPLES / 2;
+    for (size_t i = 0; i < chunk.frameCount; i++) {
+        chunk.counts[2 * i] = i * 85;          // Low bytes of 0 on the way
+        chunk.counts[2 * i + 1] = 4095 - i;
+    }
+    length = Protocol::packCaptureChunk(chunk, payload, sizeof(payload));
+    if (_throughReceiver(Protocol::CAPTURE, payload, length)) {
+        static Protocol::CaptureChunk back;
+        CHECK(Protocol::unpackCaptureChunk(payload, length, back), "capture chunk did not unpack");
+        CHECK(Protocol::captureKind(back.cause) == Protocol::CAPTURE_LIMIT && Protocol::captureLoad(back.cause) == 1 &&
+              back.frames == 200 && back.loadCount == 2 && _near(back.zero[0], 1797.3f, Protocol::ZERO_SCALE) &&
+              _near(back.ampsPerCount[1], 0.00434f, Protocol::AMPS_PER_COUNT_SCALE) &&
+              back.frameCount == Protocol::CAPTURE_CHUNK_SAMPLES / 2, "capture chunk fields changed");
+        CHECK(!memcmp(back.counts, chunk.counts, sizeof(chunk.counts)), "capture samples changed");
+    }
+    chunk.frameCount = Protocol::CAPTURE_CHUNK_SAMPLES / 2 + 1;
+    CHECK(Protocol::packCaptureChunk(chunk, payload, sizeof(payload)) == length, "overfull capture chunk not clamped");
+
+    Protocol::Spectrum spectrum = {};
+    spectrum.blockSize = 1024;
+    spectrum.sampleRate = 10000;
+    spectrum.dominantHz = 160.2f;
+    spectrum.rpm = 2403;
+    spectrum.current = 0.77f;
+    spectrum.rippleRms = 0.01834f;
+    for (size_t i = 0; i < Protocol::SPECTRUM_BANDS; i++) spectrum.bands[i] = 0.001f * (i + 1);
+    spectrum.cycles = 123456;
+    spectrum.blocks = 42;
+    length = Protocol::packSpectrum(spectrum, payload, sizeof(payload));
+    CHECK(length == 28, "spectrum packed to %zu bytes", length);
+    if (_throughReceiver(Protocol::SPECTRUM, payload, length)) {
+        Protocol::Spectrum back;
+        CHECK(Protocol::unpackSpectrum(payload, length, back), "spectrum did not unpack");
+        CHECK(back.blockSize == 1024 && _near(back.dominantHz, 160.2f, Protocol::FREQUENCY_SCALE) && back.rpm == 2403 &&
+              _near(back.rippleRms, 0.01834f, Protocol::RIPPLE_SCALE) &&
+              _near(back.bands[3], 0.004f, Protocol::RIPPLE_SCALE) && back.cycles == 123456,
+              "spectrum fields changed");
+    }
+
+    CHECK(_throughReceiver(Protocol::ACK, payload, 0), "empty payload");
+}
+
+// COBS on its own, around its block boundaries and runs of zeros
+static void _protocolCobs() {
+    static const size_t lengths[] = {0, 1, 2, 253, 254, 255, 256, 508, 509, 600};
+    uint8_t in[600];
+    uint8_t encoded[700];
+    uint8_t decoded[600];
+    for (int pattern = 0; pattern < 3; pattern++) {
+        for (size_t length : lengths) {
+            for (size_t i = 0; i < length; i++) {
+                in[i] = pattern == 0 ? 0 : pattern == 1 ? (uint8_t) (i % 255 + 1) : (uint8_t) (i * 37 % 7);
+            }
+            size_t encodedLength = Protocol::cobsEncode(in, length, encoded, sizeof(encoded));
+            CHECK(encodedLength > 0 && encodedLength <= length + length / 254 + 1,
+                  "pattern %d, %zu bytes encoded to %zu", pattern, length, encodedLength);
+            CHECK(memchr(encoded, 0, encodedLength) == NULL, "pattern %d, %zu bytes encoded a zero", pattern, length);
+            size_t decodedLength = Protocol::cobsDecode(encoded, encodedLength, decoded, sizeof(decoded));
+            CHECK(decodedLength == length && !memcmp(in, decoded, length),
+                  "pattern %d, %zu bytes decoded to %zu bytes", pattern, length, decodedLength);
+        }
+    }
+    CHECK(Protocol::cobsEncode(in, 10, encoded, 10) == 0, "encode into too small a buffer");
+}
+
+static void _protocolCrc() {
+    const uint8_t check[] = "123456789";
+    uint16_t crc = crc16(check, 9);
+    CHECK(crc == 0x29B1, "CRC-16/CCITT-FALSE check value is 0x%04X", crc);
+    CHECK(crc16Update(crc16(check, 4), check + 4, 5) == 0x29B1, "CRC does not continue across calls");
+    CHECK(crc16(check, 0) == 0xFFFF, "CRC of nothing is not the initial value");
+}
+
+// Every single bit error, before COBS and on the wire, loses the frame and nothing else
+static void _protocolBitFlips() {
+    Protocol::Telemetry telemetry = {};
+    telemetry.thermistorCount = 1;
+    telemetry.loadCount = 2;
+    telemetry.temperature[0] = 72.5f;
+    telemetry.voltage[0] = 5;
+    telemetry.current[0] = 0.77f;
+    telemetry.status[0] = true;
+    telemetry.powerAvg = 3.85f;
+    telemetry.scanRate = 10000;
+    telemetry.coulombs[0] = 1234;
+    uint8_t payload[Protocol::MAX_PAYLOAD];
+    size_t length = Protocol::packTelemetry(telemetry, payload, sizeof(payload));
+
+    // The raw frame, as encodeFrame builds it before COBS
+    uint8_t raw[Protocol::MAX_RAW_FRAME];
+    size_t rawLength = 0;
+    raw[rawLength++] = Protocol::VERSION;
+    raw[rawLength++] = Protocol::TELEMETRY;
+    raw[rawLength++] = 0x34;
+    raw[rawLength++] = 0x12;
+    for (int i = 0; i < 4; i++) raw[rawLength++] = 0x10 * i;
+    memcpy(&raw[rawLength], payload, length);
+    rawLength += length;
+    uint16_t crc = crc16(raw, rawLength);
+    raw[rawLength++] = crc;
+    raw[rawLength++] = crc >> 8;
+
+    size_t wireLength = _frame(Protocol::TELEMETRY, 0x1234, 0x30201000, payload, length);
+    uint8_t reference[Protocol::MAX_ENCODED_FRAME];
+    memcpy(reference, _wire, wireLength);
+    {
+        uint8_t encoded[Protocol::MAX_ENCODED_FRAME];
+        size_t encodedLength = Protocol::cobsEncode(raw, rawLength, encoded, sizeof(encoded));
+        CHECK(encodedLength + 1 == wireLength && !memcmp(encoded, reference, encodedLength),
+              "raw frame does not match encodeFrame");
+    }
+
+    int accepted = 0;
+    int crcErrors = 0;
+    for (size_t bit = 0; bit < rawLength * 8; bit++) {
+        uint8_t flipped[Protocol::MAX_RAW_FRAME];
+        memcpy(flipped, raw, rawLength);
+        flipped[bit / 8] ^= 1 << (bit % 8);
+        uint8_t encoded[Protocol::MAX_ENCODED_FRAME];
+        size_t encodedLength = Protocol::cobsEncode(flipped, rawLength, encoded, sizeof(encoded));
+        encoded[encodedLength++] = 0;
+
+        Protocol::FrameReceiver receiver;
+        accepted += _receive(receiver, encoded, encodedLength);
+        crcErrors += receiver.crcErrors();
+        CHECK(_receive(receiver, reference, wireLength) == 1, "no resync after raw bit %zu", bit);
+    }
+    CHECK(accepted == 0, "%d of %zu raw bit flips accepted", accepted, rawLength * 8);
+    CHECK(crcErrors == (int) (rawLength * 8), "%d of %zu raw bit flips caught by the CRC", crcErrors, rawLength * 8);
+
+    // On the wire a flip can also move COBS zeros, split the frame or drop its delimiter
+    accepted = 0;
+    for (size_t bit = 0; bit < wireLength * 8; bit++) {
+        uint8_t flipped[Protocol::MAX_ENCODED_FRAME];
+        memcpy(flipped, reference, wireLength);
+        flipped[bit / 8] ^= 1 << (bit % 8);
+
+        Protocol::FrameReceiver receiver;
+        accepted += _receive(receiver, flipped, wireLength);
+        // A lost delimiter swallows the next frame too, the one after is received
+        int received = _receive(receiver, reference, wireLength);
+        received += _receive(receiver, reference, wireLength);
+        CHECK(received >= 1, "no resync after wire bit %zu", bit);
+    }
+    CHECK(accepted == 0, "%d of %zu wire bit flips accepted", accepted, wireLength * 8);
+}
+
+// Garbage, truncated and overlong frames cost the frames they touch and no more
+static void _protocolResync() {
+    uint8_t payload[Protocol::MAX_PAYLOAD];
+    Protocol::Ack ack = {};
+    ack.seq = 1;
+    size_t length = Protocol::packAck(ack, payload, sizeof(payload));
+    size_t wireLength = _frame(Protocol::ACK, 1, 1, payload, length);
+    uint8_t frame[Protocol::MAX_ENCODED_FRAME];
+    memcpy(frame, _wire, wireLength);
+
+    Protocol::FrameReceiver receiver;
+
+    // Line noise, ending in a zero
+    static const uint8_t garbage[] = {0x55, 0xAA, 0x01, 0xFF, 0x13, 0x00, 0x00, 0x7E, 0x42, 0x00};
+    CHECK(_receive(receiver, garbage, sizeof(garbage)) == 0, "garbage accepted");
+    CHECK(_receive(receiver, frame, wireLength) == 1, "no resync after garbage");
+    CHECK(receiver.framingErrors() + receiver.crcErrors() == 2,
+          "garbage counted as %lu framing and %lu CRC errors", (unsigned long) receiver.framingErrors(),
+          (unsigned long) receiver.crcErrors());
+
+    // Cut off before its delimiter: it runs into the next frame, which is lost with it
+    uint32_t errors = receiver.framingErrors() + receiver.crcErrors();
+    CHECK(_receive(receiver, frame, wireLength / 2) == 0, "half a frame accepted");
+    CHECK(_receive(receiver, frame, wireLength) == 0, "frame after a truncated one accepted");
+    CHECK(_receive(receiver, frame, wireLength) == 1, "no resync after a truncated frame");
+    CHECK(receiver.framingErrors() + receiver.crcErrors() == errors + 1, "truncated frame not counted once");
+
+    // Cut off and delimited, as when the sender resets mid-frame
+    errors = receiver.framingErrors() + receiver.crcErrors();
+    static const uint8_t delimiter = 0;
+    for (size_t cut = 1; cut < wireLength - 1; cut++) {
+        CHECK(_receive(receiver, frame, cut) == 0 && _receive(receiver, &delimiter, 1) == 0,
+              "frame cut at %zu accepted", cut);
+    }
+    CHECK(receiver.framingErrors() + receiver.crcErrors() == errors + wireLength - 2, "cut frames not all counted");
+    CHECK(_receive(receiver, frame, wireLength) == 1, "no resync after cut frames");
+
+    // Longer than any frame, with no zero in it
+    uint32_t framingErrors = receiver.framingErrors();
+    for (size_t i = 0; i < 2 * Protocol::MAX_ENCODED_FRAME; i++) receiver.push(0x5A);
+    CHECK(_receive(receiver, &delimiter, 1) == 0 && receiver.framingErrors() == framingErrors + 1,
+          "overlong frame not a framing error");
+    CHECK(_receive(receiver, frame, wireLength) == 1, "no resync after an overlong frame");
+
+    // Valid, but from another protocol version
+    _frame(Protocol::ACK, 2, 2, payload, length);
+    uint8_t raw[Protocol::MAX_RAW_FRAME];
+    size_t rawLength = Protocol::cobsDecode(_wire, strlen((const char*) _wire), raw, sizeof(raw));
+    raw[0] = Protocol::VERSION + 1;
+    uint16_t crc = crc16(raw, rawLength - Protocol::CRC_SIZE);
+    raw[rawLength - 2] = crc;
+    raw[rawLength - 1] = crc >> 8;
+    uint8_t other[Protocol::MAX_ENCODED_FRAME];
+    size_t otherLength = Protocol::cobsEncode(raw, rawLength, other, sizeof(other));
+    other[otherLength++] = 0;
+    CHECK(_receive(receiver, other, otherLength) == 0 && receiver.versionErrors() == 1, "other version accepted");
+
+    // Frames counted, and the sequence gaps as lost
+    Protocol::FrameReceiver counting;
+    static const uint16_t seqs[] = {10, 11, 14, 15, 65533, 65535, 0, 1};
+    uint32_t tick = 1000;
+    for (uint16_t seq : seqs) {
+        size_t n = _frame(Protocol::ACK, seq, tick += 10, payload, length);
+        _receive(counting, _wire, n);
+    }
+    CHECK(counting.frames() == 8 && counting.lostFrames() == 2 + 65517 + 1 && counting.restarts() == 0,
+          "%lu frames, %lu lost and %lu restarts", (unsigned long) counting.frames(),
+          (unsigned long) counting.lostFrames(), (unsigned long) counting.restarts());
+
+    // The STM32 resetting starts seq and tick again: a new session, not 65000 lost frames. Its
+    // first frame can itself be lost, leaving only the tick to show it.
+    Protocol::FrameReceiver restarting;
+    struct { uint16_t seq; uint32_t tick; } sent[] = {
+        {500, 90000}, {501, 90100}, {0, 3}, {1, 40}, {3, 200}, {2000, 300000}, {2, 15}, {3, 20}, {4, 30},
+    };
+    for (auto& frame : sent) {
+        size_t n = _frame(Protocol::ACK, frame.seq, frame.tick, payload, length);
+        _receive(restarting, _wire, n);
+    }
+    CHECK(restarting.frames() == 9 && restarting.restarts() == 2 && restarting.lostFrames() == 1 + 1996,
+          "%lu frames, %lu lost and %lu restarts", (unsigned long) restarting.frames(),
+          (unsigned long) restarting.lostFrames(), (unsigned long) restarting.restarts());
+}
+
+
+
+// Thermistor
+
+extern HardwareAPI hardwareAPI;     // From RTOS.c
+
+// The lookup table against HardwareAPI's log() formula at every ADC count. Counts 0 and 4095 are
+// an open and a shorted thermistor, which the table clamps to the nearest real reading and the
+// formula cannot convert, so they are left out.
+static void _thermistorTable() {
+    const float LIMIT = 0.025f;     // F, between 0F and 200F; the worst is 0.022F, near 200F
+    float worst = 0;
+    int worstCounts = 0;
+    int inRange = 0;
+    float previous = -INFINITY;
+    for (int counts = 0; counts <= ThermistorTable::ADC_RANGE; counts++) {
+        float table = ThermistorTable::lookup(counts);
+        CHECK(isfinite(table), "table gives %f at %d counts", table, counts);
+        if (counts == 0 || counts == ThermistorTable::ADC_RANGE) continue;
+
+        // Higher counts are a lower thermistor resistance, so a higher temperature
+        CHECK(table > previous, "table not monotonic at %d counts", counts);
+        previous = table;
+
+        hardwareAPI.useExactTemperature(false);
+        float looked = hardwareAPI.temperatureFromCounts(counts);
+        hardwareAPI.useExactTemperature(true);
+        float exact = hardwareAPI.temperatureFromCounts(counts);
+        CHECK(looked == table, "HardwareAPI does not use the table at %d counts", counts);
+        if (exact < 0 || exact > 200) continue;
+        inRange++;
+        float error = fabsf(looked - exact);
+        if (error > worst) {
+            worst = error;
+            worstCounts = counts;
+        }
+    }
+    hardwareAPI.useExactTemperature(false);
+    CHECK(worst <= LIMIT, "table is %.4f F off at %d counts", worst, worstCounts);
+    CHECK(inRange > 3000, "only %d counts between 0F and 200F", inRange);
+    printf("%-40s %.4f F at %d counts, %d counts in 0-200 F\n", "  worst table error", worst, worstCounts, inRange);
+}
+
+
+
+// Decimation filter
+
+// Output amplitude for a unit tone at the 1khz input, once the cascade has settled. The tone goes
+// in as a sine on one channel and a cosine on the next, so each output pair is one complex sample
+// and its magnitude is the gain wherever the tone aliases to.
+static float _toneGain(DecimationFilter& filter, float hz) {
+    filter.reset();
+    unsigned long settle = 2 * filter.getDelayMillis() + 10000 / filter.getOutputRate();
+    float input[DecimationFilter::CHANNELS] = {};
+    float output[DecimationFilter::CHANNELS];
+    float gain = 0;
+    int outputs = 0;
+    for (unsigned long n = 0; outputs < 10; n++) {
+        double phase = 2 * M_PI * fmod((double) hz * n / 1000, 1.0);
+        input[0] = sin(phase);
+        input[1] = cos(phase);
+        if (!filter.push(input, output) || n < settle) continue;
+        gain = fmaxf(gain, hypotf(output[0], output[1]));
+        outputs++;
+    }
+    return gain;
+}
+
+// Every telemetry rate: flat to 0.4 of the output rate, and everything from 0.6 of it up to the
+// input Nyquist attenuated, whichever stage it aliases through. 0.4 to 0.6 is the transition band.
+static void _decimationResponse() {
+    const float RIPPLE_DB = 0.1f;
+    const float STOPBAND_DB = -50;
+    static const unsigned long rates[] = {50, 10, 1};
+    for (unsigned long rate : rates) {
+        static DecimationFilter filter;
+        if (!CHECK(filter.begin(1000, rate) && filter.getOutputRate() == rate, "no %lu hz cascade", rate)) continue;
+
+        float low = 0, high = 0;
+        for (float hz = 0; hz <= 0.4f * rate; hz += 0.02f * rate) {
+            float db = 20 * log10f(_toneGain(filter, hz));
+            low = fminf(low, db);
+            high = fmaxf(high, db);
+        }
+        CHECK(low >= -RIPPLE_DB && high <= RIPPLE_DB, "%lu hz passband is %.3f to %.3f dB", rate, low, high);
+
+        // Finer near the edge and around each multiple of the output rate, which alias to DC
+        float worst = -200, worstHz = 0;
+        for (float hz = 0.6f * rate; hz <= 500; hz = hz < 3 * rate ? hz + 0.01f * rate : hz * 1.02f) {
+            float db = 20 * log10f(_toneGain(filter, hz));
+            if (db > worst) {
+                worst = db;
+                worstHz = hz;
+            }
+        }
+        for (float hz = rate; hz <= 500; hz += rate) {
+            float db = 20 * log10f(_toneGain(filter, hz));
+            if (db > worst) {
+                worst = db;
+                worstHz = hz;
+            }
+        }
+        CHECK(worst <= STOPBAND_DB, "%lu hz stopband is %.1f dB at %.2f hz", rate, worst, worstHz);
+        printf("  %2lu hz: passband %+.3f to %+.3f dB, stopband %.1f dB at %.2f hz, delay %lu ms\n", rate, low, high,
+               worst, worstHz, filter.getDelayMillis());
+    }
+}
+
+
+
+// Streaming statistics
+
+// Every push of a random sequence against a brute force pass over the same window. The sequence
+// wraps the window many times, with runs of equal values and steady climbs and falls for the
+// monotonic queues. With spikes, some values are 1e9 and the running sums round as they come
+// and go; the sums only have to be right again once per lap, after the resum.
+template <int N>
+static void _streamingStatsAgainst(const char* name, unsigned long pushes, float offset, bool spikes) {
+    static StreamingStats<float, N> stats(0.1f);
+    static float window[N];
+    stats.reset();
+    unsigned long seed = 2024;
+    float value = offset;
+    double ewma = 0;
+    // The first push each statistic went wrong on, or pushes
+    unsigned long badCount = pushes, badMinMax = pushes, badMean = pushes, badVariance = pushes, badEwma = pushes;
+    float worstVariance = 0;
+    for (unsigned long pushed = 0; pushed < pushes; pushed++) {
+        seed = seed * 1103515245 + 12345;
+        unsigned long pick = (seed >> 16) % 8;
+        if (pick == 0 && spikes && (seed >> 8) % 4 == 0) value = 1e9f;
+        else if (pick == 0) value = offset + (float) ((seed >> 8) % 2000) / 100;    // Jump
+        else if (pick < 3) value += 0.25f;                                  // Climb
+        else if (pick < 5) value -= 0.25f;                                  // Fall
+        // else a repeat
+        stats.push(value);
+        window[pushed % N] = value;
+        ewma = pushed == 0 ? value : ewma + 0.1 * (value - ewma);
+
+        int count = pushed + 1 < (unsigned long) N ? pushed + 1 : N;
+        float min = INFINITY, max = -INFINITY;
+        double sum = 0;
+        for (int i = 0; i < count; i++) {
+            min = fminf(min, window[i]);
+            max = fmaxf(max, window[i]);
+            sum += window[i];
+        }
+        double mean = sum / count;
+        double squares = 0;
+        for (int i = 0; i < count; i++) squares += (window[i] - mean) * (window[i] - mean);
+        double variance = count > 1 ? squares / count : 0;
+        bool lapEnd = (pushed + 1) % N == 0;
+        float varianceError = fabs(stats.variance() - variance) / (variance > 1 ? variance : 1);
+        if ((lapEnd || !spikes) && varianceError > worstVariance) worstVariance = varianceError;
+
+        if (badCount == pushes && (stats.count() != count || stats.latest() != value)) badCount = pushed;
+        if (badMinMax == pushes && (stats.min() != min || stats.max() != max)) badMinMax = pushed;
+        if (badEwma == pushes && fabs(stats.ewma() - ewma) > 1e-5 * fabs(ewma) + 1e-4) badEwma = pushed;
+        if (spikes && !lapEnd) continue;
+        if (badMean == pushes && (fabs(stats.mean() - mean) > 1e-6 * fabs(mean) + 1e-6 ||
+                                  fabs(stats.windowMean() - sum / N) > 1e-6 * fabs(mean) + 1e-6)) badMean = pushed;
+        if (badVariance == pushes && varianceError > 1e-3f) badVariance = pushed;
+    }
+    CHECK(badCount == pushes, "%s: count or latest wrong from push %lu", name, badCount);
+    CHECK(badMinMax == pushes, "%s: min or max wrong from push %lu", name, badMinMax);
+    CHECK(badMean == pushes, "%s: mean or window mean wrong from push %lu", name, badMean);
+    CHECK(badVariance == pushes, "%s: variance wrong from push %lu", name, badVariance);
+    CHECK(badEwma == pushes, "%s: ewma wrong from push %lu", name, badEwma);
+    printf("  %-12s %lu pushes, %lu laps, worst variance error %.1e relative\n", name, pushes, pushes / N, worstVariance);
+}
+
+static void _streamingStats() {
+    _streamingStatsAgainst<60>("60, watts", 60 * 500 + 17, 0, false);     // powerManagementStats in RTOS.c
+    _streamingStatsAgainst<7>("7, offset", 7 * 20000 + 3, 1000, false);
+    _streamingStatsAgainst<60>("60, spikes", 60 * 500 + 17, 0, true);
+
+    StreamingStats<int, 4> empty;
+    CHECK(empty.count() == 0 && empty.min() == 0 && empty.max() == 0 && empty.mean() == 0 && empty.variance() == 0,
+          "empty window is not all zero");
+    empty.push(5);
+    CHECK(empty.windowMean() == 1.25f && empty.mean() == 5 && empty.variance() == 0,
+          "one value: window mean %f, mean %f", empty.windowMean(), empty.mean());
+}
+
+
+// Report by exception
+
+// One window of a quiet box, every channel filled in
+static Protocol::Telemetry _window() {
+    Protocol::Telemetry telemetry = {};
+    telemetry.thermistorCount = Channels::THERMISTOR_COUNT;
+    telemetry.loadCount = Channels::LOAD_COUNT;
+    for (size_t i = 0; i < Channels::THERMISTOR_COUNT; i++) telemetry.temperature[i] = 73;
+    for (size_t i = 0; i < Channels::LOAD_COUNT; i++) {
+        telemetry.voltage[i] = Channels::LOADS[i].supplyVolts;
+        telemetry.current[i] = 0.01f;
+    }
+    telemetry.powerAvg = 0.1f;
+    telemetry.scanRate = 1000;
+    return telemetry;
+}
+
+// Windows offered until one is sent, that one included, or 0 if none is within limit
+static unsigned long _untilSent(ReportByException& report, Protocol::Telemetry& telemetry, unsigned long limit) {
+    for (unsigned long windows = 1; windows <= limit; windows++) {
+        if (report.offer(telemetry)) return windows;
+    }
+    return 0;
+}
+
+// The send decisions the server's fill forward relies on: the first window, the heartbeat,
+// deadbands from the last frame sent, the forced sends and the held count
+static void _reportByException() {
+    const TelemetryDeadbands deadbands = {0.05f, 0.02f, 0.2f, 0.05f};
+    const unsigned long HEARTBEAT = 5;
+    static ReportByException report;
+    report.begin(deadbands, HEARTBEAT);
+    Protocol::Telemetry telemetry = _window();
+
+    CHECK(report.offer(telemetry) && telemetry.held == 0, "first window held");
+
+    // Unchanged windows: one frame every heartbeat windows, each counting the ones held before it
+    for (int frame = 0; frame < 3; frame++) {
+        telemetry = _window();
+        unsigned long windows = _untilSent(report, telemetry, 100);
+        CHECK(windows == HEARTBEAT && telemetry.held == HEARTBEAT - 1, "heartbeat after %lu windows, %u held",
+              windows, telemetry.held);
+    }
+
+    // Deadbands measure from the last frame sent: 0.06F a window goes out on the 4th, at 0.24F
+    report.setHeartbeat(1000);
+    telemetry = _window();
+    CHECK(report.offer(telemetry), "window after a new heartbeat held");
+    float temperature = 73;
+    for (int frame = 0; frame < 3; frame++) {
+        unsigned long windows = 0;
+        do {
+            temperature += 0.06f;
+            telemetry = _window();
+            telemetry.temperature[Channels::BOX] = temperature;
+            windows++;
+        } while (!report.offer(telemetry) && windows < 100);
+        CHECK(windows == 4 && telemetry.held == 3, "0.06F a window sent after %lu windows, %u held", windows,
+              telemetry.held);
+    }
+    unsigned long drifting = 0;
+    for (int i = 0; i < 20; i++) {
+        telemetry = _window();
+        telemetry.temperature[Channels::BOX] = temperature;
+        telemetry.current[Channels::FAN] += 0.015f * i;         // Under the deadband a window, past it in two
+        if (report.offer(telemetry)) drifting++;
+    }
+    CHECK(drifting == 9, "0.015A a window sent %lu frames in 20 windows", drifting);
+
+    // A relay, the scan rate or a text alert sends the window whatever the deadbands
+    report.setHeartbeat(1000);
+    telemetry = _window();
+    report.offer(telemetry);
+    telemetry = _window();
+    CHECK(!report.offer(telemetry), "unchanged window sent");
+    telemetry = _window();
+    telemetry.status[Channels::PELTIER] = true;
+    CHECK(report.offer(telemetry) && telemetry.held == 1, "relay change held");
+    telemetry = _window();
+    CHECK(report.offer(telemetry), "relay change back held");
+    telemetry = _window();
+    telemetry.scanRate = 10000;
+    CHECK(report.offer(telemetry), "scan rate change held");
+    telemetry = _window();
+    telemetry.scanRate = 10000;
+    telemetry.textStatus = 1;
+    CHECK(report.offer(telemetry), "text alert held");
+    telemetry = _window();
+    telemetry.scanRate = 10000;
+    telemetry.logData = true;
+    CHECK(!report.offer(telemetry), "log flag alone sent a window");
+
+    // A heartbeat of 0 sends every window, the first counting the one held above
+    report.setHeartbeat(0);
+    telemetry = _window();
+    CHECK(report.offer(telemetry) && telemetry.held == 1, "held window not counted");
+    int sent = 0;
+    for (int i = 0; i < 10; i++) {
+        telemetry = _window();
+        if (report.offer(telemetry) && telemetry.held == 0) sent++;
+    }
+    CHECK(sent == 10, "heartbeat 0 sent %d of 10 windows", sent);
+
+    // held saturates rather than wrapping
+    report.setHeartbeat(0x30000);
+    telemetry = _window();
+    report.offer(telemetry);
+    telemetry = _window();
+    unsigned long windows = _untilSent(report, telemetry, 0x20000);
+    CHECK(windows == 0, "unchanged window sent after %lu windows", windows);
+    telemetry = _window();
+    telemetry.status[Channels::FAN] = true;
+    CHECK(report.offer(telemetry) && telemetry.held == 0xFFFF, "%u held after 0x20000 windows", telemetry.held);
+
+    CHECK(report.getFrames() < report.getWindows(), "%lu frames for %lu windows", report.getFrames(),
+          report.getWindows());
+}
+
+
+// Fan spectrum
+
+// A known block through FanSpectrum::analyse and through a direct DFT in double of the same
+// windowed samples, with the features worked out the way analyse() documents them. Agreement at
+// every block size pins down the radix-2 FFT, its real split and the packing the features read,
+// which arm_rfft_fast_f32 has to match on the board.
+static void _fanSpectrum() {
+    const unsigned long RATE = 10000;
+    const float ZERO = 1798;
+    const float AMPS_PER_COUNT = HardwareAPI::ampsPerCount(Channels::FAN);
+    const double LINE_HZ = 163.7, LINE_COUNTS = 6;        // Between bins at every size
+    const double HARMONIC_HZ = 1234.5, HARMONIC_COUNTS = 2;
+    static FanSpectrum spectrum;
+    static ScanFrame frames[FanSpectrum::MAX_BLOCK];
+    static double ripple[FanSpectrum::MAX_BLOCK];
+    static const int sizes[] = {256, 512, 1024};
+    spectrum.begin(RATE, FanSpectrum::MAX_BLOCK, 4);
+    spectrum.setChannel(ZERO, AMPS_PER_COUNT);
+
+    for (int n : sizes) {
+        unsigned long seed = 12345;
+        double mean = 0;
+        for (int i = 0; i < n; i++) {
+            seed = seed * 1103515245 + 12345;     // A little broadband noise, the same every run
+            double noise = (double) ((seed >> 16) % 7) - 3;
+            double t = (double) i / RATE;
+            double counts = 1843 + LINE_COUNTS * sin(2 * M_PI * LINE_HZ * t) +
+                            HARMONIC_COUNTS * sin(2 * M_PI * HARMONIC_HZ * t + 1) + noise;
+            frames[i].current[Channels::FAN] = lround(counts);
+            mean += frames[i].current[Channels::FAN];
+        }
+        mean /= n;
+
+        if (!CHECK(spectrum.setBlockSize(n), "no %d sample block", n)) continue;
+        spectrum.start();
+        spectrum.push(frames, n);
+        Protocol::Spectrum features;
+        if (!CHECK(spectrum.analyse(features), "%d sample block not analysed", n)) continue;
+
+        // The reference: periodic Hann window over the ripple, one sided power per bin, bands
+        // from the first edge, the peak bin and a parabola through its log power
+        double squares = 0;
+        for (int i = 0; i < n; i++) {
+            double value = frames[i].current[Channels::FAN] - mean;
+            squares += value * value;
+            ripple[i] = value * (0.5 - 0.5 * cos(2 * M_PI * i / n));
+        }
+        double binHz = (double) RATE / n;
+        double scale = 2.0 / ((double) n * (3.0 * n / 8));
+        double power[FanSpectrum::MAX_BLOCK / 2] = {};
+        double bands[Protocol::SPECTRUM_BANDS] = {};
+        int peak = 0;
+        for (int k = 1; k < n / 2; k++) {
+            double re = 0, im = 0;
+            for (int i = 0; i < n; i++) {
+                double phase = 2 * M_PI * fmod((double) k * i / n, 1.0);
+                re += ripple[i] * cos(phase);
+                im -= ripple[i] * sin(phase);
+            }
+            power[k] = re * re + im * im;
+            double hz = k * binHz;
+            for (size_t b = 0; b < Protocol::SPECTRUM_BANDS; b++) {
+                if (hz >= Protocol::SPECTRUM_BAND_HZ[b] && hz < Protocol::SPECTRUM_BAND_HZ[b + 1]) {
+                    bands[b] += power[k];
+                    if (power[k] > power[peak]) peak = k;
+                }
+            }
+        }
+        double left = log(power[peak - 1]), middle = log(power[peak]), right = log(power[peak + 1]);
+        double dominantHz = (peak + 0.5 * (left - right) / (left - 2 * middle + right)) * binHz;
+
+        CHECK(fabs(features.dominantHz - dominantHz) < 0.01 * binHz, "%d samples: %.3f hz, the DFT gives %.3f hz",
+              n, features.dominantHz, dominantHz);
+        CHECK(fabs(dominantHz - LINE_HZ) < 0.1 * binHz, "%d samples: the DFT peak is at %.3f hz for a %.1f hz line",
+              n, dominantHz, LINE_HZ);
+        CHECK(features.rpm == lround(features.dominantHz * 60 / 4), "%d samples: %u rpm", n, features.rpm);
+        CHECK(fabsf(features.current - (float) (mean - ZERO) * AMPS_PER_COUNT) < 1e-4f, "%d samples: %.4f A mean",
+              n, features.current);
+        double rippleRms = sqrt(squares / n) * AMPS_PER_COUNT;
+        CHECK(fabs(features.rippleRms - rippleRms) < 1e-4 * rippleRms, "%d samples: %.5f A ripple, %.5f A expected",
+              n, features.rippleRms, rippleRms);
+        double worst = 0;
+        for (size_t b = 0; b < Protocol::SPECTRUM_BANDS; b++) {
+            double rms = sqrt(bands[b] * scale) * AMPS_PER_COUNT;
+            double error = fabs(features.bands[b] - rms) / rms;
+            if (error > worst) worst = error;
+            CHECK(error < 1e-3, "%d samples: band %zu is %.5f A rms, the DFT gives %.5f A", n, b, features.bands[b], rms);
+        }
+        printf("  %4d samples: %.3f hz against %.3f hz, worst band %.1e off\n", n, features.dominantHz, dominantHz, worst);
+    }
+}
+
+
+int main(int argc, char** argv) {
+    if (argc > 1) _filter = argv[1];
+
+    _group("protocol round trip", _protocolRoundTrip);
+    _group("protocol COBS", _protocolCobs);
+    _group("protocol CRC-16", _protocolCrc);
+    _group("protocol single bit errors", _protocolBitFlips);
+    _group("protocol resync", _protocolResync);
+    _group("thermistor table", _thermistorTable);
+    _group("decimation filter response", _decimationResponse);
+    _group("streaming statistics against brute force", _streamingStats);
+    _group("report by exception", _reportByException);
+    _group("fan spectrum against a direct DFT", _fanSpectrum);
+
+    printf("%d checks, %d failed\n", _checks, _failures);
+    return _failures == 0 ? 0 : 1;
+}
@@ -44,6 +44,14 @@ pool.getConnection()
 let lastTextMessageTime = 0;
 const TEXT_MESSAGE_COOLDOWN = 5000;
 
+// Alerts by the STM32's textStatus, sent once each time it changes
+const TEXT_MESSAGES = {
+	1: "1 minute running average exceeded 10W, powering system off.",
+	2: "Temperature exceeded 80 degrees, turning system on.",
+	3: "Fan overcurrent, relays cut. Clear the fault to run again.",
+	4: "Peltier overcurrent, relays cut. Clear the fault to run again."
+};
+
 // Twilio text message function
 async function sendTextTwilio(number, message) {
     const now = Date.now();
@@ -68,6 +76,325 @@ async function sendTextTwilio(number, message) {
     }
 }
 
+// Channels
+// The ESP32 forwards the STM32's channels as lists, in the order of its Channels.h: temperatures,
+// and loads with their voltage, current, power, relay status and energy totals. The database and
+// the dashboard keep named columns, so every message is flattened as it arrives: load i takes
+// the column prefix of LOADS[i], fanCurrent, pelStatus and so on, and the first thermistor is
+// the temperature. A load with no entry here is dropped.
+const LOADS = [{column: 'fan', name: 'fan'}, {column: 'pel', name: 'peltier'}];
+const LOAD_FIELDS = {voltage: 'Voltage', current: 'Current', power: 'Power', status: 'Status', coulombs: 'Coulombs', joules: 'Joules'};
+
+function flattenChannels(data) {
+	const {temperatures, loads, ...flat} = data;
+	if (Array.isArray(temperatures) && temperatures.length > 0) flat.temperature = temperatures[0];
+	(loads || []).forEach((load, i) => {
+		if (i >= LOADS.length) return;
+		for (const field in LOAD_FIELDS) {
+			if (field in load) flat[LOADS[i].column + LOAD_FIELDS[field]] = load[field];
+		}
+	});
+	return flat;
+}
+
+// A commandAck's relay states, null for all of them when the STM32 never answered
+function flattenAck(ack) {
+	const {status, ...flat} = ack;
+	LOADS.forEach((load, i) => {
+		flat[load.column + 'Status'] = Array.isArray(status) && i < status.length ? status[i] : null;
+	});
+	return flat;
+}
+
+
+// Control commands
+// Each /api/control request becomes a command with an id that is resent to the ESP32 until it
+// answers with a commandAck. The ack carries the STM32 result, the tick the relay switched on
+// and the relay states, and the round trip is reported as the command latency.
+// fan and peltier take a status, fault clears a latched overcurrent trip and ignores it, control
+// takes one of CONTROL_STRATEGIES as its value, and the settings in COMMAND_SETTINGS take a value, turned here into the STM32's integer argument. The
+// ESP32 maps the device to its opcode and passes the argument through.
+const COMMAND_RETRY_INTERVAL = 1500;   // longer than the ESP32's own retries to the STM32
+const COMMAND_MAX_ATTEMPTS = 3;
+const COMMAND_RESULTS = ['ok', 'malformed command', 'unknown command', 'bad argument', 'overcurrent trip not cleared', 'STM32 did not respond', 'ESP32 busy'];
+
+// The STM32's controlStrategies in order, picked by name with the control device
+const CONTROL_STRATEGIES = ['threshold', 'hysteresis', 'timeProportional', 'pid'];
+
+const COMMAND_SETTINGS = {
+	thermistorOffset: (value) => Math.round(value * 100),   // F, within 20, in hundredths
+	spectrum: (value) => Math.round(value),                  // fan spectrum block, 256, 512 or 1024 samples, 0 is off
+	heartbeat: (value) => Math.round(value),                 // s between telemetry frames at most, up to 3600, 0 sends every window
+	voltageDeadband: (value) => Math.round(value * 1000),    // V, A, F and W a telemetry value may move before a frame, up to 10
+	currentDeadband: (value) => Math.round(value * 1000),
+	temperatureDeadband: (value) => Math.round(value * 1000),
+	powerDeadband: (value) => Math.round(value * 1000),
+};
+
+let nextCommandId = 1;
+const pendingCommands = new Map();
+const commandLatency = {last: 0, avg: 0, max: 0, count: 0};
+
+function sendCommand(device, status, arg) {
+	return new Promise((resolve) => {
+		const command = {id: nextCommandId++, device: device, status: status, arg: arg, sentAt: Date.now(), attempts: 0, timer: null, resolve: resolve};
+		pendingCommands.set(command.id, command);
+		transmitCommand(command);
+	});
+}
+
+function transmitCommand(command) {
+	if (command.attempts >= COMMAND_MAX_ATTEMPTS) {
+		completeCommand(command, null);
+		return;
+	}
+	command.attempts++;
+	broadcastControlData({id: command.id, device: command.device, status: command.status, arg: command.arg});
+	command.timer = setTimeout(() => transmitCommand(command), COMMAND_RETRY_INTERVAL);
+}
+
+// ack is null when the ESP32 never answered
+function completeCommand(command, ack) {
+	clearTimeout(command.timer);
+	pendingCommands.delete(command.id);
+
+	const latency = Date.now() - command.sentAt;
+	const ok = ack !== null && ack.result === 0;
+	if (ok) {
+		commandLatency.last = latency;
+		commandLatency.count++;
+		commandLatency.avg += (latency - commandLatency.avg) / commandLatency.count;
+		commandLatency.max = Math.max(commandLatency.max, latency);
+	}
+
+	const result = {
+		id: command.id,
+		device: command.device,
+		status: command.status,
+		ok: ok,
+		error: ok ? null : (ack === null ? 'ESP32 did not respond' : COMMAND_RESULTS[ack.result] || 'unknown error'),
+		tick: ack === null ? null : ack.tick,
+		fanStatus: ack === null ? null : ack.fanStatus,
+		pelStatus: ack === null ? null : ack.pelStatus,
+		latency: latency,
+		uartLatency: ack === null ? null : ack.uartMillis,
+		attempts: command.attempts,
+		latencyAvg: commandLatency.avg,
+		latencyMax: commandLatency.max
+	};
+	broadcastCommandResult(result);
+	command.resolve(result);
+}
+
+
+// Flash log records
+// Every minute datapoint comes from the STM32's flash log, live or replayed after an outage, and
+// is resent until acked, so inserts ignore a (boot, seq) already stored. ageMillis places the
+// record in time; it is null for a record from an earlier STM32 boot, which is placed by that
+// boot's clock, learned from any record of it that came with an age.
+const bootClocks = new Map();   // boot -> wall clock ms at STM32 millis 0
+
+function recordTime(record) {
+	const now = Date.now();
+	if (record.ageMillis !== null && record.ageMillis !== undefined) {
+		bootClocks.set(record.boot, now - record.ageMillis - record.millis);
+		return new Date(now - record.ageMillis);
+	}
+	if (bootClocks.has(record.boot)) {
+		return new Date(bootClocks.get(record.boot) + record.millis);
+	}
+	console.log(`Record ${record.seq} from boot ${record.boot} has no known time, stored as now`);
+	return new Date(now);
+}
+
+// True once the record is in the database, whether stored now or before
+async function storeRecord(record) {
+	try {
+		await pool.execute('INSERT IGNORE INTO DataPoint (datetime, fanVoltage, fanCurrent, fanPower, pelVoltage, pelCurrent, pelPower, temperature, fan_status, pel_status, boot, seq) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)', [recordTime(record), record.fanVoltage, record.fanCurrent, record.fanPower, record.pelVoltage, record.pelCurrent, record.pelPower, record.temperature, record.fanStatus, record.pelStatus, record.boot, record.seq]);
+		return true;
+	} catch (error) {
+		console.log('Error storing log record:', error);
+		return false;
+	}
+}
+
+
+// Live telemetry
+// The STM32 sends telemetry by exception, a frame only when a value leaves its deadband, a
+// relay switches or the heartbeat is due. held counts the windows it left out before a frame,
+// and they are filled forward from the previous frame, spread evenly over the time between
+// the two, so the live series has every window. /api/live serves the series and how many
+// windows each frame stood for.
+const LIVE_SERIES_LENGTH = 3600;
+const liveSeries = [];
+const liveStats = {frames: 0, windows: 0};
+let lastSensorData = null;
+
+function pushLive(sample) {
+	liveSeries.push(sample);
+	if (liveSeries.length > LIVE_SERIES_LENGTH) liveSeries.splice(0, liveSeries.length - LIVE_SERIES_LENGTH);
+}
+
+function addSensorData(data) {
+	const now = Date.now();
+	const held = data.held || 0;
+	if (lastSensorData !== null && held > 0) {
+		const step = (now - lastSensorData.time) / (held + 1);
+		// Alerts and the log flag belong to the frame they came with, not to its copies
+		const fill = {...lastSensorData.data, textStatus: 0, logData: false, filled: true};
+		for (let i = Math.max(1, held - LIVE_SERIES_LENGTH + 1); i <= held; i++) {
+			pushLive({...fill, datetime: new Date(lastSensorData.time + i * step)});
+		}
+	}
+	pushLive({...data, datetime: new Date(now), filled: false});
+	lastSensorData = {time: now, data: data};
+	liveStats.frames++;
+	liveStats.windows += held + 1;
+}
+
+
+// Energy
+// Every telemetry frame carries the STM32's charge and energy totals, integrated from every ADC
+// sample and kept through its resets, so the figures here stay exact however many frames are
+// lost or held back. The totals only start again from 0 when the STM32 loses its backup
+// domain supply, which starts a new counter epoch. Each epoch is a row of the EnergyEpoch
+// table holding the last totals seen in it, and the epochs before the newest make up the
+// offset, so a server restart loads it back. The newest epoch's row is brought up to date
+// every ENERGY_SAVE_INTERVAL and when its epoch ends; a restart reloads totals up to that old,
+// and the next frame brings them up to date.
+const ENERGY_PRICE = parseFloat(process.env.ENERGY_PRICE_PER_KWH || '0.15');   // per kWh
+const JOULES_PER_KWH = 3600000;
+const ENERGY_SAVE_INTERVAL = 60000;
+const energyOffset = {fanJoules: 0, pelJoules: 0};
+let lastEnergy = null;
+let energyEpoch = null;     // id of the newest EnergyEpoch row, null until there is one
+let energySavedAt = 0;
+let energyWrites = Promise.resolve();   // one write at a time, in order
+
+async function loadEnergy() {
+	try {
+		const [rows] = await pool.execute('SELECT id, fanJoules, pelJoules FROM EnergyEpoch ORDER BY id');
+		rows.forEach((row, i) => {
+			if (i < rows.length - 1) {
+				energyOffset.fanJoules += row.fanJoules;
+				energyOffset.pelJoules += row.pelJoules;
+			} else {
+				energyEpoch = row.id;
+				lastEnergy = {fanJoules: row.fanJoules, pelJoules: row.pelJoules};
+			}
+		});
+	} catch (error) {
+		console.log('Error loading energy epochs:', error);
+	}
+}
+const energyLoaded = loadEnergy();
+
+function saveEnergy(totals, newEpoch) {
+	energySavedAt = Date.now();
+	energyWrites = energyWrites.then(async () => {
+		try {
+			if (newEpoch || energyEpoch === null) {
+				const [result] = await pool.execute('INSERT INTO EnergyEpoch (started, fanJoules, pelJoules) VALUES (?, ?, ?)', [new Date(), totals.fanJoules, totals.pelJoules]);
+				energyEpoch = result.insertId;
+			} else {
+				await pool.execute('UPDATE EnergyEpoch SET fanJoules = ?, pelJoules = ? WHERE id = ?', [totals.fanJoules, totals.pelJoules, energyEpoch]);
+			}
+		} catch (error) {
+			console.log('Error saving energy totals:', error);
+		}
+	});
+}
+
+function addEnergy(data) {
+	if (data.fanJoules === undefined) return;
+	const totals = {fanJoules: data.fanJoules, pelJoules: data.pelJoules};
+	if (lastEnergy !== null && (data.fanJoules < lastEnergy.fanJoules || data.pelJoules < lastEnergy.pelJoules)) {
+		energyOffset.fanJoules += lastEnergy.fanJoules;
+		energyOffset.pelJoules += lastEnergy.pelJoules;
+		saveEnergy(lastEnergy, false);  // the old epoch's final totals
+		saveEnergy(totals, true);
+	} else if (lastEnergy === null || Date.now() - energySavedAt >= ENERGY_SAVE_INTERVAL) {
+		saveEnergy(totals, false);
+	}
+	lastEnergy = totals;
+	const joules = energyOffset.fanJoules + energyOffset.pelJoules + data.fanJoules + data.pelJoules;
+	data.energyKWh = joules / JOULES_PER_KWH;
+	data.energyCost = data.energyKWh * ENERGY_PRICE;
+}
+
+
+// Waveform captures
+// The STM32 sends each capture as chunks of raw counts, one at a time and never resent, with
+// every load's counts in a list like the telemetry. A capture is stored once its last chunk
+// arrives, or CAPTURE_TIMEOUT after its first if the last one was lost, with null for the
+// samples of any chunk that never came. Its cause is the trigger's kind and the load that
+// tripped it, 'peltier limit' say.
+const CAPTURE_TIMEOUT = 10000;
+
+function captureCause(chunk) {
+	const load = LOADS[chunk.load];
+	if (load === undefined || !['relay', 'step', 'limit'].includes(chunk.cause)) return 'unknown';
+	return `${load.name} ${chunk.cause}`;
+}
+let openCapture = null;
+
+function addCaptureChunk(chunk) {
+	if (openCapture !== null && openCapture.id !== chunk.id) finishCapture(openCapture);
+	if (openCapture === null) {
+		const capture = {
+			id: chunk.id,
+			datetime: new Date(Date.now() - chunk.ageMillis),   // trigger time
+			cause: captureCause(chunk),
+			sampleRate: chunk.sampleRate,
+			preFrames: chunk.preFrames,
+		};
+		for (const load of LOADS) capture[load.column + 'Current'] = new Array(chunk.frames).fill(null);
+		capture.timer = setTimeout(() => finishCapture(capture), CAPTURE_TIMEOUT);
+		openCapture = capture;
+	}
+
+	(chunk.loads || []).forEach((load, c) => {
+		if (c >= LOADS.length) return;
+		const current = openCapture[LOADS[c].column + 'Current'];
+		for (let i = 0; i < load.counts.length; i++) {
+			const frame = chunk.first + i;
+			if (frame >= current.length) break;
+			current[frame] = Math.round((load.counts[i] - load.zero) * load.ampsPerCount * 1000) / 1000;
+		}
+	});
+	if (chunk.index + 1 === chunk.chunks) finishCapture(openCapture);
+}
+
+async function finishCapture(capture) {
+	clearTimeout(capture.timer);
+	if (openCapture === capture) openCapture = null;
+	const missingFrames = capture.fanCurrent.filter(value => value === null).length;
+	const row = {datetime: capture.datetime, cause: capture.cause, sampleRate: capture.sampleRate, preFrames: capture.preFrames,
+		missingFrames: missingFrames, fanCurrent: capture.fanCurrent, pelCurrent: capture.pelCurrent};
+	try {
+		await pool.execute('INSERT INTO WaveformCapture (datetime, cause, sampleRate, preFrames, missingFrames, fanCurrent, pelCurrent) VALUES (?, ?, ?, ?, ?, ?, ?)', [row.datetime, row.cause, row.sampleRate, row.preFrames, row.missingFrames, JSON.stringify(row.fanCurrent), JSON.stringify(row.pelCurrent)]);
+	} catch (error) {
+		console.log('Error storing capture:', error);
+	}
+	broadcastCapture(row);
+}
+
+
+// Fan spectrum
+// A few features of one FFT of the raw fan current, every minute or so while the fan runs. Each
+// is stored for the trend a worn bearing shows over weeks and passed on to the dashboard.
+async function storeSpectrum(spectrum) {
+	const row = {datetime: new Date(), blockSize: spectrum.blockSize, dominantHz: spectrum.dominantHz, rpm: spectrum.rpm,
+		current: spectrum.current, rippleRms: spectrum.rippleRms, bands: spectrum.bands, bandHz: spectrum.bandHz, cycles: spectrum.cycles};
+	try {
+		await pool.execute('INSERT INTO FanSpectrum (datetime, blockSize, dominantHz, rpm, current, rippleRms, bands, bandHz, cycles) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)', [row.datetime, row.blockSize, row.dominantHz, row.rpm, row.current, row.rippleRms, JSON.stringify(row.bands), JSON.stringify(row.bandHz), row.cycles]);
+	} catch (error) {
+		console.log('Error storing spectrum:', error);
+	}
+	broadcastSpectrum(row);
+}
+
+
 // Websocket
 wss.on('connection', (ws, req) => {
 
@@ -116,12 +443,29 @@ wss.on('connection', (ws, req) => {
 		if (ws.clientId === 'esp') {
 			// console.log('Received data from ESP32 client:', messageData);
 			if (messageData.type === 'sensorData') {
-				if (messageData.data.logData === true) {
-					await pool.execute('INSERT INTO DataPoint (datetime, fanVoltage, fanCurrent, fanPower, pelVoltage, pelCurrent, pelPower, temperature, fan_status, pel_status) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)', [new Date(), messageData.data.fanVoltage, messageData.data.fanCurrent, messageData.data.fanPower, messageData.data.pelVoltage, messageData.data.pelCurrent, messageData.data.pelPower, messageData.data.temperature, messageData.data.fanStatus, messageData.data.pelStatus]);
+				// The minute datapoints come as logRecords, logData only marks the window they were taken from
+				const data = flattenChannels(messageData.data);
+				await energyLoaded;
+				addEnergy(data);
+				addSensorData(data);
+				broadcastIndividualData(data);
+				if ('textStatus' in data && parseInt(data.textStatus) in TEXT_MESSAGES) {
+					sendTextTwilio(process.env.USER_PHONE_NUMBER, TEXT_MESSAGES[parseInt(data.textStatus)]);
+				}
+			} else if (messageData.type === 'logRecord') {
+				if (await storeRecord(flattenChannels(messageData.data))) {
+					ws.send(JSON.stringify({'type': 'recordAck', 'data': {seq: messageData.data.seq}}));
 				}
-				broadcastIndividualData(messageData.data);
-				if ('textStatus' in messageData.data && !isNaN(messageData.data.textStatus) && parseInt(messageData.data.textStatus) > 0) {
-					sendTextTwilio(process.env.USER_PHONE_NUMBER, parseInt(messageData.data.textStatus) == 1 ? "1 minute running average exceeded 10W, powering system off." : "Temperature exceeded 80 degrees, turning system on.");
+			} else if (messageData.type === 'captureChunk') {
+				addCaptureChunk(messageData.data);
+			} else if (messageData.type === 'spectrum') {
+				storeSpectrum(messageData.data);
+			} else if (messageData.type === 'diagnostics') {
+				broadcastDiagnostics(messageData.data);
+			} else if (messageData.type === 'commandAck') {
+				const command = pendingCommands.get(messageData.data.id);
+				if (command) {  // Acks for commands that already completed are ignored
+					completeCommand(command, flattenAck(messageData.data));
 				}
 			}
 		} else if (ws.clientId === 'web') {
@@ -143,6 +487,38 @@ function broadcastIndividualData(data) {
 	});
 }
 
+function broadcastDiagnostics(data) {
+	wss.clients.forEach((client) => {
+		if (client.readyState === WebSocket.OPEN && client.clientId === 'web') {
+			client.send(JSON.stringify({'data': data, 'type': 'diagnostics'}));
+		}
+	});
+}
+
+function broadcastCapture(data) {
+	wss.clients.forEach((client) => {
+		if (client.readyState === WebSocket.OPEN && client.clientId === 'web') {
+			client.send(JSON.stringify({'data': data, 'type': 'capture'}));
+		}
+	});
+}
+
+function broadcastSpectrum(data) {
+	wss.clients.forEach((client) => {
+		if (client.readyState === WebSocket.OPEN && client.clientId === 'web') {
+			client.send(JSON.stringify({'data': data, 'type': 'spectrum'}));
+		}
+	});
+}
+
+function broadcastCommandResult(data) {
+	wss.clients.forEach((client) => {
+		if (client.readyState === WebSocket.OPEN && client.clientId === 'web') {
+			client.send(JSON.stringify({'data': data, 'type': 'commandResult'}));
+		}
+	});
+}
+
 async function broadcastMoreData(after) {
 	const r = await getDataPoints(after);
 	wss.clients.forEach((client) => {
@@ -209,6 +585,44 @@ app.get('/api/data', async (req, res) => {
 	}
 });
 
+// Live telemetry with the held windows filled forward, oldest first
+app.get('/api/live', (req, res) => {
+	const ratio = liveStats.frames === 0 ? null : liveStats.windows / liveStats.frames;
+	res.json({'data': liveSeries, 'frames': liveStats.frames, 'windows': liveStats.windows, 'ratio': ratio, 'type': 'live'});
+});
+
+// Energy totals from the STM32's counters, null before the first frame
+app.get('/api/energy', (req, res) => {
+	if (lastEnergy === null) return res.json({'data': null, 'type': 'energy'});
+	const fanKWh = (energyOffset.fanJoules + lastEnergy.fanJoules) / JOULES_PER_KWH;
+	const pelKWh = (energyOffset.pelJoules + lastEnergy.pelJoules) / JOULES_PER_KWH;
+	res.json({'data': {fanKWh: fanKWh, pelKWh: pelKWh, kWh: fanKWh + pelKWh, cost: (fanKWh + pelKWh) * ENERGY_PRICE}, 'type': 'energy'});
+});
+
+// Newest waveform capture, null before the first
+app.get('/api/capture', async (req, res) => {
+	try {
+		const r = (await pool.execute('SELECT * FROM WaveformCapture ORDER BY datetime DESC LIMIT 1'))[0];
+		const capture = r.length === 0 ? null : {...r[0], fanCurrent: JSON.parse(r[0].fanCurrent), pelCurrent: JSON.parse(r[0].pelCurrent)};
+		res.json({'data': capture, 'type': 'capture'});
+	} catch (error) {
+		console.log('Error in /api/capture:', error);
+		res.status(500).json({ error: 'Error getting capture' });
+	}
+});
+
+// Newest fan spectrum features, null before the first
+app.get('/api/spectrum', async (req, res) => {
+	try {
+		const r = (await pool.execute('SELECT * FROM FanSpectrum ORDER BY datetime DESC LIMIT 1'))[0];
+		const spectrum = r.length === 0 ? null : {...r[0], bands: JSON.parse(r[0].bands), bandHz: JSON.parse(r[0].bandHz)};
+		res.json({'data': spectrum, 'type': 'spectrum'});
+	} catch (error) {
+		console.log('Error in /api/spectrum:', error);
+		res.status(500).json({ error: 'Error getting spectrum' });
+	}
+});
+
 // Insert data
 app.post('/api/data', async (req, res) => {
 	try {
@@ -229,13 +643,26 @@ app.post('/api/data', async (req, res) => {
 
 app.post('/api/control', async (req, res) => {
 	try {
-		const { device, status } = req.body;
-		if (device === 'fan') {
-			broadcastControlData({fanStatus: status});
-		} else if (device === 'peltier') {
-			broadcastControlData({pelStatus: status});
+		const { device, status, value } = req.body;
+		let arg;
+		if (device === 'control') {
+			arg = CONTROL_STRATEGIES.indexOf(value);
+			if (arg < 0) {
+				return res.status(400).json({ success: false, error: 'Unknown control strategy' });
+			}
+		} else if (Object.hasOwn(COMMAND_SETTINGS, device)) {
+			if (typeof value !== 'number' || !Number.isFinite(value)) {
+				return res.status(400).json({ success: false, error: 'Missing value' });
+			}
+			arg = COMMAND_SETTINGS[device](value);
+		} else if (device === 'fan' || device === 'peltier' || device === 'fault') {
+			arg = status === true ? 1 : 0;
+		} else {
+			return res.status(400).json({ success: false, error: 'Unknown device' });
 		}
-		return res.send({'success': true, 'message': 'Control data sent successfully'});
+		// Answers once the STM32 has acked the command or it timed out
+		const result = await sendCommand(device, status === true, arg);
+		return res.send({'success': result.ok, 'message': result.ok ? 'Control command acknowledged' : result.error, 'error': result.error, 'result': result});
 	} catch (error) {
 		console.log('Error in /api/control:', error);
 		res.status(500).json({ success: false, error: 'Error sending control data' });
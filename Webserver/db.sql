@@ -9,5 +9,50 @@ CREATE TABLE DataPoint (
     pelPower DOUBLE(5, 2) NOT NULL,
     temperature DOUBLE(5, 2) NOT NULL,
     fan_status BOOLEAN DEFAULT FALSE,
-    pel_status BOOLEAN DEFAULT FALSE
-);
\ No newline at end of file
+    pel_status BOOLEAN DEFAULT FALSE,
+    boot INT UNSIGNED NULL,
+    seq INT UNSIGNED NULL,
+    UNIQUE KEY record (boot, seq)
+);
+
+-- For a database made before the flash log:
+-- ALTER TABLE DataPoint ADD boot INT UNSIGNED NULL, ADD seq INT UNSIGNED NULL, ADD UNIQUE KEY record (boot, seq);
+-- Raw current around a trigger, see WaveformCapture.h. The currents are JSON arrays of amps,
+-- one per sample with null where a chunk was lost, and sample preFrames is the trigger.
+CREATE TABLE WaveformCapture (
+    id INT AUTO_INCREMENT PRIMARY KEY,
+    datetime DATETIME(3) NOT NULL,
+    cause VARCHAR(16) NOT NULL,
+    sampleRate INT NOT NULL,
+    preFrames INT NOT NULL,
+    missingFrames INT NOT NULL,
+    fanCurrent MEDIUMTEXT NOT NULL,
+    pelCurrent MEDIUMTEXT NOT NULL,
+    KEY captured (datetime)
+);
+
+-- Fan current spectrum features, see FanSpectrum.h. Amps are rms, bands is a JSON array of the
+-- rms between the edges in bandHz, and cycles is what the STM32 spent on the analysis.
+CREATE TABLE FanSpectrum (
+    id INT AUTO_INCREMENT PRIMARY KEY,
+    datetime DATETIME NOT NULL,
+    blockSize INT NOT NULL,
+    dominantHz DOUBLE NOT NULL,
+    rpm INT NOT NULL,
+    current DOUBLE NOT NULL,
+    rippleRms DOUBLE NOT NULL,
+    bands VARCHAR(255) NOT NULL,
+    bandHz VARCHAR(255) NOT NULL,
+    cycles INT UNSIGNED NOT NULL,
+    KEY analysed (datetime)
+);
+
+-- Energy counter epochs, see the Energy section of app.js. The STM32's totals start again from 0
+-- only when its backup domain loses power; each run of them is a row with the last whole J seen,
+-- and the rows before the newest are the offset added to the live totals.
+CREATE TABLE EnergyEpoch (
+    id INT AUTO_INCREMENT PRIMARY KEY,
+    started DATETIME NOT NULL,
+    fanJoules INT UNSIGNED NOT NULL,
+    pelJoules INT UNSIGNED NOT NULL
+);